@@ -11,9 +11,13 @@
 #include <GLFW/glfw3.h>
 #include "kuhl-util.h"
 #include "dgr.h"
+#include "screencap.h"
 
 static int viewmat_swapinterval = 0;
 static float fps = 0;
+static long bufferswap_last_swap = -1;   /**< Time the last glfwSwapBuffers() call returned */
+static long bufferswap_last_return = -1; /**< Time the last bufferswap() call returned */
+static float bufferswap_avg_render = 0;  /**< Average time between bufferswap() calls spent rendering */
 
 /** Guesses or esimates the refresh rate of the monitor that is
     displaying our graphics.
@@ -151,6 +155,7 @@ float bufferswap_fps(void)
 static void bufferswap_simple(void)
 {
 	glfwSwapBuffers(kuhl_get_window());
+	bufferswap_last_swap = kuhl_microseconds();
 	bufferswap_stats_fps();
 	return;
 }
@@ -200,6 +205,7 @@ static void bufferswap_latencyreduce()
 	glfwSwapBuffers(window);
 	bufferswap_stats_fps();
 	long postswap = kuhl_microseconds();
+	bufferswap_last_swap = postswap;
 
 
 
@@ -327,6 +333,16 @@ void bufferswap(void)
 		needsInit = 0;
 	}
 	
+	/* Time spent rendering this frame (since the last bufferswap()
+	 * returned). Used by bufferswap_display_time(). */
+	if(bufferswap_last_return >= 0)
+	{
+		long rendering = kuhl_microseconds() - bufferswap_last_return;
+		if(bufferswap_avg_render == 0)
+			bufferswap_avg_render = rendering;
+		bufferswap_avg_render = .9f * bufferswap_avg_render + .1f * rendering;
+	}
+
 	dgr_update(1,0); // DGR Master should send before blocking at swap.
 
 	/* Swap the buffers */
@@ -337,4 +353,56 @@ void bufferswap(void)
 		bufferswap_latencyreduce();
 
 	dgr_update(0,1); // DGR Slave should receive after swap (and before drawing)
+
+	screencap_update(); // Hand finished screen captures to the encoder thread
+	bufferswap_last_return = kuhl_microseconds();
+}
+
+/** Predicts when the frame that is being rendered now will appear on
+    the screen. Programs which use a tracking system can use this to
+    predict where the tracked objects will be when the frame is
+    displayed (see vrpn_get_predicted()).
+
+    The prediction assumes that rendering takes as long as it has
+    recently taken. If buffer swaps wait for vsync, the frame is shown
+    at the first vsync after rendering finishes. Vsyncs are assumed to
+    happen every 1/refreshrate seconds starting at the time the
+    previous swap finished. The bufferswap.displaylatency setting (in
+    milliseconds, default 0) is added to account for the time the
+    display itself takes (for example, to show the middle of the
+    screen, add half of the refresh period).
+
+    @return The time that the frame will be displayed (see kuhl_microseconds()).
+*/
+long bufferswap_display_time(void)
+{
+	static float latency = -1;
+	if(latency < 0)
+		latency = kuhl_config_float("bufferswap.displaylatency", 0, 0);
+
+	long now = kuhl_microseconds();
+	long ready = now;
+	if(bufferswap_last_return >= 0) // part of the frame has been rendered already
+		ready = (long) (bufferswap_last_return + bufferswap_avg_render);
+	if(ready < now)
+		ready = now;
+
+	long display = ready;
+	if(viewmat_swapinterval != 0 && bufferswap_last_swap >= 0)
+	{
+		static long vsyncTime = -1;
+		if(vsyncTime == -1)
+		{
+			int refreshRate = bufferswap_get_refresh_rate();
+			if(refreshRate == 59)
+				refreshRate = 60;
+			vsyncTime = (long) (1.0/refreshRate * 1000000);
+		}
+		/* Number of vsyncs after the last swap until we are ready */
+		long vsyncs = (ready - bufferswap_last_swap + vsyncTime - 1) / vsyncTime;
+		if(vsyncs < 1)
+			vsyncs = 1;
+		display = bufferswap_last_swap + vsyncs * vsyncTime;
+	}
+	return display + (long) (latency * 1000);
 }
@@ -39,6 +39,10 @@
       send/receive appropriately.
 
     * Monitors FPS and allows the user to retrieve the current FPS.
+
+    * Predicts when the frame being rendered will be displayed (see
+      bufferswap_display_time()) so that tracked objects can be
+      drawn where they will be at that time.
     
     @author Scott Kuhl
  */
@@ -50,6 +54,7 @@ extern "C" {
 
 void bufferswap(void);
 float bufferswap_fps(void);
+long bufferswap_display_time(void);
 
 #ifdef __cplusplus
 } // end extern "C"
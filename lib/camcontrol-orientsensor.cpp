@@ -3,6 +3,7 @@
 #include "camcontrol-orientsensor.h"
 #include "vecmat.h"
 #include "orient-sensor.h"
+#include "bufferswap.h"
 
 
 camcontrolOrientSensor::camcontrolOrientSensor(dispmode *currentDisplayMode, const float initialPos[3])
@@ -27,11 +28,16 @@ camcontrolOrientSensor::camcontrolOrientSensor(dispmode *currentDisplayMode, con
 
 	orientsense = orient_sensor_init(kuhl_config_get("orientsensor.tty"),
 	                                 orientSensorType);
+
+	/* Render with the orientation the sensor will have when the frame
+	 * is displayed instead of the orientation in the latest record. */
+	predict = kuhl_config_boolean("orientsensor.predict", 1, 1);
 }
 
 
 camcontrolOrientSensor::~camcontrolOrientSensor()
 {
+	orient_sensor_close(&orientsense);
 }
 
 viewmat_eye camcontrolOrientSensor::get_separate(float pos[3], float orient[16], viewmat_eye requestedEye)
@@ -41,7 +47,10 @@ viewmat_eye camcontrolOrientSensor::get_separate(float pos[3], float orient[16],
 
 	// Retrieve quaternion from sensor, convert it into a matrix.
 	float quaternion[4];
-	orient_sensor_get(&orientsense, quaternion);
+	if(predict)
+		orient_sensor_get_predicted(&orientsense, bufferswap_display_time(), quaternion);
+	else
+		orient_sensor_get(&orientsense, quaternion);
 	mat4f_rotateQuatVec_new(orient, quaternion);
 
 	// Correct rotation
@@ -12,6 +12,7 @@ class camcontrolOrientSensor : public camcontrol
 private:
 	OrientSensorState orientsense;
 	float position[3];
+	int predict; /**< Use orient_sensor_get_predicted() instead of orient_sensor_get()? */
 
 public:
 	camcontrolOrientSensor(dispmode *currentDisplayMode, const float pos[3]);
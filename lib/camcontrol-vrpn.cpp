@@ -3,6 +3,7 @@
 #include "camcontrol-vrpn.h"
 #include "vecmat.h"
 #include "vrpn-help.h"
+#include "bufferswap.h"
 
 camcontrolVrpn::camcontrolVrpn(dispmode *currentDisplayMode, const char *inObject, const char *inHostname)
 	:camcontrol(currentDisplayMode)
@@ -16,42 +17,31 @@ camcontrolVrpn::camcontrolVrpn(dispmode *currentDisplayMode, const char *inObjec
 		hostname = NULL;
 	else
 		hostname = strdup(inHostname);
-}
-
-camcontrolVrpn::~camcontrolVrpn()
-{
-	if(object != NULL)
-		free(object);
-
-	if(hostname != NULL)
-		free(hostname);
-}
 
-viewmat_eye camcontrolVrpn::get_separate(float pos[3], float rot[16], viewmat_eye requestedEye)
-{
-	viewmat_eye returnVal = VIEWMAT_EYE_MIDDLE;
-	vrpn_get(object, hostname, pos, rot);
+	/* Render with the pose the object will have when the frame is
+	 * displayed instead of the pose in the latest record. */
+	predict = kuhl_config_boolean("viewmat.vrpn.predict", 1, 1);
 
-	/* In many cases, the code above is all we need to do. Some
-	 * objects, need to be adjusted or rotated, however. */
+	/* Find the object once so that get_separate() doesn't need to
+	 * look it up by name every frame. */
+	handle = vrpn_open(object, hostname);
 
-	const char *hostname = vrpn_default_host();
-	if(hostname == NULL || object == NULL)
-		return returnVal;
-	
 	/* Some objects in the IVS lab need to be rotated to match the
-	 * orientation that we expect. Apply the fix here. */
-	if(vrpn_is_vicon(hostname)) // MTU vicon tracker
+	 * orientation that we expect. Compute the fix here and apply it in
+	 * get_separate(). */
+	hasOffset = 0;
+	mat4f_identity(offset);
+	const char *defaultHost = vrpn_default_host();
+	if(defaultHost != NULL && object != NULL &&
+	   vrpn_is_vicon(defaultHost)) // MTU vicon tracker
 	{
 		/* Note, orient has not been transposed/inverted yet. Doing
 		 * orient*offset will effectively effectively be rotating the
 		 * camera---not the world. */ 
 		if(strcmp(object, "DK2") == 0)
 		{
-			float offsetVicon[16];
-			mat4f_identity(offsetVicon);
-			mat4f_rotateAxis_new(offsetVicon, 90, 1,0,0);
-			mat4f_mult_mat4f_new(rot, rot, offsetVicon);
+			mat4f_rotateAxis_new(offset, 90, 1,0,0);
+			hasOffset = 1;
 		}
 
 		if(strcmp(object, "DSight") == 0)
@@ -62,12 +52,34 @@ viewmat_eye camcontrolVrpn::get_separate(float pos[3], float rot[16], viewmat_ey
 			float offsetVicon2[16];
 			mat4f_identity(offsetVicon2);
 			mat4f_rotateAxis_new(offsetVicon2, 180, 0,1,0);
-			
-			// orient = orient * offsetVicon1 * offsetVicon2
-			mat4f_mult_mat4f_many(rot, rot, offsetVicon1, offsetVicon2, NULL);
+
+			// offset = offsetVicon1 * offsetVicon2
+			mat4f_mult_mat4f_new(offset, offsetVicon1, offsetVicon2);
+			hasOffset = 1;
 		}
 	}
+}
+
+camcontrolVrpn::~camcontrolVrpn()
+{
+	if(object != NULL)
+		free(object);
+
+	if(hostname != NULL)
+		free(hostname);
+}
+
+viewmat_eye camcontrolVrpn::get_separate(float pos[3], float rot[16], viewmat_eye requestedEye)
+{
+	if(predict)
+		vrpn_get_handle_predicted(handle, bufferswap_display_time(), pos, rot);
+	else
+		vrpn_get_handle(handle, pos, rot);
+
+	/* In many cases, the code above is all we need to do. Some
+	 * objects, need to be adjusted or rotated, however. */
+	if(hasOffset)
+		mat4f_mult_mat4f_new(rot, rot, offset);
 
-	
 	return VIEWMAT_EYE_MIDDLE;
 }
@@ -4,12 +4,17 @@
  */
 
 #include "camcontrol.h"
+#include "vrpn-help.h"
 
 class camcontrolVrpn : public camcontrol
 {
 private:
 	char *object;
 	char *hostname;
+	int predict; /**< Use vrpn_get_handle_predicted() instead of vrpn_get_handle()? */
+	vrpn_handle handle;
+	int hasOffset; /**< Does offset need to be applied to the orientation? */
+	float offset[16];
 public:
 	camcontrolVrpn(dispmode *currentDisplayMode, const char *object, const char *hostname);
 	~camcontrolVrpn();
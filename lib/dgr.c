@@ -9,15 +9,144 @@
     DGR provides a framework for a master process to share data with
     slave processes via UDP packets on a network.
 
+    Wire format (version 2): The master serializes the records for a
+    frame and splits them into fragments which fit in a single UDP
+    packet (dgr.packetsize bytes, default 1472, which avoids IP
+    fragmentation on an Ethernet network). Each packet is a dgr_header
+    followed by one fragment. A slave reassembles the fragments and
+    only uses a frame once all of its fragments have arrived. If a
+    newer frame is completed first, the older incomplete frames are
+    discarded.
+
+    A frame contains dgr_header.count records. Each record is:
+
+    - A 16-bit ID. The highest bit is set if the name follows.
+    - If the name follows: An 8-bit length and then the name (without
+      a null terminator).
+    - A 16-bit size. If the size is 0xFFFF, a 32-bit size follows.
+    - The bytes of the record.
+
+    All integers are in the byte order of the master.
+
+    The master assigns each record a small integer ID the first time
+    it is set. A "keyframe" packet contains every record along with
+    its name. Other packets only contain the records that changed in
+    the last dgr.redundancy packets (default 1) and only include the
+    names of records that are new. Keyframes are sent every
+    dgr.keyframe packets (default 60) so that slaves which start late
+    catch up. They also fix any records that a slave missed because
+    packets were lost. Setting dgr.redundancy to a larger number makes
+    that less likely on a lossy network at the cost of larger
+    packets.
+
+    Compression: The master compresses frames that are at least
+    dgr.compress.threshold bytes (default 1024) with an LZ4-style
+    codec (the LZ4 block format with a 32-bit uncompressed size in
+    front of it). DGR_FLAG_COMPRESSED is set in the header of each
+    fragment of a compressed frame and the slave decompresses the
+    frame after it has been reassembled. If a frame doesn't shrink by
+    at least 1/8, it is sent uncompressed and the master doesn't try
+    to compress the next few frames (up to 64) so that data which
+    doesn't compress well costs little CPU time. Set dgr.compress to
+    0 to disable compression.
+
+    Multicast: Normally, the master sends every packet to each
+    address in dgr.master.dest. Instead, dgr.master.multicast can be
+    set to a multicast group and port (for example, "239.255.76.67
+    5676") so that each packet is only sent once no matter how many
+    slaves there are. Each slave sets dgr.slave.multicast to the same
+    group and dgr.slave.listenport to the same port. Several slaves
+    can run on the same machine. The following settings are used by
+    both the master and the slaves:
+
+    dgr.multicast.interface - IPv4 address of the network interface
+    to send or receive multicast packets on (default: chosen by the
+    OS). Use 127.0.0.1 to test on a single machine.
+
+    dgr.multicast.ttl - Number of routers that packets can pass
+    through (default 1, only the local network).
+
+    dgr.multicast.loop - Should slaves on the same machine as the
+    master receive packets (default 1)?
+
+    Synchronization: Each slave acknowledges the frames it uses by
+    sending a small packet back to the master. The master uses the
+    acknowledgements to measure the latency and jitter of each slave
+    (see dgr_get_slave_stats()). The dgr.sync setting on the master
+    controls how closely the slaves follow the master:
+
+    dgr.sync = latest - (default) Each slave uses the newest frame
+    that it has received when it starts rendering. This has the lowest
+    latency, but neighboring screens may show different frames.
+
+    dgr.sync = barrier - Slaves render every frame. Before swapping
+    buffers, each slave acknowledges the frame it rendered and waits
+    for the master to release it. The master waits for all of the
+    slaves (for at most dgr.barrier.timeout milliseconds, default 100)
+    before releasing them and swapping its own buffers. All of the
+    screens show the same frame at the cost of an extra round trip
+    each frame. In this mode, the master should call dgr_update(1,...)
+    once per frame (bufferswap() does this).
+
+    Recording: If dgr.mode is "record", DGR behaves like a master and
+    also writes every frame that it sends to the file named by
+    dgr.record.file (default "dgr-record.log"). dgr.master.dest and
+    dgr.master.multicast are optional in this mode. The file starts
+    with the 8 bytes "DGRLOG1\n". Each frame is stored as a 64-bit
+    timestamp (microseconds since the recording started), the
+    dgr_header of the frame (without the fragment information) and
+    the (possibly compressed) frame. dgr_replay() and the dgr-replay
+    program send a recording to slaves at the original pace, faster
+    or as fast as possible.
+
+    Blobs: dgr_blob_send() sends large, rarely changing data (such as
+    a decoded image or a model) to every slave once over TCP instead
+    of UDP. Slaves get it with dgr_blob_get(). The master listens on
+    dgr.blob.port and each slave connects to that port on the machine
+    that DGR packets come from (so dgr.blob.port must be set on the
+    master and the slaves). The master offers each blob (name, size
+    and 64-bit hash) and the slave replies "have" if it already has
+    data with the same hash, either in memory or in the
+    dgr.blob.cache directory (optional). Otherwise, the master sends
+    the data. See dgr_blob_progress() to monitor transfers.
+
+    Receiving: A slave reads packets in a background thread so that
+    the socket is drained (and large frames are reassembled) while the
+    slave is rendering. The thread appends the records of each
+    completed frame to a buffer. A keyframe replaces everything in the
+    buffer because it contains every record. dgr_update(0,1) swaps
+    that buffer with an empty one and applies the records, so it
+    doesn't wait for the network except while waiting for the first
+    keyframe and in barrier mode.
+
+    Shared memory: When several slaves run on the same machine (for
+    example, one per GPU), only one of them needs to receive packets.
+    That slave sets dgr.slave.listenport and dgr.shm (a POSIX shared
+    memory name such as "/dgr-wall"). The others only set dgr.shm.
+    The slave that receives packets writes each completed
+    (decompressed) frame into a ring of dgr.shm.slots slots (default
+    16) of dgr.shm.slotsize bytes (default 1048576) in the shared
+    memory and the others read the frames from the ring. Each slot is
+    protected by a sequence number (a seqlock) so that a frame which
+    was overwritten while a slave was copying it is discarded instead
+    of applied. Every slave still acknowledges frames to the master
+    itself, so dgr.sync = barrier waits for all of them. The shared
+    memory is not removed when the slaves exit; it is reused by the
+    next run.
+
     @author Scott Kuhl
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for recvmmsg()
+#endif
 #include "windows-compat.h"
 #include "kuhl-nodep.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 
@@ -25,27 +154,82 @@
 #if !defined __MINGW32__ && !defined _WIN32
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #endif // __MINGW32__
 
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 #include "msg.h"
 #include "kuhl-config.h"
 #include "dgr.h"
 
+#define DGR_MAX_NAME 255   /**< Longest name that fits in a packet */
+
 /** The dgr_record struct is used internally by DGR to hold a single
  * variable that DGR is keeping track of. */
 typedef struct {
-	char name[1024]; /**< The name of the variable */
-	int size;        /**< Number of bytes of data in this variable */
-	void *buffer;    /**< The bytes of data in this variable */
+	char name[DGR_MAX_NAME+1]; /**< The name of the variable */
+	uint32_t hash;   /**< Hash of the name (see dgr_hash()) */
+	int size;        /**< Number of bytes of data in this variable (-1 if it doesn't have a value yet) */
+	int offset;      /**< Location of the data in dgr_arena */
+	int capacity;    /**< Number of bytes reserved for the data in dgr_arena */
+	int registered;  /**< Size passed to dgr_register() (0 if not registered) */
+	uint32_t createdFrame; /**< Master: Frame the record was added in */
+	uint32_t changedFrame; /**< Master: Frame the record last changed in */
 } dgr_record;
 
-
+/** Header at the beginning of each DGR packet. */
+typedef struct {
+	char magic[2];      /**< Always "DG" */
+	uint8_t version;    /**< DGR_VERSION */
+	uint8_t flags;      /**< DGR_FLAG_* */
+	uint32_t session;   /**< Random number chosen by the master in dgr_init() */
+	uint32_t frame;     /**< Incremented every time the master sends */
+	uint32_t size;      /**< Number of bytes in the frame (in all fragments); slave ID in acknowledgements */
+	uint16_t fragIndex; /**< Which fragment of the frame is in this packet */
+	uint16_t fragCount; /**< Number of fragments in the frame */
+	uint16_t fragSize;  /**< Size of each fragment (except possibly the last) */
+	uint16_t count;     /**< Number of records in the frame */
+} dgr_header;
+#define DGR_VERSION 2
+#define DGR_FLAG_KEYFRAME 1 /**< Frame contains every record */
+#define DGR_FLAG_BARRIER  2 /**< Master is using dgr.sync = barrier */
+#define DGR_FLAG_ACK      4 /**< Slave acknowledging a frame (no data) */
+#define DGR_FLAG_RELEASE  8 /**< Master releasing slaves waiting at the barrier (no data) */
+#define DGR_FLAG_COMPRESSED 16 /**< Frame is compressed (see dgr_compress()) */
+
+/** A frame that a slave is reassembling from fragments. */
+typedef struct {
+	int inUse;          /**< Are we reassembling a frame in this slot? */
+	dgr_header header;  /**< Header from the first fragment we received */
+	int received;       /**< Number of fragments we have received */
+	char *data;         /**< The frame (dataAlloc bytes allocated) */
+	int dataAlloc;
+	uint8_t *have;      /**< have[i] is 1 if we received fragment i (haveAlloc bytes allocated) */
+	int haveAlloc;
+} dgr_fragments;
+/** Number of frames that a slave can reassemble at the same time. */
+#define DGR_FRAGMENT_SLOTS 4
+static dgr_fragments dgr_slots[DGR_FRAGMENT_SLOTS];
+/** Largest frame that a slave will accept. */
+#define DGR_MAX_FRAME_SIZE (64*1024*1024)
+
+#define DGR_ID_NAME 0x8000 /**< Set in a record ID if the name follows */
+#define DGR_RECORD_MAGIC "DGRLOG1\n" /**< First 8 bytes of a recording */
 
 
 /** Maximum number of records DGR can handle. */
@@ -54,9 +238,22 @@ typedef struct {
 static dgr_record dgr_list[DGR_MAX_LIST_SIZE]; 
 /** Size of the DGR record list */
 static int dgr_list_size = 0;
+/** Hash table of the records in dgr_list. Each entry is an index
+ * into dgr_list plus one (0 means the entry is empty). Uses open
+ * addressing with linear probing. Must be a power of two larger than
+ * DGR_MAX_LIST_SIZE. */
+#define DGR_HASH_SIZE 2048
+static int dgr_hash_table[DGR_HASH_SIZE];
+/** The data for all of the records. Records never give space back to
+ * the arena (except when dgr_free() is called), but a record reuses
+ * its space if its size shrinks or grows within its capacity. Once
+ * the records have been set, DGR doesn't allocate any memory. */
+static char *dgr_arena = NULL;
+static int dgr_arena_used = 0;  /**< Number of bytes of dgr_arena that are used */
+static int dgr_arena_alloc = 0; /**< Number of bytes allocated for dgr_arena */
 
 /* The socket that we are sending/receiving from */
-static int dgr_socket;
+static int dgr_socket = -1;
 #define DGR_ADDRINFO_MAX_SIZE 32  /**< Maximum number of hosts we can send packets to. */
 static struct addrinfo *dgr_addrinfo[DGR_ADDRINFO_MAX_SIZE];
 static int dgr_addrinfo_len = 0;  /**< if master, how many addresses to send packets to; length of dgr_addrinfo. */
@@ -66,15 +263,253 @@ static time_t dgr_time_lastreceive; /**< time we received last packet, 0 if have
 static int dgr_mode     = 1; /**< Set to 1 if we are master, 0 otherwise */
 static int dgr_disabled = 1; /**< Is DGR disabled? */
 
+static uint32_t dgr_session = 0;       /**< Master: Our session; Slave: Session of the master we are listening to */
+static uint32_t dgr_frame = 1;         /**< Master: Frame number of the next packet we will send */
+static uint32_t dgr_keyframe = 0;      /**< Master: Frame number of the most recent keyframe */
+static int dgr_keyframe_interval = 60; /**< Master: Packets between keyframes */
+static int dgr_redundancy = 1;         /**< Master: Number of packets each change is sent in */
+static int dgr_packetsize = 1472;      /**< Master: Maximum size of a UDP packet */
+static int dgr_send_failed = 0;        /**< Master: Did the last call to sendmsg() fail? */
+static int dgr_force_keyframe = 1;     /**< Master: Make next packet a keyframe */
+static FILE *dgr_record_file = NULL;   /**< Master: Recording that we are writing (if dgr.mode is record) */
+static long dgr_record_start = 0;      /**< Master: kuhl_microseconds() when the recording started */
+static int dgr_compress_enabled = 1;   /**< Master: dgr.compress */
+static int dgr_compress_threshold = 1024; /**< Master: Smallest frame that we try to compress */
+static int dgr_compress_skip = 0;      /**< Master: Number of frames to send before trying to compress again */
+static int dgr_compress_backoff = 0;   /**< Master: Value for dgr_compress_skip the next time compression doesn't help */
+static uint32_t dgr_last_frame = 0;    /**< Slave: Frame number of the last packet we used */
+static int dgr_have_keyframe = 0;      /**< Slave: Have we received a keyframe from this session? */
+/** Slave: Maps IDs in the packets from the master to indices in
+ * dgr_list (-1 if we don't know the name for an ID yet). */
+static int dgr_id_map[DGR_MAX_LIST_SIZE];
+static dgr_stats dgr_statistics;   /**< Slave: Updated by the receive thread */
+
+static int dgr_barrier = 0;            /**< Master: dgr.sync is barrier; Slave: master's frames have DGR_FLAG_BARRIER */
+static int dgr_barrier_timeout = 100;  /**< Master: Milliseconds to wait for slaves at the barrier */
+static uint32_t dgr_acked_frame = 0;   /**< Slave: Last frame we acknowledged at the barrier */
+static uint32_t dgr_released_frame = 0;/**< Slave: Last frame the master released */
+#if !defined __MINGW32__ && !defined _WIN32
+static struct sockaddr_storage dgr_master_addr; /**< Slave: Where packets from the master come from */
+static socklen_t dgr_master_addrlen = 0;
+#endif
+/** Slave: Random number that identifies us in acknowledgements
+ * (several slaves on one machine may send from the same address). */
+static uint32_t dgr_slave_id = 0;
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Frames that the receive thread completed but that the render
+ * thread hasn't used yet. The records of each frame are appended in
+ * order, so applying all of them has the same result as applying each
+ * frame one at a time. */
+typedef struct {
+	char *data;      /**< Records from one or more frames (alloc bytes allocated) */
+	int size;        /**< Number of bytes used in data */
+	int alloc;
+	int count;       /**< Number of records in data */
+	int frames;      /**< Number of frames in data (0 if nothing new arrived) */
+	uint32_t frame;  /**< Newest frame in data */
+	uint8_t flags;   /**< Flags of the newest frame, plus DGR_FLAG_KEYFRAME if any of the frames was a keyframe */
+	int newSession;  /**< Set if the master restarted before these frames */
+} dgr_pending;
+static dgr_pending dgr_pending_buf[2];
+/** Slave: Filled in by the receive thread. Protected by dgr_rx_mutex
+ * along with dgr_session, dgr_released_frame, dgr_master_addr,
+ * dgr_time_lastreceive and dgr_statistics. */
+static dgr_pending *dgr_pending_back = &dgr_pending_buf[0];
+/** Slave: Only used by the render thread. */
+static dgr_pending *dgr_pending_front = &dgr_pending_buf[1];
+static pthread_mutex_t dgr_rx_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when the receive thread completes a frame or receives a release. */
+static pthread_cond_t dgr_rx_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dgr_rx_thread;
+static int dgr_rx_running = 0;
+static volatile int dgr_rx_quit = 0;
+static uint32_t dgr_rx_frame = 0; /**< Slave receive thread: Newest frame that we completed */
+/** A blob (see dgr_blob_send()). */
+typedef struct {
+	char name[DGR_MAX_NAME+1];
+	uint64_t hash;   /**< See dgr_blob_hash() */
+	long size;
+	char *data;      /**< NULL once a replaced blob has been freed */
+	int complete;    /**< Have we received all of the data? */
+	int replaced;    /**< Set when a newer blob with the same name arrives */
+	int refs;        /**< Master: Number of threads sending this blob to a slave */
+} dgr_blob;
+/** Header of each message on a blob connection. */
+typedef struct {
+	char magic[2];    /**< Always "DB" */
+	uint8_t type;     /**< DGR_BLOB_* */
+	uint8_t pad;
+	uint16_t nameLen; /**< Length of the name that follows an offer */
+	uint16_t pad2;
+	uint64_t hash;    /**< Hash of the blob */
+	uint64_t size;    /**< Size of the blob */
+} dgr_blob_msg;
+#define DGR_BLOB_OFFER 1 /**< Master: The name follows; the slave replies with HAVE or WANT */
+#define DGR_BLOB_HAVE  2 /**< Slave: Already has the blob */
+#define DGR_BLOB_WANT  3 /**< Slave: Send the blob (the master sends the data after this reply) */
+#define DGR_BLOB_CHUNK (256*1024)  /**< Bytes between progress callbacks */
+#define DGR_BLOB_MAX_SIZE (1024L*1024*1024)
+/** Blobs that we sent (master) or received (slave), oldest first.
+ * Protected by dgr_blob_mutex. */
+static dgr_blob *dgr_blobs = NULL;
+static int dgr_blobs_len = 0;
+static int dgr_blobs_alloc = 0;
+static long dgr_blob_bytes = 0;
+static dgr_blob_func dgr_blob_callback = NULL;
+static void *dgr_blob_callback_arg = NULL;
+static pthread_mutex_t dgr_blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a blob is added to dgr_blobs. */
+static pthread_cond_t dgr_blob_cond = PTHREAD_COND_INITIALIZER;
+
+/** Shared memory ring (see dgr.shm) that the slave which receives
+ * packets writes frames into and other slaves on the same machine
+ * read frames from. The header is followed by the slots. */
+typedef struct {
+	char magic[8];                /**< DGR_SHM_MAGIC once the ring is initialized */
+	uint32_t slots;               /**< Number of slots */
+	uint32_t slotSize;            /**< Largest frame that fits in a slot */
+	uint32_t writeSeq;            /**< Number of frames written (frame i is in slot i % slots) */
+	uint32_t wake;                /**< Incremented when a frame or a release is written (readers wait on it with a futex) */
+	uint32_t released;            /**< Last frame the master released at the barrier */
+	uint32_t masterAddrlen;
+	struct sockaddr_storage masterAddr; /**< Where packets from the master come from */
+} dgr_shm_ring;
+/** A slot in the shared memory ring. The frame follows the slot. */
+typedef struct {
+	uint32_t seq;     /**< Seqlock: 2*i+1 while frame i is being written, 2*i+2 when it is done */
+	uint32_t pad;
+	dgr_header header;
+} dgr_shm_slot;
+#define DGR_SHM_MAGIC "DGRSHM1\n"
+#define DGR_SHM_HEADER_SIZE 4096
+static dgr_shm_ring *dgr_shm = NULL;
+static size_t dgr_shm_size = 0;
+static int dgr_shm_feeder = 0;  /**< Do we write into the ring (or read from it)? */
+
+/** Number of packets the receive thread can read with one recvmmsg() call. */
+#define DGR_RX_BATCH 32
+/** Largest possible UDP packet. */
+#define DGR_RX_PACKET 65536
+#endif
+
+/** Number of recent frames that the master remembers the send time for. */
+#define DGR_SENT_HISTORY 64
+static long dgr_sent_usec[DGR_SENT_HISTORY]; /**< Master: Time frame i was sent is in [i%DGR_SENT_HISTORY] */
+
+/** Information the master keeps about each slave. */
+typedef struct {
+#if !defined __MINGW32__ && !defined _WIN32
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+#endif
+	uint32_t id;         /**< Random ID chosen by the slave */
+	long lastHeard;      /**< kuhl_microseconds() when we last received an acknowledgement */
+	uint32_t frame;      /**< Most recent frame the slave acknowledged */
+	float lastLatency;   /**< Latency of the previous acknowledgement (ms) */
+	dgr_slave_stats stats;
+} dgr_slave;
+#define DGR_MAX_SLAVES 64
+/** A slave is waited for at the barrier if we heard from it within this many microseconds. */
+#define DGR_SLAVE_ACTIVE_USEC 2000000
+static dgr_slave dgr_slaves[DGR_MAX_SLAVES];
+static int dgr_slaves_len = 0;
+
 
 /** Frees resources that DGR has used. */
 static void dgr_free(void)
 {
-	for(int i=0; i<dgr_list_size; i++)
-		free(dgr_list[i].buffer);
 	dgr_list_size = 0;
+	dgr_arena_used = 0; // keep the memory for the next set of records
+	memset(dgr_hash_table, 0, sizeof(dgr_hash_table));
+	for(int i=0; i<DGR_MAX_LIST_SIZE; i++)
+		dgr_id_map[i] = -1;
+	dgr_force_keyframe = 1;
+}
+
+
+#if !defined __MINGW32__ && !defined _WIN32
+static void* dgr_rx_main(void *arg);
+static void* dgr_shm_main(void *arg);
+static int dgr_shm_open(int create);
+static void dgr_blob_start(int master);
+
+/** Reads dgr.multicast.interface.
+
+    @param addr Set to the address of the interface or to INADDR_ANY
+    if the interface was not specified.
+*/
+static void dgr_multicast_interface(struct in_addr *addr)
+{
+	addr->s_addr = htonl(INADDR_ANY);
+	const char *interface = kuhl_config_get("dgr.multicast.interface");
+	if(interface != NULL && inet_pton(AF_INET, interface, addr) != 1)
+	{
+		msg(MSG_FATAL, "DGR: dgr.multicast.interface must be an IPv4 address, not '%s'.", interface);
+		exit(EXIT_FAILURE);
+	}
 }
 
+/** If dgr.master.multicast is set, adds the multicast group to the
+ * list of places that we send packets to and sets the multicast
+ * options on our socket. */
+static void dgr_init_multicast_master(void)
+{
+	const char *group = kuhl_config_get("dgr.master.multicast");
+	if(group == NULL)
+		return;
+
+	char *tokens[2];
+	int numTokens = kuhl_tokenize(tokens, 2, group, " ");
+	if(numTokens != 2)
+	{
+		msg(MSG_FATAL, "DGR Master: dgr.master.multicast must contain a multicast IPv4 address and a port.");
+		exit(EXIT_FAILURE);
+	}
+	msg(MSG_INFO, "DGR Master: Preparing to send packets to multicast group %s port %s.\n", tokens[0], tokens[1]);
+
+	struct addrinfo hints, *servinfo;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	int rv;
+	if((rv = getaddrinfo(tokens[0], tokens[1], &hints, &servinfo)) != 0)
+	{
+		msg(MSG_FATAL, "DGR Master: getaddrinfo: %s\n", gai_strerror(rv));
+		exit(EXIT_FAILURE);
+	}
+	if(!IN_MULTICAST(ntohl(((struct sockaddr_in*)servinfo->ai_addr)->sin_addr.s_addr)))
+	{
+		msg(MSG_FATAL, "DGR Master: %s is not a multicast address (224.0.0.0 to 239.255.255.255).", tokens[0]);
+		exit(EXIT_FAILURE);
+	}
+	kuhl_tokenize_free(tokens, 2);
+
+	/* dgr_init_master() didn't create a socket if there weren't any
+	 * addresses in dgr.master.dest. */
+	if(dgr_addrinfo_len == 0 && (dgr_socket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		msg(MSG_FATAL, "DGR Master: socket(): %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if(dgr_addrinfo_len >= DGR_ADDRINFO_MAX_SIZE)
+		dgr_addrinfo_len = DGR_ADDRINFO_MAX_SIZE-1;
+	dgr_addrinfo[dgr_addrinfo_len] = servinfo;
+	dgr_addrinfo_len++;
+
+	unsigned char ttl = kuhl_config_int("dgr.multicast.ttl", 1, 1);
+	unsigned char loop = kuhl_config_boolean("dgr.multicast.loop", 1, 1);
+	struct in_addr interface;
+	dgr_multicast_interface(&interface);
+	if(setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1 ||
+	   setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1 ||
+	   setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) == -1)
+	{
+		msg(MSG_FATAL, "DGR Master: Unable to set multicast options: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+#endif // __MINGW32__
 
 /** Initializes a master DGR process that will send packets out on the network. */
 static void dgr_init_master()
@@ -85,7 +520,9 @@ static void dgr_init_master()
 	char *tokens[DGR_ADDRINFO_MAX_SIZE*2];
 	int numTokens = kuhl_tokenize(tokens, DGR_ADDRINFO_MAX_SIZE*2, ipAddr, " ");
 
-	if(numTokens == 0)
+	if(numTokens == 0 && (kuhl_config_isset("dgr.master.multicast") || dgr_record_file != NULL))
+		dgr_disabled = 0;
+	else if(numTokens == 0)
 	{
 		dgr_disabled = 1;
 		msg(MSG_ERROR, "DGR Master: Won't transmit since IP address was not provided.\n");
@@ -142,27 +579,57 @@ static void dgr_init_master()
 	}
 
 	kuhl_tokenize_free(tokens, DGR_ADDRINFO_MAX_SIZE*2);
+
+	dgr_init_multicast_master();
+
+	/* Ask the kernel for the time each acknowledgement arrives.
+	 * dgr_receive_acks() only reads them once a frame, so the time
+	 * it reads them would include however long the master spent
+	 * rendering. */
+	int on = 1;
+	if(dgr_socket >= 0 &&
+	   setsockopt(dgr_socket, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == -1)
+		msg(MSG_WARNING, "DGR Master: Slave latencies will include the time between frames. setsockopt(SO_TIMESTAMP): %s", strerror(errno));
+	dgr_blob_start(1);
 #endif // __MINGW32__
 }
 
-/** Initializes a DGR slave process which will receive packets from a master process. */
-static void dgr_init_slave()
-{
 #if !defined __MINGW32__ && !defined _WIN32
-	const char* port = kuhl_config_get("dgr.slave.listenport");
 
-	if(port == NULL)
-	{
-		msg(MSG_FATAL, "DGR Slave: DGR_SLAVE_LISTEN_PORT was not set.\n");
-		exit(EXIT_FAILURE);
-	}
+/** Slave: Stops the receive thread (if it is running) and closes its socket. */
+static void dgr_rx_stop(void)
+{
+	if(!dgr_rx_running)
+		return;
+	dgr_rx_quit = 1;
+	/* Wakes up the thread if it is waiting for a packet. */
+	if(dgr_socket >= 0)
+		shutdown(dgr_socket, SHUT_RDWR);
+	pthread_join(dgr_rx_thread, NULL);
+	if(dgr_socket >= 0)
+		close(dgr_socket);
+	if(dgr_shm != NULL)
+		munmap(dgr_shm, dgr_shm_size);
+	dgr_shm = NULL;
+	dgr_rx_running = 0;
+}
+#endif // __MINGW32__
+
+/** Creates the socket that a DGR slave receives packets on.
+
+    @param port The port to listen on.
+    @param group The multicast group to join (or NULL).
+*/
+static void dgr_slave_socket(const char *port, const char *group)
+{
 	msg(MSG_INFO, "DGR Slave: Preparing to receive packets on port %s.\n", port);
 	
-	dgr_time_lastreceive = 0;
 	struct addrinfo hints, *servinfo, *p;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC; // set to AF_INET forces IPv4; AF_INET6 forces IPv6; AF_UNSPEC allows any
+	if(group != NULL)
+		hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
@@ -179,6 +646,11 @@ static void dgr_init_slave()
 			perror("DGR Slave: socket");
 			continue;
 		}
+		/* Let other slaves on this machine listen to the same
+		 * multicast group and port. */
+		int reuse = 1;
+		if(group != NULL)
+			setsockopt(dgr_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 		if (bind(dgr_socket, p->ai_addr, p->ai_addrlen) == -1) {
 			close(dgr_socket);
 			msg(MSG_ERROR, "DGR Slave: bind: %s", strerror(errno));
@@ -193,7 +665,76 @@ static void dgr_init_slave()
 		exit(EXIT_FAILURE);
 	}
 
+	/* A large frame arrives as a burst of packets. Ask for a large
+	 * receive buffer so that they don't get dropped while we are
+	 * rendering. The OS may limit it to something smaller. */
+	int rcvbuf = 4*1024*1024;
+	setsockopt(dgr_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if(group != NULL)
+	{
+		msg(MSG_INFO, "DGR Slave: Joining multicast group %s.\n", group);
+		struct ip_mreq mreq;
+		if(inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1)
+		{
+			msg(MSG_FATAL, "DGR Slave: dgr.slave.multicast must be an IPv4 address, not '%s'.", group);
+			exit(EXIT_FAILURE);
+		}
+		dgr_multicast_interface(&mreq.imr_interface);
+		if(setsockopt(dgr_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+		{
+			msg(MSG_FATAL, "DGR Slave: Unable to join multicast group %s: %s", group, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	freeaddrinfo(servinfo);
+}
+
+/** Initializes a DGR slave process which will receive packets from a master process. */
+static void dgr_init_slave()
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	const char* port = kuhl_config_get("dgr.slave.listenport");
+	const char* group = kuhl_config_get("dgr.slave.multicast");
+
+	if(port == NULL && !kuhl_config_isset("dgr.shm"))
+	{
+		msg(MSG_FATAL, "DGR Slave: DGR_SLAVE_LISTEN_PORT was not set.\n");
+		exit(EXIT_FAILURE);
+	}
+	dgr_time_lastreceive = 0;
+	dgr_socket = -1;
+	if(port != NULL)
+	{
+		dgr_slave_socket(port, group);
+		/* Also share the frames with the other slaves on this machine. */
+		if(kuhl_config_isset("dgr.shm") && !dgr_shm_open(1))
+		{
+			msg(MSG_FATAL, "DGR Slave: Unable to create shared memory %s.", kuhl_config_get("dgr.shm"));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(int i=0; i<2; i++)
+	{
+		dgr_pending_buf[i].size = 0;
+		dgr_pending_buf[i].count = 0;
+		dgr_pending_buf[i].frames = 0;
+		dgr_pending_buf[i].flags = 0;
+		dgr_pending_buf[i].newSession = 0;
+	}
+	dgr_rx_frame = 0;
+	dgr_rx_quit = 0;
+	/* Without a port, the receive thread reads frames from the shared
+	 * memory that another slave on this machine writes them into. */
+	if(pthread_create(&dgr_rx_thread, NULL, port != NULL ? dgr_rx_main : dgr_shm_main, NULL) != 0)
+	{
+		msg(MSG_FATAL, "DGR Slave: Unable to create the receive thread.");
+		exit(EXIT_FAILURE);
+	}
+	dgr_rx_running = 1;
+	dgr_blob_start(0);
 #endif // __MINGW32__
 }
 
@@ -223,65 +764,146 @@ int dgr_is_enabled(void)
 	return 1;
 }
 
+/** Calculates a hash of a string (FNV-1a). */
+static uint32_t dgr_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) name; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 /** Given a name, find the index of the name in our list. Returns -1 if
  * name is not found. */
 static int dgr_findIndex(const char *name)
 {
-	for(int i=0; i<dgr_list_size; i++)
+	uint32_t hash = dgr_hash(name);
+	for(uint32_t i = hash; ; i++)
 	{
-		if(strcmp(name, dgr_list[i].name) == 0)
-			return i;
+		int entry = dgr_hash_table[i & (DGR_HASH_SIZE-1)];
+		if(entry == 0)
+			return -1;
+		dgr_record *r = &(dgr_list[entry-1]);
+		if(r->hash == hash && strcmp(name, r->name) == 0)
+			return entry-1;
 	}
-	return -1;
 }
 
-
-/** Adds a variable to DGRs list of variables. These variables will be
- * sent to slaves when dgr_update() is called.
+/** Adds a record without a value to our list.
  *
- * @param name The name of the variable.
- * @param buffer A pointer to the variable.
- * @param size The number of bytes used by the variable.
+ * @param name The name of the record (must not already be in the list).
+ * @return The index of the new record.
  */
-static void dgr_set(const char *name, const void *buffer, int size)
+static int dgr_add(const char *name)
 {
-	if(dgr_disabled)
-		return;
-	
-	// printf("dgr_set(%s, %p, %d)\n", name, buffer, size);
-	int index = dgr_findIndex(name);
-	if(index == -1)
+	if(dgr_list_size >= DGR_MAX_LIST_SIZE)
 	{
-		// printf("DGR Master: The name '%s' is new to dgr, storing it at location %d\n", name, dgr_list_size);
+		msg(MSG_FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
+		exit(EXIT_FAILURE);
+	}
+	if(strlen(name) > DGR_MAX_NAME)
+	{
+		msg(MSG_FATAL, "DGR: The name '%s' is too long; names can be at most %d characters.", name, DGR_MAX_NAME);
+		exit(EXIT_FAILURE);
+	}
+
+	int index = dgr_list_size;
+	dgr_record *record = &(dgr_list[index]);
+	memset(record, 0, sizeof(dgr_record));
+	snprintf(record->name, DGR_MAX_NAME+1, "%s", name);
+	record->hash = dgr_hash(name);
+	record->size = -1;
+	dgr_list_size++;
+
+	uint32_t i = record->hash;
+	while(dgr_hash_table[i & (DGR_HASH_SIZE-1)] != 0)
+		i++;
+	dgr_hash_table[i & (DGR_HASH_SIZE-1)] = index+1;
+	return index;
+}
+
+/** Makes sure that a record has room for a value of a given size in
+ * the arena. */
+static void dgr_reserve(dgr_record *record, int size)
+{
+	if(size <= record->capacity)
+		return;
 
-		if(dgr_list_size > DGR_MAX_LIST_SIZE)
+	/* Keep the data for each record aligned. */
+	int capacity = (size + 15) & ~15;
+	int offset = (dgr_arena_used + 15) & ~15;
+	if(offset + capacity > dgr_arena_alloc)
+	{
+		int alloc = dgr_arena_alloc > 0 ? dgr_arena_alloc : 64*1024;
+		while(offset + capacity > alloc)
+			alloc *= 2;
+		dgr_arena = realloc(dgr_arena, alloc);
+		if(dgr_arena == NULL)
 		{
-			msg(MSG_FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
+			msg(MSG_FATAL, "DGR: Unable to allocate %d bytes.", alloc);
 			exit(EXIT_FAILURE);
 		}
+		dgr_arena_alloc = alloc;
+	}
+	record->offset = offset;
+	record->capacity = capacity;
+	dgr_arena_used = offset + capacity;
+}
 
-		dgr_record *record = &(dgr_list[dgr_list_size]);
-		sprintf(record->name, "%s",  name);
+/** Stores a value in a record. These variables will be sent to
+ * slaves when dgr_update() is called.
+ *
+ * @param index The index of the record in dgr_list.
+ * @param buffer A pointer to the variable.
+ * @param size The number of bytes used by the variable.
+ */
+static void dgr_set_index(int index, const void *buffer, int size)
+{
+	dgr_record *record = &(dgr_list[index]);
+	if(record->size < 0)
+	{
+		/* The record didn't have a value (it was just created or
+		 * registered). */
+		dgr_reserve(record, size);
 		record->size = size;
-		record->buffer = malloc(size);
-		memcpy(record->buffer, buffer, size);
-
-		dgr_list_size++;
+		memcpy(dgr_arena + record->offset, buffer, size);
+		record->createdFrame = dgr_frame;
+		record->changedFrame = dgr_frame;
+		return;
 	}
-	else
-	{
-		dgr_record *record = &(dgr_list[index]);
-		// printf("DGR Master: The name '%s' is already known to dgr (at index %d)\n", name, index);
 
-		if(record->size != size)
-		{
-//			printf("DGR Master: The name %s used to have size %d but now has size %d.", name, record->size, size);
-			free(record->buffer);
-			record->buffer = malloc(size);
-			record->size = size;
-		}
-		memcpy(record->buffer, buffer, size);
+	if(record->size != size)
+	{
+		dgr_reserve(record, size);
+		record->size = size;
 	}
+	else if(memcmp(dgr_arena + record->offset, buffer, size) == 0)
+		return; // value didn't change
+	memcpy(dgr_arena + record->offset, buffer, size);
+	record->changedFrame = dgr_frame;
+}
+
+/** Adds a variable to DGRs list of variables. These variables will be
+ * sent to slaves when dgr_update() is called.
+ *
+ * @param name The name of the variable.
+ * @param buffer A pointer to the variable.
+ * @param size The number of bytes used by the variable.
+ * @return The index of the record in dgr_list.
+ */
+static int dgr_set(const char *name, const void *buffer, int size)
+{
+	if(dgr_disabled)
+		return -1;
+	
+	int index = dgr_findIndex(name);
+	if(index == -1)
+		index = dgr_add(name);
+	dgr_set_index(index, buffer, size);
+	return index;
 }
 
 
@@ -294,10 +916,16 @@ static void dgr_exit(void)
 	if(dgr_is_enabled() && dgr_is_master())
 	{
 		msg(MSG_DEBUG, "dgr_exit() is informing slaves that the master is exiting.\n");
-		dgr_free(); // clear the list of records to send.
+		dgr_free(); // clear the list of records to send (and send a keyframe)
 		int died = 1;
 		dgr_set("!!!dgr_died!!!", &died, sizeof(int));
+		dgr_barrier = 0; // slaves exit instead of acknowledging
 		dgr_update(1,1);
+		if(dgr_record_file != NULL)
+		{
+			fclose(dgr_record_file);
+			dgr_record_file = NULL;
+		}
 
 		// Don't let this get called repeatedly.
 		dgr_mode = 1;
@@ -316,10 +944,48 @@ void dgr_init(void)
 
 	dgr_mode = 1;
 	dgr_disabled = 1;
-
-	// if there already is a list, free it.
-	if(dgr_list_size > 0)
-		dgr_free();
+#if !defined __MINGW32__ && !defined _WIN32
+	dgr_rx_stop();
+#endif
+	dgr_socket = -1;
+
+	// Free the list (if there is one) and reset the ID map.
+	dgr_free();
+	memset(&dgr_statistics, 0, sizeof(dgr_statistics));
+	dgr_frame = 1;
+	dgr_keyframe = 0;
+	dgr_last_frame = 0;
+	dgr_have_keyframe = 0;
+	dgr_keyframe_interval = kuhl_config_int("dgr.keyframe", 60, 60);
+	if(dgr_keyframe_interval < 1)
+		dgr_keyframe_interval = 1;
+	dgr_redundancy = kuhl_config_int("dgr.redundancy", 1, 1);
+	if(dgr_redundancy < 1)
+		dgr_redundancy = 1;
+	const char *sync = kuhl_config_get("dgr.sync");
+	dgr_barrier = 0;
+	if(sync != NULL && strcmp(sync, "barrier") == 0)
+		dgr_barrier = 1;
+	else if(sync != NULL && strcmp(sync, "latest") != 0)
+		msg(MSG_WARNING, "dgr.sync must be 'latest' or 'barrier' but you set it to '%s'", sync);
+	dgr_barrier_timeout = kuhl_config_int("dgr.barrier.timeout", 100, 100);
+	dgr_acked_frame = 0;
+	dgr_released_frame = 0;
+	dgr_slaves_len = 0;
+	dgr_compress_enabled = kuhl_config_boolean("dgr.compress", 1, 1);
+	dgr_compress_threshold = kuhl_config_int("dgr.compress.threshold", 1024, 1024);
+	dgr_compress_skip = 0;
+	dgr_compress_backoff = 0;
+	dgr_packetsize = kuhl_config_int("dgr.packetsize", 1472, 1472);
+	if(dgr_packetsize < 256 || dgr_packetsize > 65507)
+	{
+		msg(MSG_WARNING, "dgr.packetsize must be between 256 and 65507 bytes, using 1472.");
+		dgr_packetsize = 1472;
+	}
+	/* Let slaves detect that the master has restarted. */
+	srand(time(NULL) ^ getpid());
+	dgr_session = (uint32_t) rand() ^ ((uint32_t) rand() << 16);
+	dgr_slave_id = (uint32_t) rand() ^ ((uint32_t) rand() << 16);
 	
 	if(mode != NULL)
 	{
@@ -329,6 +995,27 @@ void dgr_init(void)
 			dgr_disabled = 0;
 			dgr_init_master();
 		}
+		else if(strcmp(mode, "record") == 0)
+		{
+#if !defined __MINGW32__ && !defined _WIN32
+			const char *filename = kuhl_config_get("dgr.record.file");
+			if(filename == NULL)
+				filename = "dgr-record.log";
+			if(dgr_record_file != NULL)
+				fclose(dgr_record_file);
+			dgr_record_file = fopen(filename, "wb");
+			if(dgr_record_file == NULL || fwrite(DGR_RECORD_MAGIC, 1, 8, dgr_record_file) != 8)
+			{
+				msg(MSG_FATAL, "DGR: Unable to write recording to %s: %s", filename, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			msg(MSG_INFO, "DGR: Recording frames to %s.\n", filename);
+			dgr_record_start = kuhl_microseconds();
+#endif
+			dgr_mode = 1;
+			dgr_disabled = 0;
+			dgr_init_master();
+		}
 		else if(strcmp(mode, "slave") == 0)
 		{
 			dgr_mode = 0;
@@ -338,7 +1025,7 @@ void dgr_init(void)
 		}
 		else if(strlen(mode) > 0)
 		{
-			msg(MSG_ERROR, "dgr.mode must be 'slave' or 'master' but you set it to '%s'", mode);
+			msg(MSG_ERROR, "dgr.mode must be 'slave', 'master' or 'record' but you set it to '%s'", mode);
 		}
 	}
 	
@@ -356,6 +1043,28 @@ void dgr_init(void)
 
 
 
+/** Copies the value of a record into a buffer.
+ *
+ * @param index The index of the record in dgr_list.
+ * @param buffer A buffer for the retrieved data should be stored in.
+ * @param bufferSize The size of the buffer.
+ * @return See dgr_get().
+ */
+static int dgr_get_index(int index, void* buffer, int bufferSize)
+{
+	dgr_record *rec = &(dgr_list[index]);
+	if(rec->size < 0) // registered, but we haven't received it
+		return -1;
+	/* Copy the data if there is enough room */
+	if(bufferSize >= rec->size)
+	{
+		memcpy(buffer, dgr_arena + rec->offset, rec->size);
+		return rec->size;
+	}
+	else /* 'buffer' wasn't large enough to store data. */
+		return -2;
+}
+
 /** Given a label, a buffer to store data, and the size of that buffer,
  * get data from DGR, store it in buffer and return the actual size of
  * the data we copied into the buffer.
@@ -380,17 +1089,19 @@ static int dgr_get(const char *name, void* buffer, int bufferSize)
 	int index = dgr_findIndex(name);
 	if(index == -1)
 		return -1;
+	return dgr_get_index(index, buffer, bufferSize);
+}
 
-	/* If we found the record... */
-	dgr_record *rec = &(dgr_list[index]);
-	/* Copy the data if there is enough room */
-	if(bufferSize >= rec->size)
-	{
-		memcpy(buffer, rec->buffer, rec->size);
-		return rec->size;
-	}
-	else /* 'buffer' wasn't large enough to store data. */
-		return -2;
+/** Prints a message if dgr_get() or dgr_get_index() failed. */
+static void dgr_get_check(const char *name, int ret, int bufferSize)
+{
+	if(ret == -1)
+		msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it\n", name);
+	else if(ret == -2)
+		msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+
+	else if(ret != bufferSize)
+		msg(MSG_WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
 }
 
 
@@ -421,87 +1132,950 @@ void dgr_setget(const char *name, void* buffer, int bufferSize)
 	if(dgr_mode)
 		dgr_set(name, buffer, bufferSize);
 	else
-	{
-		int ret = dgr_get(name, buffer, bufferSize);
-		if(ret == -1)
-			msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it\n", name);
-		else if(ret == -2)
-			msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+		dgr_get_check(name, dgr_get(name, buffer, bufferSize), bufferSize);
+}
 
-		else if(ret != bufferSize)
-			msg(MSG_WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
+/** Registers a variable with DGR and returns a handle that can be
+ * passed to dgr_setget_handle(). dgr_setget_handle() is faster than
+ * dgr_setget() because it doesn't need to look up the name. Call
+ * dgr_register() after dgr_init() (for example, when your program
+ * starts) and then call dgr_setget_handle() every frame.
+ *
+ * @param name The name of the variable. Both the DGR master and DGR slaves must use the same name for the same variable.
+ * @param size The size of the variable in bytes.
+ * @return A handle for the variable.
+ */
+int dgr_register(const char *name, int size)
+{
+	int index = dgr_findIndex(name);
+	if(index == -1)
+		index = dgr_add(name);
+	dgr_record *r = &(dgr_list[index]);
+	r->registered = size;
+	dgr_reserve(r, size);
+	return index;
+}
+
+/** Same as dgr_setget() except that the variable is specified with a
+ * handle from dgr_register() instead of a name.
+ *
+ * @param handle A handle returned by dgr_register().
+ * @param buffer A pointer to the data. It must be the size that was passed to dgr_register().
+ */
+void dgr_setget_handle(int handle, void *buffer)
+{
+	if(dgr_disabled)
+		return;
+	if(handle < 0 || handle >= dgr_list_size || dgr_list[handle].registered == 0)
+	{
+		msg(MSG_ERROR, "DGR: Invalid handle %d. Did you call dgr_register() after dgr_init()?", handle);
+		return;
 	}
+
+	dgr_record *r = &(dgr_list[handle]);
+	if(dgr_mode)
+		dgr_set_index(handle, buffer, r->registered);
+	else
+		dgr_get_check(r->name, dgr_get_index(handle, buffer, r->registered), r->registered);
 }
 
 
-/** Takes the list of DGR records and puts them into a compact byte
- * stream. The format is:
- *   
- * label character string<br>
- * Null terminator at end of string<br>
- * An integer indicating the size of the data that follows.<br>
- * A buffer of the data.<br>
+/** Takes the list of DGR records and puts them into a frame (see
+ * the description of the wire format at the top of this file). The
+ * frame will be a keyframe containing every record if one is due.
+ * Otherwise, it will only contain records which changed recently.
  *
+ * @param header A header to be filled in (except for the fragment information).
  * @param size The size of the data being serialized.
  * @return A serialized array of bytes (to be free()'d by the caller)
 */
-char* dgr_serialize(int *size)
+static char* dgr_serialize(dgr_header *header, int *size)
 {
+	int isKeyframe = 0;
+	if(dgr_force_keyframe || dgr_frame - dgr_keyframe >= (uint32_t) dgr_keyframe_interval)
+	{
+		isKeyframe = 1;
+		dgr_keyframe = dgr_frame;
+		dgr_force_keyframe = 0;
+	}
+	/* Send records that changed after this frame. Everything up to
+	 * and including the last keyframe was in the keyframe. */
+	uint32_t since = dgr_keyframe;
+	if((int32_t) (dgr_frame - dgr_redundancy - dgr_keyframe) > 0)
+		since = dgr_frame - dgr_redundancy;
+	if(isKeyframe)
+		since = dgr_frame - 1;
+
+	/* Figure out which records we are sending and how much space we need. */
 	int spaceNeeded = 0;
+	int count = 0;
 	for(int i=0; i<dgr_list_size; i++)
-		spaceNeeded += strlen(dgr_list[i].name)+1+sizeof(int)+dgr_list[i].size;
-	*size = spaceNeeded;
+	{
+		dgr_record *r = &(dgr_list[i]);
+		if(r->size < 0 || (!isKeyframe && r->changedFrame <= since))
+			continue;
+		spaceNeeded += 2 + 2 + r->size;
+		if(r->size >= 0xFFFF)
+			spaceNeeded += 4;
+		if(isKeyframe || r->createdFrame > since)
+			spaceNeeded += 1 + strlen(r->name);
+		count++;
+	}
 
-	if(spaceNeeded == 0)
-		return NULL;
-	
-	char *serialized = malloc(spaceNeeded);
+	memcpy(header->magic, "DG", 2);
+	header->version = DGR_VERSION;
+	header->flags = isKeyframe ? DGR_FLAG_KEYFRAME : 0;
+	if(dgr_barrier)
+		header->flags |= DGR_FLAG_BARRIER;
+	header->session = dgr_session;
+	header->frame = dgr_frame;
+	header->size = spaceNeeded;
+	header->count = count;
+
+	char *serialized = malloc(spaceNeeded > 0 ? spaceNeeded : 1);
 	char *ptr = serialized;
 	for(int i=0; i<dgr_list_size; i++)
 	{
-		int bytesPrinted = sprintf(ptr, "%s", dgr_list[i].name);
-		ptr += bytesPrinted+1; // extra byte for null terminated string.
-		memcpy(ptr, &(dgr_list[i].size), sizeof(int));
-		ptr += sizeof(int);
-		memcpy(ptr, dgr_list[i].buffer, dgr_list[i].size);
-		ptr += dgr_list[i].size;
+		dgr_record *r = &(dgr_list[i]);
+		if(r->size < 0 || (!isKeyframe && r->changedFrame <= since))
+			continue;
+
+		uint16_t id = i;
+		if(isKeyframe || r->createdFrame > since)
+		{
+			id |= DGR_ID_NAME;
+			memcpy(ptr, &id, 2);
+			ptr += 2;
+			uint8_t nameLen = strlen(r->name);
+			*ptr = nameLen;
+			memcpy(ptr+1, r->name, nameLen);
+			ptr += 1 + nameLen;
+		}
+		else
+		{
+			memcpy(ptr, &id, 2);
+			ptr += 2;
+		}
+
+		uint16_t shortSize = r->size < 0xFFFF ? r->size : 0xFFFF;
+		memcpy(ptr, &shortSize, 2);
+		ptr += 2;
+		if(shortSize == 0xFFFF)
+		{
+			uint32_t longSize = r->size;
+			memcpy(ptr, &longSize, 4);
+			ptr += 4;
+		}
+		memcpy(ptr, dgr_arena + r->offset, r->size);
+		ptr += r->size;
 	}
 
+	dgr_frame++;
+	*size = spaceNeeded;
 	return serialized;
 }
 
 
-/** Unserializes serialized data and stores it in our global dgr_list
- * variable. We do not blow away the list, instead we just update the
- * data that is already in the list.
- *
- * @param size Length of the serialized data.
- * @param serialized The serialized data as an array of bytes.
- **/
-static void dgr_unserialize(int size, const char *serialized)
+/** Writes the extra bytes of a length in a compressed frame (LZ4
+ * block format: 255 is added to the length until a byte is less than
+ * 255). */
+static uint8_t* dgr_compress_length(uint8_t *op, int len)
 {
-	const char *ptr = serialized;
+	while(len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
 
-	while(ptr < serialized + size)
+/** Compresses a frame with an LZ4-style codec. The output is in the
+ * LZ4 block format: Each sequence is a token (the number of literal
+ * bytes in the high 4 bits and the match length minus 4 in the low 4
+ * bits; 15 means extra length bytes follow), the literal bytes, a
+ * 16-bit little-endian offset back to the match and any extra match
+ * length bytes. The last sequence only has literals.
+ *
+ * @param src The data to compress.
+ * @param srcSize The size of src.
+ * @param dst Buffer for the compressed data.
+ * @param dstCapacity The size of dst.
+ * @return The size of the compressed data or 0 if it didn't fit in dstCapacity bytes.
+ */
+static int dgr_compress(const char *src, int srcSize, char *dst, int dstCapacity)
+{
+	/* Hash table of the last position where each 4-byte sequence was
+	 * seen (plus one; 0 means empty). */
+#define DGR_LZ_HASH_BITS 12
+	static int table[1<<DGR_LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t *in = (const uint8_t*) src;
+	const uint8_t *ip = in, *anchor = in, *end = in + srcSize;
+	/* Like LZ4, the last 12 bytes don't start a match and the last 5 bytes are always literals. */
+	const uint8_t *matchStart = end - 12, *matchEnd = end - 5;
+	uint8_t *op = (uint8_t*) dst, *oend = op + dstCapacity;
+	int misses = 0;
+
+	while(srcSize >= 13 && ip < matchStart)
 	{
-		int c = 0;
-		char name[1024];
-		while(*ptr != 0)
+		uint32_t seq;
+		memcpy(&seq, ip, 4);
+		uint32_t h = (seq * 2654435761u) >> (32-DGR_LZ_HASH_BITS);
+		int ref = table[h] - 1;
+		table[h] = ip - in + 1;
+		uint32_t refSeq;
+		if(ref < 0 || ip - in - ref > 65535 || (memcpy(&refSeq, in+ref, 4), refSeq != seq))
 		{
-			name[c++] = *ptr;
-			ptr++;
+			/* Skip through data that doesn't compress faster. */
+			ip += 1 + (misses++ >> 6);
+			continue;
 		}
-		name[c++] = '\0';
-		ptr++;
-		//msg(MSG_DEBUG, "DGR unserialized: %s\n", name);
+		misses = 0;
 
-		int size = 0;
-		memcpy(&size, ptr, sizeof(int));
-		ptr += sizeof(int);
+		const uint8_t *match = in + ref;
+		const uint8_t *mp = ip + 4, *rp = match + 4;
+		while(mp < matchEnd && *mp == *rp)
+		{
+			mp++;
+			rp++;
+		}
+		int litLen = ip - anchor;
+		int matchLen = mp - ip - 4;
+		if(oend - op < 1 + litLen/255 + 1 + litLen + 2 + matchLen/255 + 1)
+			return 0;
+
+		uint8_t *token = op++;
+		*token = (litLen < 15 ? litLen : 15) << 4 | (matchLen < 15 ? matchLen : 15);
+		if(litLen >= 15)
+			op = dgr_compress_length(op, litLen - 15);
+		memcpy(op, anchor, litLen);
+		op += litLen;
+		uint16_t offset = ip - match;
+		op[0] = offset & 0xFF;
+		op[1] = offset >> 8;
+		op += 2;
+		if(matchLen >= 15)
+			op = dgr_compress_length(op, matchLen - 15);
+		ip = anchor = mp;
+	}
+
+	int litLen = end - anchor;
+	if(oend - op < 1 + litLen/255 + 1 + litLen)
+		return 0;
+	*op++ = (litLen < 15 ? litLen : 15) << 4;
+	if(litLen >= 15)
+		op = dgr_compress_length(op, litLen - 15);
+	memcpy(op, anchor, litLen);
+	op += litLen;
+	return op - (uint8_t*) dst;
+}
+
+/** Decompresses data from dgr_compress().
+ *
+ * @param src The compressed data.
+ * @param srcSize The size of src.
+ * @param dst Buffer for the decompressed data.
+ * @param dstSize The size of the data after it is decompressed.
+ * @return 1 if the data was decompressed, 0 if it is corrupt.
+ */
+static int dgr_decompress(const char *src, int srcSize, char *dst, int dstSize)
+{
+	const uint8_t *ip = (const uint8_t*) src, *iend = ip + srcSize;
+	uint8_t *op = (uint8_t*) dst, *oend = op + dstSize;
+	while(ip < iend)
+	{
+		int token = *ip++;
+		int litLen = token >> 4;
+		if(litLen == 15)
+		{
+			int b;
+			do {
+				if(ip >= iend || litLen > dstSize)
+					return 0;
+				b = *ip++;
+				litLen += b;
+			} while(b == 255);
+		}
+		if(litLen > iend - ip || litLen > oend - op)
+			return 0;
+		memcpy(op, ip, litLen);
+		op += litLen;
+		ip += litLen;
+		if(ip == iend) // the last sequence only has literals
+			break;
+
+		if(iend - ip < 2)
+			return 0;
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int matchLen = token & 15;
+		if(matchLen == 15)
+		{
+			int b;
+			do {
+				if(ip >= iend || matchLen > dstSize)
+					return 0;
+				b = *ip++;
+				matchLen += b;
+			} while(b == 255);
+		}
+		matchLen += 4;
+		if(offset == 0 || offset > op - (uint8_t*) dst || matchLen > oend - op)
+			return 0;
+		/* The match may overlap the bytes we are writing. */
+		const uint8_t *match = op - offset;
+		if(offset >= matchLen)
+			memcpy(op, match, matchLen);
+		else
+			for(int i=0; i<matchLen; i++)
+				op[i] = match[i];
+		op += matchLen;
+	}
+	return op == oend;
+}
+
+
+/** Unserializes records from one or more frames and stores them in
+ * our global dgr_list variable. We do not blow away the list, instead
+ * we just update the data that is already in the list.
+ *
+ * @param serialized The serialized records.
+ * @param size The number of bytes in serialized.
+ * @param count The number of records in serialized.
+ **/
+static void dgr_unserialize(const char *serialized, int size, int count)
+{
+	const char *ptr = serialized;
+	const char *end = serialized + size;
+	for(int i=0; i<count; i++)
+	{
+		uint16_t id;
+		char name[DGR_MAX_NAME+1];
+		name[0] = '\0';
+		uint16_t shortSize;
+		uint32_t recordSize;
+
+		if(end - ptr < 2)
+			break;
+		memcpy(&id, ptr, 2);
+		ptr += 2;
+		if(id & DGR_ID_NAME)
+		{
+			id &= ~DGR_ID_NAME;
+			if(end - ptr < 1 || end - ptr < 1 + (uint8_t) *ptr)
+				break;
+			uint8_t nameLen = *ptr;
+			memcpy(name, ptr+1, nameLen);
+			name[nameLen] = '\0';
+			ptr += 1 + nameLen;
+		}
+		if(end - ptr < 2)
+			break;
+		memcpy(&shortSize, ptr, 2);
+		ptr += 2;
+		recordSize = shortSize;
+		if(shortSize == 0xFFFF)
+		{
+			if(end - ptr < 4)
+				break;
+			memcpy(&recordSize, ptr, 4);
+			ptr += 4;
+		}
+		if(id >= DGR_MAX_LIST_SIZE || recordSize > (uint32_t) (end - ptr))
+			break;
+
+		if(name[0] != '\0')
+		{
+			dgr_id_map[id] = dgr_set(name, ptr, recordSize);
+		}
+		else if(dgr_id_map[id] >= 0)
+		{
+			/* We already know the name for this ID. */
+			dgr_set_index(dgr_id_map[id], ptr, recordSize);
+		}
+		/* Otherwise, we missed the packet with the name of this
+		 * record. We'll get it in the next keyframe. */
+		ptr += recordSize;
+	}
+	if(ptr != end)
+		msg(MSG_WARNING, "DGR Slave: Received a corrupt frame.\n");
+}
+
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Location of slot i in the shared memory ring. */
+static dgr_shm_slot* dgr_shm_slot_get(uint32_t i)
+{
+	size_t stride = (sizeof(dgr_shm_slot) + dgr_shm->slotSize + 63) & ~(size_t) 63;
+	return (dgr_shm_slot*) ((char*) dgr_shm + DGR_SHM_HEADER_SIZE + (i % dgr_shm->slots) * stride);
+}
+
+/** Wakes up slaves waiting for the shared memory ring to change. */
+static void dgr_shm_wake(void)
+{
+	__atomic_add_fetch(&dgr_shm->wake, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+	syscall(SYS_futex, &dgr_shm->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/** Waits for the shared memory ring to change.
+ *
+ * @param wake The value of dgr_shm->wake when we last looked at the ring.
+ * @param timeout Maximum number of milliseconds to wait.
+ */
+static void dgr_shm_wait(uint32_t wake, int timeout)
+{
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000L;
+	syscall(SYS_futex, &dgr_shm->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+	if(__atomic_load_n(&dgr_shm->wake, __ATOMIC_ACQUIRE) == wake)
+		usleep(500);
+#endif
+}
+
+/** Opens (or creates) the shared memory ring named by dgr.shm.
+ *
+ * @param create 1 if we are the slave that writes into the ring.
+ * @return 1 if successful, 0 if the ring doesn't exist yet (or is invalid).
+ */
+static int dgr_shm_open(int create)
+{
+	const char *name = kuhl_config_get("dgr.shm");
+	int fd = shm_open(name, create ? O_CREAT|O_RDWR : O_RDWR, 0600);
+	if(fd < 0)
+	{
+		if(create)
+			msg(MSG_ERROR, "DGR Slave: shm_open(%s): %s", name, strerror(errno));
+		return 0;
+	}
+
+	uint32_t slots = kuhl_config_int("dgr.shm.slots", 16, 16);
+	uint32_t slotSize = kuhl_config_int("dgr.shm.slotsize", 1024*1024, 1024*1024);
+	struct stat st;
+	if(!create)
+	{
+		/* Use the size that the writer chose. */
+		dgr_shm_ring ring;
+		if(fstat(fd, &st) != 0 || st.st_size < DGR_SHM_HEADER_SIZE ||
+		   pread(fd, &ring, sizeof(ring), 0) != sizeof(ring) ||
+		   memcmp(ring.magic, DGR_SHM_MAGIC, 8) != 0)
+		{
+			close(fd);
+			return 0;
+		}
+		slots = ring.slots;
+		slotSize = ring.slotSize;
+	}
+	if(slots < 2)
+		slots = 2;
+	size_t stride = (sizeof(dgr_shm_slot) + slotSize + 63) & ~(size_t) 63;
+	size_t size = DGR_SHM_HEADER_SIZE + slots * stride;
+	if(create && ftruncate(fd, size) != 0)
+	{
+		msg(MSG_ERROR, "DGR Slave: Unable to resize shared memory %s: %s", name, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	if(!create && (fstat(fd, &st) != 0 || (size_t) st.st_size < size))
+	{
+		close(fd);
+		return 0;
+	}
+	void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED)
+	{
+		msg(MSG_ERROR, "DGR Slave: Unable to map shared memory %s: %s", name, strerror(errno));
+		return 0;
+	}
+	dgr_shm = mem;
+	dgr_shm_size = size;
+	dgr_shm_feeder = create;
+
+	/* Start a new ring unless one with the same layout already
+	 * exists (slaves reading it will continue where they were). */
+	if(create && (memcmp(dgr_shm->magic, DGR_SHM_MAGIC, 8) != 0 ||
+	              dgr_shm->slots != slots || dgr_shm->slotSize != slotSize))
+	{
+		memset(dgr_shm, 0, DGR_SHM_HEADER_SIZE);
+		dgr_shm->slots = slots;
+		dgr_shm->slotSize = slotSize;
+		for(uint32_t i=0; i<slots; i++)
+			dgr_shm_slot_get(i)->seq = 0;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(dgr_shm->magic, DGR_SHM_MAGIC, 8);
+	}
+	return 1;
+}
+
+/** Slave receive thread: Writes a completed (and decompressed) frame
+ * into the shared memory ring for the other slaves on this machine.
+ *
+ * @param header The header of the frame.
+ * @param data The frame (header->size bytes).
+ * @param addr The address the frame came from.
+ * @param addrlen The length of addr.
+ */
+static void dgr_shm_publish(const dgr_header *header, const char *data,
+                            const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	if(header->size > dgr_shm->slotSize)
+	{
+		static int warned = 0;
+		if(!warned)
+			msg(MSG_WARNING, "DGR Slave: A %u byte frame doesn't fit in dgr.shm.slotsize; the other slaves on this machine will miss it (this message is only printed once).", header->size);
+		warned = 1;
+		return;
+	}
+	memcpy(&dgr_shm->masterAddr, addr, addrlen);
+	dgr_shm->masterAddrlen = addrlen;
+
+	/* Seqlock: The sequence number is odd while the slot is being
+	 * written. Readers copy the slot and then check that the sequence
+	 * number didn't change. */
+	uint32_t i = dgr_shm->writeSeq;
+	dgr_shm_slot *slot = dgr_shm_slot_get(i);
+	__atomic_store_n(&slot->seq, 2*i+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->header = *header;
+	slot->header.flags &= ~DGR_FLAG_COMPRESSED;
+	memcpy(slot+1, data, header->size);
+	__atomic_store_n(&slot->seq, 2*i+2, __ATOMIC_RELEASE);
+	__atomic_store_n(&dgr_shm->writeSeq, i+1, __ATOMIC_RELEASE);
+	dgr_shm_wake();
+}
+
+/** Slave receive thread: Appends a completed frame to the frames
+ * waiting for the render thread.
+ *
+ * @param header The header of the frame.
+ * @param data The frame (header->size bytes).
+ * @param addr The address the frame came from.
+ * @param addrlen The length of addr.
+ */
+static void dgr_receive_frame(const dgr_header *header, const char *data,
+                              const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	/* Decompress the frame into a buffer that only this thread uses. */
+	static char *raw = NULL;
+	static int rawAlloc = 0;
+	dgr_header rawHeader;
+	long decompressUsec = 0;
+	uint32_t compressedSize = header->size;
+	if(header->flags & DGR_FLAG_COMPRESSED)
+	{
+		long start = kuhl_microseconds();
+		uint32_t rawSize;
+		if(header->size < 4)
+			return;
+		memcpy(&rawSize, data, 4);
+		if(rawSize > DGR_MAX_FRAME_SIZE)
+		{
+			msg(MSG_WARNING, "DGR Slave: Ignoring a corrupt compressed frame.\n");
+			return;
+		}
+		if((int) rawSize > rawAlloc)
+		{
+			rawAlloc = rawSize;
+			raw = realloc(raw, rawAlloc);
+		}
+		if(!dgr_decompress(data+4, header->size-4, raw, rawSize))
+		{
+			msg(MSG_WARNING, "DGR Slave: Ignoring a corrupt compressed frame.\n");
+			return;
+		}
+		rawHeader = *header;
+		rawHeader.size = rawSize;
+		header = &rawHeader;
+		data = raw;
+		decompressUsec = kuhl_microseconds() - start;
+	}
+	if(dgr_shm != NULL && dgr_shm_feeder)
+		dgr_shm_publish(header, data, addr, addrlen);
+
+	pthread_mutex_lock(&dgr_rx_mutex);
+	if(header->flags & DGR_FLAG_COMPRESSED)
+	{
+		dgr_statistics.compressedFrames++;
+		dgr_statistics.compressedBytes += compressedSize;
+		dgr_statistics.uncompressedBytes += header->size;
+		dgr_statistics.compressUsec += decompressUsec;
+	}
+	if(dgr_rx_frame != 0)
+		dgr_statistics.lost += header->frame - dgr_rx_frame - 1;
+	dgr_rx_frame = header->frame;
+	dgr_statistics.frames++;
 
-		dgr_set(name, ptr, size);
-		ptr += size;
+	dgr_pending *p = dgr_pending_back;
+	if(header->flags & DGR_FLAG_KEYFRAME)
+	{
+		/* A keyframe contains every record; the render thread
+		 * doesn't need the frames before it. */
+		dgr_statistics.keyframes++;
+		p->size = 0;
+		p->count = 0;
+	}
+	if(p->size + (int) header->size > p->alloc)
+	{
+		p->alloc = p->alloc * 2 > p->size + (int) header->size ? p->alloc * 2 : p->size + (int) header->size;
+		p->data = realloc(p->data, p->alloc);
 	}
+	memcpy(p->data + p->size, data, header->size);
+	p->size += header->size;
+	p->count += header->count;
+	p->frames++;
+	p->frame = header->frame;
+	p->flags = header->flags | (p->flags & DGR_FLAG_KEYFRAME);
+
+	/* Remember where the master is so that we can acknowledge frames. */
+	memcpy(&dgr_master_addr, addr, addrlen);
+	dgr_master_addrlen = addrlen;
+
+	pthread_cond_broadcast(&dgr_rx_cond);
+	pthread_mutex_unlock(&dgr_rx_mutex);
+}
+
+/** Slave receive thread: Checks the session and frame number of a
+ * frame (or a fragment of one) before it is used.
+ *
+ * @param header The header of the frame.
+ * @return 1 if the frame should be used, 0 if it is older than a frame we already completed.
+ */
+static int dgr_receive_check(const dgr_header *header)
+{
+	/* If the master restarted, the IDs it uses may have changed. */
+	if(header->session != dgr_session)
+	{
+		pthread_mutex_lock(&dgr_rx_mutex);
+		dgr_session = header->session;
+		dgr_pending_back->size = 0;
+		dgr_pending_back->count = 0;
+		dgr_pending_back->frames = 0;
+		dgr_pending_back->flags = 0;
+		dgr_pending_back->newSession = 1;
+		dgr_rx_frame = 0;
+		pthread_mutex_unlock(&dgr_rx_mutex);
+		for(int i=0; i<DGR_FRAGMENT_SLOTS; i++)
+			dgr_slots[i].inUse = 0;
+		return 1;
+	}
+	/* Ignore frames that are older than the one we already
+	 * completed. */
+	return dgr_rx_frame == 0 || (int32_t) (header->frame - dgr_rx_frame) > 0;
+}
+
+/** Slave receive thread: Processes a single packet. If the packet
+ * completes a frame, the frame is handed to the render thread.
+ *
+ * @param size Length of the packet.
+ * @param packet The packet.
+ * @param addr The address the packet came from.
+ * @param addrlen The length of addr.
+ */
+static void dgr_receive_packet(int size, const char *packet,
+                               const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	dgr_header header;
+	if(size < (int) sizeof(dgr_header))
+		return;
+	memcpy(&header, packet, sizeof(dgr_header));
+	if(memcmp(header.magic, "DG", 2) != 0 || header.version != DGR_VERSION)
+	{
+		msg(MSG_WARNING, "DGR Slave: Ignoring a packet that isn't in the DGR format (or is from an incompatible version of DGR).\n");
+		return;
+	}
+
+	if(header.flags & DGR_FLAG_RELEASE)
+	{
+		pthread_mutex_lock(&dgr_rx_mutex);
+		if(header.session == dgr_session)
+		{
+			dgr_released_frame = header.frame;
+			pthread_cond_broadcast(&dgr_rx_cond);
+		}
+		pthread_mutex_unlock(&dgr_rx_mutex);
+		if(dgr_shm != NULL && dgr_shm_feeder)
+		{
+			__atomic_store_n(&dgr_shm->released, header.frame, __ATOMIC_RELEASE);
+			dgr_shm_wake();
+		}
+		return;
+	}
+
+	const char *fragment = packet + sizeof(dgr_header);
+	uint32_t fragmentLen = size - sizeof(dgr_header);
+	uint32_t offset = (uint32_t) header.fragIndex * header.fragSize;
+	if(header.fragIndex >= header.fragCount || header.size > DGR_MAX_FRAME_SIZE ||
+	   offset > header.size || fragmentLen > header.size - offset ||
+	   fragmentLen != (header.fragIndex < header.fragCount-1 ? header.fragSize : header.size - offset))
+	{
+		msg(MSG_WARNING, "DGR Slave: Ignoring a corrupt packet.\n");
+		return;
+	}
+
+	if(!dgr_receive_check(&header))
+		return;
+
+	/* Most frames fit in one packet. */
+	if(header.fragCount == 1)
+	{
+		dgr_receive_frame(&header, fragment, addr, addrlen);
+		return;
+	}
+
+	/* Find the frame this fragment belongs to. If this is the first
+	 * fragment we have seen for the frame, use an empty slot or
+	 * replace the oldest frame. */
+	dgr_fragments *slot = NULL;
+	for(int i=0; i<DGR_FRAGMENT_SLOTS; i++)
+	{
+		dgr_fragments *s = &(dgr_slots[i]);
+		if(s->inUse && s->header.frame == header.frame)
+		{
+			slot = s;
+			break;
+		}
+		if(slot == NULL || !s->inUse ||
+		   (slot->inUse && (int32_t) (s->header.frame - slot->header.frame) < 0))
+			slot = s;
+	}
+	if(!slot->inUse || slot->header.frame != header.frame)
+	{
+		slot->inUse = 1;
+		slot->header = header;
+		slot->received = 0;
+		if(slot->dataAlloc < (int) header.size)
+		{
+			free(slot->data);
+			slot->dataAlloc = header.size;
+			slot->data = malloc(slot->dataAlloc);
+		}
+		if(slot->haveAlloc < header.fragCount)
+		{
+			free(slot->have);
+			slot->haveAlloc = header.fragCount;
+			slot->have = malloc(slot->haveAlloc);
+		}
+		memset(slot->have, 0, header.fragCount);
+	}
+	else if(slot->header.size != header.size || slot->header.fragCount != header.fragCount ||
+	        slot->header.fragSize != header.fragSize)
+	{
+		msg(MSG_WARNING, "DGR Slave: Ignoring a fragment that doesn't match the other fragments in frame %u.\n", header.frame);
+		return;
+	}
+
+	if(slot->have[header.fragIndex])  // duplicate packet
+		return;
+	slot->have[header.fragIndex] = 1;
+	slot->received++;
+	memcpy(slot->data + offset, fragment, fragmentLen);
+	if(slot->received < slot->header.fragCount)
+		return;
+
+	/* The frame is complete. Discard any older incomplete frames. */
+	for(int i=0; i<DGR_FRAGMENT_SLOTS; i++)
+	{
+		if(dgr_slots[i].inUse && (int32_t) (dgr_slots[i].header.frame - header.frame) <= 0)
+			dgr_slots[i].inUse = 0;
+	}
+	dgr_receive_frame(&slot->header, slot->data, addr, addrlen);
+}
+
+/** Reads at least one packet (waiting for one if necessary) and any
+ * other packets that are waiting, up to DGR_RX_BATCH packets.
+ *
+ * @param ring DGR_RX_BATCH buffers of DGR_RX_PACKET bytes.
+ * @param lens Set to the length of each packet.
+ * @param addrs Set to the address each packet came from.
+ * @param addrlens Set to the length of each address.
+ * @return The number of packets read, or -1 on error.
+ */
+static int dgr_recv_batch(char *ring, int *lens, struct sockaddr_storage *addrs, socklen_t *addrlens)
+{
+#ifdef __linux__
+	/* Read every waiting packet with one system call. */
+	struct mmsghdr msgs[DGR_RX_BATCH];
+	struct iovec iov[DGR_RX_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i=0; i<DGR_RX_BATCH; i++)
+	{
+		iov[i].iov_base = ring + i*DGR_RX_PACKET;
+		iov[i].iov_len = DGR_RX_PACKET;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+	int n = recvmmsg(dgr_socket, msgs, DGR_RX_BATCH, MSG_WAITFORONE, NULL);
+	for(int i=0; i<n; i++)
+	{
+		lens[i] = msgs[i].msg_len;
+		addrlens[i] = msgs[i].msg_hdr.msg_namelen;
+	}
+	return n;
+#else
+	addrlens[0] = sizeof(struct sockaddr_storage);
+	lens[0] = recvfrom(dgr_socket, ring, DGR_RX_PACKET, 0, (struct sockaddr*) &addrs[0], &addrlens[0]);
+	return lens[0] < 0 ? -1 : 1;
+#endif
+}
+
+/** Slave receive thread: Reads packets until dgr_rx_stop() is called. */
+static void* dgr_rx_main(void *arg)
+{
+	char *ring = malloc(DGR_RX_BATCH * DGR_RX_PACKET);
+	int lens[DGR_RX_BATCH];
+	struct sockaddr_storage addrs[DGR_RX_BATCH];
+	socklen_t addrlens[DGR_RX_BATCH];
+	while(!dgr_rx_quit)
+	{
+		int n = dgr_recv_batch(ring, lens, addrs, addrlens);
+		if(dgr_rx_quit)
+			break;
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			msg(MSG_ERROR, "DGR Slave: Stopped receiving packets: %s", strerror(errno));
+			break;
+		}
+
+		long bytes = 0;
+		for(int i=0; i<n; i++)
+		{
+			dgr_receive_packet(lens[i], ring + i*DGR_RX_PACKET, &addrs[i], addrlens[i]);
+			bytes += lens[i];
+		}
+		pthread_mutex_lock(&dgr_rx_mutex);
+		dgr_statistics.bytes += bytes;
+		dgr_time_lastreceive = time(NULL);
+		pthread_mutex_unlock(&dgr_rx_mutex);
+	}
+	free(ring);
+	return NULL;
+}
+
+/** Slave receive thread: Reads frames from the shared memory ring
+ * (instead of the network) until dgr_rx_stop() is called. */
+static void* dgr_shm_main(void *arg)
+{
+	while(!dgr_rx_quit && !dgr_shm_open(0))
+		usleep(100000); // wait for the slave that receives packets to create the ring
+	if(dgr_rx_quit)
+		return NULL;
+	msg(MSG_INFO, "DGR Slave: Reading frames from shared memory %s.\n", kuhl_config_get("dgr.shm"));
+
+	char *frame = NULL;
+	uint32_t frameAlloc = 0;
+	/* Start with the oldest frame in the ring. */
+	uint32_t readSeq = __atomic_load_n(&dgr_shm->writeSeq, __ATOMIC_ACQUIRE);
+	readSeq -= readSeq < dgr_shm->slots ? readSeq : dgr_shm->slots;
+	uint32_t released = __atomic_load_n(&dgr_shm->released, __ATOMIC_ACQUIRE);
+	while(!dgr_rx_quit)
+	{
+		uint32_t wake = __atomic_load_n(&dgr_shm->wake, __ATOMIC_ACQUIRE);
+		uint32_t writeSeq = __atomic_load_n(&dgr_shm->writeSeq, __ATOMIC_ACQUIRE);
+		if((int32_t) (writeSeq - readSeq) < 0)   // the writer restarted
+			readSeq = writeSeq;
+		if(writeSeq - readSeq > dgr_shm->slots)  // we fell behind
+			readSeq = writeSeq - dgr_shm->slots;
+
+		uint32_t r = __atomic_load_n(&dgr_shm->released, __ATOMIC_ACQUIRE);
+		if(r != released)
+		{
+			released = r;
+			pthread_mutex_lock(&dgr_rx_mutex);
+			dgr_released_frame = r;
+			pthread_cond_broadcast(&dgr_rx_cond);
+			pthread_mutex_unlock(&dgr_rx_mutex);
+		}
+		if(readSeq == writeSeq)
+		{
+			dgr_shm_wait(wake, 100);
+			continue;
+		}
+
+		/* Copy the frame out of the slot, then make sure that the
+		 * writer didn't start overwriting it while we copied. */
+		dgr_shm_slot *slot = dgr_shm_slot_get(readSeq);
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dgr_header header = slot->header;
+		int ok = seq == 2*readSeq+2 && header.size <= dgr_shm->slotSize;
+		if(ok)
+		{
+			if(header.size > frameAlloc)
+			{
+				frameAlloc = header.size;
+				frame = realloc(frame, frameAlloc);
+			}
+			memcpy(frame, slot+1, header.size);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			ok = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+		}
+		readSeq++;
+		if(!ok)
+			continue; // counted as lost when the next frame arrives
+
+		struct sockaddr_storage addr;
+		socklen_t addrlen = dgr_shm->masterAddrlen;
+		if(addrlen > sizeof(addr))
+			addrlen = sizeof(addr);
+		memcpy(&addr, &dgr_shm->masterAddr, addrlen);
+		if(dgr_receive_check(&header))
+			dgr_receive_frame(&header, frame, &addr, addrlen);
+		pthread_mutex_lock(&dgr_rx_mutex);
+		dgr_time_lastreceive = time(NULL);
+		pthread_mutex_unlock(&dgr_rx_mutex);
+	}
+	free(frame);
+	return NULL;
+}
+#endif // __MINGW32__
+
+/** Gets statistics about the data that DGR has sent (if master) or
+ * received (if slave) since dgr_init() was called.
+ *
+ * @param stats A struct to be filled in.
+ */
+void dgr_get_stats(dgr_stats *stats)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	pthread_mutex_lock(&dgr_rx_mutex);
+	*stats = dgr_statistics;
+	pthread_mutex_unlock(&dgr_rx_mutex);
+	pthread_mutex_lock(&dgr_blob_mutex);
+	stats->blobBytes = dgr_blob_bytes;
+	pthread_mutex_unlock(&dgr_blob_mutex);
+#else
+	*stats = dgr_statistics;
+#endif
+}
+
+/** Gets the latency and jitter of each slave that has acknowledged
+ * frames from this master.
+ *
+ * @param stats An array to be filled in.
+ * @param maxSlaves Length of the stats array.
+ * @return The number of slaves that were copied into stats.
+ */
+int dgr_get_slave_stats(dgr_slave_stats *stats, int maxSlaves)
+{
+	int count = 0;
+	long now = kuhl_microseconds();
+	for(int i=0; i<dgr_slaves_len && count<maxSlaves; i++)
+	{
+		stats[count] = dgr_slaves[i].stats;
+		stats[count].active = now - dgr_slaves[i].lastHeard < DGR_SLAVE_ACTIVE_USEC;
+		count++;
+	}
+	return count;
 }
 
 
@@ -513,16 +2087,159 @@ void dgr_print_list(void)
 		msg(MSG_DEBUG, "DGR is disabled or not initialized correctly.\n");
 		return;
 	}
-	msg(MSG_DEBUG, "Current DGR list (index, size, buffer, name):\n");
+	msg(MSG_DEBUG, "Current DGR list (index, size, offset, name):\n");
 	for(int i=0; i<dgr_list_size; i++)
 	{
 		dgr_record *r = &(dgr_list[i]);
-		msg(MSG_DEBUG, "%3d %5d %p %s\n", i, r->size, r->buffer, r->name);
+		msg(MSG_DEBUG, "%3d %5d %7d %s\n", i, r->size, r->offset, r->name);
 	}
 	if(dgr_list_size == 0)
 		msg(MSG_DEBUG, "[ the list is empty ]\n");
 }
 
+#if !defined __MINGW32__ && !defined _WIN32
+/** Sends a packet to every slave. If sendmsg() fails (for example,
+ * because the network is temporarily down or a destination is
+ * unreachable), print a message and keep going---the slaves will
+ * catch up when the next keyframe arrives.
+ *
+ * @param iov The pieces of the packet.
+ * @param iovlen The number of pieces in iov.
+ * @return 1 if the packet was sent to every slave, 0 otherwise.
+ */
+static int dgr_sendmsg(struct iovec *iov, int iovlen)
+{
+	int ok = 1;
+	for(int i=0; i<dgr_addrinfo_len; i++)
+	{
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = dgr_addrinfo[i]->ai_addr;
+		mh.msg_namelen = dgr_addrinfo[i]->ai_addrlen;
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iovlen;
+		if(sendmsg(dgr_socket, &mh, 0) == -1)
+		{
+			if(!dgr_send_failed)
+				msg(MSG_ERROR, "DGR Master: sendmsg: %s", strerror(errno));
+			ok = 0;
+		}
+	}
+	return ok;
+}
+#endif // __MINGW32__
+
+/** Master: Compresses a frame if it is large enough and if
+ * compression has been working well.
+ *
+ * @param header The header of the frame. DGR_FLAG_COMPRESSED and the size are updated if the frame is compressed.
+ * @param buf The frame. Replaced with the compressed frame (and the original is free()'d).
+ * @param bufSize The size of the frame. Updated if the frame is compressed.
+ */
+static void dgr_compress_frame(dgr_header *header, char **buf, int *bufSize)
+{
+	if(!dgr_compress_enabled || *bufSize < dgr_compress_threshold)
+		return;
+	if(dgr_compress_skip > 0)
+	{
+		dgr_compress_skip--;
+		return;
+	}
+
+	/* Only use the compressed frame if it is at least 1/8 smaller. */
+	long start = kuhl_microseconds();
+	int capacity = *bufSize - *bufSize/8;
+	char *compressed = malloc(capacity);
+	int size = dgr_compress(*buf, *bufSize, compressed+4, capacity-4);
+	dgr_statistics.compressUsec += kuhl_microseconds() - start;
+	if(size == 0)
+	{
+		/* Wait longer each time compression doesn't help. */
+		dgr_compress_backoff = dgr_compress_backoff == 0 ? 1 : dgr_compress_backoff*2;
+		if(dgr_compress_backoff > 64)
+			dgr_compress_backoff = 64;
+		dgr_compress_skip = dgr_compress_backoff;
+		free(compressed);
+		return;
+	}
+	dgr_compress_backoff = 0;
+
+	uint32_t uncompressed = *bufSize;
+	memcpy(compressed, &uncompressed, 4);
+	dgr_statistics.compressedFrames++;
+	dgr_statistics.compressedBytes += size + 4;
+	dgr_statistics.uncompressedBytes += *bufSize;
+	free(*buf);
+	*buf = compressed;
+	*bufSize = size + 4;
+	header->size = *bufSize;
+	header->flags |= DGR_FLAG_COMPRESSED;
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Master: Splits a frame into fragments and sends them.
+ *
+ * @param header The header of the frame (except for the fragment information).
+ * @param buf The (possibly compressed) frame.
+ * @param bufSize The size of the frame.
+ */
+static void dgr_send_frame(dgr_header *header, const char *buf, int bufSize)
+{
+	int fragSize = dgr_packetsize - sizeof(dgr_header);
+	int fragCount = (bufSize + fragSize - 1) / fragSize;
+	if(fragCount == 0)
+		fragCount = 1;
+	if(fragCount > 0xFFFF)
+	{
+		msg(MSG_ERROR, "DGR Master: Can't send a %d byte frame; increase dgr.packetsize.", bufSize);
+		return;
+	}
+	header->fragCount = fragCount;
+	header->fragSize = fragSize;
+	dgr_statistics.frames++;
+	if(header->flags & DGR_FLAG_KEYFRAME)
+		dgr_statistics.keyframes++;
+	dgr_statistics.bytes += bufSize + fragCount * sizeof(dgr_header);
+
+	/* Send the header and the fragment without copying them into
+	 * one buffer. */
+	dgr_sent_usec[header->frame % DGR_SENT_HISTORY] = kuhl_microseconds();
+	int failed = 0;
+	for(int f=0; f<fragCount && !failed; f++)
+	{
+		header->fragIndex = f;
+		struct iovec iov[2];
+		iov[0].iov_base = header;
+		iov[0].iov_len = sizeof(dgr_header);
+		iov[1].iov_base = (char*) buf + f*fragSize;
+		iov[1].iov_len = f < fragCount-1 ? fragSize : bufSize - f*fragSize;
+		failed = !dgr_sendmsg(iov, 2);
+	}
+	if(dgr_send_failed && !failed)
+		msg(MSG_INFO, "DGR Master: Sending packets again.");
+	dgr_send_failed = failed;
+}
+
+/** Master: Writes a frame to the recording (see dgr.mode = record).
+ *
+ * @param header The header of the frame.
+ * @param buf The (possibly compressed) frame.
+ * @param bufSize The size of the frame.
+ */
+static void dgr_record_frame(const dgr_header *header, const char *buf, int bufSize)
+{
+	int64_t usec = kuhl_microseconds() - dgr_record_start;
+	if(fwrite(&usec, sizeof(usec), 1, dgr_record_file) != 1 ||
+	   fwrite(header, sizeof(dgr_header), 1, dgr_record_file) != 1 ||
+	   fwrite(buf, 1, bufSize, dgr_record_file) != (size_t) bufSize)
+	{
+		msg(MSG_ERROR, "DGR Master: Failed to write to the recording, stopping the recording: %s", strerror(errno));
+		fclose(dgr_record_file);
+		dgr_record_file = NULL;
+	}
+}
+#endif // __MINGW32__
+
 /** Serializes and sends DGR data out across a network. */
 static void dgr_send(void)
 {
@@ -530,123 +2247,401 @@ static void dgr_send(void)
 	if(dgr_disabled)
 		return;
 
-	int  bufSize = 0;
-	char *buf = dgr_serialize(&bufSize);
-	
 	// no need to send an empty packet.
-	if(bufSize == 0 || dgr_list_size == 0)
+	if(dgr_list_size == 0)
 		return;
-	
-	/* If the message is too large to send, sendto() will not send the
-	 * message, and will set errno to EMSGSIZE. The MTU may limit the
-	 * amount of data that we can send. With an MTU of 1500, we can
-	 * only expect to send 1472 bytes. Even with the small MTU, the
-	 * system may still allow us to send larger UDP packets due to
-	 * IPv4 fragmentation. */
-	for(int i=0; i<dgr_addrinfo_len; i++)
+
+	dgr_header header;
+	int  bufSize = 0;
+	char *buf = dgr_serialize(&header, &bufSize);
+	dgr_compress_frame(&header, &buf, &bufSize);
+	if(dgr_record_file != NULL)
+		dgr_record_frame(&header, buf, bufSize);
+	dgr_send_frame(&header, buf, bufSize);
+	free(buf);
+#endif // __MINGW32__
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Waits for a packet to arrive on our socket.
+ *
+ * @param timeout Milliseconds to wait (0 to return immediately).
+ * @return 1 if a packet is waiting to be read, 0 otherwise.
+ */
+static int dgr_poll(int timeout)
+{
+	struct pollfd fds;
+	fds.fd = dgr_socket;
+	fds.events = POLLIN;
+	int retval = poll(&fds, 1, timeout);
+	if(retval == -1)
 	{
-		int numbytes;
-		if((numbytes = sendto(dgr_socket, buf, bufSize, 0,
-		                      dgr_addrinfo[i]->ai_addr, dgr_addrinfo[i]->ai_addrlen)) == -1) {
-			msg(MSG_FATAL, "DGR Master: sendto: %s", strerror(errno));
+		msg(MSG_FATAL, "poll(): %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return retval > 0;
+}
+
+/** Slave: Exits if too much time has elapsed since the last packet
+ * that we received. */
+static void dgr_check_alive(void)
+{
+	pthread_mutex_lock(&dgr_rx_mutex);
+	time_t lastreceive = dgr_time_lastreceive;
+	pthread_mutex_unlock(&dgr_rx_mutex);
+	if(lastreceive != 0) // if we have received a packet previously
+	{
+		int seconds = 15;
+		if(time(NULL) - lastreceive >= seconds)
+		{
+			msg(MSG_FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master die? Exiting...\n", seconds);
 			exit(EXIT_FAILURE);
 		}
-		if(numbytes != bufSize) // double check that everything got sent
+	}
+}
+
+/** Slave: Waits on dgr_rx_cond. dgr_rx_mutex must be locked.
+ *
+ * @param timeout Maximum number of milliseconds to wait.
+ */
+static void dgr_rx_wait(int timeout)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&dgr_rx_cond, &dgr_rx_mutex, &ts);
+}
+
+/** Slave: Swaps the frames that the receive thread completed with
+ * an empty buffer and applies the records in them to dgr_list. */
+static void dgr_use_pending(void)
+{
+	pthread_mutex_lock(&dgr_rx_mutex);
+	dgr_pending *p = dgr_pending_back;
+	dgr_pending_back = dgr_pending_front;
+	dgr_pending_front = p;
+	pthread_mutex_unlock(&dgr_rx_mutex);
+
+	/* If the master restarted, the IDs it uses may have changed. */
+	if(p->newSession)
+	{
+		if(dgr_have_keyframe)
+			msg(MSG_INFO, "DGR Slave: Receiving packets from a new master.\n");
+		dgr_last_frame = 0;
+		dgr_have_keyframe = 0;
+		for(int i=0; i<DGR_MAX_LIST_SIZE; i++)
+			dgr_id_map[i] = -1;
+	}
+	if(p->frames > 0)
+	{
+		dgr_unserialize(p->data, p->size, p->count);
+		if(p->flags & DGR_FLAG_KEYFRAME)
+			dgr_have_keyframe = 1;
+		dgr_barrier = (p->flags & DGR_FLAG_BARRIER) ? 1 : 0;
+		dgr_last_frame = p->frame;
+	}
+	p->size = 0;
+	p->count = 0;
+	p->frames = 0;
+	p->flags = 0;
+	p->newSession = 0;
+}
+
+/** Slave: Tells the master that we are using (or finished rendering) a frame.
+ *
+ * @param frame The frame number.
+ */
+static void dgr_send_ack(uint32_t frame)
+{
+	struct sockaddr_storage addr;
+	pthread_mutex_lock(&dgr_rx_mutex);
+	socklen_t addrlen = dgr_master_addrlen;
+	memcpy(&addr, &dgr_master_addr, sizeof(addr));
+	uint32_t session = dgr_session;
+	pthread_mutex_unlock(&dgr_rx_mutex);
+	if(addrlen == 0)
+		return;
+	/* A slave that reads frames from shared memory doesn't have a
+	 * socket until it sends its first acknowledgement. */
+	if(dgr_socket < 0 && (dgr_socket = socket(addr.ss_family, SOCK_DGRAM, 0)) < 0)
+		return;
+
+	dgr_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "DG", 2);
+	header.version = DGR_VERSION;
+	header.flags = DGR_FLAG_ACK;
+	header.session = session;
+	header.frame = frame;
+	header.size = dgr_slave_id;
+	/* If the acknowledgement is lost, the master will stop waiting
+	 * for us at the barrier after a timeout. */
+	sendto(dgr_socket, &header, sizeof(header), 0, (struct sockaddr*) &addr, addrlen);
+}
+
+/** Slave: Exits if the master told us to. */
+static void dgr_check_died(void)
+{
+	/* If the packet we received indicates that dgr has died. */
+	int died = 0;
+	if(dgr_get("!!!dgr_died!!!", &died, sizeof(int)) >= 0 &&
+	   died == 1)
+	{
+		msg(MSG_DEBUG, "The master told slaves to exit. Exiting...\n");
+		exit(EXIT_SUCCESS);
+	}
+}
+#endif // __MINGW32__
+
+/** Receives DGR data from the network. The packets are read by the
+ * receive thread; dgr_receive() uses the frames it has completed.
+ *
+ * @param timeout If timeout > 0, dgr_receive() will wait for at most
+ * 'timeout' milliseconds for the first keyframe. If a timeout occurs,
+ * DGR will exit. If timeout==0, dgr_receive() will not block and will
+ * use whatever frames have arrived. If timeout==0, we still might
+ * exit if we haven't received information for a while (and we have
+ * received information successfully in the past). In barrier mode,
+ * dgr_receive() waits for the frame after the one that we rendered
+ * last. */
+static void dgr_receive(int timeout)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_disabled)
+		return;
+
+	dgr_check_alive();
+
+	uint32_t previousFrame = dgr_last_frame;
+	long start = kuhl_microseconds();
+	dgr_use_pending();
+
+	/* If we are waiting, keep waiting until we get a
+	 * keyframe---frames that aren't keyframes may not include the
+	 * names of the records. In barrier mode, we render every
+	 * frame. */
+	while((timeout > 0 && !dgr_have_keyframe) ||
+	      (dgr_barrier && dgr_have_keyframe && dgr_last_frame == dgr_acked_frame))
+	{
+		int wait = 1000;
+		if(!dgr_have_keyframe)
+		{
+			wait = timeout - (kuhl_microseconds() - start)/1000;
+			if(wait <= 0)
+			{
+				msg(MSG_FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
+				exit(EXIT_FAILURE);
+			}
+		}
+		pthread_mutex_lock(&dgr_rx_mutex);
+		if(dgr_pending_back->frames == 0 && !dgr_pending_back->newSession)
+			dgr_rx_wait(wait);
+		pthread_mutex_unlock(&dgr_rx_mutex);
+		dgr_check_alive();
+		dgr_use_pending();
+	}
+
+	/* Let the master know which frame we are using. In barrier mode,
+	 * we acknowledge the frame when we are ready to swap buffers
+	 * instead. */
+	if(!dgr_barrier && dgr_last_frame != previousFrame)
+		dgr_send_ack(dgr_last_frame);
+
+	dgr_check_died();
+#endif // __MINGW32__
+}
+
+/** Master: Processes acknowledgements from slaves.
+ *
+ * @param waitFrame If non-zero, wait (for at most dgr.barrier.timeout
+ * milliseconds) until every active slave has acknowledged this
+ * frame. If zero, only process the acknowledgements that have
+ * already arrived.
+ */
+static void dgr_receive_acks(uint32_t waitFrame)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	long start = kuhl_microseconds();
+	while(1)
+	{
+		/* Process all of the acknowledgements that have arrived
+		 * before deciding if we need to wait for more. */
+		if(!dgr_poll(0))
+		{
+			if(waitFrame == 0)
+				break;
+
+			long now = kuhl_microseconds();
+			int done = 1;
+			for(int i=0; i<dgr_slaves_len; i++)
+			{
+				dgr_slave *sl = &(dgr_slaves[i]);
+				if(now - sl->lastHeard < DGR_SLAVE_ACTIVE_USEC &&
+				   (int32_t) (sl->frame - waitFrame) < 0)
+					done = 0;
+			}
+			if(done)
+				break;
+
+			int remaining = dgr_barrier_timeout - (now - start)/1000;
+			if(remaining <= 0)
+			{
+				if(dgr_statistics.barrierTimeouts == 0)
+					msg(MSG_WARNING, "DGR Master: Stopped waiting for slaves to acknowledge frame %u after %d ms (this message is only printed once).", waitFrame, dgr_barrier_timeout);
+				dgr_statistics.barrierTimeouts++;
+				break;
+			}
+			if(!dgr_poll(remaining))
+				continue;
+		}
+
+		dgr_header header;
+		struct sockaddr_storage addr;
+		struct iovec iov;
+		iov.iov_base = &header;
+		iov.iov_len = sizeof(header);
+		char control[CMSG_SPACE(sizeof(struct timeval))];
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = &addr;
+		mh.msg_namelen = sizeof(addr);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		int numbytes = recvmsg(dgr_socket, &mh, 0);
+		socklen_t addrlen = mh.msg_namelen;
+
+		/* Use the time the acknowledgement arrived (see
+		 * SO_TIMESTAMP in dgr_init_master()). The kernel's clock is
+		 * the same one that kuhl_microseconds() uses. */
+		long now = kuhl_microseconds();
+		for(struct cmsghdr *c = CMSG_FIRSTHDR(&mh); numbytes > 0 && c != NULL; c = CMSG_NXTHDR(&mh, c))
+			if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMP)
+			{
+				struct timeval tv;
+				memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+				now = tv.tv_sec*1000000L + tv.tv_usec;
+			}
+		if(numbytes != sizeof(header) || memcmp(header.magic, "DG", 2) != 0 ||
+		   header.version != DGR_VERSION || !(header.flags & DGR_FLAG_ACK) ||
+		   header.session != dgr_session)
+			continue;
+
+		/* Find the slave (or add it to our list). */
+		dgr_slave *sl = NULL;
+		for(int i=0; i<dgr_slaves_len; i++)
+			if(dgr_slaves[i].id == header.size && dgr_slaves[i].addrlen == addrlen &&
+			   memcmp(&dgr_slaves[i].addr, &addr, addrlen) == 0)
+				sl = &(dgr_slaves[i]);
+		if(sl == NULL)
 		{
-			msg(MSG_FATAL, "DGR Master: Error sending all of the bytes in the message.");
-			exit(EXIT_FAILURE);
+			if(dgr_slaves_len >= DGR_MAX_SLAVES)
+				continue;
+			sl = &(dgr_slaves[dgr_slaves_len]);
+			dgr_slaves_len++;
+			memset(sl, 0, sizeof(dgr_slave));
+			memcpy(&sl->addr, &addr, addrlen);
+			sl->addrlen = addrlen;
+			sl->id = header.size;
+			/* Numeric addresses always fit in stats.address. */
+			char host[INET6_ADDRSTRLEN], port[6];
+			if(getnameinfo((struct sockaddr*) &addr, addrlen, host, sizeof(host), port, sizeof(port),
+			               NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+				snprintf(sl->stats.address, sizeof(sl->stats.address), "%s %s", host, port);
+			msg(MSG_INFO, "DGR Master: Slave at %s acknowledged its first frame.", sl->stats.address);
+		}
+		sl->lastHeard = now;
+		if((int32_t) (header.frame - sl->frame) > 0)
+			sl->frame = header.frame;
+
+		/* Latency is the time from when we sent the frame until we
+		 * received the acknowledgement. Jitter is the smoothed
+		 * difference between the latency of consecutive
+		 * acknowledgements (like the jitter in RFC 3550). */
+		int32_t age = dgr_frame - header.frame;
+		if(age <= 0 || age > DGR_SENT_HISTORY)
+			continue;
+		float latency = (now - dgr_sent_usec[header.frame % DGR_SENT_HISTORY]) / 1000.0f;
+		dgr_slave_stats *st = &(sl->stats);
+		if(st->acks == 0)
+			st->latency = latency;
+		else
+		{
+			st->latency += (latency - st->latency) / 16;
+			st->jitter += (fabsf(latency - sl->lastLatency) - st->jitter) / 16;
 		}
+		if(latency > st->maxLatency)
+			st->maxLatency = latency;
+		sl->lastLatency = latency;
+		st->acks++;
+	}
+#endif // __MINGW32__
+}
+
+/** Master: Waits for slaves at the barrier (if dgr.sync is barrier)
+ * and then releases them. Otherwise, processes any acknowledgements
+ * that have arrived. */
+static void dgr_barrier_master(void)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(!dgr_barrier || dgr_frame == 1) // not in barrier mode, or we haven't sent anything
+	{
+		dgr_receive_acks(0);
+		return;
 	}
-	free(buf);
+
+	long start = kuhl_microseconds();
+	dgr_receive_acks(dgr_frame-1);
+	dgr_statistics.barrierUsec += kuhl_microseconds() - start;
+
+	dgr_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "DG", 2);
+	header.version = DGR_VERSION;
+	header.flags = DGR_FLAG_RELEASE | DGR_FLAG_BARRIER;
+	header.session = dgr_session;
+	header.frame = dgr_frame-1;
+	struct iovec iov;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	dgr_sendmsg(&iov, 1);
 #endif // __MINGW32__
 }
 
-/** Receives DGR data from the network.
- *
- * @param timeout If timeout > 0, dgr_receive() will block for at most
- * 'timeout' milliseconds. If a timeout occurs, DGR will exit. If
- * timeout==0, dgr_receive() not block and will read whatever
- * information is available to read. If timeout==0, we still might
- * exit if we haven't received information for a while (and we have
- * received information successfully in the past). */
-static void dgr_receive(int timeout)
+/** Slave: In barrier mode, acknowledges the frame that we rendered
+ * and waits for the master to release us so that we can swap
+ * buffers. */
+static void dgr_barrier_slave(void)
 {
 #if !defined __MINGW32__ && !defined _WIN32
-	// TODO remove this 
-	timeout = 30 * 1000; 
-
-	if(dgr_disabled)
+	if(!dgr_barrier || !dgr_have_keyframe)
 		return;
 
-	/* If too much time has elapsed since the last packet that we received, exit. */
-	if(dgr_time_lastreceive != 0) // if we have received a packet previously
-	{
-		int seconds = 15;
-		if(time(NULL) - dgr_time_lastreceive >= seconds)
-		{
-			msg(MSG_FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master die? Exiting...\n", seconds);
-			exit(EXIT_FAILURE);
-		}
-	}
-
-	/* Use poll to wait for up to timeout seconds. */
-	struct pollfd fds;
-	fds.fd = dgr_socket;
-	fds.events = POLLIN;
-	int retval = poll(&fds, 1, timeout);
-	if(retval == -1)
-	{
-		msg(MSG_FATAL, "poll(): %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	else if(retval == 0) // nothing to read within timeout value
-	{
-		/* If a non-zero timeout value was specified and we timed out, exit() */
-		if(timeout > 0)
-		{
-			msg(MSG_FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
-			exit(EXIT_FAILURE);
-		}
-		return;
-	}
-	
-	struct sockaddr_storage their_addr;
-	socklen_t addr_len = sizeof their_addr;
-
-	char serialized[1024*1024];
-	int numbytes;
-	/* Read packets until there are no more to read. This ensures that
-	 * we are always using the newest packet. For example, 5 packets
-	 * might arrive while the slave is rendering a scene. We want to
-	 * make sure that we use the newest packet. */
-	while(1)
+	dgr_acked_frame = dgr_last_frame;
+	dgr_send_ack(dgr_acked_frame);
+
+	/* Stop waiting if the master sends a frame without
+	 * DGR_FLAG_BARRIER (for example, when it exits). If the master
+	 * doesn't release us for some other reason, stop waiting after a
+	 * second. */
+	long start = kuhl_microseconds();
+	pthread_mutex_lock(&dgr_rx_mutex);
+	while((int32_t) (dgr_released_frame - dgr_acked_frame) < 0 &&
+	      !(dgr_pending_back->frames > 0 && !(dgr_pending_back->flags & DGR_FLAG_BARRIER)))
 	{
-		if ((numbytes = recvfrom(dgr_socket, serialized, 1024*1024, 0,
-		                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-			msg(MSG_FATAL, "recvfrom: %s", strerror(errno));
-			exit(EXIT_FAILURE);
-		}
-
-		// if there is nothing to read anymore from the socket, break out of loop.
-		struct pollfd fds;
-		fds.fd = dgr_socket;
-		fds.events = POLLIN;
-		int retval = poll(&fds, 1, 0);
-		if(retval == 0)
+		int remaining = 1000 - (kuhl_microseconds() - start)/1000;
+		if(remaining <= 0)
 			break;
+		dgr_rx_wait(remaining);
 	}
-	dgr_time_lastreceive = time(NULL);
-	
-	dgr_unserialize(numbytes, serialized);
-	
-	/* If the packet we received indicates that dgr has died. */
-	int died = 0;
-	if(dgr_get("!!!dgr_died!!!", &died, sizeof(int)) >= 0 &&
-	   died == 1)
-	{
-		msg(MSG_DEBUG, "The master told slaves to exit. Exiting...\n");
-		exit(EXIT_SUCCESS);
-	}
+	pthread_mutex_unlock(&dgr_rx_mutex);
 #endif // __MINGW32__
 }
 
@@ -667,7 +2662,9 @@ static void dgr_receive(int timeout)
  * receiving.
  *
  * @param send If set to 1 and if process is a DGR master, will call
- * dgr_send().
+ * dgr_send(). In barrier mode (see dgr.sync), both the master and
+ * slaves wait for each other. Call with send set to 1 right before
+ * swapping buffers.
  *
  * @param receive If set to 1 and if process is a DGR slave, will call
  * dgr_receive().
@@ -678,20 +2675,636 @@ void dgr_update(int send, int receive)
 		return;
 	
 	if(dgr_is_master() && send == 1)
+	{
 		dgr_send();
+		dgr_barrier_master();
+	}
+	if(dgr_is_master() == 0 && send == 1)
+		dgr_barrier_slave();
 	
 	if(dgr_is_master() == 0 && receive == 1)
 	{
 		// if it is our first time receiving, allow for a delay.
-		if(dgr_time_lastreceive == 0)
+		if(dgr_last_frame == 0 && !dgr_have_keyframe)
 		{
 			/* Give plenty of time for us to receive the first
 			 * packet. It might arrive very slowly if the master
 			 * process is starting up slowly because it is loading a
 			 * large image or model file. */
-			dgr_receive(300000);  // 300000 milliseconds = 30 seconds
+			dgr_receive(30000);  // 30000 milliseconds = 30 seconds
 		}
 		else
 			dgr_receive(0);
 	}
 }
+
+/** Sends the frames in a recording (see dgr.mode = record) to the
+ * slaves. Call dgr_init() with dgr.mode set to master first. The
+ * frames are sent with our session and frame numbers, so the slaves
+ * treat the replay like a master that restarted. If dgr.sync is
+ * barrier, each frame waits for the slaves as usual, so replaying
+ * as fast as possible measures how many frames per second the
+ * slaves can handle.
+ *
+ * @param filename The recording.
+ * @param speed 1 to send the frames with the same timing as when
+ * they were recorded, 2 to send them twice as fast, etc. 0 sends them
+ * as fast as possible.
+ * @return The number of frames that were sent or -1 if the recording
+ * couldn't be read.
+ */
+long dgr_replay(const char *filename, float speed)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_disabled || !dgr_mode)
+	{
+		msg(MSG_ERROR, "DGR: dgr_replay() can only be used by a DGR master.");
+		return -1;
+	}
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "DGR: Unable to open recording %s: %s", filename, strerror(errno));
+		return -1;
+	}
+	char magic[8];
+	if(fread(magic, 1, 8, f) != 8 || memcmp(magic, DGR_RECORD_MAGIC, 8) != 0)
+	{
+		msg(MSG_ERROR, "DGR: %s isn't a DGR recording.", filename);
+		fclose(f);
+		return -1;
+	}
+
+	long frames = 0;
+	long start = kuhl_microseconds();
+	char *buf = NULL;
+	uint32_t bufAlloc = 0;
+	int64_t usec;
+	dgr_header header;
+	while(fread(&usec, sizeof(usec), 1, f) == 1 && fread(&header, sizeof(header), 1, f) == 1)
+	{
+		if(memcmp(header.magic, "DG", 2) != 0 || header.version != DGR_VERSION ||
+		   header.size > DGR_MAX_FRAME_SIZE)
+		{
+			msg(MSG_ERROR, "DGR: Recording %s is corrupt after %ld frames.", filename, frames);
+			break;
+		}
+		if(header.size > bufAlloc)
+		{
+			bufAlloc = header.size;
+			buf = realloc(buf, bufAlloc);
+		}
+		if(fread(buf, 1, header.size, f) != header.size)
+		{
+			msg(MSG_WARNING, "DGR: Recording %s ends in the middle of a frame.", filename);
+			break;
+		}
+
+		if(speed > 0)
+		{
+			long wait = start + (long) (usec / speed) - kuhl_microseconds();
+			if(wait > 0)
+				usleep(wait);
+		}
+		/* The last frame of a recording usually tells the slaves to
+		 * exit. Like dgr_exit(), don't wait for them at the barrier. */
+		int c = fgetc(f);
+		int barrier = dgr_barrier;
+		if(c == EOF)
+			dgr_barrier = 0;
+		else
+			ungetc(c, f);
+
+		header.session = dgr_session;
+		header.frame = dgr_frame++;
+		header.flags &= DGR_FLAG_KEYFRAME | DGR_FLAG_COMPRESSED;
+		if(dgr_barrier)
+			header.flags |= DGR_FLAG_BARRIER;
+		dgr_send_frame(&header, buf, header.size);
+		dgr_barrier_master();
+		dgr_barrier = barrier;
+		frames++;
+	}
+	free(buf);
+	fclose(f);
+	return frames;
+#else
+	return -1;
+#endif // __MINGW32__
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/** Computes the 64-bit FNV-1a hash of a blob. Blobs with the same
+ * hash are assumed to have the same contents. */
+static uint64_t dgr_blob_hash(const char *data, long size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for(long i=0; i<size; i++)
+	{
+		h ^= (uint8_t) data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/** Calls the progress callback (if there is one). */
+static void dgr_blob_report(const char *name, long done, long size)
+{
+	pthread_mutex_lock(&dgr_blob_mutex);
+	dgr_blob_func func = dgr_blob_callback;
+	void *arg = dgr_blob_callback_arg;
+	pthread_mutex_unlock(&dgr_blob_mutex);
+	if(func)
+		func(name, done, size, arg);
+}
+
+/** Adds a blob to dgr_blobs. dgr_blob_mutex must be locked. Any
+ * older blobs with the same name are marked as replaced.
+ *
+ * @return The index of the new blob in dgr_blobs.
+ */
+static int dgr_blob_add(const char *name, uint64_t hash, long size, char *data, int complete)
+{
+	if(dgr_blobs_len == dgr_blobs_alloc)
+	{
+		dgr_blobs_alloc = dgr_blobs_alloc == 0 ? 16 : dgr_blobs_alloc*2;
+		dgr_blobs = realloc(dgr_blobs, dgr_blobs_alloc * sizeof(dgr_blob));
+	}
+	dgr_blob *b = &(dgr_blobs[dgr_blobs_len]);
+	memset(b, 0, sizeof(dgr_blob));
+	snprintf(b->name, sizeof(b->name), "%s", name);
+	b->hash = hash;
+	b->size = size;
+	b->data = data;
+	b->complete = complete;
+	return dgr_blobs_len++;
+}
+
+/** Marks blobs with the same name as dgr_blobs[index] as replaced.
+ * dgr_blob_mutex must be locked. */
+static void dgr_blob_replace(int index)
+{
+	for(int i=0; i<dgr_blobs_len; i++)
+		if(i != index && !dgr_blobs[i].replaced && strcmp(dgr_blobs[i].name, dgr_blobs[index].name) == 0)
+			dgr_blobs[i].replaced = 1;
+}
+
+/** Sends or receives exactly size bytes on a TCP socket.
+ *
+ * @return 1 if successful, 0 if the connection closed or failed.
+ */
+static int dgr_blob_io(int sock, char *buf, long size, int sending)
+{
+	while(size > 0)
+	{
+		long n = sending ? send(sock, buf, size, MSG_NOSIGNAL) : recv(sock, buf, size, 0);
+		if(n <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+				continue;
+			return 0;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 1;
+}
+
+/** Master: Sends every blob to one slave, waiting for more blobs
+ * when it has sent all of them. One thread runs this function for
+ * each slave that connects. */
+static void* dgr_blob_master_client(void *arg)
+{
+	int sock = (int) (intptr_t) arg;
+	int next = 0;
+	while(1)
+	{
+		pthread_mutex_lock(&dgr_blob_mutex);
+		/* Skip replaced blobs after every wait too: A blob that was
+		 * added while we waited may already have been replaced and
+		 * freed. */
+		while(1)
+		{
+			while(next < dgr_blobs_len && dgr_blobs[next].replaced)
+				next++;
+			if(next < dgr_blobs_len)
+				break;
+			pthread_cond_wait(&dgr_blob_cond, &dgr_blob_mutex);
+		}
+		dgr_blob b = dgr_blobs[next];
+		dgr_blobs[next].refs++;
+		pthread_mutex_unlock(&dgr_blob_mutex);
+
+		/* Offer the blob. The slave replies with DGR_BLOB_HAVE if it
+		 * already has a blob with the same hash. */
+		dgr_blob_msg m;
+		memset(&m, 0, sizeof(m));
+		memcpy(m.magic, "DB", 2);
+		m.type = DGR_BLOB_OFFER;
+		m.nameLen = strlen(b.name);
+		m.hash = b.hash;
+		m.size = b.size;
+		int ok = dgr_blob_io(sock, (char*) &m, sizeof(m), 1) &&
+			dgr_blob_io(sock, b.name, m.nameLen, 1) &&
+			dgr_blob_io(sock, (char*) &m, sizeof(m), 0) &&
+			memcmp(m.magic, "DB", 2) == 0;
+		if(ok && m.type == DGR_BLOB_WANT)
+		{
+			for(long done=0; ok && done<b.size; )
+			{
+				long chunk = b.size - done < DGR_BLOB_CHUNK ? b.size - done : DGR_BLOB_CHUNK;
+				ok = dgr_blob_io(sock, b.data + done, chunk, 1);
+				done += chunk;
+				pthread_mutex_lock(&dgr_blob_mutex);
+				dgr_blob_bytes += chunk;
+				pthread_mutex_unlock(&dgr_blob_mutex);
+				dgr_blob_report(b.name, done, b.size);
+			}
+		}
+
+		pthread_mutex_lock(&dgr_blob_mutex);
+		dgr_blobs[next].refs--;
+		if(dgr_blobs[next].replaced && dgr_blobs[next].refs == 0)
+		{
+			free(dgr_blobs[next].data);
+			dgr_blobs[next].data = NULL;
+		}
+		pthread_mutex_unlock(&dgr_blob_mutex);
+		if(!ok)
+			break;
+		next++;
+	}
+	close(sock);
+	return NULL;
+}
+
+/** Master: Accepts connections from slaves. */
+static void* dgr_blob_master_main(void *arg)
+{
+	int listener = (int) (intptr_t) arg;
+	while(1)
+	{
+		int sock = accept(listener, NULL, NULL);
+		if(sock < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			msg(MSG_ERROR, "DGR Master: Stopped accepting blob connections: %s", strerror(errno));
+			break;
+		}
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, dgr_blob_master_client, (void*) (intptr_t) sock) != 0)
+			close(sock);
+		else
+			pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/** Slave: Looks for a blob with the given hash in memory or in the
+ * dgr.blob.cache directory and adds it to dgr_blobs with the given
+ * name. dgr_blob_mutex must be locked.
+ *
+ * @return 1 if we already had the blob, 0 if it must be sent to us.
+ */
+static int dgr_blob_have(const char *name, uint64_t hash, long size)
+{
+	for(int i=dgr_blobs_len-1; i>=0; i--)
+	{
+		dgr_blob *b = &(dgr_blobs[i]);
+		if(!b->complete || b->hash != hash || b->size != size || b->data == NULL)
+			continue;
+		if(!b->replaced && strcmp(b->name, name) == 0)
+			return 1;
+		char *data = malloc(size > 0 ? size : 1);
+		memcpy(data, b->data, size);
+		dgr_blob_replace(dgr_blob_add(name, hash, size, data, 1));
+		return 1;
+	}
+
+	const char *cache = kuhl_config_get("dgr.blob.cache");
+	if(cache == NULL)
+		return 0;
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s/%016llx", cache, (unsigned long long) hash);
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+	char *data = malloc(size > 0 ? size : 1);
+	int ok = fread(data, 1, size, f) == (size_t) size && fgetc(f) == EOF;
+	fclose(f);
+	if(!ok)
+	{
+		free(data);
+		return 0;
+	}
+	dgr_blob_replace(dgr_blob_add(name, hash, size, data, 1));
+	return 1;
+}
+
+/** Slave: Receives the blobs that the master offers on a connection.
+ *
+ * @return when the connection is closed.
+ */
+static void dgr_blob_slave_receive(int sock)
+{
+	dgr_blob_msg m;
+	char name[DGR_MAX_NAME+1];
+	while(dgr_blob_io(sock, (char*) &m, sizeof(m), 0))
+	{
+		if(memcmp(m.magic, "DB", 2) != 0 || m.type != DGR_BLOB_OFFER || m.nameLen > DGR_MAX_NAME ||
+		   m.size > DGR_BLOB_MAX_SIZE || !dgr_blob_io(sock, name, m.nameLen, 0))
+		{
+			msg(MSG_WARNING, "DGR Slave: Received a corrupt blob offer.");
+			return;
+		}
+		name[m.nameLen] = '\0';
+		long size = m.size;
+		uint64_t hash = m.hash;
+
+		pthread_mutex_lock(&dgr_blob_mutex);
+		int have = dgr_blob_have(name, hash, size);
+		pthread_mutex_unlock(&dgr_blob_mutex);
+		if(have)
+			pthread_cond_broadcast(&dgr_blob_cond);
+		m.type = have ? DGR_BLOB_HAVE : DGR_BLOB_WANT;
+		m.nameLen = 0;
+		if(!dgr_blob_io(sock, (char*) &m, sizeof(m), 1))
+			return;
+		if(have)
+		{
+			dgr_blob_report(name, size, size);
+			continue;
+		}
+
+		char *data = malloc(size > 0 ? size : 1);
+		for(long done=0; done<size; )
+		{
+			long chunk = size - done < DGR_BLOB_CHUNK ? size - done : DGR_BLOB_CHUNK;
+			if(!dgr_blob_io(sock, data + done, chunk, 0))
+			{
+				free(data);
+				return;
+			}
+			done += chunk;
+			pthread_mutex_lock(&dgr_blob_mutex);
+			dgr_blob_bytes += chunk;
+			pthread_mutex_unlock(&dgr_blob_mutex);
+			dgr_blob_report(name, done, size);
+		}
+		if(dgr_blob_hash(data, size) != hash)
+		{
+			msg(MSG_WARNING, "DGR Slave: Blob '%s' doesn't match its hash, ignoring it.", name);
+			free(data);
+			continue;
+		}
+
+		const char *cache = kuhl_config_get("dgr.blob.cache");
+		if(cache != NULL)
+		{
+			char filename[1024];
+			snprintf(filename, sizeof(filename), "%s/%016llx", cache, (unsigned long long) hash);
+			FILE *f = fopen(filename, "wb");
+			if(f == NULL || fwrite(data, 1, size, f) != (size_t) size)
+				msg(MSG_WARNING, "DGR Slave: Unable to write blob '%s' to %s.", name, filename);
+			if(f != NULL)
+				fclose(f);
+		}
+
+		pthread_mutex_lock(&dgr_blob_mutex);
+		dgr_blob_replace(dgr_blob_add(name, hash, size, data, 1));
+		pthread_cond_broadcast(&dgr_blob_cond);
+		pthread_mutex_unlock(&dgr_blob_mutex);
+	}
+}
+
+/** Slave: Connects to the master's blob port (using the address that
+ * DGR packets arrive from) and receives blobs. Reconnects if the
+ * connection closes, for example because the master restarted. */
+static void* dgr_blob_slave_main(void *arg)
+{
+	int port = (int) (intptr_t) arg;
+	while(1)
+	{
+		pthread_mutex_lock(&dgr_rx_mutex);
+		struct sockaddr_storage addr;
+		memcpy(&addr, &dgr_master_addr, sizeof(addr));
+		socklen_t addrlen = dgr_master_addrlen;
+		pthread_mutex_unlock(&dgr_rx_mutex);
+		if(addrlen == 0)  // we haven't heard from the master yet
+		{
+			usleep(100000);
+			continue;
+		}
+		if(addr.ss_family == AF_INET)
+			((struct sockaddr_in*) &addr)->sin_port = htons(port);
+		else
+			((struct sockaddr_in6*) &addr)->sin6_port = htons(port);
+
+		int sock = socket(addr.ss_family, SOCK_STREAM, 0);
+		if(sock < 0 || connect(sock, (struct sockaddr*) &addr, addrlen) != 0)
+		{
+			if(sock >= 0)
+				close(sock);
+			usleep(500000);
+			continue;
+		}
+		msg(MSG_DEBUG, "DGR Slave: Connected to the master's blob port.");
+		dgr_blob_slave_receive(sock);
+		close(sock);
+	}
+	return NULL;
+}
+
+/** Starts the threads for the blob channel if dgr.blob.port is set.
+ *
+ * @param master 1 if we are a master, 0 if we are a slave.
+ */
+static void dgr_blob_start(int master)
+{
+	static int started = 0;
+	int port = kuhl_config_int("dgr.blob.port", 0, 0);
+	if(port <= 0 || started)
+		return;
+
+	pthread_t thread;
+	if(master)
+	{
+		struct addrinfo hints, *servinfo, *p;
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		char portStr[16];
+		snprintf(portStr, sizeof(portStr), "%d", port);
+		int rv;
+		if((rv = getaddrinfo(NULL, portStr, &hints, &servinfo)) != 0)
+		{
+			msg(MSG_ERROR, "DGR Master: getaddrinfo: %s", gai_strerror(rv));
+			return;
+		}
+		int listener = -1;
+		for(p = servinfo; p != NULL; p = p->ai_next)
+		{
+			if((listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+				continue;
+			int reuse = 1;
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+			if(bind(listener, p->ai_addr, p->ai_addrlen) == 0 && listen(listener, 16) == 0)
+				break;
+			close(listener);
+			listener = -1;
+		}
+		freeaddrinfo(servinfo);
+		if(listener < 0)
+		{
+			msg(MSG_ERROR, "DGR Master: Unable to listen for blob connections on port %d: %s", port, strerror(errno));
+			return;
+		}
+		msg(MSG_INFO, "DGR Master: Sending blobs to slaves that connect to TCP port %d.\n", port);
+		if(pthread_create(&thread, NULL, dgr_blob_master_main, (void*) (intptr_t) listener) != 0)
+			return;
+	}
+	else if(pthread_create(&thread, NULL, dgr_blob_slave_main, (void*) (intptr_t) port) != 0)
+		return;
+	pthread_detach(thread);
+	started = 1;
+}
+#endif // __MINGW32__
+
+/** Sets a function which is called as blobs are sent (by a master)
+ * or received (by a slave). It is called from a background thread.
+ *
+ * @param func The function to call (or NULL).
+ * @param arg A pointer passed to func.
+ */
+void dgr_blob_progress(dgr_blob_func func, void *arg)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	pthread_mutex_lock(&dgr_blob_mutex);
+	dgr_blob_callback = func;
+	dgr_blob_callback_arg = arg;
+	pthread_mutex_unlock(&dgr_blob_mutex);
+#endif
+}
+
+/** Master: Sends a large piece of data (such as a decoded image or a
+ * model) to every slave once over a reliable connection. Slaves
+ * which connect later also receive it. If a blob with the same name
+ * and contents was already sent, this function returns immediately.
+ * If a slave already has a blob with the same contents (under any
+ * name, or in its dgr.blob.cache directory), the data isn't sent to
+ * it again. Slaves do nothing when they call this function; they
+ * call dgr_blob_get() instead.
+ *
+ * @param name The name of the blob.
+ * @param data The data to send (it is copied).
+ * @param size The size of the data in bytes.
+ */
+void dgr_blob_send(const char *name, const void *data, long size)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_disabled || !dgr_mode)
+		return;
+	if(strlen(name) > DGR_MAX_NAME || size < 0 || size > DGR_BLOB_MAX_SIZE)
+	{
+		msg(MSG_ERROR, "DGR Master: Can't send blob '%s'; the name or size is too large.", name);
+		return;
+	}
+	if(!kuhl_config_isset("dgr.blob.port"))
+	{
+		static int warned = 0;
+		if(!warned)
+			msg(MSG_WARNING, "DGR Master: dgr_blob_send() was called, but dgr.blob.port isn't set.");
+		warned = 1;
+	}
+
+	uint64_t hash = dgr_blob_hash(data, size);
+	pthread_mutex_lock(&dgr_blob_mutex);
+	for(int i=0; i<dgr_blobs_len; i++)
+	{
+		dgr_blob *b = &(dgr_blobs[i]);
+		if(!b->replaced && b->hash == hash && b->size == size && strcmp(b->name, name) == 0)
+		{
+			pthread_mutex_unlock(&dgr_blob_mutex);
+			return;
+		}
+	}
+	char *copy = malloc(size > 0 ? size : 1);
+	memcpy(copy, data, size);
+	int index = dgr_blob_add(name, hash, size, copy, 1);
+	dgr_blob_replace(index);
+	/* Free the older blobs that no slave is being sent right now. */
+	for(int i=0; i<dgr_blobs_len; i++)
+		if(dgr_blobs[i].replaced && dgr_blobs[i].refs == 0)
+		{
+			free(dgr_blobs[i].data);
+			dgr_blobs[i].data = NULL;
+		}
+	pthread_cond_broadcast(&dgr_blob_cond);
+	pthread_mutex_unlock(&dgr_blob_mutex);
+#endif
+}
+
+/** Gets a blob that was sent with dgr_blob_send(). On a master, this
+ * returns the blob that the master sent.
+ *
+ * @param name The name of the blob.
+ * @param size Set to the size of the blob (if not NULL).
+ * @param timeout Milliseconds to wait for the blob to arrive (0 to return immediately).
+ * @return The data or NULL if the blob hasn't arrived. The data
+ * belongs to DGR. On a slave, it remains valid until the next time
+ * dgr_blob_get() is called with the same name. On a master, it
+ * remains valid until dgr_blob_send() replaces the blob.
+ */
+const void* dgr_blob_get(const char *name, long *size, int timeout)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	long start = kuhl_microseconds();
+	pthread_mutex_lock(&dgr_blob_mutex);
+	while(1)
+	{
+		const void *data = NULL;
+		for(int i=0; i<dgr_blobs_len; i++)
+		{
+			dgr_blob *b = &(dgr_blobs[i]);
+			if(strcmp(b->name, name) != 0 || !b->complete)
+				continue;
+			if(!b->replaced)
+			{
+				data = b->data;
+				if(size)
+					*size = b->size;
+			}
+			else if(b->refs == 0 && b->data != NULL)
+			{
+				/* The caller is done with the older version. */
+				free(b->data);
+				b->data = NULL;
+			}
+		}
+		int remaining = timeout - (kuhl_microseconds() - start)/1000;
+		if(data != NULL || remaining <= 0)
+		{
+			pthread_mutex_unlock(&dgr_blob_mutex);
+			return data;
+		}
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += remaining / 1000;
+		ts.tv_nsec += (remaining % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&dgr_blob_cond, &dgr_blob_mutex, &ts);
+	}
+#else
+	return NULL;
+#endif
+}
@@ -16,12 +16,57 @@
 extern "C" {
 #endif
 
+/** Statistics about the packets that a DGR master has sent or that a
+ * DGR slave has received. See dgr_get_stats(). */
+typedef struct {
+	long frames;    /**< Number of packets sent or used */
+	long keyframes; /**< Number of packets that contained every record */
+	long bytes;     /**< Total size of the packets (not including UDP/IP headers) */
+	long lost;      /**< Slave: Number of frames that we never received */
+	long barrierTimeouts; /**< Master: Number of times a slave didn't reach the barrier in time */
+	long barrierUsec;     /**< Master: Total time spent waiting at the barrier (microseconds) */
+	long compressedFrames;  /**< Number of frames that were compressed */
+	long compressedBytes;   /**< Size of the compressed frames */
+	long uncompressedBytes; /**< Size of the compressed frames before they were compressed */
+	long compressUsec;      /**< Time spent compressing (master) or decompressing (slave) frames (microseconds) */
+	long blobBytes;         /**< Bytes sent or received through dgr_blob_send() */
+} dgr_stats;
+
+/** Statistics that a DGR master keeps about each slave. See
+ * dgr_get_slave_stats(). */
+typedef struct {
+	char address[64]; /**< IP address and port of the slave */
+	int active;       /**< Did we hear from the slave in the last two seconds? */
+	long acks;        /**< Number of frames the slave acknowledged */
+	float latency;    /**< Smoothed time from sending a frame to receiving the acknowledgement (ms) */
+	float jitter;     /**< Smoothed variation in latency (ms) */
+	float maxLatency; /**< Largest latency (ms) */
+} dgr_slave_stats;
+
+/** A function that is called as a blob is sent or received. See
+    dgr_blob_progress().
+
+    @param name The name of the blob.
+    @param done Number of bytes that have been sent to (or received from) one slave (or the master).
+    @param size Size of the blob.
+    @param arg The pointer passed to dgr_blob_progress().
+*/
+typedef void (*dgr_blob_func)(const char *name, long done, long size, void *arg);
+
 void dgr_init(void);
 void dgr_update(int send, int receive);
 void dgr_setget(const char *name, void* buffer, int bufferSize);
+int dgr_register(const char *name, int size);
+void dgr_setget_handle(int handle, void *buffer);
 void dgr_print_list(void);
 int dgr_is_master(void);
 int dgr_is_enabled(void);
+void dgr_get_stats(dgr_stats *stats);
+int dgr_get_slave_stats(dgr_slave_stats *stats, int maxSlaves);
+long dgr_replay(const char *filename, float speed);
+void dgr_blob_send(const char *name, const void *data, long size);
+const void* dgr_blob_get(const char *name, long *size, int timeout);
+void dgr_blob_progress(dgr_blob_func func, void *arg);
 	
 #ifdef __cplusplus
 } // end extern "C"
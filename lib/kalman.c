@@ -13,8 +13,52 @@
 #include "kuhl-nodep.h"
 #include "kalman.h"
 #include "vecmat.h"
+#include "msg.h"
 
 
+/** Creates the transition matrix (A) and the process noise covariance
+ * (Q) for a model where the state is a position, velocity and
+ * acceleration.
+ *
+ * @param a The transition matrix which moves the state ahead by dt.
+ * @param q The process noise covariance (scaled by qScale).
+ * @param dt The time step in seconds.
+ * @param qScale Scaling factor for Q.
+ */
+static void kalman_model(double a[9], double q[9], double dt, double qScale)
+{
+	/* A is the transition matrix which will move our state ahead by
+	 * one timestep. */
+	{
+		double row1[3] = { 1, dt, .5*dt*dt };
+		double row2[3] = { 0, 1, dt };
+		double row3[3] = { 0, 0, 1 };
+		mat3d_setRow(a, row1, 0);
+		mat3d_setRow(a, row2, 1);
+		mat3d_setRow(a, row3, 2);
+	}
+	
+	/* Q is the process/system noise covariance.
+
+	   From pg 156 of "Fundamentals of Kalman filtering: a practical
+	   approach" which provides tables where each state is a
+	   derivative of the one above it and all of the noise enters into
+	   the bottom-most state.  The resulting matrix can be scaled by a
+	   scalar as needed (called the "continuous process-noise spectral
+	   density") in the book.
+	*/
+	double dt2 = dt*dt, dt3 = dt2*dt, dt4 = dt3*dt, dt5 = dt4*dt;
+	{
+		double row1[3] = { dt5/20, dt4/8, dt3/6 };
+		double row2[3] = { dt4/8,  dt3/3, dt2/2 };
+		double row3[3] = { dt3/6,  dt2/2, dt };
+		mat3d_setRow(q, row1, 0);
+		mat3d_setRow(q, row2, 1);
+		mat3d_setRow(q, row3, 2);
+	}
+	for(int i=0; i<9; i++)
+		q[i] = q[i] * qScale;
+}
 
 /** Given a fully initialized kalman_state object, and a new
  * measurement, get a filtered data point. The model behind this
@@ -23,7 +67,8 @@
  *
  * This function filters only a single 1D point. You would need to
  * call this function three different times with three different
- * kalman_state variables to filter X, Y, and Z.
+ * kalman_state variables to filter X, Y, and Z (or use
+ * kalman_multi_estimate() to filter them together).
  *
  * @param state An kalman_state struct initialized by kalman_initialize()
  *
@@ -46,39 +91,10 @@ float kalman_estimate(kalman_state * state, float measured, long measured_time)
 		state->time_prev = measured_time-1;
 	double dt = (measured_time - state->time_prev)/1000000.0;
 	
-	/* A is the transition matrix which will move our state ahead by
-	 * one timestep. */
-	{
-		double row1[3] = { 1, dt, .5*dt*dt };
-		double row2[3] = { 0, 1, dt };
-		double row3[3] = { 0, 0, 1 };
-		mat3d_setRow(state->a, row1, 0);
-		mat3d_setRow(state->a, row2, 1);
-		mat3d_setRow(state->a, row3, 2);
-	}
-	// mat3d_print(state->a);
-
-	
-	/* Q is the process/system noise covariance.
-
-	   From pg 156 of "Fundamentals of Kalman filtering: a practical
-	   approach" which provides tables where each state is a
-	   derivative of the one above it and all of the noise enters into
-	   the bottom-most state.  The resulting matrix can be scaled by a
-	   scalar as needed (called the "continuous process-noise spectral
-	   density") in the book.
-	*/
+	/* A is the transition matrix and Q is the process/system noise
+	 * covariance. */
 	double q[9];
-	{
-		double row1[3] = { pow(dt,5)/20, pow(dt,4)/8, pow(dt,3)/6 };
-		double row2[3] = { pow(dt,4)/8, pow(dt,3)/3, pow(dt,2)/2 };
-		double row3[3] = { pow(dt,3)/6, pow(dt,2)/2, dt };
-		mat3d_setRow(q, row1, 0);
-		mat3d_setRow(q, row2, 1);
-		mat3d_setRow(q, row3, 2);
-	}
-	for(int i=0; i<9; i++)
-		q[i] = q[i] * state->qScale;
+	kalman_model(state->a, q, dt, state->qScale);
 //	printf("%f\n", dt);
 //	mat3d_print(q);
 
@@ -202,3 +218,178 @@ void kalman_initialize(kalman_state * state, float sigma_meas, float qScale)
 	// Converts our state into the set of variables we are measuring.
 	vec3d_set(state->h, 1,0,0);
 }
+
+
+/** Initializes a kalman_multi_state struct. See kalman_initialize()
+    for a description of the parameters.
+
+   @param state A pointer to a kalman_multi_state struct which should be initialized.
+
+   @param channels Number of values that will be filtered together (at most KALMAN_MAX_CHANNELS).
+
+   @param sigma_meas Standard deviation of the measurement noise.
+
+   @param qScale A value near 0 indicates high confidence in our
+   model.
+*/
+void kalman_multi_initialize(kalman_multi_state *state, int channels, float sigma_meas, float qScale)
+{
+	memset(state, 0, sizeof(kalman_multi_state));
+	if(channels > KALMAN_MAX_CHANNELS)
+	{
+		msg(MSG_ERROR, "kalman_multi_initialize() can filter at most %d channels, not %d.", KALMAN_MAX_CHANNELS, channels);
+		channels = KALMAN_MAX_CHANNELS;
+	}
+	state->isEnabled = 1;
+	state->channels = channels;
+	state->time_prev = -1;
+	state->qScale = qScale;
+	state->r = sigma_meas * sigma_meas;
+	mat3d_identity(state->p);
+}
+
+/** Filters one measurement of each channel. This is equivalent to
+ * calling kalman_estimate() once for each channel (with kalman_state
+ * structs initialized with the same settings), but the matrices
+ * which depend on the time between measurements, the error
+ * covariance and the Kalman gain are only calculated once.
+ *
+ * @param state A kalman_multi_state struct initialized by kalman_multi_initialize()
+ *
+ * @param measured The newest, unfiltered measurement of each channel.
+ *
+ * @param measured_time The time that the measurements were recorded
+ * in microseconds. If -1, we will use the current time.
+ *
+ * The filtered values are in state->x[0] (and the velocities and
+ * accelerations in state->x[1] and state->x[2]).
+ */
+void kalman_multi_estimate(kalman_multi_state *state, const double measured[], long measured_time)
+{
+	int n = state->channels;
+	if(state->isEnabled == 0)
+	{
+		for(int c=0; c<n; c++)
+			state->x[0][c] = measured[c];
+		return;
+	}
+
+	if(measured_time == -1)
+		measured_time = kuhl_microseconds();
+	if(state->time_prev == -1)
+		state->time_prev = measured_time-1;
+	double dt = (measured_time - state->time_prev)/1000000.0;
+
+	/* Shared by all channels: Pminus = A * P * A^T + Q */
+	double a[9], q[9];
+	kalman_model(a, q, dt, state->qScale);
+	double a_transpose[9], a_dot_p[9], p_minus[9];
+	mat3d_transpose_new(a_transpose, a);
+	mat3d_mult_mat3d_new(a_dot_p, a, state->p);
+	mat3d_mult_mat3d_new(p_minus, a_dot_p, a_transpose);
+	for(int i=0; i<9; i++)
+		p_minus[i] += q[i];
+
+	/* Kalman gain. H is (1,0,0), so Pminus * transpose(H) is the
+	 * first column of Pminus and H * Pminus * transpose(H) is its
+	 * first element. */
+	double k[3];
+	double inv_s = 1/(p_minus[mat3_getIndex(0,0)] + state->r);
+	for(int i=0; i<3; i++)
+		k[i] = p_minus[mat3_getIndex(i,0)] * inv_s;
+
+	/* P = Pminus - K * H * Pminus (the first row of Pminus scaled by K) */
+	for(int i=0; i<3; i++)
+		for(int j=0; j<3; j++)
+			state->p[mat3_getIndex(i,j)] = p_minus[mat3_getIndex(i,j)] - k[i]*p_minus[mat3_getIndex(0,j)];
+
+	/* Per channel: project the state ahead and correct it with the
+	 * measurement. */
+	const double a01 = dt, a02 = .5*dt*dt;
+	double *x0 = state->x[0], *x1 = state->x[1], *x2 = state->x[2];
+	for(int c=0; c<n; c++)
+	{
+		double m0 = x0[c] + a01*x1[c] + a02*x2[c];
+		double m1 = x1[c] + a01*x2[c];
+		double innovation = measured[c] - m0;
+		x0[c] = m0 + k[0]*innovation;
+		x1[c] = m1 + k[1]*innovation;
+		x2[c] = x2[c] + k[2]*innovation;
+	}
+	state->time_prev = measured_time;
+}
+
+/** Initializes a kalman_quat_state struct.
+
+   @param state A pointer to a kalman_quat_state struct which should be initialized.
+
+   @param sigma_meas Standard deviation of the measurement noise (radians).
+
+   @param qScale A value near 0 indicates high confidence in our
+   model (see kalman_initialize()).
+*/
+void kalman_quat_initialize(kalman_quat_state *state, float sigma_meas, float qScale)
+{
+	memset(state, 0, sizeof(kalman_quat_state));
+	kalman_multi_initialize(&(state->axes), 3, sigma_meas, qScale);
+	vec4d_set(state->quat, 0, 0, 0, 1);
+}
+
+/** Filters an orientation measurement.
+
+   @param state A kalman_quat_state struct initialized by kalman_quat_initialize()
+
+   @param measured The newest, unfiltered orientation (x,y,z,w).
+
+   @param measured_time The time that 'measured' was recorded in
+   microseconds. If -1, we will use the current time.
+
+   The filtered orientation is in state->quat and the angular
+   velocity (radians/second, world coordinates) is in state->axes.x[1].
+*/
+void kalman_quat_estimate(kalman_quat_state *state, const double measured[4], long measured_time)
+{
+	if(measured_time == -1)
+		measured_time = kuhl_microseconds();
+
+	double q[4];
+	quatd_normalize_new(q, measured);
+	if(state->count++ == 0 || state->axes.isEnabled == 0)
+	{
+		vec4d_copy(state->quat, q);
+		state->axes.time_prev = measured_time;
+		return;
+	}
+
+	/* The rotation from our estimate to the measurement: dq = q * conj(estimate) */
+	double conj[4] = { -state->quat[0], -state->quat[1], -state->quat[2], state->quat[3] };
+	double dq[4];
+	quatd_mult_quatd_new(dq, q, conj);
+	if(dq[3] < 0) // take the shorter way around
+		vec4d_scalarMult(dq, -1);
+
+	/* ...as a rotation vector (axis * angle in radians) */
+	double sinHalf = vec3d_norm(dq);
+	double rotation[3];
+	if(sinHalf > 1e-12)
+		vec3d_scalarMult_new(rotation, dq, 2*atan2(sinHalf, dq[3]) / sinHalf);
+	else
+		vec3d_scalarMult_new(rotation, dq, 2);
+
+	/* Filter the rotation. The error state always starts at 0 (our
+	 * estimate), so the model predicts that we have rotated by
+	 * angvel*dt + 1/2*angacc*dt^2 since then. */
+	for(int c=0; c<3; c++)
+		state->axes.x[0][c] = 0;
+	kalman_multi_estimate(&(state->axes), rotation, measured_time);
+
+	/* Rotate our estimate by the filtered rotation. */
+	double angle = vec3d_norm(state->axes.x[0]);
+	if(angle > 1e-12)
+	{
+		double s = sin(angle/2) / angle;
+		double filtered[4] = { state->axes.x[0][0]*s, state->axes.x[0][1]*s, state->axes.x[0][2]*s, cos(angle/2) };
+		quatd_mult_quatd_new(state->quat, filtered, state->quat);
+		quatd_normalize(state->quat);
+	}
+}
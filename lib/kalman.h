@@ -30,6 +30,45 @@ typedef struct {
 void kalman_initialize(kalman_state * state, float sigma_meas, float qScale);
 float kalman_estimate(kalman_state * state, float measured, long measured_time);
 
+
+/** Maximum number of channels in a kalman_multi_state */
+#define KALMAN_MAX_CHANNELS 4
+
+/** Several channels (for example, x, y and z) filtered with the same
+ * model, measurement noise and measurement times. Since the error
+ * covariance and the Kalman gain don't depend on the measurements,
+ * they are the same for every channel and are only calculated once
+ * per measurement. The states are stored one array per state
+ * variable so that the per-channel update is a simple loop that the
+ * compiler can vectorize. */
+typedef struct {
+	int isEnabled; /**< If set to 0, disable kalman filter */
+	int channels;  /**< Number of channels (at most KALMAN_MAX_CHANNELS) */
+	long time_prev; /**< Time of previous measurement in microseconds */
+	double qScale; /**< Scaling factor for Q matrix (system error) */
+	double r;      /**< Variance of measurement error */
+	double p[9];   /**< Estimated error of our current state (shared by all channels) */
+	double x[3][KALMAN_MAX_CHANNELS]; /**< Filtered position (x[0]), velocity (x[1]) and acceleration (x[2]) of each channel */
+} kalman_multi_state;
+
+/** Filters orientations (unit quaternions). The filter tracks the
+ * orientation, angular velocity and angular acceleration. Each new
+ * measurement is compared with the current estimate as a small
+ * rotation (an "error state" in the tangent space of the rotation
+ * group) which is filtered on the x, y and z axes with a
+ * kalman_multi_state. The filtered rotation is then applied to the
+ * estimate, so the estimate always remains a unit quaternion. */
+typedef struct {
+	kalman_multi_state axes; /**< Rotation since the previous estimate (x[0]), angular velocity (x[1], radians/second) and angular acceleration (x[2]) around the x, y and z axes */
+	double quat[4];  /**< Filtered orientation (x,y,z,w) */
+	int count;       /**< Number of measurements so far */
+} kalman_quat_state;
+
+void kalman_multi_initialize(kalman_multi_state *state, int channels, float sigma_meas, float qScale);
+void kalman_multi_estimate(kalman_multi_state *state, const double measured[], long measured_time);
+void kalman_quat_initialize(kalman_quat_state *state, float sigma_meas, float qScale);
+void kalman_quat_estimate(kalman_quat_state *state, const double measured[4], long measured_time);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
@@ -119,7 +119,7 @@ const char* kuhl_config_get(const char *key)
     empty string. */
 int kuhl_config_isset(const char *key)
 {
-	return (kuhl_config_get(key) == NULL);
+	return (kuhl_config_get(key) != NULL);
 }
 
 /** Returns 1 if the key is set to true in the config file. Returns 0
@@ -599,6 +599,8 @@ int kuhl_tokenize(char *result[], const int resultLen, const char *str, const ch
 	/* Make pointers in result array point to NULL */
 	for(int i=0; i<resultLen; i++)
 		result[i] = NULL;
+	if(str == NULL)
+		return 0;
 
 	/* Make a copy of str so that we can modify it */
 	char *str2 = strdup(str);
@@ -47,6 +47,8 @@
 
 #include "kuhl-util.h"
 #include "vecmat.h"
+#include "screencap.h"
+#include "video.h"
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 #include "imageio.h"
 #else /* use STB image loading if ImageMagick isn't available' */
@@ -1813,6 +1815,7 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
 		msg(MSG_ERROR, "Your card's rough estimate for the maximum texture size that it supports: %dx%d\n", maxTextureSize, maxTextureSize);
 		msg(MSG_WARNING, "Common max texture sizes for graphics cards can be found at: http://feedback.wildfiregames.com/report/opengl/feature/GL_MAX_TEXTURE_SIZE");
+		msg(MSG_WARNING, "Images that are too large for a texture can be converted into a tiled pyramid with panorama-tiler and drawn with tiledtex_draw().");
 
 		// According to the website above, as of July 2014, 85% of
 		// computers support 8k or larger. Most computers on MTU's
@@ -2187,25 +2190,32 @@ float kuhl_read_texture_file(const char *filename, GLuint *texName)
 	return kuhl_read_texture_file_wrap(filename, texName, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 }
 
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-static void kuhl_screenshot_im(const char *outputImageFilename)
-{
-	// Get window size
-	//int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
-	//int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
-	int windowWidth,windowHeight;
-	glfwGetFramebufferSize(kuhl_get_window(), &windowWidth, &windowHeight);
+/** Writes RGB pixels to an image file. The type of image file is
+    determined by the filename extension. ImageMagick can write to any
+    format it supports; STB can only write png, tga and bmp files.
 
-	// Allocate space for data from window
-	char *data = kuhl_malloc(windowWidth * windowHeight * 3);
-	// Read pixels from the window
-	glReadPixels(0,0,windowWidth,windowHeight,
-	             GL_RGB,GL_UNSIGNED_BYTE, data);
-	kuhl_errorcheck();
+    This function does not use OpenGL and can safely be called from a
+    thread other than the one that is rendering.
+
+    @param outputImageFilename The name of the image file to write.
+
+    @param data RGB pixels (3 bytes per pixel, no padding between
+    rows) starting at the bottom left corner of the image. The array
+    may be modified by this function.
+
+    @param width Width of the image in pixels.
+
+    @param height Height of the image in pixels.
+
+    @return 0 on success, -1 on failure.
+*/
+int kuhl_write_image(const char *outputImageFilename, unsigned char *data, int width, int height)
+{
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
 	// Set up image output settings
 	imageio_info info_out;
-	info_out.width    = windowWidth;
-	info_out.height   = windowHeight;
+	info_out.width    = width;
+	info_out.height   = height;
 	info_out.depth    = 8; // bits/color in output image
 	info_out.quality  = 85;
 	info_out.colorspace = sRGBColorspace;
@@ -2216,85 +2226,119 @@ static void kuhl_screenshot_im(const char *outputImageFilename)
 	// Write image to disk
 	imageout(&info_out, data);
 	free(info_out.filename); // cleanup
-	free(data);
+	return 0;
+#else
+	int comp = 3; // 3 = RGB, 4 = RGBA
+	int stride_in_bytes = width*comp*sizeof(char);
+
+	kuhl_flip_texture_array(data, width, height, comp);
+
+	int ok=0;
+	const char *s = outputImageFilename;
+	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
+		ok = stbi_write_png(s, width, height, comp, data, stride_in_bytes);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
+		ok = stbi_write_tga(s, width, height, comp, data);
+	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
+		ok = stbi_write_bmp(s, width, height, comp, data);
+
+	if (!ok)
+	{
+		msg(MSG_ERROR, "Failed write image to %s (note: STB can only write png, tga, and bmp files.)\n", outputImageFilename);
+		return -1;
+	}
+	return 0;
+#endif // KUHL_UTIL_USE_IMAGEMAGICK
 }
-#else // KUHL_UTIL_USE_IMAGEMAGICK
 
-static void kuhl_screenshot_stb(const char *outputImageFilename)
+/** Takes a screenshot of the current OpenGL screen and writes it to
+    an image file. This function waits for OpenGL to finish drawing
+    and for the file to be written. Use screencap_request() to take
+    screenshots without stalling the rendering loop.
+
+    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension. This function will allow you to write to any image format that ImageMagick supports. Suggestion: PNG files often work best for screenshots; try "output.png".
+*/
+void kuhl_screenshot(const char *outputImageFilename)
 {
 	// Get window size
-	//int windowWidth  = glutGet(GLUT_WINDOW_WIDTH);
-	//int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
 	int windowWidth,windowHeight;
 	glfwGetFramebufferSize(kuhl_get_window(), &windowWidth, &windowHeight);
 
-	
-	int comp = 3; // 3 = RGB, 4 = RGBA
-	int stride_in_bytes = windowWidth*comp*sizeof(char);
 	// Allocate space for data from window
-	unsigned char *data = kuhl_malloc(stride_in_bytes*windowHeight);
-	// Read pixels from the window
+	unsigned char *data = kuhl_malloc(windowWidth * windowHeight * 3);
+	// Read pixels from the window. Rows of RGB pixels may not be a multiple of 4 bytes long.
+	GLint previousAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &previousAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 	glReadPixels(0,0,windowWidth,windowHeight,
 	             GL_RGB,GL_UNSIGNED_BYTE, data);
+	glPixelStorei(GL_PACK_ALIGNMENT, previousAlignment);
 	kuhl_errorcheck();
 
-	kuhl_flip_texture_array(data, windowWidth, windowHeight, 3);
-
-	int ok=0;
-	const char *s = outputImageFilename;
-	if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".png"))
-		ok = stbi_write_png(s, windowWidth, windowHeight, comp, data, stride_in_bytes);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".tga"))
-		ok = stbi_write_tga(s, windowWidth, windowHeight, comp, data);
-	else if(strlen(s) > 4 && !strcmp(s + strlen(s) - 4, ".bmp"))
-		ok = stbi_write_bmp(s, windowWidth, windowHeight, comp, data);
+	int ret = kuhl_write_image(outputImageFilename, data, windowWidth, windowHeight);
 	free(data);
-	
-	if (!ok)
+	if(ret < 0)
 	{
-		msg(MSG_FATAL, "Failed write screenshot to %s (note: STB can only write png, tga, and bmp files.)\n", outputImageFilename);
+		msg(MSG_FATAL, "Failed write screenshot to %s\n", outputImageFilename);
 		exit(EXIT_FAILURE);
 	}
-
 }
-#endif // end else part of ifdef KUHL_UTIL_USE_IMAGEMAGICK
 
-/** Takes a screenshot of the current OpenGL screen and writes it to an image file.
 
-    @param outputImageFilename The name of the image file that you want to record the screenshot in. The type of image file is determined by the filename extension. This function will allow you to write to any image format that ImageMagick supports. Suggestion: PNG files often work best for screenshots; try "output.png".
-*/
-void kuhl_screenshot(const char *outputImageFilename)
+static long kuhl_video_record_start = -1; /**< Time that recording started */
+static int kuhl_video_record_fps = 30;
+static video_writer *kuhl_video_record_writer = NULL;
+
+/** Receives frames from screencap and hands them to the video writer. */
+static void kuhl_video_record_add(unsigned char *data, int width, int height, long usec, void *arg)
 {
-#ifdef KUHL_UTIL_USE_IMAGEMAGICK
-	kuhl_screenshot_im(outputImageFilename);
-#else
-	kuhl_screenshot_stb(outputImageFilename);
-#endif
+	if(data == NULL)
+		return;
+	/* Use the time that the frame was captured to determine where it
+	 * belongs in the video. */
+	int64_t frame = (int64_t) (usec - kuhl_video_record_start) * kuhl_video_record_fps / 1000000;
+	video_writer_add_frame((video_writer*) arg, data, width, height, frame);
 }
 
+static void kuhl_video_record_close(void)
+{
+	video_writer_close(kuhl_video_record_writer);
+	kuhl_video_record_writer = NULL;
+}
 
-/** Records individual frames to image files that can later be
-  combined into a single video file. Call this function every frame
-  and it will capture the image data from the frame buffer and write
-  it to an image file if enough time has elapsed to record a
-  frame. Each image filename will include a frame number. This
-  function writes TIFF files to avoid unnecessary computation
-  compressing images. Instructions for converting the image files into
-  a video file using ffmpeg or avconv will be printed to standard
+/** Records the contents of the screen into a video file or into
+  individual image files. Call this function every frame and it will
+  capture the framebuffer whenever it is time to record another
+  frame. The pixels are read asynchronously with screencap and are
+  encoded by a background thread.
+
+  If fileLabel has an extension (for example, "label.mp4"), the frames
+  are encoded into a single video file. See video_writer_open() for a
+  list of supported filenames---".y4m" files and "|command" pipes work
+  even if the library wasn't compiled with ffmpeg. Frames are placed
+  in the video based on the time that they were captured, so the video
+  plays back at the correct speed even if the program can't render
+  fps frames per second.
+
+  Call screencap_flush() after the main loop ends so that the last
+  frames are written.
+
+  If fileLabel has no extension, a TIFF (or BMP) file is written for
+  each frame and instructions for converting the image files into a
+  video file using ffmpeg or avconv will be printed to standard
   out. This may run slowly if you are saving files to a non-local
   filesystem.
 
     @param fileLabel If fileLabel is set to "label", this function
-    will create files such as "label-00000000.tif"
+    will create files such as "label-00000000.tif". If it is set to
+    "label.mp4", it will create a single video file.
     
     @param fps The number of frames per second to record. Suggested value: 30.
  */
 void kuhl_video_record(const char *fileLabel, int fps)
 {
-#ifndef _WIN32
-	static int kuhl_video_record_frame = 0; // frame that we have recorded.
-	static time_t kuhl_video_record_prev_sec = 0; // time of previous frame (seconds)
-	static suseconds_t kuhl_video_record_prev_usec = 0; // time of previous frame usecs
+	static int kuhl_video_record_frame = 0; // number of image files written
+	static long kuhl_video_record_next = 0; // time to record next frame
 
 #ifdef KUHL_UTIL_USE_IMAGEMAGICK
 	char *exten = "tif";
@@ -2302,45 +2346,64 @@ void kuhl_video_record(const char *fileLabel, int fps)
 	char *exten = "bmp";
 #endif
 
-// Get current time
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+	long now = kuhl_microseconds();
 
-	if(kuhl_video_record_prev_sec == 0) // first time
+	if(kuhl_video_record_start < 0) // first time
 	{
-		kuhl_video_record_prev_sec  = tv.tv_sec;
-		kuhl_video_record_prev_usec = tv.tv_usec;
-		msg(MSG_INFO, "Recording %d frames per second. NOTE: If your screen is too large, then we may be unable to actually record images at the requested FPS rate.\n", fps);
-		msg(MSG_INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
-		msg(MSG_INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(MSG_INFO, " - or -\n");
-		msg(MSG_INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
-		msg(MSG_INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		if(fps < 1)
+			fps = 1;
+		kuhl_video_record_start = now;
+		kuhl_video_record_next = now;
+		kuhl_video_record_fps = fps;
+
+		const char *slash = strrchr(fileLabel, '/');
+		const char *dot = strrchr(fileLabel, '.');
+		if(fileLabel[0] == '|' || strcmp(fileLabel, "-") == 0 ||
+		   (dot != NULL && (slash == NULL || dot > slash)))
+		{
+			int width, height;
+			glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+			kuhl_video_record_writer = video_writer_open(fileLabel, width, height, fps);
+			if(kuhl_video_record_writer == NULL)
+			{
+				msg(MSG_FATAL, "Unable to record video to %s", fileLabel);
+				exit(EXIT_FAILURE);
+			}
+			/* Registered before screencap registers its exit
+			 * handler so that captures which are still being copied
+			 * are handed to the writer before it is closed. */
+			atexit(kuhl_video_record_close);
+			msg(MSG_INFO, "Recording %d frames per second to %s\n", fps, fileLabel);
+		}
+		else
+		{
+			msg(MSG_INFO, "Recording %d frames per second. NOTE: If your screen is too large, then the files may not be written to disk as fast as they are captured; see screencap.h. Use a filename such as %s.mp4 to write a video file directly.\n", fps, fileLabel);
+			msg(MSG_INFO, "Use either of the following commands to assemble Ogg video (Ogg video files are widely supported and not encumbered by patent restrictions):\n");
+			msg(MSG_INFO, "ffmpeg -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			msg(MSG_INFO, " - or -\n");
+			msg(MSG_INFO, "avconv -r %d -f image2 -i %s-%%08d.%s -qscale:v 7 %s.ogv\n", fps, fileLabel, exten, fileLabel);
+			msg(MSG_INFO, "In either program, the -qscale:v parameter sets the quality: 0 (lowest) to 10 (highest)\n");
+		}
 	}
 
-	time_t sec       = tv.tv_sec;
-	suseconds_t usec = tv.tv_usec;
+	if(now < kuhl_video_record_next)
+		return; // don't take screenshot
 
-	// useconds between recording frames
-	int usecs_over_seconds = 1000000;
-	int usec_to_wait = usecs_over_seconds / fps;
+	/* Schedule the next frame relative to the start time so that
+	 * errors don't accumulate. If we fell behind, skip ahead to the
+	 * next frame in the future. */
+	int64_t frame = (int64_t) (now - kuhl_video_record_start) * kuhl_video_record_fps / 1000000;
+	kuhl_video_record_next = kuhl_video_record_start + (long) ((frame+1) * 1000000 / kuhl_video_record_fps);
 
-	if(kuhl_video_record_prev_sec == sec &&
-	   usec - kuhl_video_record_prev_usec < usec_to_wait)
-		return; // don't take screenshot
-	else if(kuhl_video_record_prev_sec == sec-1 &&
-	        (usecs_over_seconds-kuhl_video_record_prev_usec)+usec<usec_to_wait)
-		return; // don't take screenshot
+	if(kuhl_video_record_writer != NULL)
+		screencap_request_func(kuhl_video_record_add, kuhl_video_record_writer);
 	else
 	{
-		kuhl_video_record_prev_sec  = sec;
-		kuhl_video_record_prev_usec = usec;
 		char filename[1024];
 		snprintf(filename, 1024, "%s-%08d.%s", fileLabel, kuhl_video_record_frame, exten);
-		kuhl_screenshot(filename); // TODO: Should we check if the screenshot writes?
+		screencap_request(filename);
 		kuhl_video_record_frame++;
 	}
-#endif // end ifndef _WIN32
 }
 
 #ifdef KUHL_UTIL_USE_ASSIMP
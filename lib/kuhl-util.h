@@ -209,6 +209,7 @@ kuhl_geometry* kuhl_label_geom(kuhl_geometry *geom, GLuint program, float *width
                                const char *message, float color[3], float bgcolor[4], float pointsize);
 float kuhl_read_texture_file_wrap(const char *filename, GLuint *texName, GLuint wrapS, GLuint wrapT);
 float kuhl_read_texture_file(const char *filename, GLuint *texName);
+int kuhl_write_image(const char *outputImageFilename, unsigned char *data, int width, int height);
 void kuhl_screenshot(const char *outputImageFilename);
 void kuhl_video_record(const char *fileLabel, int fps);
 
@@ -23,9 +23,13 @@
 #include "mousemove.h"
 #include "msg.h"
 #include "orient-sensor.h"
+#include "pose-predict.h"
 #include "queue.h"
+#include "screencap.h"
 #include "serial.h"
 #include "tdl-util.h"
+#include "tiledtex.h"
+#include "track-stats.h"
 #include "vecmat.h"
 #include "video.h"
 #include "viewmat.h"
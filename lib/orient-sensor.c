@@ -8,6 +8,19 @@
  * This file provides a way to interact with the YEI orientation
  * sensor that use used by the Sensics dSight HMD.
  *
+ * BNO055 records are read by a thread so that reading from the serial
+ * port never delays rendering. The thread reads bytes as they arrive,
+ * finds the records in them, and puts each record into a ring buffer
+ * with the time it was received. If the stream is corrupted, the
+ * thread skips bytes until it finds the start of a record again. The
+ * render thread only copies samples out of the ring buffer:
+ * orient_sensor_get() returns the latest orientation and
+ * orient_sensor_get_predicted() interpolates between samples (or
+ * extrapolates past the latest one) for a specific time. The ring
+ * buffer has one writer and the readers never remove samples, so it
+ * needs no lock: a reader copies a sample and then checks that the
+ * reader thread didn't overwrite it while it was being copied.
+ *
  * @author Evan Hauck
  * @author Scott Kuhl
  */
@@ -22,9 +35,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h> /* uint8_t */
-#include <time.h>
+#include <math.h>
+#include "vecmat.h"
+
+/* 1 sanity check float, 4 floats for quat, 4 more bytes for calibration data */
+#define RECORD_SIZE (4+4*4+4)
+
+/* Hex for the 123.456 float sent from the arduino at the start of each record */
+#define RECORD_MAGIC 0x42f6e979
+
+/* Baud rate of the sensor and the time it takes to receive one byte
+ * (8 data bits, a start bit and a stop bit). */
+#define ORIENT_SENSOR_BAUD 115200
+#define ORIENT_SENSOR_BYTE_USEC (10*1000000.0/ORIENT_SENSOR_BAUD)
+
+/* If no records arrive for this long, reconnect to the sensor. */
+#define ORIENT_SENSOR_TIMEOUT_USEC 2000000
+
+/* Never extrapolate more than this far past the latest sample. */
+#define ORIENT_SENSOR_MAX_PREDICT_USEC 50000
 
-/** Opens a connection to the orientation sensor.
+/* Samples used to estimate the angular velocity must be at least this
+ * far apart. Records that arrive together have nearly the same
+ * receive time, so the angular velocity between them is mostly
+ * noise. */
+#define ORIENT_SENSOR_MIN_INTERVAL_USEC 5000
+
+static void orient_sensor_start(OrientSensorReader *r);
+
+/** Opens a connection to the orientation sensor. For a BNO055 sensor,
+    this also starts the thread that reads records from it.
 
     @param deviceFile The serial device to communicate with. For example, /dev/ttyACM0
 */
@@ -71,190 +111,362 @@ OrientSensorState orient_sensor_init(const char* deviceFileIn, int sensorType)
 	OrientSensorState state;
 	strncpy(state.deviceFile, deviceFile, 32);
 	state.deviceFile[31]='\0';
-	state.isWorking = 0;
 	state.type = sensorType;
-	state.lastDataTime = 0;
-	for(int i=0; i<4; i++)
-		state.lastData[i] = 0.0;
+	state.fd = -1;
+	state.reader = NULL;
+	/* Until the first record arrives, report no rotation. */
+	vec4f_set(state.lastData, 0, 0, 0, 1);
 
 	/* Create connection, apply proper tty settings */
-	if(sensorType == ORIENT_SENSOR_BNO055)
+	int fd = serial_open(deviceFile, ORIENT_SENSOR_BAUD, 0, 1, 5);
+	if(sensorType != ORIENT_SENSOR_BNO055)
 	{
-		state.fd = serial_open(deviceFile, 115200, 0, 1, 5);
-		// we will find the magic byte at the start of a record in our get() function.
+		state.fd = fd;
+		return state;
 	}
-	else
-		state.fd = serial_open(deviceFile, 115200, 0, 1, 5);
-	
+
+	OrientSensorReader *r = (OrientSensorReader*) calloc(1, sizeof(OrientSensorReader));
+	r->fd = fd;
+	strncpy(r->deviceFile, state.deviceFile, 32);
+	orient_sensor_start(r);
+	state.reader = r;
 	return state;
 }
 
 
-
 static void orient_sensor_get_dsight(OrientSensorState *state, float quaternion[4])
 {
 
 }
 
-static void orient_sensor_get_bno055(OrientSensorState *state, float quaternion[4])
+/** Prints messages about how well the sensor is calibrated. */
+static void orient_sensor_calibration(const unsigned char calibration[4])
+{
+	uint8_t sys, gyro, accel, mag;
+	sys    = calibration[0];
+	gyro   = calibration[1];
+	accel  = calibration[2];
+	mag    = calibration[3];
+
+	if(sys == 0)
+		msg(MSG_ERROR, "Sensor is uncalibrated.");
+	else if (sys == 1)
+		msg(MSG_WARNING, "Sensor calibration is poor.");
+
+	if(gyro == 0)
+		msg(MSG_WARNING, "Gyro is uncalibrated. Let sensor sit still.");
+	else if(gyro == 1)
+		msg(MSG_WARNING, "Gyro calibration is poor. Let sensor sit still.");
+
+	if(accel == 0)
+		msg(MSG_WARNING, "Accelerometer is uncalibrated. Place sensor on 6 sides of block.");
+	else if(accel == 1)
+		msg(MSG_WARNING, "Accelerometer calibration is poor. Place sensor on 6 sides of block.");
+
+	if(mag == 0)
+		msg(MSG_WARNING, "Magnetometer is uncalibrated. Use figure 8 motion.");
+	else if(mag == 1)
+		msg(MSG_WARNING, "Magnetometer calibration is poor. Use figure 8 motion.");
+
+	if(sys < 2 || gyro < 2 || accel < 2 || mag < 2)
+		msg(MSG_BLUE, "Raw orientation sensor calib data: sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
+}
+
+/** Checks that bytes look like a BNO055 record: the magic bytes, a
+ * unit quaternion and calibration values from 0 to 3. Checking more
+ * than the magic bytes keeps us from accepting a record that starts
+ * at the wrong place when a quaternion happens to contain the magic
+ * bytes. */
+static int orient_sensor_valid(const char *record)
+{
+	int32_t v = RECORD_MAGIC;
+	if(memcmp(record, &v, 4) != 0)
+		return 0;
+
+	float quat[4];
+	memcpy(quat, record+4, sizeof(float)*4);
+	float len = vec4f_norm(quat);
+	if(!(len > 0.9f && len < 1.1f)) // also false for NaN
+		return 0;
+
+	for(int i=0; i<4; i++)
+		if((uint8_t) record[4*5+i] > 3)
+			return 0;
+	return 1;
+}
+
+/** Finds the records in buf and puts them in the ring buffer.
+
+    @param r The reader.
+    @param buf The bytes that have been read but not parsed yet.
+    @param len The number of bytes in buf.
+    @param usec The time the last byte in buf was received.
+
+    @return The number of bytes at the start of buf that were used.
+*/
+static int orient_sensor_parse(OrientSensorReader *r, const char *buf, int len, long usec)
 {
-// 1 sanity check float, 4 floats for quat, 4 more bytes for calibration data
-#define RECORD_SIZE 4+4*4+4
 	static int calibrationMessage = 100;
 
-	int options = SERIAL_NONE;
-	if(state->isWorking == 0)
-	{
-		/* isWorking will be set to 0 in our init function. If a long
-		 * time passed between init() and now, our input buffer may
-		 * have overflowed. Here, we discard data in the input buffer
-		 * and set the options so we will block when reading from the
-		 * input buffer. */
-		serial_discard(state->fd);
-		options = SERIAL_CONSUME;
-	}
-	else
+	int i = 0;
+	while(len - i >= RECORD_SIZE)
 	{
-		/* If connection is working: Consume any extra records in
-		 * input buffer. If there are not enough data in input buffer,
-		 * use cached data. */
-		options = SERIAL_CONSUME|SERIAL_NONBLOCK;
-	}
-		
+		if(!orient_sensor_valid(buf+i))
+		{
+			/* The bytes didn't look like the start of a record. This
+			 * can happen if a byte was lost or if there was a problem
+			 * with the sensor. Skip a byte and look again. */
+			if(r->isWorking)
+			{
+				uint32_t received;
+				memcpy(&received, buf+i, 4);
+				msg(MSG_WARNING, "Synchronizing to orientation sensor stream...");
+				msg(MSG_DEBUG,   "Synchronizing because we expected 0x%08x but  received 0x%08x", RECORD_MAGIC, received);
+				r->isWorking = 0;
+				__atomic_add_fetch(&r->resyncs, 1, __ATOMIC_RELAXED);
+			}
+			__atomic_add_fetch(&r->skipped, 1, __ATOMIC_RELAXED);
+			i++;
+			continue;
+		}
 
-	/* Try to read a record, hope that we started reading at the
-	 * beginning of a record */
-	char temp[RECORD_SIZE];
-	temp[0] = '\0'; // make sure temp doesn't happen to contain magic byte.
-	if(serial_read(state->fd, temp, RECORD_SIZE, options) == 0)
-	{
-		// If SERIAL_NONBLOCK was used *and* if there wasn't enough
-		// bytes to read a full record, use cached data. Note:
-		// serial_read() can never return 0 except when the
-		// SERIAL_NONBLOCK setting is used.
-
-		/* Check how old the cached data is. If it is old, we have
-		 * been using the same cached data for too long. */
-		if(time(NULL) - state->lastDataTime >= 2)
+		if(r->isWorking == 0)
 		{
-			msg(MSG_WARNING, "We haven't received a new record from the orientation sensor in the past couple seconds. Is sensor still connected? Trying to reconnect.");
+			msg(MSG_INFO, "Successfully synchronized to orientation sensor.\n");
+			r->isWorking = 1;
 		}
-		else
+
+		/* Records that arrived together all have the same read()
+		 * time. Estimate when each one was received from the number
+		 * of bytes that came after it. */
+		unsigned int head = r->head;
+		OrientSensorSample *s = &r->ring[head % ORIENT_SENSOR_RING_SIZE];
+		s->usec = usec - (long) ((len - i - RECORD_SIZE) * ORIENT_SENSOR_BYTE_USEC);
+		memcpy(s->quat, buf+i+4, sizeof(float)*4);
+		memcpy(s->calibration, buf+i+4*5, 4);
+		__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+
+		calibrationMessage--;
+		if(calibrationMessage < 0)
 		{
-			for(int i=0; i<4; i++)
-				quaternion[i] = state->lastData[i];
-			// msg(MSG_INFO, "Using cached data for orientation sensor.\n");
-			return;
+			calibrationMessage = 1000;
+			orient_sensor_calibration(s->calibration);
 		}
+		i += RECORD_SIZE;
 	}
+	return i;
+}
 
+#ifndef _WIN32
+static void orient_sensor_reconnect(OrientSensorReader *r)
+{
+	serial_close(r->fd);
+	r->isWorking = 0;
+	__atomic_add_fetch(&r->reconnects, 1, __ATOMIC_RELAXED);
+	r->fd = serial_open(r->deviceFile, ORIENT_SENSOR_BAUD, 0, 1, 5);
+}
 
-	/* Look for magic bytes at beginning of record */
-	int32_t v = 0x42f6e979; // hex for the 123.456 float sent from arduino	
-	while(memcmp(temp, &v, 4) != 0)
+static void* orient_sensor_thread(void *arg)
+{
+	OrientSensorReader *r = (OrientSensorReader*) arg;
+	char buf[4096];
+	int len = 0;
+	long lastRecord = kuhl_microseconds();
+
+	while(!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
 	{
-		/* While we are here, the first bytes of the record didn't
-		 * match the magic bytes we were expecting. This can happen if
-		 * the sender overwhelmed our buffer or if there was a problem
-		 * with the sensor. */
-		if(state->isWorking) // if the sensor was previously working, print message
-		{
-			uint32_t received;
-			memcpy(&received, temp, 4);
-			msg(MSG_WARNING, "Synchronizing to orientation sensor stream (may block if we can't read from sensor)...");
-			msg(MSG_DEBUG,   "Synchronizing because we expected 0x%08x but  received 0x%08x", v, received);
-		}
-		state->isWorking = 0;
-		serial_discard(state->fd); // clear input buffer in case it
-								   // got filled up. Therefore, the
-								   // find and read calls below WILL
-								   // BLOCK until we get new data.
-
-		/* Try to find the magic bytes somewhere in the stream of data. */
-		if(serial_find(state->fd, (char*) &v, 4, 1000) == 1)
+		/* Wait a short time so that we notice when we should stop. */
+		int n = serial_read_some(r->fd, buf+len, sizeof(buf)-len, 100);
+		long now = kuhl_microseconds();
+		if(n < 0)
 		{
-			/* If we found the magic bytes, copy them into our buffer
-			 * and read the rest of the record. */
-			if(serial_read(state->fd, temp+4, RECORD_SIZE-4, SERIAL_NONE) == RECORD_SIZE-4)
-				memcpy(temp, &v, 4);
+			if(__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+				break;
+			msg(MSG_ERROR, "Failed to read from orientation sensor. Trying to reconnect.");
+			orient_sensor_reconnect(r);
+			len = 0;
+			lastRecord = kuhl_microseconds();
+			continue;
 		}
-		else
+		len += n;
+
+		unsigned int before = r->head;
+		int used = orient_sensor_parse(r, buf, len, now);
+		memmove(buf, buf+used, len-used);
+		len -= used;
+
+		if(r->head != before)
+			lastRecord = now;
+		else if(now - lastRecord >= ORIENT_SENSOR_TIMEOUT_USEC)
 		{
-			/* If we didn't find the bytes, something more serious may
-			 * have went wrong. */
-			msg(MSG_ERROR, "Failed to resynchronize to orientation sensor. Trying to reconnect.");
-			serial_close(state->fd);
-			*state = orient_sensor_init(state->deviceFile, state->type);
-			serial_read(state->fd, temp, RECORD_SIZE, SERIAL_CONSUME);
+			msg(MSG_WARNING, "We haven't received a new record from the orientation sensor in the past couple seconds. Is sensor still connected? Trying to reconnect.");
+			orient_sensor_reconnect(r);
+			len = 0;
+			lastRecord = kuhl_microseconds();
 		}
+	}
+	return NULL;
+}
+#endif
 
-	} // end while magic byte is wrong.
-
-	// If we get here, we successfully synchronized...
-	if(state->isWorking == 0)
+static void orient_sensor_start(OrientSensorReader *r)
+{
+#ifndef _WIN32
+	if(pthread_create(&r->thread, NULL, orient_sensor_thread, r) != 0)
 	{
-		msg(MSG_INFO, "Successfully synchronized to orientation sensor.\n");
-		state->isWorking = 1;
+		msg(MSG_FATAL, "Failed to start orientation sensor thread.");
+		exit(EXIT_FAILURE);
 	}
-	state->lastDataTime = time(NULL);
-	// msg(MSG_GREEN, "Record OK");
+#else
+	msg(MSG_ERROR, "Orientation sensors are not supported on Windows.");
+#endif
+}
 
-	uint8_t sys, gyro, accel, mag;
-	sys    = temp[4*5+0];
-	gyro   = temp[4*5+1];
-	accel  = temp[4*5+2];
-	mag    = temp[4*5+3];
-	calibrationMessage--;
-	if(calibrationMessage < 0)
-	{
-		calibrationMessage = 1000;
-		
-		if(sys == 0)
-			msg(MSG_ERROR, "Sensor is uncalibrated.");
-		else if (sys == 1)
-			msg(MSG_WARNING, "Sensor calibration is poor.");
-
-		if(gyro == 0)
-			msg(MSG_WARNING, "Gyro is uncalibrated. Let sensor sit still.");
-		else if(gyro == 1)
-			msg(MSG_WARNING, "Gyro calibration is poor. Let sensor sit still.");
-
-		if(accel == 0)
-			msg(MSG_WARNING, "Accelerometer is uncalibrated. Place sensor on 6 sides of block.");
-		else if(accel == 1)
-			msg(MSG_WARNING, "Accelerometer calibration is poor. Place sensor on 6 sides of block.");
-		
-		if(mag == 0)
-			msg(MSG_WARNING, "Magnetometer is uncalibrated. Use figure 8 motion.");
-		else if(mag == 1)
-			msg(MSG_WARNING, "Magnetometer calibration is poor. Use figure 8 motion.");
+/** Copies a sample out of the ring buffer.
 
-		if(sys < 2 || gyro < 2 || accel < 2 || mag < 2)
-			msg(MSG_BLUE, "Raw orientation sensor calib data: sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
-	}
-	// msg(MSG_INFO, "sys=%d gyro=%d accel=%d mag=%d", sys, gyro, accel, mag);
+    @return 1 if the sample was copied, 0 if the reader thread has
+    already overwritten it (or is overwriting it).
+*/
+static int orient_sensor_copy(const OrientSensorReader *r, unsigned int index, OrientSensorSample *sample)
+{
+	*sample = r->ring[index % ORIENT_SENSOR_RING_SIZE];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	return head - index < ORIENT_SENSOR_RING_SIZE;
+}
+
+/** Gets the latest sample received from the sensor. This does not
+    read from the sensor and never blocks.
+
+    @param state A OrientSensorState struct created by orient_sensor_init()
+    @param sample Set to the latest sample.
 
-	/* Copy data from our buffer into quaternion buffer and into the lastData buffer */
-	memcpy(quaternion, temp+4, sizeof(float)*4);
-	memcpy(state->lastData, quaternion, sizeof(float)*4);
+    @return 1 if there was a sample, 0 if no records have been received yet.
+*/
+int orient_sensor_sample(OrientSensorState *state, OrientSensorSample *sample)
+{
+	if(state->reader == NULL)
+		return 0;
+	while(1)
+	{
+		unsigned int head = __atomic_load_n(&state->reader->head, __ATOMIC_ACQUIRE);
+		if(head == 0)
+			return 0;
+		if(orient_sensor_copy(state->reader, head-1, sample))
+			return 1;
+	}
 }
 
+/** Estimates the orientation of the sensor at a specific time. If
+    the time is between two samples, the orientation is interpolated.
+    If it is after the latest sample, the angular velocity between
+    the latest samples is integrated forward from the latest sample (up
+    to ORIENT_SENSOR_MAX_PREDICT_USEC). This does not read from the
+    sensor and never blocks.
+
+    @param state A OrientSensorState struct created by orient_sensor_init()
+    @param usec The time (see kuhl_microseconds()). Often, this is
+    the time the next frame will be displayed (see
+    bufferswap_display_time()).
+    @param quaternion The estimated orientation.
+
+    @return 1 if the orientation came from the sensor, 0 if no records
+    have been received yet (quaternion is set to the last orientation
+    we returned).
+*/
+int orient_sensor_get_predicted(OrientSensorState *state, long usec, float quaternion[4])
+{
+	OrientSensorReader *r = state->reader;
+	OrientSensorSample newer, older;
+	unsigned int head;
+	if(r == NULL || (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == 0 ||
+	   !orient_sensor_copy(r, head-1, &newer))
+	{
+		vec4f_copy(quaternion, state->lastData);
+		return 0;
+	}
 
+	/* Find the samples to interpolate or extrapolate between. If we
+	 * run out of samples, use the oldest one we have. */
+	int haveOlder = 0;
+	for(unsigned int i=2; i<=head && i<ORIENT_SENSOR_RING_SIZE; i++)
+	{
+		OrientSensorSample s;
+		if(!orient_sensor_copy(r, head-i, &s))
+			break;
+		if(usec < newer.usec && s.usec > usec)
+		{
+			/* Both samples are after usec; keep looking back. */
+			newer = s;
+			continue;
+		}
+		older = s;
+		haveOlder = 1;
+		/* Stop when the samples are on both sides of usec or when they
+		 * are far enough apart to extrapolate from. */
+		if(usec < newer.usec || newer.usec - s.usec >= ORIENT_SENSOR_MIN_INTERVAL_USEC)
+			break;
+	}
 
+	long interval = haveOlder ? newer.usec - older.usec : 0;
+	if(interval <= 0)
+		vec4f_copy(quaternion, newer.quat);
+	else
+	{
+		long ahead = usec - older.usec;
+		if(usec - newer.usec > ORIENT_SENSOR_MAX_PREDICT_USEC)
+			ahead = newer.usec + ORIENT_SENSOR_MAX_PREDICT_USEC - older.usec;
+		if(ahead < 0)
+			ahead = 0;
+		quatf_slerp_new(quaternion, older.quat, newer.quat, ahead / (float) interval);
+		quatf_normalize(quaternion);
+	}
+	vec4f_copy(state->lastData, quaternion);
+	return 1;
+}
 
-/** Retrieve the latest orientation from the sensor.
+/** Retrieve the latest orientation from the sensor. This does not
+    read from the sensor and never blocks; the reader thread started
+    by orient_sensor_init() does the reading.
 
     @param state A OrientSensorState struct created by orient_sensor_init()
     @param quaternion The quaternion retrieved from the sensor.
 */
 void orient_sensor_get(OrientSensorState *state, float quaternion[4])
 {
+	OrientSensorSample sample;
 	switch(state->type)
 	{
 		case ORIENT_SENSOR_BNO055:
-			orient_sensor_get_bno055(state, quaternion);
+			if(orient_sensor_sample(state, &sample))
+				vec4f_copy(state->lastData, sample.quat);
+			vec4f_copy(quaternion, state->lastData);
 			break;
 		case ORIENT_SENSOR_DSIGHT:
 			orient_sensor_get_dsight(state, quaternion);
 	}
 }
+
+/** Stops the reader thread (if there is one) and closes the connection
+    to the sensor.
+
+    @param state A OrientSensorState struct created by orient_sensor_init()
+*/
+void orient_sensor_close(OrientSensorState *state)
+{
+	if(state->fd >= 0)
+	{
+		serial_close(state->fd);
+		state->fd = -1;
+	}
+	OrientSensorReader *r = state->reader;
+	if(r == NULL)
+		return;
+#ifndef _WIN32
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(r->thread, NULL);
+#endif
+	serial_close(r->fd);
+	free(r);
+	state->reader = NULL;
+}
@@ -8,6 +8,10 @@
 */
 
 #pragma once
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,21 +24,56 @@ enum
 	ORIENT_SENSOR_DSIGHT    = 2
 };
 
+/** Number of samples the reader thread keeps (a power of two). */
+#define ORIENT_SENSOR_RING_SIZE 256
+
+/** One record received from the sensor. */
+typedef struct
+{
+	long usec;          /**< When the record was received (kuhl_microseconds()) */
+	float quat[4];      /**< Orientation */
+	unsigned char calibration[4]; /**< Calibration of the system, gyro, accelerometer and magnetometer (0=uncalibrated to 3=calibrated) */
+} OrientSensorSample;
+
+/** A thread that reads records from the sensor and puts them in a
+ * ring buffer (see orient-sensor.c). Only the reader thread writes to
+ * this struct after orient_sensor_init() returns. */
 typedef struct
 {
 	int fd;
+	char deviceFile[32]; /**< Name of the serial device (/dev/ttyUSB0) */
+	int isWorking;       /**< Set to 1 while we are synchronized to the stream of records */
+
+	OrientSensorSample ring[ORIENT_SENSOR_RING_SIZE];
+	unsigned int head;   /**< Number of samples ever put in ring */
+
+	long resyncs;        /**< Number of times we lost track of where records start */
+	long skipped;        /**< Bytes discarded while resynchronizing */
+	long reconnects;     /**< Number of times the serial device was reopened */
+
+	int stop;            /**< Set to 1 to make the thread exit */
+#ifndef _WIN32
+	pthread_t thread;
+#endif
+} OrientSensorReader;
+
+typedef struct
+{
 	char deviceFile[32]; /**< Name of the serial device (/dev/ttyUSB0) */
 	float lastData[4]; /**< The last piece of data we received. Useful if we want to use cached data when there isn't new data to read. */
-	int lastDataTime; /**< What time did we receive the data in lastData? */
-	int isWorking; /**< Set to 1 when we have successfully received data */
 	int type;
+	int fd; /**< Serial device for sensors without a reader thread; -1 if the reader owns it */
+	OrientSensorReader *reader; /**< NULL if the sensor type doesn't use a reader thread */
 } OrientSensorState;
 
-	
+
 OrientSensorState orient_sensor_init(const char* deviceFile, int sensorType);
 void orient_sensor_get(OrientSensorState *state, float quaternion[4]);
+int orient_sensor_get_predicted(OrientSensorState *state, long usec, float quaternion[4]);
+int orient_sensor_sample(OrientSensorState *state, OrientSensorSample *sample);
+void orient_sensor_close(OrientSensorState *state);
+
 
-	
 #ifdef __cplusplus
 } // end extern "C"
 #endif
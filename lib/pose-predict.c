@@ -0,0 +1,133 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+#include "windows-compat.h"
+#include <string.h>
+#include <math.h>
+
+#include "pose-predict.h"
+#include "vecmat.h"
+
+/** Initializes a pose_predictor.
+
+    @param p The predictor to initialize.
+
+    @param posSigma Standard deviation of the position measurements
+    (see kalman_initialize()).
+
+    @param posQScale Confidence in the model of the position Kalman
+    filter (see kalman_initialize()).
+
+    @param orientSigma Standard deviation of the orientation
+    measurements (radians).
+
+    @param orientQScale Confidence in the model of the orientation
+    Kalman filter.
+*/
+void pose_predictor_init(pose_predictor *p, float posSigma, float posQScale,
+                         float orientSigma, float orientQScale)
+{
+	memset(p, 0, sizeof(pose_predictor));
+	kalman_multi_initialize(&(p->position), 3, posSigma, posQScale);
+	kalman_quat_initialize(&(p->orientation), orientSigma, orientQScale);
+}
+
+/** Adds a sample from the tracking system to a predictor.
+
+    @param p The predictor.
+
+    @param pos The measured position.
+
+    @param quat The measured orientation (x,y,z,w).
+
+    @param usec The time the sample was measured (microseconds). Must
+    be later than the time of the previous sample.
+*/
+void pose_predictor_add(pose_predictor *p, const float pos[3], const float quat[4], long usec)
+{
+	double posd[3] = { pos[0], pos[1], pos[2] };
+	double quatd[4] = { quat[0], quat[1], quat[2], quat[3] };
+	kalman_multi_estimate(&(p->position), posd, usec);
+	kalman_quat_estimate(&(p->orientation), quatd, usec);
+	p->time = usec;
+	p->count++;
+}
+
+/** Gets the filtered position, velocity and acceleration of the
+ * latest sample added to a predictor. */
+void pose_predictor_state(const pose_predictor *p, float pos[3], float vel[3], float acc[3])
+{
+	for(int i=0; i<3; i++)
+	{
+		pos[i] = p->position.x[0][i];
+		vel[i] = p->position.x[1][i];
+		acc[i] = p->position.x[2][i];
+	}
+}
+
+/** Gets the filtered orientation (x,y,z,w) and angular velocity
+ * (radians/second, world coordinates) of the latest sample added to a
+ * predictor. */
+void pose_predictor_orientation(const pose_predictor *p, float quat[4], float angvel[3])
+{
+	for(int i=0; i<4; i++)
+		quat[i] = p->orientation.quat[i];
+	for(int i=0; i<3; i++)
+		angvel[i] = p->orientation.axes.x[1][i];
+}
+
+/** Predicts the pose of a tracked object.
+
+    @param p The predictor.
+
+    @param usec The time to predict the pose for (microseconds, using
+    the same clock as the samples).
+
+    @param pos Set to the predicted position.
+
+    @param quat Set to the predicted orientation (x,y,z,w).
+*/
+void pose_predictor_get(const pose_predictor *p, long usec, float pos[3], float quat[4])
+{
+	float vel[3], acc[3], angvel[3];
+	pose_predictor_state(p, pos, vel, acc);
+	pose_predictor_orientation(p, quat, angvel);
+	if(p->count > 0)
+		pose_extrapolate(pos, quat, vel, acc, angvel, (usec - p->time) / 1000000.0f);
+}
+
+/** Moves a pose forward in time.
+
+    @param pos The position to extrapolate (modified).
+
+    @param quat The orientation (x,y,z,w) to extrapolate (modified).
+
+    @param vel Velocity (units/second).
+
+    @param acc Acceleration (units/second^2).
+
+    @param angvel Angular velocity (radians/second, world coordinates).
+
+    @param dt Number of seconds to move forward.
+*/
+void pose_extrapolate(float pos[3], float quat[4], const float vel[3], const float acc[3],
+                      const float angvel[3], float dt)
+{
+	for(int i=0; i<3; i++)
+		pos[i] += vel[i]*dt + .5f*acc[i]*dt*dt;
+
+	/* Rotate by |angvel|*dt radians around angvel. */
+	float speed = vec3f_norm(angvel);
+	float halfAngle = .5f * speed * dt;
+	if(speed < 1e-8f)
+		return;
+	float s = sinf(halfAngle) / speed;
+	float dq[4] = { angvel[0]*s, angvel[1]*s, angvel[2]*s, cosf(halfAngle) };
+	quatf_mult_quatf_new(quat, dq, quat);
+	quatf_normalize(quat);
+}
@@ -0,0 +1,49 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    pose-predict predicts where a tracked object will be a short time
+    in the future so that graphics can be rendered for the pose the
+    object will have when the frame appears on the screen instead of
+    the pose it had when the tracking system last measured it.
+
+    Position is filtered with a Kalman filter (see
+    kalman_multi_estimate()) which also estimates velocity and
+    acceleration, and the position is extrapolated with them.
+    Orientation is filtered with a Kalman filter on quaternions (see
+    kalman_quat_estimate()) which estimates the angular velocity, and
+    the orientation is extrapolated by rotating it with the angular
+    velocity.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include "kalman.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	kalman_multi_state position;   /**< Position, velocity and acceleration on the x, y and z axes */
+	kalman_quat_state orientation; /**< Orientation and angular velocity */
+	long time;        /**< Time of the latest sample (microseconds) */
+	int count;        /**< Number of samples added */
+} pose_predictor;
+
+void pose_predictor_init(pose_predictor *p, float posSigma, float posQScale,
+                         float orientSigma, float orientQScale);
+void pose_predictor_add(pose_predictor *p, const float pos[3], const float quat[4], long usec);
+void pose_predictor_state(const pose_predictor *p, float pos[3], float vel[3], float acc[3]);
+void pose_predictor_orientation(const pose_predictor *p, float quat[4], float angvel[3]);
+void pose_predictor_get(const pose_predictor *p, long usec, float pos[3], float quat[4]);
+void pose_extrapolate(float pos[3], float quat[4], const float vel[3], const float acc[3],
+                      const float angvel[3], float dt);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
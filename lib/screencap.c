@@ -0,0 +1,503 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+    Asynchronous screen capture. See screencap.h for an overview.
+
+    @author Scott Kuhl
+ */
+
+#include "windows-compat.h"
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "kuhl-util.h"
+#include "screencap.h"
+
+/** Number of PBOs that pixels are read into. With 3 PBOs, the
+ * pixels from a frame are typically mapped two frames later. */
+#define SCREENCAP_NUM_PBO 3
+/** Maximum number of encoder threads */
+#define SCREENCAP_MAX_THREADS 8
+
+/** States of a screencap_slot. A slot moves through them in order. */
+enum {
+	SCREENCAP_FREE,    /**< Not in use */
+	SCREENCAP_PENDING, /**< Waiting for the fence */
+	SCREENCAP_MAPPED,  /**< Mapped, waiting for an encoder thread to copy the pixels */
+	SCREENCAP_COPYING, /**< An encoder thread is copying the pixels */
+	SCREENCAP_DONE     /**< Copied; waiting to be unmapped and passed to func */
+};
+
+/** A PBO that pixels are being copied into. */
+typedef struct {
+	GLuint pbo;
+	GLsizeiptr size;     /**< Size of the PBO in bytes */
+	GLsync fence;        /**< Signaled when copy into PBO is finished */
+	int state;           /**< SCREENCAP_FREE, etc. Protected by screencap_mutex. */
+	void *mapped;        /**< The mapped PBO or NULL if it isn't mapped */
+	unsigned char *data; /**< Pixels copied out of the PBO */
+	long seq;            /**< Order that the request was made in */
+	long usec;           /**< Time that the request was made */
+	screencap_func func; /**< Receives the pixels */
+	void *arg;           /**< Passed to func */
+	int width, height;
+} screencap_slot;
+
+/** A frame that is waiting to be written to disk. */
+typedef struct {
+	char *filename;
+	unsigned char *data; /**< RGB pixels, bottom row first */
+	int width, height;
+} screencap_job;
+
+static screencap_slot screencap_slots[SCREENCAP_NUM_PBO];
+static long screencap_seq = 0;
+static int screencap_initialized = 0;
+static int screencap_use_pbo = 0;
+
+/* Bounded queue of frames waiting to be written. Protected by screencap_mutex. */
+static screencap_job *screencap_queue = NULL;
+static int screencap_queue_cap = 0;
+static int screencap_queue_len = 0;
+static int screencap_queue_read = 0;
+static int screencap_active = 0; /**< Jobs being written right now */
+#ifndef _WIN32
+static pthread_mutex_t screencap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t screencap_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t screencap_not_full  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t screencap_copied    = PTHREAD_COND_INITIALIZER;
+static pthread_t screencap_threads[SCREENCAP_MAX_THREADS];
+static int screencap_num_threads = 0;
+#endif
+
+static void screencap_lock(void)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&screencap_mutex);
+#endif
+}
+
+static void screencap_unlock(void)
+{
+#ifndef _WIN32
+	pthread_mutex_unlock(&screencap_mutex);
+#endif
+}
+
+/** Returns the oldest slot in the given state (or the oldest slot
+ * that is in use if state is SCREENCAP_FREE). Returns NULL if there
+ * is no such slot. Called with screencap_mutex held. */
+static screencap_slot* screencap_oldest(int state)
+{
+	screencap_slot *oldest = NULL;
+	for(int i=0; i<SCREENCAP_NUM_PBO; i++)
+	{
+		screencap_slot *s = &(screencap_slots[i]);
+		if(s->state == SCREENCAP_FREE ||
+		   (state != SCREENCAP_FREE && s->state != state))
+			continue;
+		if(oldest == NULL || s->seq < oldest->seq)
+			oldest = s;
+	}
+	return oldest;
+}
+
+/** Copies the pixels out of a mapped PBO. The copy is made by an
+ * encoder thread so that the thread that is rendering doesn't need
+ * to. */
+static void screencap_copy(screencap_slot *slot)
+{
+	unsigned char *data = kuhl_malloc(slot->size);
+	memcpy(data, slot->mapped, slot->size);
+	slot->data = data;
+}
+
+/** Writes one captured frame and frees it. */
+static void screencap_write(screencap_job *job)
+{
+	if(kuhl_write_image(job->filename, job->data, job->width, job->height) < 0)
+		msg(MSG_ERROR, "Failed to write screen capture to %s", job->filename);
+	free(job->filename);
+	free(job->data);
+}
+
+#ifndef _WIN32
+/** Encoder thread: Copies pixels out of mapped PBOs and writes frames
+ * in the queue to disk. Copies are done first so that PBOs are
+ * returned to the rendering thread quickly. */
+static void* screencap_encoder(void *arg)
+{
+	pthread_mutex_lock(&screencap_mutex);
+	while(1)
+	{
+		screencap_slot *slot;
+		while((slot = screencap_oldest(SCREENCAP_MAPPED)) == NULL &&
+		      screencap_queue_len == 0)
+			pthread_cond_wait(&screencap_not_empty, &screencap_mutex);
+
+		if(slot != NULL)
+		{
+			slot->state = SCREENCAP_COPYING;
+			pthread_mutex_unlock(&screencap_mutex);
+			screencap_copy(slot);
+			pthread_mutex_lock(&screencap_mutex);
+			slot->state = SCREENCAP_DONE;
+			pthread_cond_broadcast(&screencap_copied);
+			continue;
+		}
+
+		screencap_job job = screencap_queue[screencap_queue_read];
+		screencap_queue_read = (screencap_queue_read+1) % screencap_queue_cap;
+		screencap_queue_len--;
+		screencap_active++;
+		pthread_cond_broadcast(&screencap_not_full);
+		pthread_mutex_unlock(&screencap_mutex);
+
+		screencap_write(&job);
+
+		pthread_mutex_lock(&screencap_mutex);
+		screencap_active--;
+		pthread_cond_broadcast(&screencap_not_full);
+	}
+	return NULL;
+}
+#endif
+
+/** Hands a captured frame to the encoder thread(s). Waits if the
+ * queue is full. */
+static void screencap_submit(screencap_job *job)
+{
+#ifdef _WIN32
+	screencap_write(job);
+#else
+	pthread_mutex_lock(&screencap_mutex);
+	if(screencap_queue_len == screencap_queue_cap)
+	{
+		static int warned = 0;
+		if(!warned)
+			msg(MSG_WARNING, "Screen capture queue is full; rendering will wait for frames to be written to disk. Consider increasing screencap.threads or writing to a faster disk.");
+		warned = 1;
+		while(screencap_queue_len == screencap_queue_cap)
+			pthread_cond_wait(&screencap_not_full, &screencap_mutex);
+	}
+	int write = (screencap_queue_read + screencap_queue_len) % screencap_queue_cap;
+	screencap_queue[write] = *job;
+	screencap_queue_len++;
+	pthread_cond_signal(&screencap_not_empty);
+	pthread_mutex_unlock(&screencap_mutex);
+#endif
+}
+
+/** A screencap_func which hands the pixels to the encoder thread(s)
+ * to be written to an image file. */
+static void screencap_to_file(unsigned char *data, int width, int height, long usec, void *arg)
+{
+	if(data == NULL)
+	{
+		msg(MSG_ERROR, "Screen capture: Unable to write %s", (char*) arg);
+		free(arg);
+		return;
+	}
+	screencap_job job;
+	job.filename = (char*) arg;
+	job.data = data;
+	job.width = width;
+	job.height = height;
+	screencap_submit(&job);
+}
+
+static void screencap_exit(void);
+
+static void screencap_init(void)
+{
+	if(screencap_initialized)
+		return;
+	screencap_initialized = 1;
+
+	/* Fences require OpenGL 3.2 or the ARB_sync extension. */
+	screencap_use_pbo = GLEW_VERSION_3_2 || glewIsSupported("GL_ARB_sync");
+	if(!screencap_use_pbo)
+		msg(MSG_WARNING, "Screen capture: Sync objects are not supported; reading pixels without pixel buffer objects.");
+	if(screencap_use_pbo)
+	{
+		for(int i=0; i<SCREENCAP_NUM_PBO; i++)
+		{
+			glGenBuffers(1, &(screencap_slots[i].pbo));
+			screencap_slots[i].size = 0;
+			screencap_slots[i].state = SCREENCAP_FREE;
+			screencap_slots[i].mapped = NULL;
+		}
+	}
+
+	screencap_queue_cap = kuhl_config_int("screencap.queue", 8, 8);
+	if(screencap_queue_cap < 1)
+		screencap_queue_cap = 1;
+	screencap_queue = kuhl_malloc(sizeof(screencap_job)*screencap_queue_cap);
+
+#ifndef _WIN32
+	screencap_num_threads = kuhl_config_int("screencap.threads", 1, 1);
+	if(screencap_num_threads < 1)
+		screencap_num_threads = 1;
+	if(screencap_num_threads > SCREENCAP_MAX_THREADS)
+		screencap_num_threads = SCREENCAP_MAX_THREADS;
+	for(int i=0; i<screencap_num_threads; i++)
+	{
+		if(pthread_create(&(screencap_threads[i]), NULL, screencap_encoder, NULL) != 0)
+		{
+			msg(MSG_FATAL, "Failed to create screen capture thread.");
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+	atexit(screencap_exit);
+}
+
+/** Maps a PBO whose fence has been reached so that an encoder thread
+ * can copy the pixels out of it. Called with screencap_mutex held. */
+static void screencap_map(screencap_slot *slot)
+{
+	glDeleteSync(slot->fence);
+	slot->fence = 0;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	slot->mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot->size, GL_MAP_READ_BIT);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	slot->data = NULL;
+	if(slot->mapped == NULL)
+	{
+		msg(MSG_ERROR, "Screen capture: Failed to map pixel buffer object.");
+		slot->state = SCREENCAP_DONE;
+		return;
+	}
+#ifdef _WIN32
+	screencap_copy(slot);
+	slot->state = SCREENCAP_DONE;
+#else
+	slot->state = SCREENCAP_MAPPED;
+	pthread_cond_signal(&screencap_not_empty);
+#endif
+}
+
+/** Unmaps a slot that an encoder thread has copied the pixels out of
+ * and passes the pixels to the slot's screencap_func. Called with
+ * screencap_mutex held; the mutex is released while func runs.
+
+ @param unmap Set if the PBO should be unmapped. The OpenGL context
+ must be current if this is set.
+*/
+static void screencap_deliver(screencap_slot *slot, int unmap)
+{
+	if(unmap && slot->mapped != NULL)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+	slot->mapped = NULL;
+	slot->state = SCREENCAP_FREE;
+	screencap_unlock();
+	slot->func(slot->data, slot->width, slot->height, slot->usec, slot->arg);
+	screencap_lock();
+}
+
+/** Waits for the oldest pending screen capture to be copied out of
+ * its PBO and passes it to its screencap_func. Called with
+ * screencap_mutex held. */
+static void screencap_finish_oldest(void)
+{
+	screencap_slot *slot = screencap_oldest(SCREENCAP_FREE);
+	if(slot->state == SCREENCAP_PENDING)
+	{
+		/* Only this thread changes a pending slot, so the encoder
+		 * threads can keep working while we wait. */
+		screencap_unlock();
+		glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		screencap_lock();
+		screencap_map(slot);
+	}
+#ifndef _WIN32
+	while(slot->state != SCREENCAP_DONE)
+		pthread_cond_wait(&screencap_copied, &screencap_mutex);
+#endif
+	screencap_deliver(slot, 1);
+}
+
+/** Checks if any pending screen captures have been copied into their
+    PBOs and, if so, maps them so that the encoder thread can copy the
+    pixels out. Captures that the encoder thread has finished copying
+    are unmapped and handed to their screencap_func in the order they
+    were requested. This function never waits for OpenGL or for the
+    encoder thread. It is called automatically by bufferswap() and
+    screencap_request().
+*/
+void screencap_update(void)
+{
+	if(!screencap_initialized || !screencap_use_pbo)
+		return;
+
+	screencap_lock();
+	screencap_slot *slot;
+	while((slot = screencap_oldest(SCREENCAP_PENDING)) != NULL)
+	{
+		GLenum status = glClientWaitSync(slot->fence, 0, 0);
+		if(status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		screencap_map(slot);
+	}
+	while((slot = screencap_oldest(SCREENCAP_FREE)) != NULL &&
+	      slot->state == SCREENCAP_DONE)
+		screencap_deliver(slot, 1);
+	screencap_unlock();
+}
+
+/** Starts capturing the current contents of the screen. The pixels
+    are passed to a function a short time later (typically two frames
+    later) by screencap_update() on the thread that made the request.
+
+    @param func The function that receives the pixels. The pixels are
+    RGB, the first pixel is in the bottom left corner and there is no
+    padding between rows. The function is responsible for free()ing
+    the pixels. If OpenGL failed to provide the pixels, func is called
+    with NULL instead so that it can release arg. func should return
+    quickly; for example, by handing the pixels to another thread.
+
+    @param arg A pointer that is passed to func.
+*/
+void screencap_request_func(screencap_func func, void *arg)
+{
+	screencap_init();
+	screencap_update();
+	long usec = kuhl_microseconds();
+
+	int width, height;
+	glfwGetFramebufferSize(kuhl_get_window(), &width, &height);
+	GLsizeiptr size = (GLsizeiptr) width*height*3;
+
+	GLint previousAlignment = 4;
+	glGetIntegerv(GL_PACK_ALIGNMENT, &previousAlignment);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	if(!screencap_use_pbo)
+	{
+		unsigned char *data = kuhl_malloc(size);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, data);
+		glPixelStorei(GL_PACK_ALIGNMENT, previousAlignment);
+		kuhl_errorcheck();
+		func(data, width, height, usec, arg);
+		return;
+	}
+
+	/* Use a free PBO. If all are in use, wait for the oldest one. */
+	screencap_lock();
+	screencap_slot *slot = NULL;
+	for(int i=0; i<SCREENCAP_NUM_PBO && slot == NULL; i++)
+		if(screencap_slots[i].state == SCREENCAP_FREE)
+			slot = &(screencap_slots[i]);
+	if(slot == NULL)
+	{
+		slot = screencap_oldest(SCREENCAP_FREE);
+		screencap_finish_oldest();
+	}
+	screencap_unlock();
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	if(slot->size != size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		slot->size = size;
+	}
+	/* With a PBO bound, the last parameter is an offset into the
+	 * PBO and glReadPixels() returns without waiting. */
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, previousAlignment);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot->seq = screencap_seq++;
+	slot->usec = usec;
+	slot->func = func;
+	slot->arg = arg;
+	slot->width = width;
+	slot->height = height;
+	screencap_lock();
+	slot->state = SCREENCAP_PENDING;
+	screencap_unlock();
+	kuhl_errorcheck();
+}
+
+/** Starts capturing the current contents of the screen. The pixels
+    are written to an image file by a background thread a short time
+    later. Calling this function every frame is inexpensive as long as
+    the encoder thread can keep up.
+
+    @param filename The image file to write. The type of image file is
+    determined by the filename extension. See kuhl_write_image().
+*/
+void screencap_request(const char *filename)
+{
+	screencap_request_func(screencap_to_file, strdup(filename));
+}
+
+/** Waits for all pending screen captures to be written to disk.
+ * Call this function before the program exits while the OpenGL
+ * context is still current (for example, after the main loop
+ * ends). Captures that are still waiting for OpenGL when the program
+ * exits are discarded. */
+void screencap_flush(void)
+{
+	if(!screencap_initialized)
+		return;
+
+	screencap_lock();
+	if(screencap_use_pbo)
+	{
+		while(screencap_oldest(SCREENCAP_FREE) != NULL)
+			screencap_finish_oldest();
+	}
+#ifndef _WIN32
+	while(screencap_queue_len > 0 || screencap_active > 0)
+		pthread_cond_wait(&screencap_not_full, &screencap_mutex);
+#endif
+	screencap_unlock();
+}
+
+/** Called when the program exits. The OpenGL context may already be
+ * gone, so this function makes no OpenGL calls: Captures that have
+ * already been mapped are finished and written, captures that are
+ * still waiting for OpenGL are discarded. */
+static void screencap_exit(void)
+{
+	int discarded = 0;
+	screencap_lock();
+	screencap_slot *slot;
+	while((slot = screencap_oldest(SCREENCAP_FREE)) != NULL)
+	{
+		if(slot->state == SCREENCAP_PENDING)
+		{
+			discarded++;
+			slot->data = NULL;
+		}
+#ifndef _WIN32
+		else
+		{
+			while(slot->state != SCREENCAP_DONE)
+				pthread_cond_wait(&screencap_copied, &screencap_mutex);
+		}
+#endif
+		screencap_deliver(slot, 0);
+	}
+#ifndef _WIN32
+	while(screencap_queue_len > 0 || screencap_active > 0)
+		pthread_cond_wait(&screencap_not_full, &screencap_mutex);
+#endif
+	screencap_unlock();
+	if(discarded > 0)
+		msg(MSG_WARNING, "Screen capture: Discarded %d frame(s) that were not finished when the program exited. Call screencap_flush() before exiting.", discarded);
+}
@@ -0,0 +1,64 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    screencap captures the contents of the screen and writes them to
+    image files without stalling the rendering loop.
+
+    kuhl_screenshot() calls glReadPixels() which waits for OpenGL to
+    finish rendering, copies the pixels into main memory and then
+    encodes the image file---all before it returns. screencap instead
+    asks OpenGL to copy the pixels into one of several pixel buffer
+    objects (PBOs) and inserts a fence after the copy. One or two
+    frames later, after the fence has been reached, the PBO is mapped
+    and a background thread copies the pixels out of it and writes the
+    image file. screencap_update() is called by bufferswap() every
+    frame to check the fences and to unmap PBOs that have been copied.
+
+    Call screencap_flush() before the program exits, while the OpenGL
+    context is still current, to finish any captures that are still
+    in progress. Captures that are waiting for OpenGL when the program
+    exits are discarded.
+
+    The following configuration file settings are supported:
+
+    screencap.queue - Maximum number of captured frames waiting to be
+    written to disk (default 8). If the encoder thread(s) fall behind,
+    screencap_request() waits for space in the queue instead of using
+    an unbounded amount of memory.
+
+    screencap.threads - Number of encoder threads (default 1).
+
+    screencap_request_func() can be used to send the captured pixels
+    somewhere other than an image file. For example,
+    kuhl_video_record() uses it to send frames to a video_writer.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A function which receives captured pixels. See screencap_request_func().
+
+    @param data RGB pixels (bottom row first) which the function must free().
+    @param width Width of the image in pixels.
+    @param height Height of the image in pixels.
+    @param usec Time that the capture was requested (see kuhl_microseconds()).
+    @param arg The pointer passed to screencap_request_func().
+*/
+typedef void (*screencap_func)(unsigned char *data, int width, int height, long usec, void *arg);
+
+void screencap_request(const char *filename);
+void screencap_request_func(screencap_func func, void *arg);
+void screencap_update(void);
+void screencap_flush(void);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <poll.h>
 #endif
 #include <errno.h>
 #include <string.h>
@@ -190,6 +191,56 @@ int serial_read(int fd, char* buf, size_t numBytes, int options)
 }
 
 
+/**
+   Reads whatever bytes are available from a file descriptor, waiting
+   for some to arrive if there are none. Unlike serial_read(), this
+   never waits for a specific number of bytes, which makes it useful
+   for a thread that parses a stream of records as it arrives.
+
+   @param fd File descriptor to read from.
+   @param buf Buffer to put the bytes in.
+   @param maxBytes Size of buf.
+   @param timeoutMs Milliseconds to wait for bytes to arrive (-1 to wait forever).
+
+   @return Number of bytes read. 0 if no bytes arrived before the
+   timeout. -1 if there was a read() error or if the device was
+   disconnected.
+ */
+int serial_read_some(int fd, char *buf, size_t maxBytes, int timeoutMs)
+{
+#ifdef _WIN32
+	msg(MSG_ERROR, "This function is not defined on Windows.");
+	return -1;
+#else
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int ret = poll(&pfd, 1, timeoutMs);
+	if(ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if(ret == 0)
+		return 0;
+	if(!(pfd.revents & POLLIN))
+	{
+		// POLLHUP or POLLERR without data: the device went away.
+		if(SERIAL_DEBUG)
+			msg(MSG_DEBUG, "serial_read_some(): Did serial cable get disconnected?\n");
+		return -1;
+	}
+
+	ssize_t bytesRead = read(fd, buf, maxBytes);
+	if(bytesRead <= 0)
+	{
+		if(SERIAL_DEBUG)
+			msg(MSG_DEBUG, "serial_read_some(): read error %s\n", bytesRead == 0 ? "end of file" : strerror(errno));
+		return -1;
+	}
+	return (int) bytesRead;
+#endif
+}
+
+
 /** Applies settings to a serial connection (sets baud rate, parity, etc).
 
     @param fd The file descriptor corresponding to an open serial connection.
@@ -404,6 +455,8 @@ int serial_open(const char *deviceFile, int speed, int parity, int vmin, int vti
 #else
 		fd = open(deviceFile, O_RDWR);
 #endif
+		if(fd != -1)
+			break;
 	}
 	if(fd == -1)
 	{
@@ -32,6 +32,7 @@ int serial_find(int fd, char *bytes, int len, int maxbytes);
 void serial_discard(int fd);
 void serial_write(const int fd, const char* buf, size_t numBytes);
 int serial_read(int fd, char* buf, size_t numBytes, int options);
+int serial_read_some(int fd, char *buf, size_t maxBytes, int timeoutMs);
 int serial_open(const char *deviceFile, int speed, int parity, int vmin, int vtime);
 void serial_close(int fd);
 
@@ -172,26 +172,19 @@ int tdl_read(FILE *f, float pos[3], float orient[9])
 	return -1;
 #else
 
-	const int posSize = 3*(signed int)sizeof(float);
-	const int orientSize = 9*(signed int)sizeof(float);
-	
-	int readVal = fread(pos, posSize, 1, f);
-	if(feof(f))
-		return 1; // EOF
-	if(readVal < 1)
-	{
-		perror("Reading position failed");
-		return -1;
-	}
-
-	readVal = fread(orient, orientSize, 1, f);
+	/* A record is the position followed by the orientation; read
+	 * both with one call. */
+	float record[12];
+	int readVal = fread(record, sizeof(record), 1, f);
 	if(feof(f))
 		return 1; // EOF
 	if(readVal < 1)
 	{
-		perror("Reading orientation failed");
+		perror("Reading record failed");
 		return -1;
 	}
+	memcpy(pos, record, 3*sizeof(float));
+	memcpy(orient, record+3, 9*sizeof(float));
 	
 	return 0; // success
 #endif
@@ -211,16 +204,12 @@ void tdl_write(FILE *f, float pos[3], float orient[9])
 	msg(MSG_ERROR, "This function is not defined on Windows.");
 #else
 
-	const int posSize = 3*(signed int)sizeof(float);
-	const int orientSize = 9*(signed int)sizeof(float);
-	if(fwrite(pos, posSize, 1, f) != 1)
-	{
-		perror("Writing position failed");
-	}
-	
-	if(fwrite(orient, orientSize, 1, f) != 1)
+	float record[12];
+	memcpy(record, pos, 3*sizeof(float));
+	memcpy(record+3, orient, 9*sizeof(float));
+	if(fwrite(record, sizeof(record), 1, f) != 1)
 	{
-		perror("Writing orientation failed");
+		perror("Writing record failed");
 	}
 #endif
 }
@@ -268,3 +257,593 @@ int tdl_validate(FILE *f)
 }
 
 
+/* Version 2 .tdl files
+
+   Version 1 files hold one object and no timestamps, so a recording
+   must be played back at the rate it was recorded at. Version 2 files
+   hold any number of objects, a timestamp for every record and an
+   index so that a reader can find the records near a time without
+   reading the whole file. The layout is:
+
+   - A tdl2_header (64 bytes). The first 8 bytes are the same as in a
+     version 1 file; the byte after them is the version.
+   - header.objects names, TDL2_NAME_LENGTH bytes each, NUL padded.
+   - Blocks of up to TDL2_BLOCK_RECORDS records in time order. Each
+     block is a tdl2_block followed by the records.
+   - The index: header.blocks tdl2_index entries, written by
+     tdl2_finish(). If the program that was writing the file stopped
+     without calling tdl2_finish(), tdl2_open() rebuilds the index
+     from the block headers.
+
+   An uncompressed record is 40 bytes: the time (int64), the object
+   (uint16), 2 unused bytes, the position (3 floats) and the
+   quaternion (4 floats). A compressed record (TDL2_COMPRESS) is a
+   sequence of variable-length integers (7 bits per byte, lowest bits
+   first): the microseconds since the previous record in the block,
+   the object, and for each of the 7 values the difference between it
+   and the previous value of the same object in the block (zigzag
+   encoded so that small negative numbers are short). Values are
+   rounded to multiples of header.posQuantum and header.quatQuantum
+   before the differences are computed. Each block starts over from
+   zero, so a block can be decoded without the ones before it.
+
+   Everything is stored in the byte order of the machine that wrote the
+   file. byteOrder lets a reader notice a file from a machine with a
+   different byte order.
+*/
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <math.h>
+
+#define TDL2_BYTE_ORDER 0x01020304
+#define TDL2_RECORD_BYTES 40
+/* 10 bytes of time, 3 bytes of object and 5 bytes for each value */
+#define TDL2_MAX_COMPRESSED_BYTES 48
+
+static const unsigned char tdl_magic[8] = { 219, 84, 68, 76, 13, 10, 26, 10 };
+
+static unsigned char* tdl2_put_varint(unsigned char *p, uint64_t v)
+{
+	while(v >= 0x80)
+	{
+		*p++ = (unsigned char) (v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (unsigned char) v;
+	return p;
+}
+
+/* Returns a pointer to the byte after the integer or NULL if the
+ * integer doesn't end before end. */
+static const unsigned char* tdl2_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	uint64_t result = 0;
+	for(int shift=0; p < end && shift < 64; shift += 7)
+	{
+		unsigned char b = *p++;
+		result |= (uint64_t) (b & 0x7f) << shift;
+		if((b & 0x80) == 0)
+		{
+			*v = result;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static void tdl2_quantize(const tdl2_header *h, const float pos[3], const float quat[4], int32_t q[7])
+{
+	for(int i=0; i<3; i++)
+		q[i] = (int32_t) lrintf(pos[i] / h->posQuantum);
+	for(int i=0; i<4; i++)
+		q[3+i] = (int32_t) lrintf(quat[i] / h->quatQuantum);
+}
+
+/** Creates a version 2 .tdl file.
+
+    @param path The file to create.
+
+    @param names The names of the objects that will be recorded. Names
+    longer than TDL2_NAME_LENGTH-1 characters are truncated.
+
+    @param objects The number of names.
+
+    @param flags TDL2_COMPRESS to store positions with TDL2_POS_QUANTUM
+    resolution and quaternions with TDL2_QUAT_QUANTUM resolution in
+    about a third of the space, 0 to store floats.
+
+    @return A writer to pass to tdl2_write() and tdl2_finish() or NULL
+    if the file couldn't be created.
+*/
+tdl2_writer* tdl2_create(const char *path, const char **names, int objects, int flags)
+{
+	if(objects < 1 || objects > 65535)
+	{
+		msg(MSG_ERROR, "Can't create %s with %d objects.", path, objects);
+		return NULL;
+	}
+	FILE *f = fopen(path, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to create %s.", path);
+		return NULL;
+	}
+
+	tdl2_writer *w = (tdl2_writer*) calloc(1, sizeof(tdl2_writer));
+	w->f = f;
+	memcpy(w->header.magic, tdl_magic, 8);
+	w->header.version = 2;
+	w->header.flags = (uint8_t) (flags & TDL2_COMPRESS);
+	w->header.objects = (uint16_t) objects;
+	w->header.byteOrder = TDL2_BYTE_ORDER;
+	w->header.posQuantum = TDL2_POS_QUANTUM;
+	w->header.quatQuantum = TDL2_QUAT_QUANTUM;
+	w->buf = (unsigned char*) malloc(TDL2_BLOCK_RECORDS*TDL2_MAX_COMPRESSED_BYTES + 8);
+	w->prev = (int32_t*) calloc(objects*7, sizeof(int32_t));
+	w->offset = sizeof(tdl2_header) + objects*TDL2_NAME_LENGTH;
+
+	/* The header is written again by tdl2_finish() once the index is
+	 * written. */
+	int ok = fwrite(&(w->header), sizeof(tdl2_header), 1, f) == 1;
+	for(int i=0; i<objects && ok; i++)
+	{
+		char name[TDL2_NAME_LENGTH];
+		memset(name, 0, TDL2_NAME_LENGTH);
+		strncpy(name, names[i], TDL2_NAME_LENGTH-1);
+		ok = fwrite(name, TDL2_NAME_LENGTH, 1, f) == 1;
+	}
+	if(!ok)
+	{
+		msg(MSG_ERROR, "Unable to write header of %s.", path);
+		fclose(f);
+		free(w->buf);
+		free(w->prev);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+/* Writes the records in w->buf to the file as a block. */
+static int tdl2_flush(tdl2_writer *w)
+{
+	if(w->bufRecords == 0)
+		return 0;
+
+	/* Keep blocks and the index 8-byte aligned so that a reader can use
+	 * them where they are in the memory-mapped file. */
+	while(w->bufBytes % 8 != 0)
+		w->buf[w->bufBytes++] = 0;
+
+	tdl2_block block;
+	memset(&block, 0, sizeof(tdl2_block));
+	block.magic = TDL2_BLOCK_MAGIC;
+	block.records = w->bufRecords;
+	block.bytes = (uint32_t) w->bufBytes;
+	block.first = w->blockFirst;
+	block.last = w->prevTime;
+	if(fwrite(&block, sizeof(tdl2_block), 1, w->f) != 1 ||
+	   fwrite(w->buf, w->bufBytes, 1, w->f) != 1)
+	{
+		/* The file may now end with part of a block, so don't write
+		 * anything else to it. The records in the block weren't
+		 * written. */
+		msg(MSG_ERROR, "Unable to write %u records to .tdl file.", w->bufRecords);
+		w->failed = 1;
+		w->header.records -= w->bufRecords;
+		w->bufBytes = 0;
+		w->bufRecords = 0;
+		return -1;
+	}
+
+	if(w->header.blocks == w->indexAlloc)
+	{
+		w->indexAlloc = w->indexAlloc ? w->indexAlloc*2 : 64;
+		w->index = (tdl2_index*) realloc(w->index, w->indexAlloc*sizeof(tdl2_index));
+	}
+	w->index[w->header.blocks].first = w->blockFirst;
+	w->index[w->header.blocks].offset = w->offset;
+	w->header.blocks++;
+
+	w->offset += sizeof(tdl2_block) + w->bufBytes;
+	w->bufBytes = 0;
+	w->bufRecords = 0;
+	memset(w->prev, 0, w->header.objects*7*sizeof(int32_t));
+	return 0;
+}
+
+/** Adds a record to a version 2 .tdl file. Records must be written in
+ * time order.
+
+    @return 0 on success, -1 if the record couldn't be written. After
+    writing to the file fails, every later call fails too.
+*/
+int tdl2_write(tdl2_writer *w, const tdl2_record *r)
+{
+	if(w->failed)
+		return -1;
+	if(r->object < 0 || r->object >= w->header.objects)
+	{
+		msg(MSG_ERROR, "Object %d isn't in the .tdl file.", r->object);
+		return -1;
+	}
+	if(w->header.records > 0 && r->time < w->prevTime)
+	{
+		msg(MSG_ERROR, "Record at %lld is older than the previous record (%lld).",
+		    (long long) r->time, (long long) w->prevTime);
+		return -1;
+	}
+
+	if(w->header.records == 0)
+		w->header.first = r->time;
+	if(w->bufRecords == 0)
+	{
+		w->blockFirst = r->time;
+		w->prevTime = r->time;
+	}
+
+	unsigned char *p = w->buf + w->bufBytes;
+	if(w->header.flags & TDL2_COMPRESS)
+	{
+		p = tdl2_put_varint(p, (uint64_t) (r->time - w->prevTime));
+		p = tdl2_put_varint(p, (uint64_t) r->object);
+		int32_t q[7];
+		tdl2_quantize(&(w->header), r->pos, r->quat, q);
+		int32_t *prev = w->prev + r->object*7;
+		for(int i=0; i<7; i++)
+		{
+			int64_t diff = (int64_t) q[i] - prev[i];
+			p = tdl2_put_varint(p, ((uint64_t) diff << 1) ^ (uint64_t) (diff >> 63));
+			prev[i] = q[i];
+		}
+	}
+	else
+	{
+		uint16_t object = (uint16_t) r->object;
+		memcpy(p, &(r->time), 8);
+		memcpy(p+8, &object, 2);
+		memset(p+10, 0, 2);
+		memcpy(p+12, r->pos, 3*sizeof(float));
+		memcpy(p+24, r->quat, 4*sizeof(float));
+		p += TDL2_RECORD_BYTES;
+	}
+	w->bufBytes = p - w->buf;
+	w->bufRecords++;
+	w->prevTime = r->time;
+	w->header.last = r->time;
+	w->header.records++;
+
+	if(w->bufRecords == TDL2_BLOCK_RECORDS)
+		return tdl2_flush(w);
+	return 0;
+}
+
+/** Writes the remaining records and the index of a version 2 .tdl
+ * file, closes the file and frees the writer.
+
+    @return 0 on success, -1 if the file couldn't be completed
+    (including when an earlier tdl2_write() failed). The records that
+    were written can still be read if the index couldn't be written.
+*/
+int tdl2_finish(tdl2_writer *w)
+{
+	int ok = !w->failed && tdl2_flush(w) == 0;
+	if(ok)
+	{
+		w->header.indexOffset = w->offset;
+		if(w->header.blocks > 0)
+			ok = fwrite(w->index, sizeof(tdl2_index), w->header.blocks, w->f) == w->header.blocks;
+	}
+	if(ok)
+	{
+		ok = fseek(w->f, 0, SEEK_SET) == 0 &&
+			fwrite(&(w->header), sizeof(tdl2_header), 1, w->f) == 1;
+	}
+	if(fclose(w->f) != 0)
+		ok = 0;
+	if(!ok)
+		msg(MSG_ERROR, "Unable to write the index of a .tdl file.");
+
+	free(w->buf);
+	free(w->prev);
+	free(w->index);
+	free(w);
+	return ok ? 0 : -1;
+}
+
+/* Moves the reader to the start of block b. */
+static void tdl2_start_block(tdl2_reader *r, uint64_t b)
+{
+	r->block = b;
+	r->inBlock = 0;
+	r->blockRecords = 0;
+	if(b >= r->header.blocks)
+		return;
+
+	tdl2_block block;
+	uint64_t offset = r->index[b].offset;
+	if(offset > r->size - sizeof(tdl2_block))
+	{
+		msg(MSG_ERROR, "Block %llu of .tdl file is outside of the file.", (unsigned long long) b);
+		r->block = r->header.blocks;
+		return;
+	}
+	memcpy(&block, r->map + offset, sizeof(tdl2_block));
+	if(block.magic != TDL2_BLOCK_MAGIC || block.bytes > r->size - offset - sizeof(tdl2_block))
+	{
+		msg(MSG_ERROR, "Block %llu of .tdl file is corrupt.", (unsigned long long) b);
+		r->block = r->header.blocks;
+		return;
+	}
+	r->blockRecords = block.records;
+	r->offset = offset + sizeof(tdl2_block);
+	r->blockEnd = r->offset + block.bytes;
+	r->time = block.first;
+	memset(r->prev, 0, r->header.objects*7*sizeof(int32_t));
+}
+
+/* Decodes the record at the reader's position without moving the
+ * reader. On success, returns the offset of the following record and
+ * stores the quantized values of a compressed record in q. Returns 0
+ * if the record is corrupt. */
+static size_t tdl2_decode(const tdl2_reader *r, tdl2_record *rec, int32_t q[7])
+{
+	const unsigned char *p = r->map + r->offset;
+	const unsigned char *end = r->map + r->blockEnd;
+	if(r->header.flags & TDL2_COMPRESS)
+	{
+		uint64_t delta, object;
+		if((p = tdl2_get_varint(p, end, &delta)) == NULL ||
+		   (p = tdl2_get_varint(p, end, &object)) == NULL ||
+		   object >= r->header.objects)
+			return 0;
+		rec->time = r->time + (int64_t) delta;
+		rec->object = (int) object;
+		const int32_t *prev = r->prev + object*7;
+		for(int i=0; i<7; i++)
+		{
+			uint64_t v;
+			if((p = tdl2_get_varint(p, end, &v)) == NULL)
+				return 0;
+			int64_t diff = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+			q[i] = (int32_t) (prev[i] + diff);
+		}
+		for(int i=0; i<3; i++)
+			rec->pos[i] = q[i] * r->header.posQuantum;
+		for(int i=0; i<4; i++)
+			rec->quat[i] = q[3+i] * r->header.quatQuantum;
+	}
+	else
+	{
+		if(end - p < TDL2_RECORD_BYTES)
+			return 0;
+		uint16_t object;
+		memcpy(&(rec->time), p, 8);
+		memcpy(&object, p+8, 2);
+		memcpy(rec->pos, p+12, 3*sizeof(float));
+		memcpy(rec->quat, p+24, 4*sizeof(float));
+		if(object >= r->header.objects)
+			return 0;
+		rec->object = object;
+		p += TDL2_RECORD_BYTES;
+	}
+	return p - r->map;
+}
+
+/* Returns the next record (see tdl2_next()) if advance is set,
+ * otherwise only looks at it. */
+static int tdl2_peek(tdl2_reader *r, tdl2_record *rec, int advance)
+{
+	while(r->block < r->header.blocks && r->inBlock == r->blockRecords)
+		tdl2_start_block(r, r->block+1);
+	if(r->block >= r->header.blocks)
+		return 0;
+
+	int32_t q[7];
+	size_t next = tdl2_decode(r, rec, q);
+	if(next == 0)
+	{
+		msg(MSG_ERROR, "Block %llu of .tdl file is corrupt.", (unsigned long long) r->block);
+		tdl2_start_block(r, r->block+1);
+		return -1;
+	}
+	if(advance)
+	{
+		r->offset = next;
+		r->time = rec->time;
+		r->inBlock++;
+		if(r->header.flags & TDL2_COMPRESS)
+			memcpy(r->prev + rec->object*7, q, sizeof(q));
+	}
+	return 1;
+}
+
+/** Opens a version 2 .tdl file for reading. The file is memory
+ * mapped, so opening even a long recording is fast, and the reader
+ * starts at the first record.
+
+    @param path The file to open.
+
+    @return A reader or NULL if the file couldn't be read. Version 1
+    files can be converted with the tdl-convert program.
+*/
+tdl2_reader* tdl2_open(const char *path)
+{
+#ifdef _WIN32
+	msg(MSG_ERROR, "This function is not defined on Windows.");
+	return NULL;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		msg(MSG_ERROR, "Unable to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(tdl2_header))
+	{
+		msg(MSG_ERROR, "%s is not a .tdl file.", path);
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		msg(MSG_ERROR, "Unable to map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	tdl2_reader *r = (tdl2_reader*) calloc(1, sizeof(tdl2_reader));
+	r->map = (const unsigned char*) map;
+	r->size = st.st_size;
+	memcpy(&(r->header), map, sizeof(tdl2_header));
+	tdl2_header *h = &(r->header);
+	const char *problem = NULL;
+	if(memcmp(h->magic, tdl_magic, 8) != 0)
+		problem = "is not a .tdl file";
+	else if(h->version == 0)
+		problem = "is a version 1 .tdl file (convert it with tdl-convert)";
+	else if(h->version != 2)
+		problem = "is from a newer version of this library";
+	else if(h->byteOrder != TDL2_BYTE_ORDER)
+		problem = "was written on a machine with a different byte order";
+	else if(h->objects == 0 || sizeof(tdl2_header) + h->objects*TDL2_NAME_LENGTH > r->size)
+		problem = "is truncated";
+	if(problem)
+	{
+		msg(MSG_ERROR, "%s %s.", path, problem);
+		munmap(map, r->size);
+		free(r);
+		return NULL;
+	}
+
+	r->names = (char (*)[TDL2_NAME_LENGTH]) malloc(h->objects*TDL2_NAME_LENGTH);
+	memcpy(r->names, r->map + sizeof(tdl2_header), h->objects*TDL2_NAME_LENGTH);
+	for(int i=0; i<h->objects; i++)
+		r->names[i][TDL2_NAME_LENGTH-1] = '\0';
+	r->prev = (int32_t*) calloc(h->objects*7, sizeof(int32_t));
+
+	if(h->indexOffset != 0 && h->indexOffset <= r->size &&
+	   h->blocks <= (r->size - h->indexOffset) / sizeof(tdl2_index))
+		r->index = (const tdl2_index*) (r->map + h->indexOffset);
+	else
+	{
+		/* The file wasn't finished. Find the blocks that were written
+		 * completely. */
+		uint64_t alloc = 0;
+		size_t offset = sizeof(tdl2_header) + h->objects*TDL2_NAME_LENGTH;
+		h->blocks = 0;
+		h->records = 0;
+		tdl2_block block;
+		while(offset + sizeof(tdl2_block) <= r->size)
+		{
+			memcpy(&block, r->map + offset, sizeof(tdl2_block));
+			if(block.magic != TDL2_BLOCK_MAGIC || block.bytes > r->size - offset - sizeof(tdl2_block))
+				break;
+			if(h->blocks == alloc)
+			{
+				alloc = alloc ? alloc*2 : 64;
+				r->ownIndex = (tdl2_index*) realloc(r->ownIndex, alloc*sizeof(tdl2_index));
+			}
+			r->ownIndex[h->blocks].first = block.first;
+			r->ownIndex[h->blocks].offset = offset;
+			if(h->blocks == 0)
+				h->first = block.first;
+			h->last = block.last;
+			h->blocks++;
+			h->records += block.records;
+			offset += sizeof(tdl2_block) + block.bytes;
+		}
+		r->index = r->ownIndex;
+		msg(MSG_WARNING, "%s was not closed properly. Found %llu records in it.",
+		    path, (unsigned long long) h->records);
+	}
+
+	tdl2_start_block(r, 0);
+	return r;
+#endif
+}
+
+/** Returns the index of the object with the given name in a version 2
+ * .tdl file or -1 if the file has no records for an object with that
+ * name. */
+int tdl2_object(const tdl2_reader *r, const char *name)
+{
+	for(int i=0; i<r->header.objects; i++)
+		if(strcmp(r->names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+/** Moves a reader so that tdl2_next() returns the first record at or
+ * after a time. Finding the block takes O(log n) time for a file with n
+ * blocks and at most TDL2_BLOCK_RECORDS records are decoded.
+
+    @param r The reader.
+
+    @param usec The time to move to.
+
+    @return 1 if there is a record at or after the time, 0 if the time
+    is after the last record.
+*/
+int tdl2_seek(tdl2_reader *r, int64_t usec)
+{
+	/* Find the last block that starts before usec. Records with the
+	 * same time may span two blocks, so the block that starts at usec
+	 * is not necessarily the one to start at. */
+	uint64_t lo = 0, hi = r->header.blocks;
+	while(lo < hi)
+	{
+		uint64_t mid = lo + (hi-lo)/2;
+		if(r->index[mid].first < usec)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	tdl2_start_block(r, lo > 0 ? lo-1 : 0);
+
+	tdl2_record rec;
+	int ret;
+	while((ret = tdl2_peek(r, &rec, 0)) != 0)
+	{
+		if(ret == 1 && rec.time >= usec)
+			return 1;
+		if(ret == 1)
+			tdl2_peek(r, &rec, 1);
+	}
+	return 0;
+}
+
+/** Reads the next record from a version 2 .tdl file.
+
+    @param r The reader.
+
+    @param rec Set to the record.
+
+    @return 1 if a record was read, 0 at the end of the file and -1 if
+    the file is corrupt (the reader skips to the next block, so reading
+    can continue).
+*/
+int tdl2_next(tdl2_reader *r, tdl2_record *rec)
+{
+	return tdl2_peek(r, rec, 1);
+}
+
+/** Closes a version 2 .tdl file and frees the reader. */
+void tdl2_close(tdl2_reader *r)
+{
+#ifndef _WIN32
+	munmap((void*) r->map, r->size);
+#endif
+	free(r->names);
+	free(r->ownIndex);
+	free(r->prev);
+	free(r);
+}
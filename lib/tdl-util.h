@@ -4,6 +4,9 @@
  */
 
 #pragma once
+#include <stdio.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +21,104 @@ bool tdl_validate(FILE *f);
 int tdl_validate(FILE *f);
 #endif
 
+
+/* Version 2 .tdl files (see tdl-util.c for the file layout) */
+
+#define TDL2_NAME_LENGTH 64     /**< Bytes stored for each object name, including the NUL */
+#define TDL2_BLOCK_RECORDS 256  /**< Records per block; seeking decodes at most this many records */
+#define TDL2_POS_QUANTUM 0.00001f       /**< Position resolution of compressed files (0.01 mm) */
+#define TDL2_QUAT_QUANTUM (1.0f/65536)  /**< Quaternion resolution of compressed files */
+
+#define TDL2_BLOCK_MAGIC 0x4b4c4254  /**< "TBLK" at the start of each tdl2_block */
+
+/** Flags for tdl2_create(). */
+#define TDL2_COMPRESS 1  /**< Store quantized differences between records instead of floats */
+
+/** One record in a version 2 .tdl file. */
+typedef struct {
+	int64_t time;   /**< Microseconds. The clock is chosen by the program that writes the file; VRPN message times are microseconds since 1970. */
+	int object;     /**< Index of the object the record is for */
+	float pos[3];   /**< Position */
+	float quat[4];  /**< Orientation quaternion (x,y,z,w) */
+} tdl2_record;
+
+/** Header at the start of a version 2 .tdl file. */
+typedef struct {
+	unsigned char magic[8];  /**< Same as a version 1 file */
+	uint8_t version;         /**< 2 (the same byte is 0 in a version 1 file) */
+	uint8_t flags;           /**< TDL2_COMPRESS */
+	uint16_t objects;        /**< Number of object names after the header */
+	uint32_t byteOrder;      /**< 0x01020304 in the byte order of the file */
+	int64_t first;           /**< Time of the first record */
+	int64_t last;            /**< Time of the last record */
+	uint64_t records;        /**< Number of records */
+	uint64_t indexOffset;    /**< Offset of the index, 0 if the file was not closed */
+	uint64_t blocks;         /**< Number of blocks (and index entries) */
+	float posQuantum;        /**< Position resolution if compressed */
+	float quatQuantum;       /**< Quaternion resolution if compressed */
+} tdl2_header;
+
+/** Header in front of each block of records. */
+typedef struct {
+	uint32_t magic;    /**< TDL2_BLOCK_MAGIC */
+	uint32_t records;  /**< Number of records in the block */
+	uint32_t bytes;    /**< Size of the records that follow (a multiple of 8) */
+	uint32_t reserved;
+	int64_t first;     /**< Time of the first record in the block */
+	int64_t last;      /**< Time of the last record in the block */
+} tdl2_block;
+
+/** An entry in the index at the end of a version 2 .tdl file. */
+typedef struct {
+	int64_t first;    /**< Time of the first record in the block */
+	uint64_t offset;  /**< Offset of the tdl2_block in the file */
+} tdl2_index;
+
+/** State of a version 2 .tdl file being written (see tdl2_create()). */
+typedef struct {
+	FILE *f;
+	tdl2_header header;
+	unsigned char *buf;     /**< Records in the block being written */
+	size_t bufBytes;
+	uint32_t bufRecords;
+	int64_t blockFirst;
+	int64_t prevTime;
+	int32_t *prev;          /**< Previous quantized values of each object in this block */
+	tdl2_index *index;
+	uint64_t indexAlloc;
+	uint64_t offset;        /**< Offset in the file where the next block goes */
+	int failed;             /**< Set when writing a block fails; later writes fail too */
+} tdl2_writer;
+
+/** A memory-mapped version 2 .tdl file being read (see tdl2_open()). */
+typedef struct {
+	const unsigned char *map;  /**< The memory-mapped file */
+	size_t size;
+	tdl2_header header;
+	char (*names)[TDL2_NAME_LENGTH];  /**< Names of the objects (header.objects of them) */
+	const tdl2_index *index;   /**< header.blocks entries */
+	tdl2_index *ownIndex;      /**< Index rebuilt by tdl2_open() if the file has none */
+
+	/* Position of the next record that tdl2_next() returns */
+	uint64_t block;         /**< Block that contains the next record */
+	uint32_t inBlock;       /**< Records already read from the block */
+	uint32_t blockRecords;  /**< Records in the block */
+	size_t offset;          /**< Offset of the next record in the file */
+	size_t blockEnd;        /**< Offset of the end of the block */
+	int64_t time;           /**< Time of the previous record in the block */
+	int32_t *prev;          /**< Previous quantized values of each object in this block */
+} tdl2_reader;
+
+tdl2_writer* tdl2_create(const char *path, const char **names, int objects, int flags);
+int tdl2_write(tdl2_writer *w, const tdl2_record *r);
+int tdl2_finish(tdl2_writer *w);
+
+tdl2_reader* tdl2_open(const char *path);
+int tdl2_object(const tdl2_reader *r, const char *name);
+int tdl2_seek(tdl2_reader *r, int64_t usec);
+int tdl2_next(tdl2_reader *r, tdl2_record *rec);
+void tdl2_close(tdl2_reader *r);
+
 #ifdef __cplusplus
 } // end extern "C"
 #endif
@@ -0,0 +1,995 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+    Tiled texture pyramids that are streamed from disk as needed. See
+    tiledtex.h for an overview.
+
+    @author Scott Kuhl
+ */
+
+#define _FILE_OFFSET_BITS 64 // allow fseeko() past 2GB on 32 bit machines
+#include "windows-compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/types.h>
+#endif
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "tiledtex.h"
+
+#ifdef _WIN32
+#define tiledtex_fseek _fseeki64
+#else
+#define tiledtex_fseek fseeko
+#endif
+
+/** Maximum number of levels in a pyramid. 32 levels allows for
+ * images that are over 2^31 pixels wide. */
+#define TILEDTEX_MAX_LEVELS 32
+/** Maximum number of tiles that can be requested from the loader
+ * thread but not yet copied into the atlas. */
+#define TILEDTEX_MAX_OUTSTANDING 64
+/** A request is ignored by the loader thread if it was made more
+ * than this many calls to tiledtex_draw() ago. */
+#define TILEDTEX_STALE 8
+/** Tiles used within this many calls to tiledtex_draw() (for each
+ * tiled texture that shares the atlas) are not evicted from the atlas
+ * (2 allows both eyes to share tiles). */
+#define TILEDTEX_KEEP 2
+
+enum { TILE_EMPTY, TILE_REQUESTED, TILE_RESIDENT, TILE_FAILED };
+
+/** Information about one tile in the pyramid. Only accessed by the
+ * thread that calls tiledtex_draw(). */
+typedef struct {
+	int level;     /**< Level in pyramid, 0 is full resolution */
+	int tx, ty;    /**< Tile column and row (0,0 is bottom left) */
+	int state;     /**< TILE_EMPTY, TILE_REQUESTED, etc. */
+	int slot;      /**< Slot in the atlas if resident, -1 otherwise */
+	long lastUsed; /**< Value of the atlas useCount when tile was last drawn */
+} tiledtex_tile;
+
+/** A tile that has been requested or loaded by the loader thread. */
+typedef struct {
+	int tile;              /**< Index into tiles array */
+	long drawCount;        /**< drawCount when the tile was requested */
+	long seq;              /**< Order in which requests were given to the loader thread */
+	int stale;             /**< Set if loader skipped the request */
+	unsigned char *pixels; /**< Tile pixels (NULL if not loaded) */
+} tiledtex_request;
+
+/** A texture that caches tiles. All tiled textures whose tiles are
+ * the same size share one atlas (for example, the twelve faces of a
+ * stereo cubemap). Only accessed by the rendering thread. */
+typedef struct tiledtex_atlas {
+	GLuint tex;
+	int storedSize;    /**< Width and height of each slot (tileSize + 2*border) */
+	int size;          /**< Width and height of the texture */
+	int slotsPerRow;
+	int numSlots;
+	struct tiledtex **slotOwner; /**< Tiled texture each slot belongs to, NULL if empty */
+	int *slotTile;     /**< Tile stored in each slot */
+	long useCount;     /**< Incremented each time any of its tiled textures is drawn */
+	int users;         /**< Number of tiled textures using the atlas */
+	struct tiledtex_atlas *next;
+} tiledtex_atlas;
+
+struct tiledtex {
+	tiledtex_header hdr;
+	FILE *file;
+	size_t tileBytes;  /**< Bytes per tile in the file */
+	int storedSize;    /**< tileSize + 2*border */
+
+	int levelW[TILEDTEX_MAX_LEVELS];
+	int levelH[TILEDTEX_MAX_LEVELS];
+	int tilesX[TILEDTEX_MAX_LEVELS];
+	int tilesY[TILEDTEX_MAX_LEVELS];
+	int levelFirst[TILEDTEX_MAX_LEVELS]; /**< Index of first tile in each level */
+	int numTiles;
+	tiledtex_tile *tiles;
+
+	tiledtex_atlas *atlas;
+	int uploadsPerDraw;
+
+	GLuint vao, vbo;
+	float *verts;      /**< Interleaved x,y,z,s,t for each vertex */
+	int vertsLen, vertsCap;
+	long drawCount;
+
+	/* Used only by the rendering thread */
+	tiledtex_request pending[TILEDTEX_MAX_OUTSTANDING]; /**< New requests made during this draw */
+	int numPending;
+	tiledtex_request ready[TILEDTEX_MAX_OUTSTANDING];   /**< Loaded tiles waiting to be uploaded */
+	int numReady;
+	int outstanding;   /**< Requests made but not yet uploaded or discarded */
+
+	/* Shared with the loader thread, protected by tiledtex_mutex */
+	tiledtex_request requests[TILEDTEX_MAX_OUTSTANDING];
+	int numRequests;
+	tiledtex_request done[TILEDTEX_MAX_OUTSTANDING];
+	int numDone;
+	long sharedDrawCount;
+	int busy;          /**< Set while the loader thread is reading a tile from this file */
+	int quit;
+	struct tiledtex *next;
+};
+
+/* Atlases that are in use. Only accessed by the rendering thread. */
+static tiledtex_atlas *tiledtex_atlases = NULL;
+
+/* All tiled textures share one loader thread. The list of tiled
+ * textures and the shared fields of each of them are protected by
+ * tiledtex_mutex. */
+static tiledtex *tiledtex_list = NULL;
+static long tiledtex_seq = 0;
+#ifndef _WIN32
+static pthread_mutex_t tiledtex_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tiledtex_cond = PTHREAD_COND_INITIALIZER;
+static int tiledtex_loader_running = 0;
+#endif
+
+
+/** Fills in the per-level dimensions of a pyramid from its header.
+
+    @return Number of levels needed for the image.
+*/
+static int tiledtex_levels(const tiledtex_header *hdr, int levelW[], int levelH[], int tilesX[], int tilesY[])
+{
+	int w = hdr->width, h = hdr->height;
+	for(int l=0; l<TILEDTEX_MAX_LEVELS; l++)
+	{
+		levelW[l] = w;
+		levelH[l] = h;
+		tilesX[l] = (w + hdr->tileSize - 1) / hdr->tileSize;
+		tilesY[l] = (h + hdr->tileSize - 1) / hdr->tileSize;
+		if(tilesX[l] == 1 && tilesY[l] == 1)
+			return l+1;
+		w = (w+1)/2;
+		h = (h+1)/2;
+	}
+	return TILEDTEX_MAX_LEVELS;
+}
+
+/** Halves the resolution of an image using a box filter. */
+static unsigned char* tiledtex_downsample(const unsigned char *src, int w, int h, int comp)
+{
+	int nw = (w+1)/2, nh = (h+1)/2;
+	unsigned char *dst = kuhl_malloc((size_t)nw*nh*comp);
+	for(int y=0; y<nh; y++)
+	{
+		int y0 = 2*y, y1 = 2*y+1 < h ? 2*y+1 : 2*y;
+		for(int x=0; x<nw; x++)
+		{
+			int x0 = 2*x, x1 = 2*x+1 < w ? 2*x+1 : 2*x;
+			for(int c=0; c<comp; c++)
+			{
+				int sum = src[((size_t)y0*w+x0)*comp+c] + src[((size_t)y0*w+x1)*comp+c] +
+				          src[((size_t)y1*w+x0)*comp+c] + src[((size_t)y1*w+x1)*comp+c];
+				dst[((size_t)y*nw+x)*comp+c] = (unsigned char)((sum+2)/4);
+			}
+		}
+	}
+	return dst;
+}
+
+/** Converts an image into a tiled pyramid file that can be loaded
+    with tiledtex_open(). The entire image must fit into main memory
+    but does not need to fit into a texture.
+
+    @param filename The file to write (typically ends in .ktp).
+
+    @param image Row-major pixels starting at the bottom left corner
+    of the image.
+
+    @param width Width of the image in pixels.
+
+    @param height Height of the image in pixels.
+
+    @param components 3 for RGB or 4 for RGBA.
+
+    @param tileSize Width and height of each tile. 256 or 512 is a
+    good choice.
+
+    @param shape The surface the image should be drawn on. Cylindrical
+    and spherical panoramas wrap around horizontally.
+
+    @return 0 on success, -1 on failure.
+*/
+int tiledtex_build(const char *filename, const unsigned char *image, int width, int height, int components, int tileSize, tiledtex_shape shape)
+{
+	if(image == NULL || width < 1 || height < 1 || tileSize < 1 ||
+	   (components != 3 && components != 4))
+	{
+		msg(MSG_ERROR, "Invalid image passed to tiledtex_build().");
+		return -1;
+	}
+
+	tiledtex_header hdr;
+	memcpy(hdr.magic, "KTP1", 4);
+	hdr.width = width;
+	hdr.height = height;
+	hdr.components = components;
+	hdr.tileSize = tileSize;
+	hdr.border = 1;
+	hdr.shape = shape;
+
+	int levelW[TILEDTEX_MAX_LEVELS], levelH[TILEDTEX_MAX_LEVELS];
+	int tilesX[TILEDTEX_MAX_LEVELS], tilesY[TILEDTEX_MAX_LEVELS];
+	hdr.levels = tiledtex_levels(&hdr, levelW, levelH, tilesX, tilesY);
+
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to open %s for writing.", filename);
+		return -1;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	int wrap = (shape == TILEDTEX_CYLINDER || shape == TILEDTEX_SPHERE);
+	int stored = tileSize + 2*hdr.border;
+	unsigned char *tile = kuhl_malloc((size_t)stored*stored*components);
+	const unsigned char *level = image;
+	int ok = 1;
+	for(int l=0; l<hdr.levels && ok; l++)
+	{
+		int w = levelW[l], h = levelH[l];
+		msg(MSG_INFO, "Level %2d: %6dx%-6d (%dx%d tiles)\n", l, w, h, tilesX[l], tilesY[l]);
+		for(int ty=0; ty<tilesY[l] && ok; ty++)
+		{
+			for(int tx=0; tx<tilesX[l] && ok; tx++)
+			{
+				for(int y=0; y<stored; y++)
+				{
+					int sy = ty*tileSize + y - hdr.border;
+					if(sy < 0)  sy = 0;
+					if(sy >= h) sy = h-1;
+					for(int x=0; x<stored; x++)
+					{
+						int sx = tx*tileSize + x - hdr.border;
+						if(wrap)
+							sx = ((sx % w) + w) % w;
+						else if(sx < 0)
+							sx = 0;
+						else if(sx >= w)
+							sx = w-1;
+						memcpy(tile + ((size_t)y*stored+x)*components,
+						       level + ((size_t)sy*w+sx)*components, components);
+					}
+				}
+				if(fwrite(tile, (size_t)stored*stored*components, 1, f) != 1)
+				{
+					msg(MSG_ERROR, "Failed to write tile to %s", filename);
+					ok = 0;
+				}
+			}
+		}
+
+		if(l+1 < hdr.levels)
+		{
+			unsigned char *next = tiledtex_downsample(level, w, h, components);
+			if(level != image)
+				free((void*)level);
+			level = next;
+		}
+	}
+	if(level != image)
+		free((void*)level);
+	free(tile);
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+/** Checks if a file appears to be a tiled pyramid file.
+
+    @return 1 if the file starts with the tiled pyramid header, 0 otherwise.
+*/
+int tiledtex_is_file(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+		return 0;
+	char magic[4];
+	int ret = fread(magic, 4, 1, f) == 1 && memcmp(magic, "KTP1", 4) == 0;
+	fclose(f);
+	return ret;
+}
+
+/** Reads one tile from disk. Called from the loader thread (or from
+ * the rendering thread before the loader thread starts).
+
+    @return Newly allocated tile pixels or NULL on error.
+ */
+static unsigned char* tiledtex_read_tile(tiledtex *tt, int tileIndex)
+{
+	unsigned char *pixels = malloc(tt->tileBytes);
+	if(pixels == NULL)
+		return NULL;
+	int64_t offset = sizeof(tiledtex_header) + (int64_t)tileIndex * tt->tileBytes;
+	if(tiledtex_fseek(tt->file, offset, SEEK_SET) != 0 ||
+	   fread(pixels, tt->tileBytes, 1, tt->file) != 1)
+	{
+		free(pixels);
+		return NULL;
+	}
+	return pixels;
+}
+
+#ifndef _WIN32
+/** Loader thread. Reads the most recently requested tile (of any
+ * tiled texture) first so that the tiles needed by the current view
+ * arrive before tiles for a view that the user has already moved
+ * away from. */
+static void* tiledtex_loader(void *arg)
+{
+	pthread_mutex_lock(&tiledtex_mutex);
+	while(1)
+	{
+		tiledtex *tt = NULL;
+		for(tiledtex *t = tiledtex_list; t != NULL; t = t->next)
+			if(!t->quit && t->numRequests > 0 &&
+			   (tt == NULL || t->requests[t->numRequests-1].seq > tt->requests[tt->numRequests-1].seq))
+				tt = t;
+		if(tt == NULL)
+		{
+			pthread_cond_wait(&tiledtex_cond, &tiledtex_mutex);
+			continue;
+		}
+		tiledtex_request r = tt->requests[--tt->numRequests];
+		r.stale = tt->sharedDrawCount - r.drawCount > TILEDTEX_STALE;
+		tt->busy = 1;
+		pthread_mutex_unlock(&tiledtex_mutex);
+
+		if(!r.stale)
+			r.pixels = tiledtex_read_tile(tt, r.tile);
+
+		pthread_mutex_lock(&tiledtex_mutex);
+		tt->done[tt->numDone++] = r;
+		tt->busy = 0;
+		/* tiledtex_free() may be waiting for us. */
+		pthread_cond_broadcast(&tiledtex_cond);
+	}
+	return NULL;
+}
+
+/** Starts the loader thread if it hasn't been started. */
+static void tiledtex_loader_start(void)
+{
+	if(tiledtex_loader_running)
+		return;
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, tiledtex_loader, NULL) != 0)
+	{
+		msg(MSG_FATAL, "Failed to create tiled texture loader thread.");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	tiledtex_loader_running = 1;
+}
+#endif
+
+
+/** Gets the atlas for tiles of a given size, creating it if
+ * needed. Requires a current OpenGL context.
+
+    @return The atlas or NULL if tiles of this size don't fit into a
+    texture.
+ */
+static tiledtex_atlas* tiledtex_atlas_get(int storedSize)
+{
+	for(tiledtex_atlas *a = tiledtex_atlases; a != NULL; a = a->next)
+	{
+		if(a->storedSize == storedSize)
+		{
+			a->users++;
+			return a;
+		}
+	}
+
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	int atlasSize = kuhl_config_int("tiledtex.atlassize", 4096, 4096);
+	if(atlasSize > maxTextureSize)
+		atlasSize = maxTextureSize;
+	if(atlasSize / storedSize < 1)
+	{
+		msg(MSG_ERROR, "Tiles (%dx%d) are larger than the largest supported texture (%d)", storedSize, storedSize, atlasSize);
+		return NULL;
+	}
+
+	tiledtex_atlas *a = calloc(1, sizeof(tiledtex_atlas));
+	a->storedSize = storedSize;
+	a->slotsPerRow = atlasSize / storedSize;
+	a->size = a->slotsPerRow * storedSize;
+	a->numSlots = a->slotsPerRow * a->slotsPerRow;
+	a->slotOwner = calloc(a->numSlots, sizeof(tiledtex*));
+	a->slotTile = kuhl_malloc(sizeof(int)*a->numSlots);
+	a->users = 1;
+
+	/* RGB and RGBA tiled textures share the atlas; RGB tiles are
+	 * opaque. */
+	GLint previouslyBoundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
+	glGenTextures(1, &(a->tex));
+	glBindTexture(GL_TEXTURE_2D, a->tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, a->size, a->size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+	kuhl_errorcheck();
+
+	a->next = tiledtex_atlases;
+	tiledtex_atlases = a;
+	msg(MSG_INFO, "Created %dx%d tiled texture atlas with %d slots\n", a->size, a->size, a->numSlots);
+	return a;
+}
+
+/** Removes the tiles of a tiled texture from its atlas and deletes
+ * the atlas if no other tiled texture uses it. */
+static void tiledtex_atlas_release(tiledtex *tt)
+{
+	tiledtex_atlas *a = tt->atlas;
+	if(a == NULL)
+		return;
+	tt->atlas = NULL;
+	for(int s=0; s<a->numSlots; s++)
+		if(a->slotOwner[s] == tt)
+			a->slotOwner[s] = NULL;
+	if(--a->users > 0)
+		return;
+
+	tiledtex_atlas **p = &tiledtex_atlases;
+	while(*p != a)
+		p = &((*p)->next);
+	*p = a->next;
+	glDeleteTextures(1, &(a->tex));
+	free(a->slotOwner);
+	free(a->slotTile);
+	free(a);
+}
+
+/** Finds an empty atlas slot or evicts the least recently used tile
+ * of any tiled texture that shares the atlas. The coarsest level of
+ * each tiled texture is never evicted.
+
+    @return A slot number or -1 if all slots are in use.
+ */
+static int tiledtex_find_slot(tiledtex_atlas *a)
+{
+	int best = -1;
+	long bestUsed = LONG_MAX;
+	long keep = a->useCount - (long) TILEDTEX_KEEP*a->users;
+	for(int s=0; s<a->numSlots; s++)
+	{
+		tiledtex *owner = a->slotOwner[s];
+		if(owner == NULL)
+			return s;
+		tiledtex_tile *t = &(owner->tiles[a->slotTile[s]]);
+		if(t->level == owner->hdr.levels-1 || t->lastUsed > keep)
+			continue;
+		if(t->lastUsed < bestUsed)
+		{
+			bestUsed = t->lastUsed;
+			best = s;
+		}
+	}
+	if(best >= 0)
+	{
+		tiledtex_tile *t = &(a->slotOwner[best]->tiles[a->slotTile[best]]);
+		t->state = TILE_EMPTY;
+		t->slot = -1;
+		a->slotOwner[best] = NULL;
+	}
+	return best;
+}
+
+/** Copies a loaded tile into the atlas. Assumes the atlas is bound. */
+static void tiledtex_upload(tiledtex *tt, int tileIndex, const unsigned char *pixels)
+{
+	tiledtex_tile *t = &(tt->tiles[tileIndex]);
+	tiledtex_atlas *a = tt->atlas;
+	int slot = tiledtex_find_slot(a);
+	if(slot < 0)
+	{
+		/* Atlas is full of tiles that are in use. If the tile is
+		 * still needed, it will be requested again. */
+		t->state = TILE_EMPTY;
+		return;
+	}
+	GLenum format = tt->hdr.components == 4 ? GL_RGBA : GL_RGB;
+	/* Rows of RGB tiles may not be a multiple of 4 bytes long. */
+	GLint previousAlignment = 4;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &previousAlignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0,
+	                (slot % a->slotsPerRow) * a->storedSize,
+	                (slot / a->slotsPerRow) * a->storedSize,
+	                a->storedSize, a->storedSize, format, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, previousAlignment);
+	t->state = TILE_RESIDENT;
+	t->slot = slot;
+	t->lastUsed = a->useCount;
+	a->slotOwner[slot] = tt;
+	a->slotTile[slot] = tileIndex;
+}
+
+
+/** Opens a tiled pyramid file. The coarsest level is loaded
+    immediately; all other tiles are loaded as needed by
+    tiledtex_draw(). Requires a current OpenGL context.
+
+    @param filename The tiled pyramid file created by tiledtex_build().
+
+    @return A tiledtex object or NULL on error.
+*/
+tiledtex* tiledtex_open(const char *filename)
+{
+	char *path = kuhl_find_file(filename);
+	FILE *f = fopen(path, "rb");
+	free(path);
+	if(f == NULL)
+	{
+		msg(MSG_ERROR, "Unable to open tiled texture %s", filename);
+		return NULL;
+	}
+
+	tiledtex *tt = calloc(1, sizeof(tiledtex));
+	tt->file = f;
+	if(fread(&(tt->hdr), sizeof(tiledtex_header), 1, f) != 1 ||
+	   memcmp(tt->hdr.magic, "KTP1", 4) != 0 ||
+	   tt->hdr.levels < 1 || tt->hdr.levels > TILEDTEX_MAX_LEVELS ||
+	   tt->hdr.tileSize < 1 || tt->hdr.border < 0 ||
+	   (tt->hdr.components != 3 && tt->hdr.components != 4))
+	{
+		msg(MSG_ERROR, "%s is not a valid tiled texture file.", filename);
+		fclose(f);
+		free(tt);
+		return NULL;
+	}
+
+	tiledtex_levels(&(tt->hdr), tt->levelW, tt->levelH, tt->tilesX, tt->tilesY);
+	tt->storedSize = tt->hdr.tileSize + 2*tt->hdr.border;
+	tt->tileBytes = (size_t)tt->storedSize * tt->storedSize * tt->hdr.components;
+	tt->numTiles = 0;
+	for(int l=0; l<tt->hdr.levels; l++)
+	{
+		tt->levelFirst[l] = tt->numTiles;
+		tt->numTiles += tt->tilesX[l]*tt->tilesY[l];
+	}
+	tt->tiles = kuhl_malloc(sizeof(tiledtex_tile)*tt->numTiles);
+	for(int l=0; l<tt->hdr.levels; l++)
+		for(int ty=0; ty<tt->tilesY[l]; ty++)
+			for(int tx=0; tx<tt->tilesX[l]; tx++)
+			{
+				tiledtex_tile *t = &(tt->tiles[tt->levelFirst[l] + ty*tt->tilesX[l] + tx]);
+				t->level = l;
+				t->tx = tx;
+				t->ty = ty;
+				t->state = TILE_EMPTY;
+				t->slot = -1;
+				t->lastUsed = 0;
+			}
+
+	/* Find (or create) the atlas that caches tiles. */
+	tt->atlas = tiledtex_atlas_get(tt->storedSize);
+	if(tt->atlas == NULL)
+	{
+		msg(MSG_ERROR, "Unable to cache the tiles of %s", filename);
+		tiledtex_free(tt);
+		return NULL;
+	}
+	tt->uploadsPerDraw = kuhl_config_int("tiledtex.uploads", 8, 8);
+
+	GLint previouslyBoundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
+	glBindTexture(GL_TEXTURE_2D, tt->atlas->tex);
+
+	/* The coarsest level is always resident so that there is always
+	 * something to draw. */
+	int top = tt->hdr.levels-1;
+	for(int i=tt->levelFirst[top]; i<tt->numTiles; i++)
+	{
+		unsigned char *pixels = tiledtex_read_tile(tt, i);
+		if(pixels == NULL)
+		{
+			msg(MSG_ERROR, "Failed to read tile %d from %s", i, filename);
+			glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+			tiledtex_free(tt);
+			return NULL;
+		}
+		tiledtex_upload(tt, i, pixels);
+		free(pixels);
+		if(tt->tiles[i].state != TILE_RESIDENT)
+		{
+			msg(MSG_ERROR, "The tiled texture atlas is too full to open %s; try increasing tiledtex.atlassize.", filename);
+			glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+			tiledtex_free(tt);
+			return NULL;
+		}
+	}
+	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+	kuhl_errorcheck();
+
+	glGenVertexArrays(1, &(tt->vao));
+	glGenBuffers(1, &(tt->vbo));
+
+	/* Hand the tiled texture to the loader thread. */
+#ifndef _WIN32
+	pthread_mutex_lock(&tiledtex_mutex);
+	tiledtex_loader_start();
+#endif
+	tt->next = tiledtex_list;
+	tiledtex_list = tt;
+#ifndef _WIN32
+	pthread_mutex_unlock(&tiledtex_mutex);
+#endif
+
+	msg(MSG_INFO, "Opened tiled texture %s: %dx%d, %d levels, %d tiles, %d atlas slots shared by %d tiled texture(s)\n", filename,
+	    tt->hdr.width, tt->hdr.height, tt->hdr.levels, tt->numTiles, tt->atlas->numSlots, tt->atlas->users);
+	return tt;
+}
+
+
+/** Converts a texture coordinate on the surface to a 3D point. */
+static void tiledtex_surface(float pos[3], tiledtex_shape shape, float u, float v)
+{
+	switch(shape)
+	{
+		case TILEDTEX_CYLINDER:
+		{
+			float theta = (1-u)*2*M_PI;
+			pos[0] = .5*sin(theta);
+			pos[1] = v-.5;
+			pos[2] = .5*cos(theta);
+			break;
+		}
+		case TILEDTEX_SPHERE:
+		{
+			float theta = (1-u)*2*M_PI;
+			float phi = (v-.5)*M_PI;
+			pos[0] = .5*cos(phi)*sin(theta);
+			pos[1] = .5*sin(phi);
+			pos[2] = .5*cos(phi)*cos(theta);
+			break;
+		}
+		default:
+			pos[0] = u-.5;
+			pos[1] = v-.5;
+			pos[2] = -.5;
+			break;
+	}
+}
+
+/** Information needed while walking the pyramid during one draw. */
+typedef struct {
+	float mvp[16];
+	int viewport[4];
+	int grid;  /**< Number of rows/columns of quads drawn per tile */
+} tiledtex_view;
+
+#define TILEDTEX_MAX_GRID 8
+
+/** Region of the full image covered by a tile in texture coordinates. */
+static void tiledtex_tile_uv(const tiledtex *tt, const tiledtex_tile *t, float uv[4])
+{
+	float scale = (float)(1 << t->level) * tt->hdr.tileSize;
+	uv[0] = t->tx * scale / tt->hdr.width;
+	uv[1] = t->ty * scale / tt->hdr.height;
+	uv[2] = fminf(1, (t->tx+1) * scale / tt->hdr.width);
+	uv[3] = fminf(1, (t->ty+1) * scale / tt->hdr.height);
+}
+
+/** Appends the quads covering a tile to the vertex array. The
+ * texture coordinates point to the part of the atlas slot of a
+ * resident ancestor tile (or the tile itself) that covers the
+ * tile. */
+static void tiledtex_emit(tiledtex *tt, const tiledtex_view *view, const float pts[][3], const float uv[4], const tiledtex_tile *src)
+{
+	float srcUV[4];
+	tiledtex_tile_uv(tt, src, srcUV);
+	int contentW = tt->levelW[src->level] - src->tx*tt->hdr.tileSize;
+	int contentH = tt->levelH[src->level] - src->ty*tt->hdr.tileSize;
+	if(contentW > tt->hdr.tileSize) contentW = tt->hdr.tileSize;
+	if(contentH > tt->hdr.tileSize) contentH = tt->hdr.tileSize;
+	const tiledtex_atlas *a = tt->atlas;
+	float slotX = (src->slot % a->slotsPerRow) * a->storedSize + tt->hdr.border;
+	float slotY = (src->slot / a->slotsPerRow) * a->storedSize + tt->hdr.border;
+
+	int g = view->grid;
+	int needed = tt->vertsLen + g*g*6*5;
+	if(needed > tt->vertsCap)
+	{
+		tt->vertsCap = needed*2;
+		tt->verts = realloc(tt->verts, sizeof(float)*tt->vertsCap);
+	}
+
+	static const int corners[6][2] = { {0,0}, {1,0}, {1,1}, {0,0}, {1,1}, {0,1} };
+	for(int j=0; j<g; j++)
+		for(int i=0; i<g; i++)
+			for(int c=0; c<6; c++)
+			{
+				int gi = i + corners[c][0];
+				int gj = j + corners[c][1];
+				float u = uv[0] + (uv[2]-uv[0]) * gi / g;
+				float v = uv[1] + (uv[3]-uv[1]) * gj / g;
+				float *vert = tt->verts + tt->vertsLen;
+				memcpy(vert, pts[gj*(g+1)+gi], sizeof(float)*3);
+				vert[3] = (slotX + (u-srcUV[0])/(srcUV[2]-srcUV[0]) * contentW) / a->size;
+				vert[4] = (slotY + (v-srcUV[1])/(srcUV[3]-srcUV[1]) * contentH) / a->size;
+				tt->vertsLen += 5;
+			}
+}
+
+/** Queues a tile to be read by the loader thread. */
+static void tiledtex_request_tile(tiledtex *tt, int tileIndex)
+{
+	tiledtex_tile *t = &(tt->tiles[tileIndex]);
+	if(t->state != TILE_EMPTY || tt->outstanding >= TILEDTEX_MAX_OUTSTANDING)
+		return;
+	t->state = TILE_REQUESTED;
+	tiledtex_request *r = &(tt->pending[tt->numPending++]);
+	r->tile = tileIndex;
+	r->drawCount = tt->drawCount;
+	r->stale = 0;
+	r->pixels = NULL;
+	tt->outstanding++;
+}
+
+/** Decides if a tile is visible and how much detail it needs. Draws
+ * the tile or recursively visits its four children at the next finer
+ * level.
+
+    @param best The finest resident tile that covers this tile.
+ */
+static void tiledtex_visit(tiledtex *tt, const tiledtex_view *view, int tileIndex, const tiledtex_tile *best)
+{
+	tiledtex_tile *t = &(tt->tiles[tileIndex]);
+	float uv[4];
+	tiledtex_tile_uv(tt, t, uv);
+
+	/* Transform a grid of points on the tile into clip coordinates. */
+	int g = view->grid;
+	float pts[(TILEDTEX_MAX_GRID+1)*(TILEDTEX_MAX_GRID+1)][3];
+	int outside[6] = { 1,1,1,1,1,1 }; // are all points outside of each clip plane?
+	int behind = 0;
+	float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+	for(int j=0; j<=g; j++)
+		for(int i=0; i<=g; i++)
+		{
+			float *p = pts[j*(g+1)+i];
+			tiledtex_surface(p, (tiledtex_shape) tt->hdr.shape,
+			                 uv[0] + (uv[2]-uv[0])*i/g, uv[1] + (uv[3]-uv[1])*j/g);
+			float clip[4] = { p[0], p[1], p[2], 1 };
+			mat4f_mult_vec4f(clip, view->mvp);
+			for(int k=0; k<3; k++)
+			{
+				if(clip[k] >= -clip[3]) outside[2*k]   = 0;
+				if(clip[k] <=  clip[3]) outside[2*k+1] = 0;
+			}
+			if(clip[3] <= 0)
+			{
+				behind = 1;
+				continue;
+			}
+			float x = (clip[0]/clip[3]*.5+.5) * view->viewport[2];
+			float y = (clip[1]/clip[3]*.5+.5) * view->viewport[3];
+			minX = fminf(minX, x); maxX = fmaxf(maxX, x);
+			minY = fminf(minY, y); maxY = fmaxf(maxY, y);
+		}
+	for(int k=0; k<6; k++)
+		if(outside[k])
+			return;
+
+	if(t->state == TILE_RESIDENT)
+	{
+		t->lastUsed = tt->atlas->useCount;
+		best = t;
+	}
+
+	/* If the tile covers more pixels on the screen than it has texels,
+	 * use the next finer level. */
+	int refine = 0;
+	if(t->level > 0)
+	{
+		int contentW = tt->levelW[t->level] - t->tx*tt->hdr.tileSize;
+		int contentH = tt->levelH[t->level] - t->ty*tt->hdr.tileSize;
+		if(contentW > tt->hdr.tileSize) contentW = tt->hdr.tileSize;
+		if(contentH > tt->hdr.tileSize) contentH = tt->hdr.tileSize;
+		refine = behind || maxX-minX > contentW || maxY-minY > contentH;
+	}
+
+	if(!refine)
+	{
+		tiledtex_request_tile(tt, tileIndex);
+		tiledtex_emit(tt, view, (const float (*)[3]) pts, uv, best);
+		return;
+	}
+
+	int cl = t->level-1;
+	for(int cy=2*t->ty; cy<=2*t->ty+1 && cy<tt->tilesY[cl]; cy++)
+		for(int cx=2*t->tx; cx<=2*t->tx+1 && cx<tt->tilesX[cl]; cx++)
+			tiledtex_visit(tt, view, tt->levelFirst[cl] + cy*tt->tilesX[cl] + cx, best);
+}
+
+
+/** Draws a tiled texture. Before calling this function, the caller
+    should call glUseProgram() with a program that has "in_Position"
+    and "in_TexCoord" attributes and a "tex" sampler (such as
+    texture.vert and texture.frag) and set its ModelView and
+    Projection uniforms to the same matrices passed to this
+    function. Tiles that are not yet loaded are requested; the best
+    available lower-resolution tiles are drawn in their place.
+
+    @param tt The tiled texture to draw.
+    @param modelview The modelview matrix used to draw the surface.
+    @param projection The projection matrix.
+    @param viewport The viewport we are drawing into (x, y, width, height).
+*/
+void tiledtex_draw(tiledtex *tt, const float modelview[16], const float projection[16], const int viewport[4])
+{
+	if(tt == NULL)
+		return;
+	tt->drawCount++;
+	tt->atlas->useCount++;
+	kuhl_errorcheck();
+
+	GLint previouslyBoundTexture = 0;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
+	GLint previouslyActiveTexture = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
+	GLint previousVAO = 0;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
+	GLint program = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tt->atlas->tex);
+
+	/* Copy tiles that the loader thread has finished reading into the
+	 * atlas. */
+#ifndef _WIN32
+	pthread_mutex_lock(&tiledtex_mutex);
+	for(int i=0; i<tt->numDone; i++)
+		tt->ready[tt->numReady++] = tt->done[i];
+	tt->numDone = 0;
+	pthread_mutex_unlock(&tiledtex_mutex);
+#endif
+	int uploads = 0;
+	while(tt->numReady > 0 && uploads < tt->uploadsPerDraw)
+	{
+		tiledtex_request *r = &(tt->ready[--tt->numReady]);
+		if(r->pixels != NULL)
+		{
+			tiledtex_upload(tt, r->tile, r->pixels);
+			free(r->pixels);
+			uploads++;
+		}
+		else if(r->stale)
+			tt->tiles[r->tile].state = TILE_EMPTY;
+		else
+		{
+			msg(MSG_ERROR, "Failed to read tile %d from tiled texture.", r->tile);
+			tt->tiles[r->tile].state = TILE_FAILED;
+		}
+		tt->outstanding--;
+	}
+	kuhl_errorcheck();
+
+	/* Decide which tiles to draw and which tiles to request. */
+	tiledtex_view view;
+	mat4f_mult_mat4f_new(view.mvp, projection, modelview);
+	memcpy(view.viewport, viewport, sizeof(int)*4);
+	view.grid = tt->hdr.shape == TILEDTEX_PLANE ? 1 : TILEDTEX_MAX_GRID;
+	tt->vertsLen = 0;
+	int top = tt->hdr.levels-1;
+	for(int i=tt->levelFirst[top]; i<tt->numTiles; i++)
+		tiledtex_visit(tt, &view, i, &(tt->tiles[i]));
+
+	/* Hand the new requests to the loader thread. */
+#ifndef _WIN32
+	pthread_mutex_lock(&tiledtex_mutex);
+	for(int i=0; i<tt->numPending; i++)
+	{
+		tt->pending[i].seq = tiledtex_seq++;
+		tt->requests[tt->numRequests++] = tt->pending[i];
+	}
+	tt->sharedDrawCount = tt->drawCount;
+	if(tt->numPending > 0)
+		pthread_cond_broadcast(&tiledtex_cond);
+	pthread_mutex_unlock(&tiledtex_mutex);
+#else
+	/* No loader thread on Windows: Read tiles now; they will be
+	 * uploaded the next time we draw. */
+	for(int i=0; i<tt->numPending; i++)
+	{
+		tt->pending[i].pixels = tiledtex_read_tile(tt, tt->pending[i].tile);
+		tt->ready[tt->numReady++] = tt->pending[i];
+	}
+#endif
+	tt->numPending = 0;
+
+	/* Draw all of the tiles with one draw call. */
+	if(tt->vertsLen > 0 && program != 0)
+	{
+		glBindVertexArray(tt->vao);
+		glBindBuffer(GL_ARRAY_BUFFER, tt->vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(float)*tt->vertsLen, tt->verts, GL_STREAM_DRAW);
+		GLint posLoc = glGetAttribLocation(program, "in_Position");
+		GLint texLoc = glGetAttribLocation(program, "in_TexCoord");
+		if(posLoc != -1)
+		{
+			glEnableVertexAttribArray(posLoc);
+			glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, sizeof(float)*5, 0);
+		}
+		if(texLoc != -1)
+		{
+			glEnableVertexAttribArray(texLoc);
+			glVertexAttribPointer(texLoc, 2, GL_FLOAT, GL_FALSE, sizeof(float)*5, (void*)(sizeof(float)*3));
+		}
+		GLint samplerLoc = glGetUniformLocation(program, "tex");
+		if(samplerLoc != -1)
+			glUniform1i(samplerLoc, 0);
+		glDrawArrays(GL_TRIANGLES, 0, tt->vertsLen/5);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+
+	glBindVertexArray(previousVAO);
+	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+	glActiveTexture(previouslyActiveTexture);
+	kuhl_errorcheck();
+}
+
+/** Frees all resources associated with a tiled texture (including
+ * OpenGL objects). The atlas is deleted when the last tiled texture
+ * that uses it is freed.
+
+    @param tt The tiled texture to free.
+*/
+void tiledtex_free(tiledtex *tt)
+{
+	if(tt == NULL)
+		return;
+
+	/* Take the tiled texture away from the loader thread. */
+#ifndef _WIN32
+	pthread_mutex_lock(&tiledtex_mutex);
+	tt->quit = 1;
+	while(tt->busy)
+		pthread_cond_wait(&tiledtex_cond, &tiledtex_mutex);
+#endif
+	tiledtex **p = &tiledtex_list;
+	while(*p != NULL && *p != tt)
+		p = &((*p)->next);
+	if(*p != NULL)
+		*p = tt->next;
+#ifndef _WIN32
+	pthread_mutex_unlock(&tiledtex_mutex);
+#endif
+
+	for(int i=0; i<tt->numDone; i++)
+		free(tt->done[i].pixels);
+	for(int i=0; i<tt->numReady; i++)
+		free(tt->ready[i].pixels);
+	tiledtex_atlas_release(tt);
+	if(tt->vao != 0)
+		glDeleteVertexArrays(1, &(tt->vao));
+	if(tt->vbo != 0)
+		glDeleteBuffers(1, &(tt->vbo));
+	if(tt->file != NULL)
+		fclose(tt->file);
+	free(tt->tiles);
+	free(tt->verts);
+	free(tt);
+}
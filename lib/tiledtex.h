@@ -0,0 +1,90 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    tiledtex provides a tiled texture pyramid (sometimes called
+    "sparse" or "virtual" texturing) for images that are too large to
+    fit into a single OpenGL texture or into video memory. It is
+    primarily intended for very large (gigapixel) panoramas.
+
+    An image is first converted into a tiled pyramid file (*.ktp)
+    with tiledtex_build() (see samples/panorama-tiler.c). Level 0 of
+    the pyramid contains the full resolution image. Each subsequent
+    level is half of the resolution of the previous level. The last
+    level always fits into a single tile. Every level is divided into
+    square tiles with a small border so that linear filtering does not
+    bleed between neighboring tiles.
+
+    At runtime, tiledtex_open() loads only the coarsest level. Each
+    time tiledtex_draw() is called, the tiles are tested against the
+    view frustum on the CPU and the resolution that is needed for each
+    visible tile is estimated from its projected size on the
+    screen. Tiles that are needed but are not yet in video memory are
+    requested from a background thread which reads them from
+    disk. Loaded tiles are copied into an "atlas" texture which acts
+    as a cache. Until a tile arrives, the best lower-resolution
+    ancestor that is available is drawn in its place. The least
+    recently used tiles are evicted when the atlas is full. All tiled
+    textures share one loader thread, and all tiled textures with the
+    same tile size share one atlas (the six or twelve faces of a
+    cubemap use a single atlas).
+
+    The following configuration file settings are supported:
+
+    tiledtex.atlassize - Width and height of each atlas texture in
+    pixels (default 4096). The value is reduced if the video card does
+    not support textures that large.
+
+    tiledtex.uploads - Maximum number of tiles to copy into the atlas
+    per call to tiledtex_draw() (default 8).
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <GL/glew.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The surface that a tiled texture is wrapped around when it is
+ * drawn. All surfaces have a width, height and/or diameter of 1 and
+ * are centered at the origin. */
+typedef enum {
+	TILEDTEX_PLANE = 0,    /**< Quad from (-.5,-.5,-.5) to (.5,.5,-.5) (one face of a cubemap) */
+	TILEDTEX_CYLINDER = 1, /**< Cylindrical panorama; matches the cylinder in panorama.c */
+	TILEDTEX_SPHERE = 2    /**< Equirectangular panorama on a sphere */
+} tiledtex_shape;
+
+/** Header at the beginning of a tiled pyramid file. The tile data
+ * follows immediately after the header. Tiles are stored one level at
+ * a time (level 0 first), row by row starting at the bottom left
+ * tile. Each tile is (tileSize+2*border)^2*components bytes. */
+typedef struct {
+	char magic[4];      /**< Always "KTP1" */
+	int32_t width;      /**< Width of level 0 in pixels */
+	int32_t height;     /**< Height of level 0 in pixels */
+	int32_t components; /**< 3 (RGB) or 4 (RGBA) */
+	int32_t tileSize;   /**< Width and height of the usable area of each tile */
+	int32_t border;     /**< Number of border pixels on each side of each tile */
+	int32_t levels;     /**< Number of levels in the pyramid */
+	int32_t shape;      /**< A tiledtex_shape value */
+} tiledtex_header;
+
+typedef struct tiledtex tiledtex;
+
+int tiledtex_build(const char *filename, const unsigned char *image, int width, int height, int components, int tileSize, tiledtex_shape shape);
+int tiledtex_is_file(const char *filename);
+
+tiledtex* tiledtex_open(const char *filename);
+void tiledtex_draw(tiledtex *tt, const float modelview[16], const float projection[16], const int viewport[4]);
+void tiledtex_free(tiledtex *tt);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -0,0 +1,275 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file track-stats computes statistics about a stream of tracking
+ * records one record at a time: the mean and standard deviation of the
+ * position and orientation (Welford's method), the time between
+ * records and how much it varies (jitter), drop-outs, the latency and
+ * the Allan deviation of the position. The Allan deviation shows how
+ * the noise changes with the averaging time: white noise decreases as
+ * more records are averaged while drift does not. Since the records
+ * are not stored, the memory needed doesn't depend on how many records
+ * are added, so the statistics can be collected from a live tracker
+ * for as long as needed or from a long recording.
+ *
+ * @author Scott Kuhl
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "track-stats.h"
+#include "vecmat.h"
+
+/* Number of intervals to average before the mean interval is used to
+ * find drop-outs and jitter. */
+#define TRACK_STATS_WARMUP 10
+
+/** Initializes a track_stats struct.
+
+    @param s The struct to initialize.
+
+    @param binUsec Width of the histogram bins in microseconds (250 if
+    0 or less).
+
+    @param dropoutFactor An interval between records that is longer
+    than this times the mean interval is a drop-out (3 if 0 or less).
+*/
+void track_stats_init(track_stats *s, long binUsec, float dropoutFactor)
+{
+	memset(s, 0, sizeof(track_stats));
+	s->binUsec = binUsec > 0 ? binUsec : 250;
+	s->dropoutFactor = dropoutFactor > 0 ? dropoutFactor : 3;
+}
+
+static void track_stats_welford(long n, double *mean, double *m2, double value)
+{
+	double delta = value - *mean;
+	*mean += delta / n;
+	*m2 += delta * (value - *mean);
+}
+
+static void track_stats_allan_add(track_stats_allan allan[TRACK_STATS_ALLAN_LEVELS], double value)
+{
+	for(int k=0; k<TRACK_STATS_ALLAN_LEVELS; k++)
+	{
+		track_stats_allan *a = &allan[k];
+		a->sum += value;
+		a->inGroup++;
+		if(a->inGroup < (1 << k))
+			continue;
+
+		double avg = a->sum / a->inGroup;
+		if(a->groups > 0)
+			a->sumSq += (avg - a->prevAvg) * (avg - a->prevAvg);
+		a->prevAvg = avg;
+		a->groups++;
+		a->sum = 0;
+		a->inGroup = 0;
+	}
+}
+
+/** Adds a record.
+
+    @param s The statistics to add the record to.
+
+    @param usec The time the record was recorded (microseconds).
+
+    @param received The time the record was received (microseconds, on
+    the same clock as usec) or 0 if it isn't known.
+
+    @param pos The position.
+
+    @param quat The orientation quaternion (x,y,z,w).
+*/
+void track_stats_add(track_stats *s, long usec, long received, const float pos[3], const float quat[4])
+{
+	s->count++;
+
+	/* q and -q are the same orientation; use the one that is closest
+	 * to the first record so that averaging the components works. */
+	float q[4];
+	vec4f_copy(q, quat);
+	if(s->count == 1)
+		vec4f_copy(s->firstQuat, q);
+	else if(vec4f_dot(q, s->firstQuat) < 0)
+		vec4f_scalarMult(q, -1);
+
+	for(int i=0; i<3; i++)
+		track_stats_welford(s->count, &s->mean[i], &s->m2[i], pos[i]);
+	for(int i=0; i<4; i++)
+		track_stats_welford(s->count, &s->mean[3+i], &s->m2[3+i], q[i]);
+	for(int i=0; i<3; i++)
+		track_stats_allan_add(s->allan[i], pos[i]);
+
+	if(received != 0)
+	{
+		s->latencies++;
+		track_stats_welford(s->latencies, &s->latencyMean, &s->latencyM2, received - usec);
+	}
+
+	if(s->count == 1)
+	{
+		s->firstTime = usec;
+		s->lastTime = usec;
+		return;
+	}
+
+	long interval = usec - s->lastTime;
+	if(interval <= 0)
+	{
+		s->backwards++;
+		if(interval < 0)
+			return;
+	}
+	s->lastTime = usec;
+
+	/* Look for drop-outs and jitter with the mean interval before this
+	 * one was added. */
+	if(s->intervals >= TRACK_STATS_WARMUP)
+	{
+		double expected = s->intervalMean;
+		if(interval > s->dropoutFactor * expected)
+		{
+			s->dropouts++;
+			s->dropoutUsec += interval - expected;
+		}
+		int bin = (int) floor((interval - expected) / s->binUsec) + TRACK_STATS_BINS/2;
+		if(bin < 0)
+			bin = 0;
+		if(bin >= TRACK_STATS_BINS)
+			bin = TRACK_STATS_BINS-1;
+		s->jitterHist[bin]++;
+	}
+
+	s->intervals++;
+	track_stats_welford(s->intervals, &s->intervalMean, &s->intervalM2, interval);
+	if(s->intervals == 1 || interval < s->intervalMin)
+		s->intervalMin = interval;
+	if(interval > s->intervalMax)
+		s->intervalMax = interval;
+	if(interval > s->longestGap)
+	{
+		s->longestGap = interval;
+		s->longestGapTime = usec;
+	}
+	long bin = interval / s->binUsec;
+	s->intervalHist[bin < TRACK_STATS_BINS ? bin : TRACK_STATS_BINS-1]++;
+}
+
+/** Returns the standard deviation of x, y, z or a quaternion
+ * component (value 0 to 6). */
+double track_stats_stddev(const track_stats *s, int value)
+{
+	if(s->count < 2)
+		return 0;
+	return sqrt(s->m2[value] / (s->count-1));
+}
+
+/** Returns the Allan deviation of a position axis.
+
+    @param s The statistics.
+
+    @param axis 0, 1 or 2 for x, y or z.
+
+    @param level The averaging time is 2^level records.
+
+    @param tau Set to the averaging time in seconds (based on the mean
+    interval between records).
+
+    @return The Allan deviation or -1 if there aren't enough records
+    for this averaging time.
+*/
+double track_stats_allan_dev(const track_stats *s, int axis, int level, double *tau)
+{
+	const track_stats_allan *a = &(s->allan[axis][level]);
+	*tau = (1 << level) * s->intervalMean / 1000000.0;
+	/* Require a few differences so that the estimate means something. */
+	if(a->groups < 4)
+		return -1;
+	return sqrt(a->sumSq / (2.0 * (a->groups-1)));
+}
+
+static void track_stats_histogram(const long hist[TRACK_STATS_BINS], long binUsec, long offsetBins, const char *lastLabel)
+{
+	long most = 0, total = 0;
+	for(int i=0; i<TRACK_STATS_BINS; i++)
+	{
+		total += hist[i];
+		if(hist[i] > most)
+			most = hist[i];
+	}
+	if(total == 0)
+		return;
+	for(int i=0; i<TRACK_STATS_BINS; i++)
+	{
+		if(hist[i] == 0)
+			continue;
+		char bar[41];
+		int len = (int) (40 * hist[i] / most);
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		double from = (i - offsetBins) * binUsec / 1000.0;
+		if(i == TRACK_STATS_BINS-1 && lastLabel)
+			printf("  %s %7.2f ms %9ld %5.1f%% %s\n", lastLabel, from, hist[i], 100.0*hist[i]/total, bar);
+		else
+			printf("  %7.2f to %7.2f ms %9ld %5.1f%% %s\n", from, from + binUsec/1000.0,
+			       hist[i], 100.0*hist[i]/total, bar);
+	}
+}
+
+/** Prints the statistics.
+
+    @param s The statistics to print.
+
+    @param name The name of the object (can be NULL).
+*/
+void track_stats_print(const track_stats *s, const char *name)
+{
+	double seconds = (s->lastTime - s->firstTime) / 1000000.0;
+	printf("=== %s: %ld records in %.2f seconds (%.1f records/second)\n", name ? name : "",
+	       s->count, seconds, seconds > 0 ? s->intervals / seconds : 0.0);
+	if(s->count == 0)
+		return;
+
+	printf("Position mean:   %12.6f %12.6f %12.6f\n", s->mean[0], s->mean[1], s->mean[2]);
+	printf("Position stddev: %12.8f %12.8f %12.8f\n",
+	       track_stats_stddev(s, 0), track_stats_stddev(s, 1), track_stats_stddev(s, 2));
+	printf("Quat mean:       %12.6f %12.6f %12.6f %12.6f\n", s->mean[3], s->mean[4], s->mean[5], s->mean[6]);
+	printf("Quat stddev:     %12.8f %12.8f %12.8f %12.8f\n",
+	       track_stats_stddev(s, 3), track_stats_stddev(s, 4), track_stats_stddev(s, 5), track_stats_stddev(s, 6));
+
+	if(s->intervals > 0)
+	{
+		printf("Interval: mean %.3f ms, stddev (jitter) %.3f ms, min %.3f ms, max %.3f ms\n",
+		       s->intervalMean / 1000, s->intervals > 1 ? sqrt(s->intervalM2 / (s->intervals-1)) / 1000 : 0.0,
+		       s->intervalMin / 1000.0, s->intervalMax / 1000.0);
+		printf("Drop-outs (interval > %.1fx mean): %ld, %.1f ms lost, longest gap %.3f ms at %.3f seconds\n",
+		       s->dropoutFactor, s->dropouts, s->dropoutUsec / 1000,
+		       s->longestGap / 1000.0, (s->longestGapTime - s->firstTime) / 1000000.0);
+	}
+	if(s->backwards > 0)
+		printf("Records with a time that was not after the previous record: %ld\n", s->backwards);
+	if(s->latencies > 1)
+		printf("Latency: mean %.3f ms, stddev %.3f ms\n", s->latencyMean / 1000,
+		       sqrt(s->latencyM2 / (s->latencies-1)) / 1000);
+
+	printf("Interval histogram:\n");
+	track_stats_histogram(s->intervalHist, s->binUsec, 0, "    longer than");
+	printf("Jitter histogram (interval minus mean interval):\n");
+	track_stats_histogram(s->jitterHist, s->binUsec, TRACK_STATS_BINS/2, NULL);
+
+	printf("Allan deviation of position:\n");
+	printf("  %12s %12s %12s %12s\n", "tau (s)", "x", "y", "z");
+	for(int k=0; k<TRACK_STATS_ALLAN_LEVELS; k++)
+	{
+		double tau, dev[3];
+		for(int i=0; i<3; i++)
+			dev[i] = track_stats_allan_dev(s, i, k, &tau);
+		if(dev[0] < 0)
+			break;
+		printf("  %12.4f %12.8f %12.8f %12.8f\n", tau, dev[0], dev[1], dev[2]);
+	}
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of bins in the update interval and jitter histograms (the
+ * last bin of the interval histogram also counts everything larger). */
+#define TRACK_STATS_BINS 64
+
+/** Number of averaging times in the Allan deviation. Level k
+ * averages 2^k records. */
+#define TRACK_STATS_ALLAN_LEVELS 16
+
+/** One averaging time of the Allan deviation of one value. */
+typedef struct {
+	double sum;      /**< Sum of the values in the current group */
+	double prevAvg;  /**< Average of the previous group */
+	double sumSq;    /**< Sum of squared differences between averages of neighboring groups */
+	long groups;     /**< Number of completed groups */
+	int inGroup;     /**< Number of values in the current group */
+} track_stats_allan;
+
+/** Statistics about the records of one tracked object. Records are
+ * added one at a time and the memory used doesn't depend on the
+ * number of records. */
+typedef struct {
+	long count;          /**< Number of records */
+
+	/* Mean and sum of squared differences from the mean (Welford's
+	 * method) of x, y, z and the quaternion */
+	double mean[7];
+	double m2[7];
+	float firstQuat[4];  /**< Quaternions are flipped to be in the same hemisphere as this one */
+
+	/* Time between records (microseconds) */
+	long firstTime;      /**< Time of the first record */
+	long lastTime;       /**< Time of the latest record */
+	long intervals;      /**< Number of intervals between records */
+	double intervalMean;
+	double intervalM2;
+	long intervalMin;
+	long intervalMax;
+	long backwards;      /**< Records that were not newer than the previous one */
+	long intervalHist[TRACK_STATS_BINS]; /**< Intervals in bins of binUsec */
+	long jitterHist[TRACK_STATS_BINS];   /**< Interval minus mean interval in bins of binUsec, centered on 0 */
+	long binUsec;        /**< Width of the histogram bins */
+
+	/* Drop-outs: intervals longer than dropoutFactor times the mean */
+	float dropoutFactor;
+	long dropouts;       /**< Number of drop-outs */
+	double dropoutUsec;  /**< Time lost to drop-outs (beyond the mean interval) */
+	long longestGap;     /**< Longest interval (microseconds) */
+	long longestGapTime; /**< Time of the record after the longest interval */
+
+	/* Latency: time received minus time recorded (if known) */
+	long latencies;
+	double latencyMean;
+	double latencyM2;
+
+	/* Allan deviation of x, y and z */
+	track_stats_allan allan[3][TRACK_STATS_ALLAN_LEVELS];
+} track_stats;
+
+void track_stats_init(track_stats *s, long binUsec, float dropoutFactor);
+void track_stats_add(track_stats *s, long usec, long received, const float pos[3], const float quat[4]);
+double track_stats_stddev(const track_stats *s, int value);
+double track_stats_allan_dev(const track_stats *s, int axis, int level, double *tau);
+void track_stats_print(const track_stats *s, const char *name);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
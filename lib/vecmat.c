@@ -1300,7 +1300,7 @@ void quatf_from_mat3f(float quat[4], const float matrix[9])
 
 	   quat[X] = (matrix[mat3_getIndex(Z,Y)] - matrix[mat3_getIndex(Y,Z)]) * s;
 	   quat[Y] = (matrix[mat3_getIndex(X,Z)] - matrix[mat3_getIndex(Z,X)]) * s;
-	   quat[Z] = (matrix[mat3_getIndex(Y,Z)] - matrix[mat3_getIndex(X,Y)]) * s;
+	   quat[Z] = (matrix[mat3_getIndex(Y,X)] - matrix[mat3_getIndex(X,Y)]) * s;
    }
 
    else
@@ -1338,7 +1338,7 @@ void quatd_from_mat3d(double quat[4], const double matrix[9])
 
 	   quat[X] = (matrix[mat3_getIndex(Z,Y)] - matrix[mat3_getIndex(Y,Z)]) * s;
 	   quat[Y] = (matrix[mat3_getIndex(X,Z)] - matrix[mat3_getIndex(Z,X)]) * s;
-	   quat[Z] = (matrix[mat3_getIndex(Y,Z)] - matrix[mat3_getIndex(X,Y)]) * s;
+	   quat[Z] = (matrix[mat3_getIndex(Y,X)] - matrix[mat3_getIndex(X,Y)]) * s;
    }
 
    else
@@ -1502,7 +1502,7 @@ void quatf_slerp_new(float result[4], const float start[4], const float end[4],
 		{
 			float omega = acosf(cosOmega);
 			float sinOmega = sinf(omega);
-			startScale = sinf((1.0f-t)*omega / sinOmega);
+			startScale = sinf((1.0f-t)*omega) / sinOmega;
 			endScale = sinf(t*omega)/sinOmega;
 		}
 		else
@@ -1560,7 +1560,7 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 		{
 			double omega = acos(cosOmega);
 			double sinOmega = sin(omega);
-			startScale = sin((1.0-t)*omega / sinOmega);
+			startScale = sin((1.0-t)*omega) / sinOmega;
 			endScale = sin(t*omega)/sinOmega;
 		}
 		else
@@ -1586,6 +1586,33 @@ void quatd_slerp_new(double result[4], const double start[4], const double end[4
 	vec4d_normalize(result);
 }
 
+/** Multiplies two quaternions (x,y,z,w). Rotating by the result is
+ the same as rotating by b and then rotating by a.
+
+ @param result The product a*b (can be the same as a or b).
+ @param a The quaternion on the left.
+ @param b The quaternion on the right.
+ */
+void quatf_mult_quatf_new(float result[4], const float a[4], const float b[4])
+{
+	float r[4];
+	r[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	r[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4f_copy(result, r);
+}
+/** Multiplies two quaternions (x,y,z,w). For full documentation, see quatf_mult_quatf_new() */
+void quatd_mult_quatd_new(double result[4], const double a[4], const double b[4])
+{
+	double r[4];
+	r[0] = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	r[1] = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+	r[2] = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+	r[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	vec4d_copy(result, r);
+}
+
 	
 
 
@@ -1742,6 +1742,10 @@ void quatd_rotateAxisVec_new(double quat[4], double degrees, const double axis[3
 void quatf_slerp_new(float  result[4], const float  start[4], const float  end[4], float  t);
 void quatd_slerp_new(double result[4], const double start[4], const double end[4], double t);
 
+/* Multiply quaternions. */
+void quatf_mult_quatf_new(float  result[4], const float  a[4], const float  b[4]);
+void quatd_mult_quatd_new(double result[4], const double a[4], const double b[4]);
+
 /* Create a new translation matrix (rotation part set to
    identity). Any data in the 'result' matrix that you pass to these
    functions will be ignored and lost. */
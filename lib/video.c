@@ -30,8 +30,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <math.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include "kuhl-util.h"
+#include "queue.h"
 #include "video.h"
 
 #ifndef HAVE_FFMPEG
@@ -47,87 +55,110 @@ void video_cleanup(video_state *state)
 	exit(EXIT_FAILURE);
 }
 
+video_player* video_player_open(const char *filename, int loop)
+{
+	msg(MSG_ERROR, "Library is not compiled against FFMpeg. Unable to play %s", filename);
+	return NULL;
+}
+video_player* video_player_open_crop(const char *filename, int loop, const float crop[4])
+{
+	return video_player_open(filename, loop);
+}
+int video_player_update(video_player *vp) { return -1; }
+void video_player_textures(const video_player *vp, GLuint tex[3]) { tex[0] = tex[1] = tex[2] = 0; }
+float video_player_aspect_ratio(const video_player *vp) { return 1; }
+void video_player_get_crop(const video_player *vp, float crop[4]) { crop[0] = crop[1] = 0; crop[2] = crop[3] = 1; }
+int64_t video_player_duration(const video_player *vp) { return 0; }
+int64_t video_player_time(const video_player *vp) { return 0; }
+void video_player_seek(video_player *vp, int64_t usec) { }
+void video_player_close(video_player *vp) { }
+
 #else
 
-static int video_decode_packet(video_state *state, int cached)
+/** Converts the frame that was just decoded into RGB. Returns 0 on
+ * success. */
+static int video_convert_frame(video_state *state)
 {
-	int ret = state->pkt.size;
-	int got_frame = 0;
-
-	if(state->pkt.stream_index == state->video_stream_idx)
-	{
-		ret = avcodec_decode_video2(state->video_dec_ctx, state->frame, &got_frame, &(state->pkt));
-		if(ret < 0)
-		{
-			msg(MSG_ERROR, "Error decoding frame (%s)", av_err2str(ret));
-			return ret;
-		}
+	if (state->frame->width  != state->width  ||
+	    state->frame->height != state->height ||
+	    state->frame->format != state->pix_fmt) {
+		/* To handle this change, one could call av_image_alloc again and
+		 * decode the following frames into another rawvideo file. */
+		msg(MSG_ERROR, "Error: Width, height and pixel format have to be "
+		    "constant in a rawvideo file, but the width, height or "
+		    "pixel format of the input video changed:\n"
+		    "old: width = %d, height = %d, format = %s\n"
+		    "new: width = %d, height = %d, format = %s\n",
+		    state->width, state->height, av_get_pix_fmt_name(state->pix_fmt),
+		    state->frame->width, state->frame->height,
+		    av_get_pix_fmt_name(state->frame->format));
+		return -1;
+	}
 
-		if(got_frame)
-		{
-			if (state->frame->width  != state->width  ||
-			    state->frame->height != state->height ||
-			    state->frame->format != state->pix_fmt) {
-				/* To handle this change, one could call av_image_alloc again and
-				 * decode the following frames into another rawvideo file. */
-				msg(MSG_ERROR, "Error: Width, height and pixel format have to be "
-				    "constant in a rawvideo file, but the width, height or "
-				    "pixel format of the input video changed:\n"
-				    "old: width = %d, height = %d, format = %s\n"
-				    "new: width = %d, height = %d, format = %s\n",
-				    state->width, state->height, av_get_pix_fmt_name(state->pix_fmt),
-				    state->frame->width, state->frame->height,
-				    av_get_pix_fmt_name(state->frame->format));
-				return -1;
-			}
+	/* Calculate a reasonable time value that the caller can
+	 * use to display frames at the correct speed. */
+	int64_t pts = state->frame->best_effort_timestamp;
+	state->usec = av_rescale_q ( pts,  state->video_stream->time_base, AV_TIME_BASE_Q );
 
-			/* Calculate a reasonable time value that the caller can
-			 * use to display frames at the correct speed. */
-			uint64_t pts = av_frame_get_best_effort_timestamp(state->frame);
-			state->usec = av_rescale_q ( pts,  state->video_stream->time_base, AV_TIME_BASE_Q );
-            
 #if 0
-			msg(MSG_DEBUG, "video_frame%s n:%d coded_n:%d usec:%"PRId64"\n",
-			    cached ? "(cached)" : "",
-			    state->video_frame_count++, state->frame->coded_picture_number, state->usec);
+	msg(MSG_DEBUG, "video_frame n:%d usec:%"PRId64"\n",
+	    state->video_frame_count++, state->usec);
 #endif
 
-			/* Allocate final space that we will return to user. */
-			if(state->data == NULL)
-				state->data = (unsigned char*) malloc(state->width*state->height*3);
-
-			/* Convert from whatever colorspace the video is into 8-bit RGB.
-
-			   TODO: It would be significantly more efficient to do
-			   this conversion in a shader program.
-			*/
-			uint8_t *outData[] = { (uint8_t*) state->data };
-			const int destStride[] = {3*state->width};
-			sws_scale(state->sws_ctx, (const uint8_t**) state->frame->data, state->frame->linesize, 0, state->height, outData, destStride);
-
-			/* The image we get from FFMPEG is flipped vertically (if
-			 * we look at the data and expect 0,0 to be in the lower
-			 * left and the first pixel of data corresponds to that
-			 * lower left corner. However, flipping it on the CPU is
-			 * considerably slower than doing it on the
-			 * GPU. Therefore, the following is commented out. */
-			//kuhl_flip_texture_array(state->data, state->width, state->height, 3);
-
-			/* Indicate to the caller that we have retrieved a new video frame */
-			state->has_new_video_frame = 1;
-		}
-	}
-	else
-	{
-		//msg(MSG_DEBUG, "video index didn't match: expecting=%d found=%d", state->video_stream_idx, state->pkt.stream_index);
-	}
+	/* Allocate final space that we will return to user. */
+	if(state->data == NULL)
+		state->data = (unsigned char*) malloc(state->width*state->height*3);
 
-	/* If we use frame reference counting, we own the data and need
-	 * to de-reference it when we don't use it anymore */
-	if(got_frame)
-		av_frame_unref(state->frame);
+	/* Convert from whatever colorspace the video is into 8-bit RGB.
 
-	return ret;
+	   TODO: It would be significantly more efficient to do
+	   this conversion in a shader program.
+	*/
+	uint8_t *outData[] = { (uint8_t*) state->data };
+	const int destStride[] = {3*state->width};
+	sws_scale(state->sws_ctx, (const uint8_t**) state->frame->data, state->frame->linesize, 0, state->height, outData, destStride);
+
+	/* The image we get from FFMPEG is flipped vertically (if
+	 * we look at the data and expect 0,0 to be in the lower
+	 * left and the first pixel of data corresponds to that
+	 * lower left corner. However, flipping it on the CPU is
+	 * considerably slower than doing it on the
+	 * GPU. Therefore, the following is commented out. */
+	//kuhl_flip_texture_array(state->data, state->width, state->height, 3);
+
+	/* Indicate to the caller that we have retrieved a new video frame */
+	state->has_new_video_frame = 1;
+	return 0;
+}
+
+/** Reads packets and sends them to the decoder until it produces a
+ * frame. Returns 0 if a frame was decoded, AVERROR_EOF at the end of
+ * the file or another negative number on error. */
+static int video_decode_frame(video_state *state)
+{
+	while(1)
+	{
+		int ret = avcodec_receive_frame(state->video_dec_ctx, state->frame);
+		if(ret != AVERROR(EAGAIN))
+			return ret;
+
+		if(av_read_frame(state->fmt_ctx, state->pkt) < 0)
+		{
+			/* Flush the frames that the decoder is holding on to. */
+			if(state->draining)
+				return AVERROR_EOF;
+			state->draining = 1;
+			avcodec_send_packet(state->video_dec_ctx, NULL);
+			continue;
+		}
+		if(state->pkt->stream_index == state->video_stream_idx)
+		{
+			ret = avcodec_send_packet(state->video_dec_ctx, state->pkt);
+			if(ret < 0 && ret != AVERROR(EAGAIN))
+				msg(MSG_ERROR, "Error decoding frame (%s)", av_err2str(ret));
+		}
+		av_packet_unref(state->pkt);
+	}
 }
 
 
@@ -136,8 +167,7 @@ static int open_codec_context(enum AVMediaType type, video_state *state)
 	int ret, stream_index;
 	AVStream *st;
 	AVCodecContext *dec_ctx = NULL;
-	AVCodec *dec = NULL;
-	AVDictionary *opts = NULL;
+	const AVCodec *dec = NULL;
 
 	ret = av_find_best_stream(state->fmt_ctx, type, -1, -1, NULL, 0);
 	if (ret < 0) {
@@ -149,22 +179,26 @@ static int open_codec_context(enum AVMediaType type, video_state *state)
 		st = state->fmt_ctx->streams[stream_index];
 
 		/* find decoder for the stream */
-		dec_ctx = st->codec;
-		dec = avcodec_find_decoder(dec_ctx->codec_id);
+		dec = avcodec_find_decoder(st->codecpar->codec_id);
 		if (!dec) {
 			fprintf(stderr, "Failed to find %s codec\n",
 			        av_get_media_type_string(type));
 			return AVERROR(EINVAL);
 		}
 
-		/* Init the decoders, with or without reference counting */
-		av_dict_set(&opts, "refcounted_frames", "1", 0);
-		if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
+		/* Init the decoder */
+		dec_ctx = avcodec_alloc_context3(dec);
+		if (!dec_ctx)
+			return AVERROR(ENOMEM);
+		if ((ret = avcodec_parameters_to_context(dec_ctx, st->codecpar)) < 0 ||
+		    (ret = avcodec_open2(dec_ctx, dec, NULL)) < 0) {
 			fprintf(stderr, "Failed to open %s codec\n",
 			        av_get_media_type_string(type));
+			avcodec_free_context(&dec_ctx);
 			return ret;
 		}
 		state->video_stream_idx = stream_index;
+		state->video_dec_ctx = dec_ctx;
 		//msg(MSG_DEBUG, "best index: %d\n", stream_index);
 	}
 
@@ -189,28 +223,29 @@ static video_state* video_init(const char *filename)
 	ret->video_stream_idx = -1;
 	ret->sws_ctx = NULL;
 	ret->frame = NULL;
+	ret->pkt = NULL;
 	ret->fmt_ctx = NULL;
 	ret->video_dec_ctx = NULL;
 	ret->video_stream = NULL;
 	ret->video_frame_count = 0;
-
-	av_register_all();
+	ret->draining = 0;
 
 	/* open input file, and allocate format context */
 	if (avformat_open_input(&(ret->fmt_ctx), filename, NULL, NULL) < 0) {
 		msg(MSG_ERROR, "Could not open source file '%s'", filename);
+		free(ret);
 		return NULL;
 	}
 
 	/* retrieve stream information */
 	if (avformat_find_stream_info(ret->fmt_ctx, NULL) < 0) {
 		msg(MSG_ERROR, "Could not find stream information in '%s'", filename);
+		video_cleanup(ret);
 		return NULL;
 	}
 
 	if (open_codec_context(AVMEDIA_TYPE_VIDEO, ret) >= 0) {
 		ret->video_stream = ret->fmt_ctx->streams[ret->video_stream_idx];
-		ret->video_dec_ctx = ret->video_stream->codec;
 
 		/* allocate image where the decoded image will be put */
 		ret->width = ret->video_dec_ctx->width;
@@ -229,32 +264,29 @@ static video_state* video_init(const char *filename)
 		return NULL;
 	}
 
-	AVFrame *frame = av_frame_alloc();
-	if(!frame)
+	ret->frame = av_frame_alloc();
+	ret->pkt = av_packet_alloc();
+	if(!ret->frame || !ret->pkt)
 	{
 		msg(MSG_ERROR, "Could not allocate frame for video '%s'", filename);
 		video_cleanup(ret);
 		return NULL;
 	}
-	ret->frame = frame;
 
 	/* Create a swscontext to convert colorspace to RGB */
 	ret->sws_ctx = sws_getContext(ret->width, ret->height,
 	                              ret->pix_fmt, ret->width, ret->height,
 	                              AV_PIX_FMT_RGB24, 0, 0, 0, 0);
-    
-
-	av_init_packet(&(ret->pkt));
-	ret->pkt.data = NULL;
-	ret->pkt.size = 0;
 	return ret;
 }
 
 void video_cleanup(video_state *state)
 {
-	avcodec_close(state->video_dec_ctx);
+	avcodec_free_context(&(state->video_dec_ctx));
 	avformat_close_input(&(state->fmt_ctx));
 	av_frame_free(&(state->frame));
+	av_packet_free(&(state->pkt));
+	sws_freeContext(state->sws_ctx);
 	free(state);
 }
 
@@ -273,23 +305,14 @@ video_state* video_get_next_frame(video_state *state, const char *filename)
 
 	long startDecodeTime = kuhl_microseconds();
 	state->has_new_video_frame = 0;
-	
-	while(av_read_frame(state->fmt_ctx, &(state->pkt)) >= 0)
+
+	int ret;
+	while((ret = video_decode_frame(state)) == 0)
 	{
-		AVPacket orig_pkt = state->pkt;
-		do
-		{
-			//msg(MSG_DEBUG, "looping.");
-			int retval = video_decode_packet(state, 0);
-			if(retval < 0)
-				break;
-			state->pkt.data += retval;
-			state->pkt.size -= retval;
-
-		} while(state->pkt.size > 0);
-	    
-		av_packet_unref(&orig_pkt);
-		//msg(MSG_DEBUG, "finished reading packet");
+		int converted = video_convert_frame(state);
+		av_frame_unref(state->frame);
+		if(converted < 0)
+			break;
 
 		if(state->has_new_video_frame)
 		{
@@ -301,11 +324,1309 @@ video_state* video_get_next_frame(video_state *state, const char *filename)
 			return state;
 		}
 	}
+	if(ret < 0 && ret != AVERROR_EOF)
+		msg(MSG_ERROR, "Error decoding frame (%s)", av_err2str(ret));
 
-	msg(MSG_FATAL, "Didn't find frame, exiting");
-	exit(EXIT_FAILURE);
-	
-	return state;
+	/* End of the video (or an error). The caller can call
+	 * video_get_next_frame() with a NULL state to start over. */
+	msg(MSG_INFO, "Reached end of video %s", state->filename);
+	video_cleanup(state);
+	return NULL;
+}
+
+
+/* ---------------- Video player ----------------
+
+   video_get_next_frame() decodes on the calling thread and converts
+   each frame into RGB on the CPU. A video_player instead decodes
+   ahead on a background thread into a small pool of frames. The frames
+   are kept in YUV 4:2:0 form (three planes) and are uploaded into
+   three single-channel textures; the conversion into RGB is done in a
+   fragment program (see samples/videoplay.frag).
+
+   All video players share a pool of decoder threads. Whenever a
+   thread is idle, it decodes a frame for the player that has the
+   fewest frames ready. A player can also be restricted to a region of
+   the video (see video_player_open_crop()); only that region is
+   converted, copied and uploaded so that each screen of a multiscreen
+   wall pays only for the pixels that it displays.
+*/
+
+/** A decoded frame. */
+typedef struct video_player_frame {
+	unsigned char *planes[3]; /**< Y, U and V planes, top row first, no padding */
+	int64_t usec;             /**< Presentation time (includes time from previous loops) */
+	struct video_player_frame *next;
+} video_player_frame;
+
+struct video_player {
+	char filename[1024];
+	int loop;
+	int videoWidth, videoHeight; /**< Size of the frames in the file */
+	int cropX, cropY;         /**< Top left corner of the region we display (even) */
+	int width, height;        /**< Size of the Y plane (size of the region) */
+	int cwidth, cheight;      /**< Size of the U and V planes */
+	int64_t duration;         /**< Length of the video in microseconds */
+	int64_t frameUsec;        /**< Length of one frame in microseconds */
+	GLuint tex[3];
+
+	/* Used only by the decoder thread */
+	AVFormatContext *fmt_ctx;
+	AVCodecContext *dec_ctx;
+	AVStream *stream;
+	AVFrame *frame;
+	AVPacket *pkt;
+	struct SwsContext *sws_ctx;
+	unsigned char *converted; /**< Full frame converted to YUV420P (if needed) */
+	int streamIndex;
+	int64_t startUsec;        /**< Timestamp of first frame in the file */
+	int64_t loopOffset;       /**< Added to timestamps after looping */
+	int64_t lastUsec;         /**< Timestamp of the last decoded frame */
+	int64_t skipUntil;        /**< Discard frames before this time (after seeking) */
+	int draining;
+
+	/* Used only by the rendering thread */
+	long clockStart;          /**< kuhl_microseconds() when video time was 0 */
+	int clockRunning;
+	int64_t shownUsec;        /**< Time of the frame in the textures */
+
+	/* Shared between threads; protected by mutex. */
+	video_player_frame *free;   /**< Frames that can be decoded into */
+	video_player_frame *ready;  /**< Decoded frames, sorted by time */
+	int seekRequested;
+	int64_t seekUsec;
+	int eof;
+	int numReady;
+	int busy;                 /**< Set while a decoder thread is working on this player */
+	int quit;
+	struct video_player *poolNext;
+};
+
+#define VIDEO_MAX_THREADS 16
+/* The player list and the shared fields of every player are protected
+ * by video_pool_mutex. Critical sections are short; no decoding is
+ * done while holding the mutex. */
+static video_player *video_pool_players = NULL;
+#ifndef _WIN32
+static pthread_mutex_t video_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t video_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t video_pool_threads[VIDEO_MAX_THREADS];
+static int video_pool_num_threads = 0;
+#endif
+
+static void video_player_lock(video_player *vp)
+{
+#ifndef _WIN32
+	pthread_mutex_lock(&video_pool_mutex);
+#endif
+}
+
+static void video_player_unlock(video_player *vp)
+{
+#ifndef _WIN32
+	pthread_mutex_unlock(&video_pool_mutex);
+#endif
+}
+
+/** Wakes up the decoder threads. Caller must hold the lock. */
+static void video_player_wake(void)
+{
+#ifndef _WIN32
+	pthread_cond_broadcast(&video_pool_cond);
+#endif
+}
+
+/** Reads packets and sends them to the decoder until it produces a
+ * frame. Returns 0 if a frame was decoded, AVERROR_EOF at the end of
+ * the file or another negative number on error. */
+static int video_player_decode(video_player *vp)
+{
+	while(1)
+	{
+		int ret = avcodec_receive_frame(vp->dec_ctx, vp->frame);
+		if(ret != AVERROR(EAGAIN))
+			return ret;
+
+		if(av_read_frame(vp->fmt_ctx, vp->pkt) < 0)
+		{
+			/* Flush the frames that the decoder is holding on to. */
+			if(vp->draining)
+				return AVERROR_EOF;
+			vp->draining = 1;
+			avcodec_send_packet(vp->dec_ctx, NULL);
+			continue;
+		}
+		if(vp->pkt->stream_index == vp->streamIndex)
+		{
+			ret = avcodec_send_packet(vp->dec_ctx, vp->pkt);
+			if(ret < 0 && ret != AVERROR(EAGAIN))
+				msg(MSG_WARNING, "Error decoding %s (%s)", vp->filename, av_err2str(ret));
+		}
+		av_packet_unref(vp->pkt);
+	}
+}
+
+/** Seeks the decoder to a time (microseconds from the start of the
+ * video). Called on the decoder thread. */
+static void video_player_decoder_seek(video_player *vp, int64_t usec)
+{
+	int64_t target = av_rescale_q(usec + vp->startUsec, AV_TIME_BASE_Q, vp->stream->time_base);
+	if(av_seek_frame(vp->fmt_ctx, vp->streamIndex, target, AVSEEK_FLAG_BACKWARD) < 0)
+		msg(MSG_WARNING, "Failed to seek to %"PRId64" usec in %s", usec, vp->filename);
+	avcodec_flush_buffers(vp->dec_ctx);
+	vp->draining = 0;
+	vp->skipUntil = usec;
+}
+
+/** Copies the region of the most recently decoded frame that we
+ * display into f. */
+static void video_player_copy(video_player *vp, video_player_frame *f)
+{
+	AVFrame *fr = vp->frame;
+	const uint8_t *src[3] = { fr->data[0], fr->data[1], fr->data[2] };
+	int srcStride[3] = { fr->linesize[0], fr->linesize[1], fr->linesize[2] };
+
+	if(fr->format != AV_PIX_FMT_YUV420P || fr->width != vp->videoWidth || fr->height != vp->videoHeight)
+	{
+		/* Other pixel formats (and full range "J" formats) are
+		 * converted into limited range YUV 4:2:0 so that a single
+		 * fragment program can be used for all videos. */
+		int cw = (vp->videoWidth+1)/2, ch = (vp->videoHeight+1)/2;
+		if(vp->converted == NULL)
+			vp->converted = (unsigned char*) kuhl_malloc(vp->videoWidth*vp->videoHeight + 2*cw*ch);
+		uint8_t *dst[4] = { vp->converted, vp->converted + vp->videoWidth*vp->videoHeight,
+		                    vp->converted + vp->videoWidth*vp->videoHeight + cw*ch, NULL };
+		int dstStride[4] = { vp->videoWidth, cw, cw, 0 };
+		vp->sws_ctx = sws_getCachedContext(vp->sws_ctx, fr->width, fr->height, fr->format,
+		                                   vp->videoWidth, vp->videoHeight, AV_PIX_FMT_YUV420P,
+		                                   SWS_BILINEAR, NULL, NULL, NULL);
+		sws_scale(vp->sws_ctx, (const uint8_t**) fr->data, fr->linesize, 0, fr->height, dst, dstStride);
+		for(int i=0; i<3; i++)
+		{
+			src[i] = dst[i];
+			srcStride[i] = dstStride[i];
+		}
+	}
+
+	/* Copy the region of interest. cropX and cropY are even, so the
+	 * chroma planes start at exactly half of those values. */
+	av_image_copy_plane(f->planes[0], vp->width,
+	                    src[0] + vp->cropY*srcStride[0] + vp->cropX, srcStride[0],
+	                    vp->width, vp->height);
+	for(int i=1; i<3; i++)
+		av_image_copy_plane(f->planes[i], vp->cwidth,
+		                    src[i] + vp->cropY/2*srcStride[i] + vp->cropX/2, srcStride[i],
+		                    vp->cwidth, vp->cheight);
 }
 
+/** Decodes one frame into a free frame and adds it to the ready
+    list. If there are no free frames, nothing happens. Returns 1 if
+    the caller should wait before calling this function again (no free
+    frames, end of video or an error) and 0 otherwise. */
+static int video_player_step(video_player *vp)
+{
+	video_player_lock(vp);
+	if(vp->seekRequested)
+	{
+		/* Throw away everything that was decoded before the seek. */
+		while(vp->ready != NULL)
+		{
+			video_player_frame *f = vp->ready;
+			vp->ready = f->next;
+			f->next = vp->free;
+			vp->free = f;
+		}
+		vp->numReady = 0;
+		int64_t usec = vp->seekUsec;
+		vp->seekRequested = 0;
+		vp->eof = 0;
+		video_player_unlock(vp);
+
+		video_player_decoder_seek(vp, usec);
+		vp->loopOffset = 0;
+		video_player_lock(vp);
+	}
+	video_player_frame *f = vp->free;
+	if(f == NULL || vp->eof)
+	{
+		video_player_unlock(vp);
+		return 1;
+	}
+	vp->free = f->next;
+	video_player_unlock(vp);
+
+	int ret = video_player_decode(vp);
+	if(ret == AVERROR_EOF && vp->loop && vp->lastUsec >= 0)
+	{
+		vp->loopOffset += vp->lastUsec + vp->frameUsec;
+		vp->lastUsec = -1;
+		video_player_decoder_seek(vp, 0);
+		ret = video_player_decode(vp);
+	}
+
+	int64_t usec = 0;
+	if(ret == 0)
+	{
+		int64_t pts = vp->frame->best_effort_timestamp;
+		if(pts == AV_NOPTS_VALUE)
+			usec = vp->lastUsec + vp->frameUsec;
+		else
+			usec = av_rescale_q(pts, vp->stream->time_base, AV_TIME_BASE_Q) - vp->startUsec;
+		vp->lastUsec = usec;
+		if(usec >= vp->skipUntil)
+			video_player_copy(vp, f);
+		av_frame_unref(vp->frame);
+	}
+	else if(ret != AVERROR_EOF)
+		msg(MSG_ERROR, "Error decoding %s (%s)", vp->filename, av_err2str(ret));
+
+	video_player_lock(vp);
+	if(ret != 0 || usec < vp->skipUntil || vp->seekRequested)
+	{
+		/* Return the frame to the free list */
+		f->next = vp->free;
+		vp->free = f;
+		if(ret != 0)
+			vp->eof = 1;
+	}
+	else
+	{
+		vp->skipUntil = 0;
+		/* Insert into ready list sorted by time */
+		f->usec = usec + vp->loopOffset;
+		video_player_frame **p = &(vp->ready);
+		while(*p != NULL && (*p)->usec <= f->usec)
+			p = &((*p)->next);
+		f->next = *p;
+		*p = f;
+		vp->numReady++;
+	}
+	int wait = (vp->free == NULL || vp->eof) && !vp->seekRequested;
+	video_player_unlock(vp);
+	return wait;
+}
+
+/** Returns 1 if a decoder thread should work on this
+ * player. Caller must hold the lock. */
+static int video_player_needs_work(const video_player *vp)
+{
+	return !vp->busy && !vp->quit && (vp->seekRequested || (vp->free != NULL && !vp->eof));
+}
+
+#ifndef _WIN32
+/** Decoder thread. Repeatedly decodes a frame for the player which
+ * has the fewest frames ready to display. */
+static void* video_pool_thread(void *arg)
+{
+	pthread_mutex_lock(&video_pool_mutex);
+	while(1)
+	{
+		video_player *best = NULL;
+		for(video_player *vp = video_pool_players; vp != NULL; vp = vp->poolNext)
+			if(video_player_needs_work(vp) && (best == NULL || vp->numReady < best->numReady))
+				best = vp;
+		if(best == NULL)
+		{
+			pthread_cond_wait(&video_pool_cond, &video_pool_mutex);
+			continue;
+		}
+
+		best->busy = 1;
+		pthread_mutex_unlock(&video_pool_mutex);
+		video_player_step(best);
+		pthread_mutex_lock(&video_pool_mutex);
+		best->busy = 0;
+		/* Another thread may be waiting for us (video_player_close()). */
+		pthread_cond_broadcast(&video_pool_cond);
+	}
+	return NULL;
+}
+
+/** Starts the decoder threads if they haven't been started. */
+static void video_pool_start(void)
+{
+	if(video_pool_num_threads > 0)
+		return;
+	video_pool_num_threads = kuhl_config_int("video.threads", 2, 2);
+	if(video_pool_num_threads < 1)
+		video_pool_num_threads = 1;
+	if(video_pool_num_threads > VIDEO_MAX_THREADS)
+		video_pool_num_threads = VIDEO_MAX_THREADS;
+	for(int i=0; i<video_pool_num_threads; i++)
+	{
+		if(pthread_create(&(video_pool_threads[i]), NULL, video_pool_thread, NULL) != 0)
+		{
+			msg(MSG_FATAL, "Failed to create video decoder thread.");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(video_pool_threads[i]);
+	}
+}
+#endif
+
+/** Opens a video file and starts decoding it on a background
+    thread. Must be called from the thread with the OpenGL context
+    since it creates the three textures that the video is displayed
+    with.
+
+    The following configuration file settings are supported:
+
+    video.queue - Number of frames to decode ahead of time (default 8).
+
+    video.threads - Number of decoder threads shared by all video
+    players (default 2). Each thread decodes one video at a time.
+
+    @param filename The video file to play.
+
+    @param loop If set, the video starts over when it reaches the end.
+
+    @return A video player or NULL if the file could not be played.
+*/
+video_player* video_player_open(const char *filename, int loop)
+{
+	return video_player_open_crop(filename, loop, NULL);
+}
+
+/** Opens a video file like video_player_open() but only displays
+    a region of the video. The entire video is still decoded (video
+    codecs can't decode part of a frame), but only the region is
+    converted, copied and uploaded into the textures. The textures are
+    the size of the region.
+
+    @param filename The video file to play.
+
+    @param loop If set, the video starts over when it reaches the end.
+
+    @param crop The region of the video to display: left, bottom,
+    right, top where (0,0) is the bottom left corner of the video and
+    (1,1) is the top right corner. The region is enlarged slightly so
+    that it starts and ends on even pixels. Use
+    video_player_get_crop() to get the actual region. If NULL, the
+    entire video is displayed.
+
+    @return A video player or NULL if the file could not be played.
+*/
+video_player* video_player_open_crop(const char *filename, int loop, const float crop[4])
+{
+	video_player *vp = (video_player*) calloc(1, sizeof(video_player));
+	snprintf(vp->filename, 1024, "%s", filename);
+	vp->loop = loop;
+	vp->lastUsec = -1;
+
+	if(avformat_open_input(&(vp->fmt_ctx), filename, NULL, NULL) < 0 ||
+	   avformat_find_stream_info(vp->fmt_ctx, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Could not open video file '%s'", filename);
+		free(vp);
+		return NULL;
+	}
+
+	const AVCodec *dec = NULL;
+	vp->streamIndex = av_find_best_stream(vp->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+	if(vp->streamIndex < 0 || dec == NULL)
+	{
+		msg(MSG_ERROR, "Could not find a video stream that can be decoded in '%s'", filename);
+		avformat_close_input(&(vp->fmt_ctx));
+		free(vp);
+		return NULL;
+	}
+	vp->stream = vp->fmt_ctx->streams[vp->streamIndex];
+	vp->dec_ctx = avcodec_alloc_context3(dec);
+	avcodec_parameters_to_context(vp->dec_ctx, vp->stream->codecpar);
+	vp->dec_ctx->thread_count = 0; // let the decoder pick the number of threads
+	if(avcodec_open2(vp->dec_ctx, dec, NULL) < 0)
+	{
+		msg(MSG_ERROR, "Failed to open %s decoder for '%s'", dec->name, filename);
+		avcodec_free_context(&(vp->dec_ctx));
+		avformat_close_input(&(vp->fmt_ctx));
+		free(vp);
+		return NULL;
+	}
+	vp->frame = av_frame_alloc();
+	vp->pkt = av_packet_alloc();
+
+	vp->videoWidth = vp->dec_ctx->width;
+	vp->videoHeight = vp->dec_ctx->height;
+	vp->cropX = 0;
+	vp->cropY = 0;
+	vp->width = vp->videoWidth;
+	vp->height = vp->videoHeight;
+	if(crop != NULL)
+	{
+		/* Convert to pixels; rows are counted from the top of the
+		 * video. Align to even pixels for the chroma planes. */
+		int x0 = (int) floorf(crop[0]*vp->videoWidth);
+		int x1 = (int) ceilf(crop[2]*vp->videoWidth);
+		int y0 = vp->videoHeight - (int) ceilf(crop[3]*vp->videoHeight);
+		int y1 = vp->videoHeight - (int) floorf(crop[1]*vp->videoHeight);
+		x0 &= ~1;
+		y0 &= ~1;
+		if(x0 < 0) x0 = 0;
+		if(y0 < 0) y0 = 0;
+		if(x1 > vp->videoWidth) x1 = vp->videoWidth;
+		if(y1 > vp->videoHeight) y1 = vp->videoHeight;
+		if(x1 - x0 < 2) x1 = x0 + 2;
+		if(y1 - y0 < 2) y1 = y0 + 2;
+		vp->cropX = x0;
+		vp->cropY = y0;
+		vp->width = x1 - x0;
+		vp->height = y1 - y0;
+	}
+	vp->cwidth = (vp->width+1)/2;
+	vp->cheight = (vp->height+1)/2;
+
+	vp->startUsec = 0;
+	if(vp->stream->start_time != AV_NOPTS_VALUE)
+		vp->startUsec = av_rescale_q(vp->stream->start_time, vp->stream->time_base, AV_TIME_BASE_Q);
+	vp->duration = 0;
+	if(vp->fmt_ctx->duration != AV_NOPTS_VALUE)
+		vp->duration = vp->fmt_ctx->duration;
+	vp->frameUsec = 1000000/30;
+	if(vp->stream->avg_frame_rate.num > 0 && vp->stream->avg_frame_rate.den > 0)
+		vp->frameUsec = av_rescale_q(1, av_inv_q(vp->stream->avg_frame_rate), AV_TIME_BASE_Q);
+
+	/* Allocate the frames that the decoder thread decodes into. */
+	int numFrames = kuhl_config_int("video.queue", 8, 8);
+	if(numFrames < 2)
+		numFrames = 2;
+	for(int i=0; i<numFrames; i++)
+	{
+		video_player_frame *f = (video_player_frame*) kuhl_malloc(sizeof(video_player_frame));
+		f->planes[0] = (unsigned char*) kuhl_malloc(vp->width*vp->height + 2*vp->cwidth*vp->cheight);
+		f->planes[1] = f->planes[0] + vp->width*vp->height;
+		f->planes[2] = f->planes[1] + vp->cwidth*vp->cheight;
+		f->next = vp->free;
+		vp->free = f;
+	}
+
+	/* Create the textures, initially black. */
+	glGenTextures(3, vp->tex);
+	GLint previousTexture, previousAlignment;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &previousAlignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	unsigned char *black = (unsigned char*) kuhl_malloc(vp->width*vp->height);
+	for(int i=0; i<3; i++)
+	{
+		int w = i==0 ? vp->width  : vp->cwidth;
+		int h = i==0 ? vp->height : vp->cheight;
+		memset(black, i==0 ? 16 : 128, w*h);
+		glBindTexture(GL_TEXTURE_2D, vp->tex[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, black);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	free(black);
+	glBindTexture(GL_TEXTURE_2D, previousTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, previousAlignment);
+	kuhl_errorcheck();
+
+	msg(MSG_INFO, "Playing %s (%dx%d, %s, %.1f seconds)", filename, vp->videoWidth, vp->videoHeight,
+	    av_get_pix_fmt_name(vp->dec_ctx->pix_fmt), vp->duration/1000000.0);
+	if(crop != NULL)
+		msg(MSG_INFO, "Displaying %dx%d region at (%d,%d) of %s", vp->width, vp->height, vp->cropX, vp->cropY, filename);
+
+	/* Hand the player to the decoder threads. */
+#ifndef _WIN32
+	video_pool_start();
+#endif
+	video_player_lock(vp);
+	vp->poolNext = video_pool_players;
+	video_pool_players = vp;
+	video_player_wake();
+	video_player_unlock(vp);
+	return vp;
+}
+
+/** Copies the newest frame that should be displayed now into the
+    textures. Frames that were decoded but are already too old are
+    skipped. This function never waits for the decoder; if the decoder
+    is behind, the previous frame remains in the textures.
+
+    @param vp The video player.
+
+    @return 1 if the textures were updated, 0 if they were not and -1
+    if the video has ended (and isn't looping).
+*/
+int video_player_update(video_player *vp)
+{
+	long now = kuhl_microseconds();
+	video_player_frame *show = NULL;
+	video_player_frame *skipped = NULL;
+	int ended = 0;
+
+#ifdef _WIN32
+	/* Without threads, decode a couple of frames on this thread. */
+	for(int i=0; i<2; i++)
+		if(video_player_step(vp))
+			break;
+#endif
+
+	video_player_lock(vp);
+	if(vp->seekRequested)
+	{
+		video_player_unlock(vp);
+		return 0;
+	}
+	/* The first frame (or the first frame after a seek) starts the clock. */
+	if(!vp->clockRunning && vp->ready != NULL)
+	{
+		vp->clockStart = now - (long) vp->ready->usec;
+		vp->clockRunning = 1;
+	}
+	int64_t videoTime = now - vp->clockStart;
+	while(vp->clockRunning && vp->ready != NULL && vp->ready->usec <= videoTime)
+	{
+		if(show != NULL)
+		{
+			show->next = skipped;
+			skipped = show;
+		}
+		show = vp->ready;
+		vp->ready = show->next;
+		vp->numReady--;
+	}
+	if(skipped != NULL)
+	{
+		/* Return frames we skipped to the decoder. */
+		video_player_frame *last = skipped;
+		while(last->next != NULL)
+			last = last->next;
+		last->next = vp->free;
+		vp->free = skipped;
+	}
+	ended = vp->eof && vp->ready == NULL && show == NULL;
+	video_player_unlock(vp);
+
+	if(show == NULL)
+		return ended ? -1 : 0;
+
+	GLint previousTexture, previousAlignment;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &previousAlignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(int i=0; i<3; i++)
+	{
+		glBindTexture(GL_TEXTURE_2D, vp->tex[i]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+		                i==0 ? vp->width  : vp->cwidth,
+		                i==0 ? vp->height : vp->cheight,
+		                GL_RED, GL_UNSIGNED_BYTE, show->planes[i]);
+	}
+	glBindTexture(GL_TEXTURE_2D, previousTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, previousAlignment);
+	kuhl_errorcheck();
+	vp->shownUsec = show->usec;
+
+	/* Give the frame back to the decoder thread. */
+	video_player_lock(vp);
+	show->next = vp->free;
+	vp->free = show;
+	video_player_wake();
+	video_player_unlock(vp);
+	return 1;
+}
+
+/** Gets the textures that video_player_update() copies frames
+    into. tex[0] contains the Y (luma) plane at full resolution and
+    tex[1] and tex[2] contain the U and V (chroma) planes at half
+    resolution. Each texture has one channel (GL_RED). The first row
+    of each texture is the top of the video. See samples/videoplay.frag
+    for a fragment program that converts these into RGB.
+
+    @param vp The video player.
+
+    @param tex Set to the three texture names.
+*/
+void video_player_textures(const video_player *vp, GLuint tex[3])
+{
+	for(int i=0; i<3; i++)
+		tex[i] = vp->tex[i];
+}
+
+/** Returns the width of the video divided by its height. The
+ * region passed to video_player_open_crop() does not affect the
+ * value. */
+float video_player_aspect_ratio(const video_player *vp)
+{
+	return vp->videoWidth / (float) vp->videoHeight;
+}
+
+/** Gets the region of the video that is in the textures.
+
+    @param vp The video player.
+
+    @param crop Set to left, bottom, right, top where (0,0) is the
+    bottom left corner of the video and (1,1) is the top right corner.
+*/
+void video_player_get_crop(const video_player *vp, float crop[4])
+{
+	crop[0] = vp->cropX / (float) vp->videoWidth;
+	crop[2] = (vp->cropX + vp->width) / (float) vp->videoWidth;
+	crop[3] = 1 - vp->cropY / (float) vp->videoHeight;
+	crop[1] = 1 - (vp->cropY + vp->height) / (float) vp->videoHeight;
+}
+
+/** Returns the length of the video in microseconds (0 if unknown). */
+int64_t video_player_duration(const video_player *vp)
+{
+	return vp->duration;
+}
+
+/** Returns the time of the frame currently in the textures in
+ * microseconds. If the video is looping, the time keeps increasing
+ * after the video starts over. */
+int64_t video_player_time(const video_player *vp)
+{
+	return vp->shownUsec;
+}
+
+/** Jumps to a different time in the video. The frames that were
+    already decoded are discarded and the textures keep the current
+    frame until the decoder reaches the new time.
+
+    @param vp The video player.
+
+    @param usec Time in microseconds since the beginning of the video.
+*/
+void video_player_seek(video_player *vp, int64_t usec)
+{
+	if(usec < 0)
+		usec = 0;
+	if(vp->duration > 0 && usec >= vp->duration)
+		usec = vp->loop ? usec % vp->duration : vp->duration - vp->frameUsec;
+
+	video_player_lock(vp);
+	vp->seekRequested = 1;
+	vp->seekUsec = usec;
+	vp->clockRunning = 0;
+	video_player_wake();
+	video_player_unlock(vp);
+}
+
+/** Removes the player from the decoder threads, deletes the
+ * textures and frees the video player. */
+void video_player_close(video_player *vp)
+{
+	if(vp == NULL)
+		return;
+
+	video_player_lock(vp);
+	vp->quit = 1;
+#ifndef _WIN32
+	/* Wait for a decoder thread to finish with this player. */
+	while(vp->busy)
+		pthread_cond_wait(&video_pool_cond, &video_pool_mutex);
+#endif
+	video_player **p = &video_pool_players;
+	while(*p != vp)
+		p = &((*p)->poolNext);
+	*p = vp->poolNext;
+	video_player_unlock(vp);
+
+	video_player_frame *lists[2] = { vp->free, vp->ready };
+	for(int i=0; i<2; i++)
+	{
+		while(lists[i] != NULL)
+		{
+			video_player_frame *next = lists[i]->next;
+			free(lists[i]->planes[0]);
+			free(lists[i]);
+			lists[i] = next;
+		}
+	}
+	glDeleteTextures(3, vp->tex);
+	free(vp->converted);
+	sws_freeContext(vp->sws_ctx);
+	av_frame_free(&(vp->frame));
+	av_packet_free(&(vp->pkt));
+	avcodec_free_context(&(vp->dec_ctx));
+	avformat_close_input(&(vp->fmt_ctx));
+	free(vp);
+}
+
+#endif // HAVE_FFMPEG
+
+
+/** Calculates the region of a video that is visible on this screen
+    when the video fills a larger overall frustum. For example, if a
+    video fills an entire multiscreen wall, the master frustum (see
+    viewmat_get_master_frustum()) and the frustum for this screen (see
+    viewmat_get_frustum()) can be used to get the region to pass to
+    video_player_open_crop().
+
+    @param crop Set to the visible region of the video: left, bottom,
+    right, top where (0,0) is the bottom left corner of the video and
+    (1,1) is the top right corner.
+
+    @param frustum The frustum for this screen (left, right, bottom,
+    top, near, far).
+
+    @param master The frustum that the video fills.
+
+    @return 1 if some of the video is visible, 0 otherwise.
+*/
+int video_player_crop_from_frustum(float crop[4], const float frustum[6], const float master[6])
+{
+	/* Move the screen's frustum onto the master's near plane. */
+	float scale = master[4] / frustum[4];
+	float l = frustum[0]*scale, r = frustum[1]*scale;
+	float b = frustum[2]*scale, t = frustum[3]*scale;
+
+	crop[0] = (l - master[0]) / (master[1] - master[0]);
+	crop[1] = (b - master[2]) / (master[3] - master[2]);
+	crop[2] = (r - master[0]) / (master[1] - master[0]);
+	crop[3] = (t - master[2]) / (master[3] - master[2]);
+	for(int i=0; i<4; i++)
+	{
+		if(crop[i] < 0) crop[i] = 0;
+		if(crop[i] > 1) crop[i] = 1;
+	}
+	return crop[2] > crop[0] && crop[3] > crop[1];
+}
+
+
+/* ---------------- Video writer ----------------
+
+   A video_writer receives RGB frames (typically from screencap) and
+   encodes them into a single video file on a background thread. If
+   libav/ffmpeg is available, any container and codec that it supports
+   can be written. Otherwise (or if the filename ends in .y4m), raw
+   YUV4MPEG2 is written which ffmpeg, mplayer, x264, etc. can read.
+*/
+
+/** A frame waiting to be encoded. */
+typedef struct {
+	unsigned char *rgb; /**< RGB pixels, bottom row first */
+	int width, height;
+	int64_t frame;      /**< Frame number (in units of 1/fps seconds) */
+} video_writer_frame;
+
+struct video_writer {
+	char filename[1024];
+	int width, height;  /**< Size of the frames in the video file */
+	int fps;
+	int64_t lastFrame;  /**< Frame number of the last frame written, -1 if none */
+	int warnedSize;
+
+	/* Used for YUV4MPEG2 output */
+	FILE *file;
+	int isPipe;
+	unsigned char *yuv; /**< Y, U and V planes of the last frame */
+
+#ifdef HAVE_FFMPEG
+	AVFormatContext *fmt_ctx;
+	AVCodecContext *enc_ctx;
+	AVStream *stream;
+	AVFrame *frame;
+	AVPacket *pkt;
+	struct SwsContext *sws_ctx;
+#endif
+
+	/* Frames waiting to be encoded. Protected by mutex. */
+	queue *frames;
+	int maxFrames;
+	int quit;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_t thread;
+#endif
+};
+
+
+/** Converts a bottom-row-first RGB image into top-row-first Y, U and
+ * V planes (BT.601, 4:2:0). Width and height must be even. */
+static void video_writer_rgb_to_yuv420(const unsigned char *rgb, int width, int height, unsigned char *yuv)
+{
+	unsigned char *yPlane = yuv;
+	unsigned char *uPlane = yuv + width*height;
+	unsigned char *vPlane = uPlane + (width/2)*(height/2);
+
+	for(int y=0; y<height; y+=2)
+	{
+		const unsigned char *row0 = rgb + 3*width*(height-1-y);
+		const unsigned char *row1 = row0 - 3*width;
+		for(int x=0; x<width; x+=2)
+		{
+			int r=0, g=0, b=0;
+			const unsigned char *px[4] = { row0+3*x, row0+3*(x+1), row1+3*x, row1+3*(x+1) };
+			int outIndex[4] = { y*width+x, y*width+x+1, (y+1)*width+x, (y+1)*width+x+1 };
+			for(int i=0; i<4; i++)
+			{
+				yPlane[outIndex[i]] = (unsigned char) (((66*px[i][0] + 129*px[i][1] + 25*px[i][2] + 128) >> 8) + 16);
+				r += px[i][0];
+				g += px[i][1];
+				b += px[i][2];
+			}
+			r = (r+2)/4;
+			g = (g+2)/4;
+			b = (b+2)/4;
+			int c = (y/2)*(width/2)+x/2;
+			uPlane[c] = (unsigned char) (((-38*r -  74*g + 112*b + 128) >> 8) + 128);
+			vPlane[c] = (unsigned char) (((112*r -  94*g -  18*b + 128) >> 8) + 128);
+		}
+	}
+}
+
+/** Writes a frame into a YUV4MPEG2 stream. Since YUV4MPEG2 has a
+ * constant frame rate, the previous frame is repeated to fill in any
+ * frames that were skipped because the program was rendering slower
+ * than the requested frame rate. */
+static void video_writer_y4m_frame(video_writer *vw, video_writer_frame *f)
+{
+	size_t frameBytes = (size_t) vw->width*vw->height*3/2;
+	if(vw->lastFrame >= 0)
+	{
+		for(int64_t i=vw->lastFrame+1; i<f->frame; i++)
+		{
+			fputs("FRAME\n", vw->file);
+			fwrite(vw->yuv, 1, frameBytes, vw->file);
+		}
+	}
+
+	/* Crop to an even size by dropping the top row and/or right column. */
+	if(f->width != vw->width || f->height != vw->height)
+	{
+		unsigned char *cropped = kuhl_malloc(vw->width*vw->height*3);
+		for(int y=0; y<vw->height; y++)
+			memcpy(cropped+3*vw->width*y, f->rgb+3*f->width*y, 3*vw->width);
+		video_writer_rgb_to_yuv420(cropped, vw->width, vw->height, vw->yuv);
+		free(cropped);
+	}
+	else
+		video_writer_rgb_to_yuv420(f->rgb, vw->width, vw->height, vw->yuv);
+
+	fputs("FRAME\n", vw->file);
+	if(fwrite(vw->yuv, 1, frameBytes, vw->file) != frameBytes)
+		msg(MSG_ERROR, "Failed to write frame %"PRId64" to %s", f->frame, vw->filename);
+}
+
+#ifdef HAVE_FFMPEG
+/** Sends a frame to the encoder (or flushes the encoder if frame is
+ * NULL) and writes any packets that the encoder returns. */
+static void video_writer_encode(video_writer *vw, AVFrame *frame)
+{
+	int ret = avcodec_send_frame(vw->enc_ctx, frame);
+	if(ret < 0)
+	{
+		msg(MSG_ERROR, "Error encoding frame for %s (%s)", vw->filename, av_err2str(ret));
+		return;
+	}
+
+	while((ret = avcodec_receive_packet(vw->enc_ctx, vw->pkt)) >= 0)
+	{
+		av_packet_rescale_ts(vw->pkt, vw->enc_ctx->time_base, vw->stream->time_base);
+		vw->pkt->stream_index = vw->stream->index;
+		/* av_interleaved_write_frame() takes ownership of the packet. */
+		if((ret = av_interleaved_write_frame(vw->fmt_ctx, vw->pkt)) < 0)
+			msg(MSG_ERROR, "Error writing packet to %s (%s)", vw->filename, av_err2str(ret));
+	}
+}
+
+static void video_writer_av_frame(video_writer *vw, video_writer_frame *f)
+{
+	if(av_frame_make_writable(vw->frame) < 0)
+	{
+		msg(MSG_ERROR, "Could not make video frame writable");
+		return;
+	}
+
+	/* Convert to the encoder's pixel format (and scale if the window
+	 * was resized). A negative stride flips the image so that the
+	 * top row comes first. */
+	vw->sws_ctx = sws_getCachedContext(vw->sws_ctx, f->width, f->height, AV_PIX_FMT_RGB24,
+	                                   vw->width, vw->height, vw->enc_ctx->pix_fmt,
+	                                   SWS_BILINEAR, NULL, NULL, NULL);
+	const uint8_t *src[] = { f->rgb + 3*f->width*(f->height-1) };
+	const int srcStride[] = { -3*f->width };
+	sws_scale(vw->sws_ctx, src, srcStride, 0, f->height, vw->frame->data, vw->frame->linesize);
+
+	vw->frame->pts = f->frame;
+	video_writer_encode(vw, vw->frame);
+}
+
+/** Sets up libav to write a video file. Returns 0 on success. */
+static int video_writer_av_open(video_writer *vw)
+{
+	if(avformat_alloc_output_context2(&(vw->fmt_ctx), NULL, NULL, vw->filename) < 0 || vw->fmt_ctx == NULL)
+	{
+		msg(MSG_ERROR, "Could not determine video format from filename '%s'", vw->filename);
+		return -1;
+	}
+
+	/* Use the codec in the config file if there is one, otherwise use
+	 * the default codec for the container. */
+	const char *codecName = kuhl_config_get("videowriter.codec");
+	const AVCodec *codec = NULL;
+	if(codecName != NULL)
+		codec = avcodec_find_encoder_by_name(codecName);
+	else
+		codec = avcodec_find_encoder(vw->fmt_ctx->oformat->video_codec);
+	if(codec == NULL)
+	{
+		msg(MSG_ERROR, "Could not find video encoder %s for '%s'", codecName ? codecName : "", vw->filename);
+		return -1;
+	}
+
+	vw->stream = avformat_new_stream(vw->fmt_ctx, NULL);
+	vw->enc_ctx = avcodec_alloc_context3(codec);
+	if(vw->stream == NULL || vw->enc_ctx == NULL)
+	{
+		msg(MSG_ERROR, "Could not allocate video stream for '%s'", vw->filename);
+		return -1;
+	}
+
+	AVCodecContext *c = vw->enc_ctx;
+	c->width = vw->width;
+	c->height = vw->height;
+	c->time_base = (AVRational){ 1, vw->fps };
+	c->framerate = (AVRational){ vw->fps, 1 };
+	c->gop_size = vw->fps;
+	/* Default is roughly 0.15 bits per pixel. */
+	c->bit_rate = kuhl_config_int("videowriter.bitrate", 0, 0);
+	if(c->bit_rate <= 0)
+		c->bit_rate = (int64_t) vw->width*vw->height*vw->fps*15/100;
+	c->pix_fmt = AV_PIX_FMT_YUV420P;
+	const enum AVPixelFormat *pixFmts = NULL;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+	/* AVCodec.pix_fmts is deprecated in FFmpeg 7.1 and later. */
+	avcodec_get_supported_config(c, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0, (const void**) &pixFmts, NULL);
+#else
+	pixFmts = codec->pix_fmts;
+#endif
+	if(pixFmts != NULL)
+	{
+		c->pix_fmt = pixFmts[0];
+		for(int i=0; pixFmts[i] != AV_PIX_FMT_NONE; i++)
+			if(pixFmts[i] == AV_PIX_FMT_YUV420P)
+				c->pix_fmt = AV_PIX_FMT_YUV420P;
+	}
+	if(vw->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	vw->stream->time_base = c->time_base;
+
+	int ret;
+	if((ret = avcodec_open2(c, codec, NULL)) < 0)
+	{
+		msg(MSG_ERROR, "Could not open video encoder %s (%s)", codec->name, av_err2str(ret));
+		return -1;
+	}
+	avcodec_parameters_from_context(vw->stream->codecpar, c);
+
+	if(!(vw->fmt_ctx->oformat->flags & AVFMT_NOFILE) &&
+	   (ret = avio_open(&(vw->fmt_ctx->pb), vw->filename, AVIO_FLAG_WRITE)) < 0)
+	{
+		msg(MSG_ERROR, "Could not open '%s' (%s)", vw->filename, av_err2str(ret));
+		return -1;
+	}
+	if((ret = avformat_write_header(vw->fmt_ctx, NULL)) < 0)
+	{
+		msg(MSG_ERROR, "Could not write header to '%s' (%s)", vw->filename, av_err2str(ret));
+		return -1;
+	}
+
+	/* vw->frame is only set once everything is ready so that
+	 * video_writer_av_close() knows whether to flush the encoder. */
+	AVFrame *frame = av_frame_alloc();
+	vw->pkt = av_packet_alloc();
+	if(frame == NULL || vw->pkt == NULL)
+	{
+		msg(MSG_ERROR, "Could not allocate video frame for '%s'", vw->filename);
+		av_frame_free(&frame);
+		return -1;
+	}
+	frame->format = c->pix_fmt;
+	frame->width = c->width;
+	frame->height = c->height;
+	if(av_frame_get_buffer(frame, 0) < 0)
+	{
+		msg(MSG_ERROR, "Could not allocate video frame for '%s'", vw->filename);
+		av_frame_free(&frame);
+		return -1;
+	}
+	vw->frame = frame;
+
+	msg(MSG_INFO, "Writing %s with %s (%dx%d, %d fps, %"PRId64" bits/sec)",
+	    vw->filename, codec->name, vw->width, vw->height, vw->fps, (int64_t) c->bit_rate);
+	return 0;
+}
+
+static void video_writer_av_close(video_writer *vw)
+{
+	if(vw->frame != NULL) // header was written
+	{
+		video_writer_encode(vw, NULL);
+		av_write_trailer(vw->fmt_ctx);
+	}
+	if(vw->fmt_ctx && !(vw->fmt_ctx->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&(vw->fmt_ctx->pb));
+	avcodec_free_context(&(vw->enc_ctx));
+	av_frame_free(&(vw->frame));
+	av_packet_free(&(vw->pkt));
+	sws_freeContext(vw->sws_ctx);
+	avformat_free_context(vw->fmt_ctx);
+}
 #endif // HAVE_FFMPEG
+
+/** Encodes one frame and frees its pixels. Called on the writer thread. */
+static void video_writer_write(video_writer *vw, video_writer_frame *f)
+{
+	/* Frames must arrive in order; skip any duplicates. */
+	if(f->frame > vw->lastFrame)
+	{
+#ifdef HAVE_FFMPEG
+		if(vw->file == NULL)
+			video_writer_av_frame(vw, f);
+		else
+#endif
+		if(f->width < vw->width || f->height < vw->height ||
+		   f->width > vw->width+1 || f->height > vw->height+1)
+		{
+			if(!vw->warnedSize)
+				msg(MSG_WARNING, "Frame size changed from %dx%d to %dx%d; frames will be skipped while writing %s.", vw->width, vw->height, f->width, f->height, vw->filename);
+			vw->warnedSize = 1;
+		}
+		else
+			video_writer_y4m_frame(vw, f);
+		vw->lastFrame = f->frame;
+	}
+	free(f->rgb);
+}
+
+#ifndef _WIN32
+static void* video_writer_thread(void *arg)
+{
+	video_writer *vw = (video_writer*) arg;
+	pthread_mutex_lock(&(vw->mutex));
+	while(1)
+	{
+		while(queue_length(vw->frames) == 0 && !vw->quit)
+			pthread_cond_wait(&(vw->not_empty), &(vw->mutex));
+		if(queue_length(vw->frames) == 0) // quit and nothing left to write
+			break;
+
+		video_writer_frame f;
+		queue_remove(vw->frames, &f);
+		pthread_cond_signal(&(vw->not_full));
+		pthread_mutex_unlock(&(vw->mutex));
+
+		video_writer_write(vw, &f);
+
+		pthread_mutex_lock(&(vw->mutex));
+	}
+	pthread_mutex_unlock(&(vw->mutex));
+	return NULL;
+}
+#endif
+
+/** Opens a video file for writing and starts a thread to encode the
+    frames.
+
+    The format is chosen based on the filename. If the filename ends
+    with ".y4m", raw YUV4MPEG2 is written. If the filename starts with
+    "|", the rest of the filename is run as a command and YUV4MPEG2 is
+    written to its standard input (for example, "|ffmpeg -i - out.mp4").
+    If the filename is "-", YUV4MPEG2 is written to standard out. All
+    other filenames are written with libav/ffmpeg; the container is
+    chosen from the extension (.mp4, .mkv, .ogv, etc.). If the library
+    wasn't compiled with ffmpeg, ".y4m" is appended to such filenames.
+
+    The following configuration file settings are supported:
+
+    videowriter.codec - Name of the ffmpeg encoder to use (for example,
+    libx264 or mpeg4). Default is the default encoder for the container.
+
+    videowriter.bitrate - Bits per second. Default depends on the size
+    and frame rate of the video.
+
+    videowriter.queue - Maximum number of frames waiting to be encoded
+    (default 8).
+
+    @param filename The video file to write.
+
+    @param width Width of the frames in pixels. Odd widths are rounded
+    down since most codecs require even dimensions.
+
+    @param height Height of the frames in pixels. Odd heights are
+    rounded down.
+
+    @param fps Frames per second.
+
+    @return A video_writer or NULL if the file could not be opened.
+*/
+video_writer* video_writer_open(const char *filename, int width, int height, int fps)
+{
+	if(width < 2 || height < 2 || fps < 1)
+	{
+		msg(MSG_ERROR, "Invalid video size (%dx%d) or frame rate (%d)", width, height, fps);
+		return NULL;
+	}
+
+	video_writer *vw = (video_writer*) calloc(1, sizeof(video_writer));
+	snprintf(vw->filename, 1024, "%s", filename);
+	vw->width  = width & ~1;
+	vw->height = height & ~1;
+	vw->fps = fps;
+	vw->lastFrame = -1;
+
+	const char *dot = strrchr(filename, '.');
+	int useY4M = (filename[0] == '|' || strcmp(filename, "-") == 0 ||
+	              (dot != NULL && strcasecmp(dot, ".y4m") == 0));
+#ifndef HAVE_FFMPEG
+	if(!useY4M)
+	{
+		msg(MSG_WARNING, "Library is not compiled against FFMpeg. Writing uncompressed YUV4MPEG2 video instead.");
+		snprintf(vw->filename, 1024, "%s.y4m", filename);
+		useY4M = 1;
+	}
+#endif
+
+	if(useY4M)
+	{
+		if(vw->filename[0] == '|')
+		{
+#ifdef _WIN32
+			vw->file = _popen(vw->filename+1, "wb");
+#else
+			vw->file = popen(vw->filename+1, "w");
+#endif
+			vw->isPipe = 1;
+		}
+		else if(strcmp(vw->filename, "-") == 0)
+			vw->file = stdout;
+		else
+			vw->file = fopen(vw->filename, "wb");
+		if(vw->file == NULL)
+		{
+			msg(MSG_ERROR, "Could not open '%s' for writing video", vw->filename);
+			free(vw);
+			return NULL;
+		}
+		fprintf(vw->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", vw->width, vw->height, vw->fps);
+		vw->yuv = kuhl_malloc(vw->width*vw->height*3/2);
+		msg(MSG_INFO, "Writing YUV4MPEG2 video to %s (%dx%d, %d fps)", vw->filename, vw->width, vw->height, vw->fps);
+	}
+#ifdef HAVE_FFMPEG
+	else if(video_writer_av_open(vw) < 0)
+	{
+		video_writer_av_close(vw);
+		free(vw);
+		return NULL;
+	}
+#endif
+
+	vw->maxFrames = kuhl_config_int("videowriter.queue", 8, 8);
+	if(vw->maxFrames < 1)
+		vw->maxFrames = 1;
+	vw->frames = queue_new(vw->maxFrames+1, sizeof(video_writer_frame));
+#ifndef _WIN32
+	pthread_mutex_init(&(vw->mutex), NULL);
+	pthread_cond_init(&(vw->not_empty), NULL);
+	pthread_cond_init(&(vw->not_full), NULL);
+	if(pthread_create(&(vw->thread), NULL, video_writer_thread, vw) != 0)
+	{
+		msg(MSG_FATAL, "Failed to create video writer thread.");
+		exit(EXIT_FAILURE);
+	}
+#endif
+	return vw;
+}
+
+/** Adds a frame to the video. The frame is encoded by a background
+    thread. This function only waits if too many frames are already
+    waiting to be encoded (see videowriter.queue).
+
+    @param vw The video writer.
+
+    @param rgb RGB pixels with the bottom row first and no padding
+    between rows (the format produced by glReadPixels() and
+    screencap). The video writer takes ownership of the pixels and
+    will free() them.
+
+    @param width Width of the image. If the size doesn't match the
+    size passed to video_writer_open(), the image is scaled (ffmpeg)
+    or skipped (YUV4MPEG2).
+
+    @param height Height of the image.
+
+    @param frame The time of the frame in units of 1/fps seconds
+    since the beginning of the video. Frame numbers must increase; if
+    a frame number is skipped, the previous frame is shown for longer.
+*/
+void video_writer_add_frame(video_writer *vw, unsigned char *rgb, int width, int height, int64_t frame)
+{
+	video_writer_frame f;
+	f.rgb = rgb;
+	f.width = width;
+	f.height = height;
+	f.frame = frame;
+
+#ifdef _WIN32
+	video_writer_write(vw, &f);
+#else
+	pthread_mutex_lock(&(vw->mutex));
+	if(queue_length(vw->frames) >= vw->maxFrames)
+	{
+		static int warned = 0;
+		if(!warned)
+			msg(MSG_WARNING, "Video encoder can't keep up; rendering will wait for frames to be encoded. Consider a faster codec (videowriter.codec), a lower frame rate or a smaller window.");
+		warned = 1;
+		while(queue_length(vw->frames) >= vw->maxFrames)
+			pthread_cond_wait(&(vw->not_full), &(vw->mutex));
+	}
+	queue_add(vw->frames, &f);
+	pthread_cond_signal(&(vw->not_empty));
+	pthread_mutex_unlock(&(vw->mutex));
+#endif
+}
+
+/** Waits for all frames to be encoded, finishes writing the video
+ * file and frees the video writer.
+
+ @param vw The video writer to close.
+*/
+void video_writer_close(video_writer *vw)
+{
+	if(vw == NULL)
+		return;
+
+#ifndef _WIN32
+	pthread_mutex_lock(&(vw->mutex));
+	vw->quit = 1;
+	pthread_cond_signal(&(vw->not_empty));
+	pthread_mutex_unlock(&(vw->mutex));
+	pthread_join(vw->thread, NULL);
+	pthread_mutex_destroy(&(vw->mutex));
+	pthread_cond_destroy(&(vw->not_empty));
+	pthread_cond_destroy(&(vw->not_full));
+#endif
+
+	if(vw->file != NULL)
+	{
+		if(vw->isPipe)
+		{
+#ifdef _WIN32
+			_pclose(vw->file);
+#else
+			pclose(vw->file);
+#endif
+		}
+		else if(vw->file != stdout)
+			fclose(vw->file);
+		else
+			fflush(stdout);
+		free(vw->yuv);
+	}
+#ifdef HAVE_FFMPEG
+	else
+		video_writer_av_close(vw);
+#endif
+
+	queue_free(vw->frames);
+	msg(MSG_INFO, "Finished writing video %s (%"PRId64" frames)", vw->filename, vw->lastFrame+1);
+	free(vw);
+}
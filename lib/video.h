@@ -1,9 +1,12 @@
 #pragma once
+#include <stdint.h>
+#include <GL/glew.h>
 
 #ifdef HAVE_FFMPEG
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
+#include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #endif
@@ -21,8 +24,9 @@ typedef struct {
 
 #ifdef HAVE_FFMPEG
 	enum AVPixelFormat pix_fmt;
-	AVPacket pkt;
+	AVPacket *pkt;
 	int video_stream_idx;
+	int draining;
 
 	struct SwsContext *sws_ctx;
 	AVFrame *frame;
@@ -37,3 +41,25 @@ typedef struct {
 
 video_state* video_get_next_frame(video_state *state, const char *filename);
 void video_cleanup(video_state *state);
+
+/** Plays a video file by decoding frames on a background thread. */
+typedef struct video_player video_player;
+
+video_player* video_player_open(const char *filename, int loop);
+video_player* video_player_open_crop(const char *filename, int loop, const float crop[4]);
+int video_player_crop_from_frustum(float crop[4], const float frustum[6], const float master[6]);
+int video_player_update(video_player *vp);
+void video_player_textures(const video_player *vp, GLuint tex[3]);
+float video_player_aspect_ratio(const video_player *vp);
+void video_player_get_crop(const video_player *vp, float crop[4]);
+int64_t video_player_duration(const video_player *vp);
+int64_t video_player_time(const video_player *vp);
+void video_player_seek(video_player *vp, int64_t usec);
+void video_player_close(video_player *vp);
+
+/** Writes RGB frames into a video file using a background thread. */
+typedef struct video_writer video_writer;
+
+video_writer* video_writer_open(const char *filename, int width, int height, int fps);
+void video_writer_add_frame(video_writer *vw, unsigned char *rgb, int width, int height, int64_t frame);
+void video_writer_close(video_writer *vw);
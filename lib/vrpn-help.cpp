@@ -4,12 +4,39 @@
  */
 
 /** @file
+ *
+ * VRPN records are received by a background "tracker thread" which
+ * runs the mainloop() of every tracked object vrpn.pollrate times a
+ * second (default 1000). The thread smooths each record with a Kalman
+ * filter and publishes it as the latest sample of the object. The
+ * sample is protected by a sequence number (a seqlock) instead of a
+ * mutex, so vrpn_get() never waits for the network or for the tracker
+ * thread: it copies the latest sample and (if vrpn.predict is set to
+ * a number of milliseconds) extrapolates the pose that far past the
+ * current time (see pose-predict.c). vrpn_get_predicted() instead
+ * extrapolates the pose to a given time, such as the time returned by
+ * bufferswap_display_time(). On Windows, there is no tracker thread and
+ * vrpn_get() runs mainloop() itself.
+ *
+ * vrpn_open() looks up an object once and returns a handle;
+ * vrpn_get_handle() then gets the latest pose without formatting,
+ * hashing or allocating anything. vrpn_get() and vrpn_get_predicted()
+ * keep a small cache of the object and hostname strings they have been
+ * called with, so they only build the object\@hostname string and
+ * search for the object the first time they are called for an object.
+ *
+ * Programs that need every record instead of the latest one (such as
+ * vrpn/recorder.c) can register a callback with vrpn_set_callback().
+ * The tracker thread calls it for each record as it arrives, before
+ * the record is smoothed.
+ *
  * @author Scott Kuhl
  */
 #include <stdlib.h>
 #include <stdio.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <pthread.h>
 #endif
 #include <map>
 #include <string>
@@ -23,50 +50,148 @@
 #include "kuhl-util.h"
 #include "vecmat.h"
 #include "kalman.h"
+#include "pose-predict.h"
 #include "vrpn-help.h"
 
 #ifndef MISSING_VRPN
 
 
+/** The latest record received for a tracked object. */
+typedef struct {
+	float pos[3];    /**< Smoothed position */
+	float vel[3];    /**< Velocity estimated by the Kalman filter (units/second) */
+	float acc[3];    /**< Acceleration estimated by the Kalman filter (units/second^2) */
+	float quat[4];   /**< Smoothed orientation */
+	float angvel[3]; /**< Angular velocity (radians/second) */
+	long time;      /**< Time the tracking system recorded the record (microseconds) */
+	long received;  /**< Time we received the record (kuhl_microseconds()) */
+} TrackedSample;
+
 /** A struct which we will create for every single tracked
  * object. These will be in a map so that we can easily find the
  * struct that corresponds with an object using the "object\@tracker"
  * notation. */
-typedef struct {
-	vrpn_Tracker_Remote *tracker; /**< The VRPN tracker for this object */
-	vrpn_TRACKERCB data; /**< Data we receive from VRPN (we receive it in the callback */
-	int hasData; /**< Has data been written to? */
-	int failCount; /**< Number of times vrpn_get() has been called with hasData == 0 */
+typedef struct TrackedObject {
+	char *fullname; /**< object\@tracker */
+	int isVicon;    /**< Is the tracker the Vicon system in the IVS lab (see vrpn_is_vicon())? */
+
+	/* Only used by the tracker thread: */
+	vrpn_Tracker_Remote *tracker; /**< The VRPN tracker for this object (NULL until we connect) */
+	struct TrackedHost *host; /**< The server that the object is on (NULL until the tracker thread looks it up) */
+	struct timeval lastTime; /**< msg_time of the previous record */
+	int hasLastTime; /**< Has lastTime been written to? */
 	kuhl_fps_state fps_state; /**< Track how many records per second this object has sent us */
-	kalman_state kalman[7]; /**< Kalman filter state for this object */
+	pose_predictor predictor; /**< Kalman filters which smooth the pose and estimate velocities */
+
+	/* Written by the tracker thread, read by vrpn_get(): */
+	unsigned int seq; /**< Odd while sample is being written; 0 until the first record arrives */
+	TrackedSample sample; /**< The latest record */
+
+	/* Set by vrpn_set_callback(), called by the tracker thread: */
+	vrpn_callback callback; /**< Called with every record (NULL if none) */
+	void *callbackData;     /**< Passed to callback */
+
+	/* Raw records requested by vrpn_get_raw() (protected by vrpn_mutex): */
+	float *raw;   /**< Array to copy count*7 raw values into */
+	int rawCount; /**< Number of records copied into raw so far */
+	int rawWanted; /**< Number of records that vrpn_get_raw() wants (0 if none) */
+
+	/* Only used by vrpn_get(): */
+	int failCount; /**< Number of times vrpn_get() has been called without any data */
+
+	struct TrackedObject *next; /**< Next object that the tracker thread polls */
 } TrackedObject;
 
-/** A mapping of object\@tracker strings to vrpn_Tracker_Remote objects
- * so we can quickly find the appropriate object given an
- * object\@tracker string. */
+/** A VRPN server that one or more tracked objects are on. Only used
+ * by the tracker thread. */
+typedef struct TrackedHost {
+	char *hostname;
+	vrpn_Connection *connection; /**< NULL if we aren't connected or connecting */
+	long connectStart; /**< When we started connecting (microseconds) */
+	long nextConnect;  /**< Time to try to connect again if connecting failed (microseconds) */
+	long backoff;      /**< Time to wait after the next failure (microseconds) */
+	int trackers;      /**< Number of trackers using the connection */
+	struct TrackedHost *next;
+} TrackedHost;
+
+/** Servers that the tracker thread connects to. */
+static TrackedHost *vrpn_hosts = NULL;
+
+/** A mapping of object\@tracker strings to TrackedObjects so we can
+ * quickly find the appropriate object given an object\@tracker
+ * string. */
 std::map<std::string, TrackedObject*> nameToTracker;
 
+/** Objects that the tracker thread polls. New objects are added to
+ * the front of the list; objects are never removed. */
+static TrackedObject *vrpn_objects = NULL;
+
+#ifndef _WIN32
+static pthread_mutex_t vrpn_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when vrpn_get_raw() has received all of the records it wants. */
+static pthread_cond_t vrpn_raw_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t vrpn_thread;
+static int vrpn_thread_started = 0;
+#endif
 
-static void smooth(TrackedObject *to)
+static void vrpn_lock(void)
 {
-	long microseconds = (to->data.msg_time.tv_sec* 1000000L) + to->data.msg_time.tv_usec;
-	/* Smooth position */
-	for(int i=0; i<3; i++)
-	{
-		to->data.pos[i] = kalman_estimate(&(to->kalman[i]),
-		                                  to->data.pos[i],
-		                                  microseconds);
-	}
+#ifndef _WIN32
+	pthread_mutex_lock(&vrpn_mutex);
+#endif
+}
+static void vrpn_unlock(void)
+{
+#ifndef _WIN32
+	pthread_mutex_unlock(&vrpn_mutex);
+#endif
+}
+
 
-	/* Smooth orientation */
-	for(int i=0; i<4; i++)
+/** Tracker thread: Smooths a record and publishes it as the latest
+ * sample of an object. */
+static void vrpn_publish(TrackedObject *to, const vrpn_TRACKERCB &t)
+{
+	TrackedSample sample;
+	long microseconds = (t.msg_time.tv_sec* 1000000L) + t.msg_time.tv_usec;
+	sample.time = microseconds;
+	sample.received = kuhl_microseconds();
+
+	/* Smooth position and orientation and estimate velocities */
+	float pos[3] = { (float) t.pos[0], (float) t.pos[1], (float) t.pos[2] };
+	float quat[4] = { (float) t.quat[0], (float) t.quat[1], (float) t.quat[2], (float) t.quat[3] };
+	pose_predictor_add(&(to->predictor), pos, quat, microseconds);
+	pose_predictor_state(&(to->predictor), sample.pos, sample.vel, sample.acc);
+	pose_predictor_orientation(&(to->predictor), sample.quat, sample.angvel);
+
+	/* vrpn_read() copies the sample and then checks that seq didn't
+	 * change while it was copying. */
+	unsigned int seq = to->seq;
+	__atomic_store_n(&to->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	to->sample = sample;
+	__atomic_store_n(&to->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+/** Copies the latest sample of an object without waiting for the
+ * tracker thread.
+
+    @return 1 if successful, 0 if we haven't received any records for the object.
+*/
+static int vrpn_read(TrackedObject *to, TrackedSample *sample)
+{
+	while(1)
 	{
-		to->data.quat[i] = kalman_estimate(&(to->kalman[3+i]),
-		                                   to->data.quat[i],
-		                                   microseconds);
+		unsigned int seq = __atomic_load_n(&to->seq, __ATOMIC_ACQUIRE);
+		if(seq == 0)
+			return 0;
+		if(seq & 1) // tracker thread is writing the sample right now
+			continue;
+		*sample = to->sample;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&to->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
 	}
-	
-	// printf("%ld, %lf, %lf\n", kuhl_milliseconds(), t.pos[0], smoothed);
 }
 
 static void vrpn_sanity_check(const struct timeval lastTime,
@@ -88,14 +213,13 @@ static void vrpn_sanity_check(const struct timeval lastTime,
  * provides us with new data. This may be called repeatedly for each
  * record that we have missed if many records have been delivered
  * since the last call to the VRPN mainloop() function. */
-static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
+static void VRPN_CALLBACK handle_tracker(void *userdata, vrpn_TRACKERCB t)
 {
-	std::string s = (char*)name;
-	TrackedObject *tracked = nameToTracker[s];
+	TrackedObject *tracked = (TrackedObject*) userdata;
 		
 	float fps = kuhl_getfps(&(tracked->fps_state));
 	if(tracked->fps_state.frame == 0)
-		msg(MSG_INFO, "VRPN records per second: %.1f (%s)\n", fps, s.c_str());
+		msg(MSG_INFO, "VRPN records per second: %.1f (%s)\n", fps, tracked->fullname);
 
 	/* Some tracking systems return large values when a point gets
 	 * lost. If the tracked point seems to be lost, ignore this
@@ -104,8 +228,19 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	vec3f_set(pos, t.pos[0], t.pos[1], t.pos[2]);
 	vec4f_set(quat, t.quat[0], t.quat[1], t.quat[2], t.quat[3]);
 
-	if(tracked->hasData)
-		vrpn_sanity_check(tracked->data.msg_time, t.msg_time, (char*)name);
+	if(tracked->hasLastTime)
+		vrpn_sanity_check(tracked->lastTime, t.msg_time, tracked->fullname);
+	tracked->lastTime = t.msg_time;
+	tracked->hasLastTime = 1;
+
+	/* Give every record to the callback, even if the point seems to be
+	 * lost. */
+	vrpn_callback callback = __atomic_load_n(&tracked->callback, __ATOMIC_ACQUIRE);
+	if(callback)
+	{
+		long microseconds = (t.msg_time.tv_sec* 1000000L) + t.msg_time.tv_usec;
+		callback(tracked->callbackData, microseconds, pos, quat);
+	}
 
 	if(0)
 	{
@@ -119,70 +254,199 @@ static void VRPN_CALLBACK handle_tracker(void *name, vrpn_TRACKERCB t)
 	
 	if(vec3f_norm(pos) > 100)
 		return;
+
+	/* Give vrpn_get_raw() every record before it is smoothed. */
+	if(__atomic_load_n(&tracked->rawWanted, __ATOMIC_ACQUIRE))
+	{
+		vrpn_lock();
+		if(tracked->rawCount < tracked->rawWanted)
+		{
+			float *r = tracked->raw + tracked->rawCount*7;
+			for(int i=0; i<3; i++)
+				r[i] = t.pos[i];
+			for(int i=0; i<4; i++)
+				r[3+i] = t.quat[i];
+			tracked->rawCount++;
+#ifndef _WIN32
+			if(tracked->rawCount == tracked->rawWanted)
+				pthread_cond_broadcast(&vrpn_raw_cond);
+#endif
+		}
+		vrpn_unlock();
+	}
 	
-	// Store the data so we can use it later.
-	tracked->data = t;
-	smooth(tracked);
-	tracked->hasData = 1;
+	vrpn_publish(tracked, t);
 }
 
-/** Establish a VRPN connection to a specified host.
+/** Tracker thread: Finds (or creates) the server that an object is on.
 
-    @param fullname A string containing either the hostname or
-    something in the format of object\@hostname.
+    @param fullname Either the hostname or something in the format of
+    object\@hostname.
+ */
+static TrackedHost* vrpn_host(const char *fullname)
+{
+	const char *at = strchr(fullname, '@');
+	const char *hostname = at ? at+1 : fullname;
+	for(TrackedHost *h = vrpn_hosts; h != NULL; h = h->next)
+		if(strcmp(h->hostname, hostname) == 0)
+			return h;
+
+	TrackedHost *h = (TrackedHost*) calloc(1, sizeof(TrackedHost));
+	h->hostname = strdup(hostname);
+	h->next = vrpn_hosts;
+	vrpn_hosts = h;
+	return h;
+}
+
+/** Tracker thread: Establishes a VRPN connection to a server without
+    waiting for the server to answer. Each call runs the main loop of
+    the connection once. If the server doesn't answer within a second,
+    the connection is dropped and we try again later; the time between
+    attempts doubles (up to 30 seconds) each time we fail so that a
+    server which is down doesn't slow down the objects on servers that
+    are up. All of the objects on a server share one connection
+    attempt.
 
-    @return Returns 0 if connection failed, 1 otherwise.
+    @return 1 if we are connected to the server, 0 otherwise.
  */
-static int vrpn_connect(const char *fullname)
+static int vrpn_connect(TrackedHost *h)
 {
-	msg(MSG_INFO, "Connecting to VRPN server to track '%s'\n", fullname);
-
-	/* If we are making a TCP connection and the server isn't up, the
-	 * following function call may hang for a long time. Also, the
-	 * documentation indicates that if we call this function multiple
-	 * times with the same hostname, the same connection will be
-	 * returned (and new connections won't be made). Accepts
-	 * object@hostname notation. */
-	vrpn_Connection *connection = vrpn_get_connection_by_name(fullname);
-	/* Wait for a bit to see if we can connect. Sometimes we don't immediately connect! */
-	for(int i=0; i<1000 && !connection->connected(); i++)
+	long now = kuhl_microseconds();
+	if(h->connection == NULL)
 	{
-		usleep(1000); // 1000 microseconds * 1000 = up to 1 second of waiting.
-		connection->mainloop();
+		if(now < h->nextConnect)
+			return 0;
+		msg(MSG_INFO, "Connecting to VRPN server '%s'\n", h->hostname);
+		/* The documentation indicates that if we call this function
+		 * multiple times with the same hostname, the same connection
+		 * will be returned (and new connections won't be made). */
+		h->connection = vrpn_get_connection_by_name(h->hostname);
+		h->connectStart = now;
+		if(h->connection == NULL)
+			h->connectStart -= 1000000; // fail below
 	}
-	/* If connection failed, exit. */
-	if(!connection->connected())
+	else if(h->connection->connected())
+		return 1;
+
+	/* Sometimes we don't immediately connect! */
+	if(h->connection != NULL)
 	{
-		delete connection;
-		msg(MSG_ERROR, "Failed to connect to tracker: %s\n", fullname);
+		h->connection->mainloop();
+		if(h->connection->connected())
+		{
+			h->backoff = 0;
+			return 1;
+		}
+	}
+	/* Once trackers use the connection, VRPN reconnects by itself. */
+	if(now - h->connectStart < 1000000 || h->trackers > 0)
 		return 0;
+
+	/* Give up for now. */
+	if(h->backoff < 1000000)
+		h->backoff = 1000000;
+	delete h->connection;
+	h->connection = NULL;
+	h->nextConnect = now + h->backoff;
+	msg(MSG_ERROR, "Failed to connect to VRPN server %s; trying again in %ld seconds\n", h->hostname, h->backoff/1000000);
+	h->backoff *= 2;
+	if(h->backoff > 30000000)
+		h->backoff = 30000000;
+	return 0;
+}
+
+/** Tracker thread: Connects to objects that we aren't connected to
+ * yet and runs the VRPN main loop of every object (which calls
+ * handle_tracker() for each record that has arrived). */
+static void vrpn_poll(void)
+{
+	for(TrackedObject *to = __atomic_load_n(&vrpn_objects, __ATOMIC_ACQUIRE); to != NULL; to = to->next)
+	{
+		if(to->tracker == NULL)
+		{
+			if(to->host == NULL)
+				to->host = vrpn_host(to->fullname);
+			if(!vrpn_connect(to->host))
+				continue;
+			/* Create a vrpn_Tracker_Remote object, register the callback function. */
+			msg(MSG_INFO, "Connected to VRPN server to track '%s'\n", to->fullname);
+			to->tracker = new vrpn_Tracker_Remote(to->fullname, to->host->connection);
+			to->tracker->register_change_handler((void*) to, handle_tracker);
+			to->host->trackers++;
+		}
+		to->tracker->mainloop();
+	}
+}
+
+#ifndef _WIN32
+/** The tracker thread. Runs vrpn_poll() vrpn.pollrate times per second. */
+static void* vrpn_thread_main(void *arg)
+{
+	int rate = kuhl_config_int("vrpn.pollrate", 1000, 1000);
+	if(rate < 1)
+		rate = 1000;
+	long period = 1000000 / rate;
+	while(1)
+	{
+		long start = kuhl_microseconds();
+		vrpn_poll();
+		long elapsed = kuhl_microseconds() - start;
+		if(elapsed < period)
+			usleep(period - elapsed);
 	}
+	return NULL;
+}
+#endif
 
-	/* Create a vrpn_Tracker_Remove object, register the callback function. */
-	vrpn_Tracker_Remote *tkr = new vrpn_Tracker_Remote(fullname, connection);
-	tkr->register_change_handler((void*) strdup(fullname), handle_tracker);
+/** Finds the TrackedObject for an object\@tracker string. If there
+ * isn't one yet, it is created and the tracker thread will connect
+ * to it (the tracker thread is started the first time this is
+ * called).
+
+ @param fullname A string in the format object\@hostname.
+*/
+static TrackedObject* vrpn_lookup(const char *fullname)
+{
+	std::map<std::string, TrackedObject*>::iterator it = nameToTracker.find(fullname);
+	if(it != nameToTracker.end())
+		return it->second;
 
 	/* Store all of the information we will need later about this tracked object */
-	TrackedObject *to = (TrackedObject*) malloc(sizeof(TrackedObject));
-	to->tracker = tkr;
-	to->hasData = 0;
-	to->failCount = 0;
+	TrackedObject *to = (TrackedObject*) calloc(1, sizeof(TrackedObject));
+	to->fullname = strdup(fullname);
+	to->isVicon = vrpn_is_vicon(fullname);
 	kuhl_getfps_init(&(to->fps_state));
 
 	/* Initialize kalman filter */
-	for(int i=0; i<3; i++) /* position */
-		kalman_initialize(&(to->kalman[i]), 0.00004f, 0.01f);
-	for(int i=3; i<7; i++) /* orientation */
-		kalman_initialize(&(to->kalman[i]), 0.0001f, 0.01f);
-		
+	pose_predictor_init(&(to->predictor), 0.00004f, 0.01f, 0.0002f, 0.01f);
+
 	nameToTracker[std::string(fullname)] = to;
-	return 1;
+	vrpn_lock();
+	to->next = vrpn_objects;
+	__atomic_store_n(&vrpn_objects, to, __ATOMIC_RELEASE);
+	vrpn_unlock();
+
+#ifndef _WIN32
+	if(!vrpn_thread_started)
+	{
+		if(pthread_create(&vrpn_thread, NULL, vrpn_thread_main, NULL) != 0)
+		{
+			msg(MSG_FATAL, "Unable to create the VRPN tracker thread.");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(vrpn_thread);
+		vrpn_thread_started = 1;
+	}
+#endif
+	return to;
 }
 
-/** Retrieves the latest information from a VRPN connection and stores
-    it in an appropriate TrackerObject.
+/** Retrieves the latest sample of a tracked object.
 
- @param fullname A string in the format object\@hostname.
+ @param to The object.
+
+ @param usec If not 0, predict the pose of the object at this time
+ (kuhl_microseconds()).
 
  @param pos An array to store the resulting position data.
 
@@ -190,21 +454,17 @@ static int vrpn_connect(const char *fullname)
 
  @return Returns 1 on success; 0 on failure.
 */
-static int vrpn_update(const char *fullname, float pos[3], float orient[16])
+static int vrpn_update(TrackedObject *to, long usec, float pos[3], float orient[16])
 {
-	TrackedObject *to = nameToTracker[fullname];
-	if(to == NULL)
-	{
-		msg(MSG_FATAL, "vrpn_update() was called before vrpn_connect() was called for object '%s'", fullname);
-		return 0;
-	}
-		
-	/* If we already have a tracker object, ask it to run the main
-	 * loop (and therefore call our handle_tracker() function if
-	 * there is new data). */
-	to->tracker->mainloop();
+#ifdef _WIN32
+	/* Without a tracker thread, run the VRPN main loop ourselves
+	 * (which calls our handle_tracker() function if there is new
+	 * data). */
+	vrpn_poll();
+#endif
 
-	if(to->hasData == 0) /* If mainloop() called our callback, hasData should be 1 */
+	TrackedSample t;
+	if(vrpn_read(to, &t) == 0) /* If the tracker thread has received data, the sample is available */
 	{
 		const static int maxmessages = 4;  /** How many times should error messages be displayed */
 		const static int messagemod = 500; /** How many times does vrpn_get() get called before message is printed */
@@ -218,20 +478,30 @@ static int vrpn_update(const char *fullname, float pos[3], float orient[16])
 		to->failCount++;
 		if(to->failCount % messagemod == 0)
 		{
-			msg(MSG_WARNING, "VRPN has not received any data for %s", fullname);
+			msg(MSG_WARNING, "VRPN has not received any data for %s", to->fullname);
 			msg(MSG_WARNING, "As a result, you may see VRPN messages about receiving no response from server.");
 			if(to->failCount == messagemod*maxmessages)
-				msg(MSG_WARNING, "This is your last message about %s", fullname);
+				msg(MSG_WARNING, "This is your last message about %s", to->fullname);
 		}
 
 		return 0;
 	}
 
-	/* If we get to here, to->hasData indicates that the VRPN callback
-	 * has been called at least once and we have therefore received some data. */
+	/* If we get to here, the VRPN callback has been called at least
+	 * once and we have therefore received some data. */
 	to->failCount = 0;
-		
-	vrpn_TRACKERCB t = to->data;
+
+	/* Predict the pose at the requested time. The sample is already
+	 * (now - t.received) old. */
+	if(usec != 0)
+	{
+		float dt = (usec - t.received) / 1000000.0f;
+		if(dt > 0.1f) // don't extrapolate far if records stop arriving
+			dt = 0.1f;
+		if(dt > 0)
+			pose_extrapolate(t.pos, t.quat, t.vel, t.acc, t.angvel, dt);
+	}
+
 	float pos4[4];
 	for(int i=0; i<3; i++)
 		pos4[i] = t.pos[i];
@@ -239,7 +509,8 @@ static int vrpn_update(const char *fullname, float pos[3], float orient[16])
 
 	double orientd[16];
 	// Convert quaternion into orientation matrix.
-	q_to_ogl_matrix(orientd, t.quat);
+	q_type quat = { t.quat[0], t.quat[1], t.quat[2], t.quat[3] };
+	q_to_ogl_matrix(orientd, quat);
 	for(int i=0; i<16; i++)
 		orient[i] = (float) orientd[i];
 
@@ -264,7 +535,7 @@ static int vrpn_update(const char *fullname, float pos[3], float orient[16])
 	 * Below, we convert the position and orientation
 	 * information into the OpenGL convention.
 	 */
-	if(vrpn_is_vicon(fullname)) // MTU vicon tracker
+	if(to->isVicon) // MTU vicon tracker
 	{
 		float viconTransform[16] = { 1,0,0,0,  // column major order!
 		                             0,0,-1,0,
@@ -285,6 +556,55 @@ static int vrpn_update(const char *fullname, float pos[3], float orient[16])
 }
 
 
+/** Number of object/hostname pairs that vrpn_get() remembers. */
+#define VRPN_CACHE_SIZE 32
+
+/** An object and hostname that vrpn_get() or vrpn_get_predicted()
+ * has been called with. */
+typedef struct {
+	char *object;
+	char *hostname; /**< NULL if vrpn_get() was called with a NULL hostname */
+	TrackedObject *to;
+} vrpn_cache_entry;
+
+static vrpn_cache_entry vrpn_cache[VRPN_CACHE_SIZE];
+static int vrpn_cache_count = 0;
+
+/** Like vrpn_open(), but looks for the object and hostname in
+ * vrpn_cache first so that the object\@hostname string is only built
+ * and looked up the first time. */
+static TrackedObject* vrpn_cached_open(const char *object, const char *hostname)
+{
+	/* vrpn_open() complains about a NULL object. */
+	for(int i=0; object && i<vrpn_cache_count; i++)
+	{
+		vrpn_cache_entry *e = &vrpn_cache[i];
+		if(strcmp(e->object, object) == 0 &&
+		   (e->hostname == hostname ||
+		    (e->hostname && hostname && strcmp(e->hostname, hostname) == 0)))
+			return e->to;
+	}
+
+	TrackedObject *to = vrpn_open(object, hostname);
+	if(vrpn_cache_count < VRPN_CACHE_SIZE)
+	{
+		vrpn_cache_entry *e = &vrpn_cache[vrpn_cache_count++];
+		e->object = strdup(object);
+		e->hostname = hostname ? strdup(hostname) : NULL;
+		e->to = to;
+	}
+	return to;
+}
+
+/** Returns the number of microseconds to predict ahead in vrpn_get()
+ * (the vrpn.predict setting). */
+static long vrpn_predict_usec(void)
+{
+	static long predict = -1;
+	if(predict < 0)
+		predict = (long) (kuhl_config_float("vrpn.predict", 0, 0) * 1000);
+	return predict;
+}
 
 #endif // ifndef MISSING_VRPN
 
@@ -393,18 +713,124 @@ int vrpn_get(const char *object, const char *hostname, float pos[3], float orien
 	msg(MSG_ERROR, "You are missing VRPN support.\n");
 	return 0;
 #else
+	return vrpn_get_handle(vrpn_cached_open(object, hostname), pos, orient);
+#endif
+}
+
+/** Like vrpn_get(), but predicts the position and orientation of the
+ * tracked object at a specific time instead of returning the latest
+ * record. The prediction is limited to 100 milliseconds after the
+ * latest record arrived.
+ *
+ * @param object The name of the object being tracked.
+ *
+ * @param hostname The IP address or hostname of the VRPN server or
+ * tracking system computer. If hostname is set to NULL, the
+ * ~/.vrpn-server file is consulted.
+ *
+ * @param usec The time to predict the pose for (see
+ * kuhl_microseconds()). Typically, this is the time that the frame
+ * being rendered will appear on the screen (see
+ * bufferswap_display_time()).
+ *
+ * @param pos An array to be filled in with the position information.
+ *
+ * @param orient An array to be filled in with the orientation matrix.
+ *
+ * @return 1 if we returned data from the tracker. 0 if there was
+ * problems connecting to the tracker.
+ */
+int vrpn_get_predicted(const char *object, const char *hostname, long usec, float pos[3], float orient[16])
+{
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+	return 0;
+#else
+	return vrpn_get_handle_predicted(vrpn_cached_open(object, hostname), usec, pos, orient);
+#endif
+}
 
-	/* Combine object and hostname into 'object@hostname'. Also, find
-	 * default hostname if it is NULL. */
+/** Starts tracking an object and returns a handle that can be passed
+ * to vrpn_get_handle() and vrpn_get_handle_predicted(). Those
+ * functions are faster than vrpn_get() because they don't need to find
+ * the object. Calling vrpn_open() again with the same object and
+ * hostname returns the same handle. Handles are never freed.
+ *
+ * @param object The name of the object being tracked.
+ *
+ * @param hostname The IP address or hostname of the VRPN server. If
+ * NULL, the vrpn.server setting is used.
+ *
+ * @return A handle or NULL if VRPN support is missing.
+ */
+vrpn_handle vrpn_open(const char *object, const char *hostname)
+{
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+	return NULL;
+#else
 	char fullname[256];
 	vrpn_fullname(object, hostname, fullname);
+	return vrpn_lookup(fullname);
+#endif
+}
 
-	/* Check if we have a tracker object for that string in our map. */
-	if(nameToTracker.count(fullname))
-		return vrpn_update(fullname, pos, orient);
-	else
-		return vrpn_connect(fullname);
+/** Like vrpn_get(), but for an object returned by vrpn_open().
+ *
+ * @param handle The object.
+ *
+ * @param pos An array to be filled in with the position information.
+ *
+ * @param orient An array to be filled in with the orientation matrix.
+ *
+ * @return 1 if we returned data from the tracker. 0 if there was
+ * problems connecting to the tracker.
+ */
+int vrpn_get_handle(vrpn_handle handle, float pos[3], float orient[16])
+{
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+#ifdef MISSING_VRPN
+	return 0;
+#else
+	if(handle == NULL)
+		return 0;
 
+	/* Predict where the object will be vrpn.predict milliseconds from
+	 * now (if set). */
+	long predict = vrpn_predict_usec();
+	long usec = predict > 0 ? kuhl_microseconds() + predict : 0;
+	return vrpn_update(handle, usec, pos, orient);
+#endif
+}
+
+/** Like vrpn_get_predicted(), but for an object returned by
+ * vrpn_open().
+ *
+ * @param handle The object.
+ *
+ * @param usec The time to predict the pose for (see
+ * kuhl_microseconds()).
+ *
+ * @param pos An array to be filled in with the position information.
+ *
+ * @param orient An array to be filled in with the orientation matrix.
+ *
+ * @return 1 if we returned data from the tracker. 0 if there was
+ * problems connecting to the tracker.
+ */
+int vrpn_get_handle_predicted(vrpn_handle handle, long usec, float pos[3], float orient[16])
+{
+	vec3f_set(pos, 10000,10000,10000);
+	mat4f_identity(orient);
+#ifdef MISSING_VRPN
+	return 0;
+#else
+	if(handle == NULL)
+		return 0;
+	return vrpn_update(handle, usec, pos, orient);
 #endif
 }
 
@@ -431,38 +857,73 @@ float* vrpn_get_raw(const char *object, const char *hostname, int count)
 	return 0;
 #else
 
-	/* Make sure we are connected */
-	float pos[4], orient[16];
-	vrpn_get(object, hostname, pos, orient);
-
 	char fullname[256];
 	vrpn_fullname(object, hostname, fullname);
+	TrackedObject *to = vrpn_lookup(fullname);
 
-	TrackedObject *to = nameToTracker[std::string(fullname)];
-
-	/* Disable kalman filtering */
-	for(int i = 0; i<7; i++)
-		to->kalman[i].isEnabled = 0;
-	
+	/* The tracker thread copies each record (before it is smoothed)
+	 * into data until we have count records. */
 	float *data = (float*) malloc(sizeof(float)*7*count);
-
-	for(int i=0; i<count; i++)
-	{
-		while(to->hasData == 0)
-			to->tracker->mainloop();
-		to->hasData = 0;
-
-		data[i*7+0] = to->data.pos[0];
-		data[i*7+1] = to->data.pos[1];
-		data[i*7+2] = to->data.pos[2];
-		data[i*7+3] = to->data.quat[0];
-		data[i*7+4] = to->data.quat[1];
-		data[i*7+5] = to->data.quat[2];
-		data[i*7+6] = to->data.quat[3];
-	}
+	vrpn_lock();
+	to->raw = data;
+	to->rawCount = 0;
+	__atomic_store_n(&to->rawWanted, count, __ATOMIC_RELEASE);
+#ifdef _WIN32
+	while(to->rawCount < count)
+		vrpn_poll();
+#else
+	while(to->rawCount < count)
+		pthread_cond_wait(&vrpn_raw_cond, &vrpn_mutex);
+#endif
+	__atomic_store_n(&to->rawWanted, 0, __ATOMIC_RELEASE);
+	to->raw = NULL;
+	vrpn_unlock();
 	return data;
 #endif
 }
+
+/** Registers a function that is called with every record that VRPN
+    delivers for an object. Unlike vrpn_get(), no records are skipped
+    and the records are not smoothed, so this is useful for recording
+    or analyzing tracking data.
+
+    The callback is called by the tracker thread (on Windows, by
+    vrpn_get()), so it must return quickly and must not call other
+    vrpn-help functions. Each record is passed with the time that the
+    tracking system recorded it (VRPN message time in microseconds
+    since 1970), its position and its orientation quaternion
+    (x,y,z,w). The position and orientation are in the coordinate
+    system of the tracking system (the conversion that vrpn_get()
+    does for Vicon is not applied).
+
+    @param object The object to receive records for.
+
+    @param hostname The hostname of the VRPN server. If NULL, the
+    vrpn.server setting is used.
+
+    @param callback The function to call, or NULL to stop calling it.
+
+    @param data Passed to the callback.
+
+    @return 1 on success, 0 if VRPN support is missing.
+ */
+int vrpn_set_callback(const char *object, const char *hostname, vrpn_callback callback, void *data)
+{
+#ifdef MISSING_VRPN
+	msg(MSG_ERROR, "You are missing VRPN support.\n");
+	return 0;
+#else
+	char fullname[256];
+	vrpn_fullname(object, hostname, fullname);
+	TrackedObject *to = vrpn_lookup(fullname);
+
+	/* The tracker thread reads callback before callbackData. */
+	__atomic_store_n(&to->callback, (vrpn_callback) NULL, __ATOMIC_RELEASE);
+	to->callbackData = data;
+	__atomic_store_n(&to->callback, callback, __ATOMIC_RELEASE);
+	return 1;
+#endif
+}
 	
 
 
@@ -22,10 +22,22 @@
 extern "C" {
 #endif
 
+/** A tracked object (see vrpn_open()). */
+typedef struct TrackedObject* vrpn_handle;
+
+/** Called with every record that VRPN delivers for an object (see
+ * vrpn_set_callback()). */
+typedef void (*vrpn_callback)(void *data, long usec, const float pos[3], const float quat[4]);
+
 int vrpn_get(const char *object, const char *hostname, float pos[3], float orient[16]);
+int vrpn_get_predicted(const char *object, const char *hostname, long usec, float pos[3], float orient[16]);
+vrpn_handle vrpn_open(const char *object, const char *hostname);
+int vrpn_get_handle(vrpn_handle handle, float pos[3], float orient[16]);
+int vrpn_get_handle_predicted(vrpn_handle handle, long usec, float pos[3], float orient[16]);
 const char* vrpn_default_host(void);
 int vrpn_is_vicon(const char *hostname);
 float* vrpn_get_raw(const char *name, const char *host, int count);
+int vrpn_set_callback(const char *object, const char *hostname, vrpn_callback callback, void *data);
 	
 #ifdef __cplusplus
 } // end extern "C"
@@ -0,0 +1,72 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Sends a DGR recording (made by running a program with
+ * dgr.mode = record) to DGR slaves. This makes it possible to
+ * reproduce what a wall displayed or to load test slaves without
+ * running the real master program. The destination is read from the
+ * dgr.master.dest (or dgr.master.multicast) setting in the
+ * configuration file; dgr.mode must be master. With dgr.sync =
+ * barrier and "-s max", the number of frames per second that is
+ * printed is the number of frames per second the slaves can handle.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "libkuhl.h"
+
+int main(int argc, char *argv[])
+{
+	float speed = 1;
+	int i = 1;
+	for(; i<argc-1; i++)
+	{
+		if(strcmp(argv[i], "-c") == 0)
+			kuhl_config_filename(argv[++i]);
+		else if(strcmp(argv[i], "-s") == 0 && strcmp(argv[i+1], "max") == 0)
+		{
+			speed = 0;
+			i++;
+		}
+		else if(strcmp(argv[i], "-s") == 0 && sscanf(argv[i+1], "%f", &speed) == 1 && speed > 0)
+			i++;
+		else
+			break;
+	}
+	if(i != argc-1)
+	{
+		printf("Usage: %s [-c config.ini] [-s speed|max] recording.log\n", argv[0]);
+		printf("Speed is 1 for the original pace (default), 2 for twice as fast, etc.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	dgr_init();
+	if(!dgr_is_enabled() || !dgr_is_master())
+	{
+		msg(MSG_FATAL, "Set dgr.mode to master and set dgr.master.dest in the configuration file.");
+		exit(EXIT_FAILURE);
+	}
+
+	long start = kuhl_microseconds();
+	long frames = dgr_replay(argv[i], speed);
+	if(frames < 0)
+		exit(EXIT_FAILURE);
+	double seconds = (kuhl_microseconds() - start) / 1000000.0;
+
+	dgr_stats stats;
+	dgr_get_stats(&stats);
+	printf("Sent %ld frames (%ld keyframes) in %.2f seconds: %.1f frames/second, %.2f MB/second\n",
+	       frames, stats.keyframes, seconds, frames/seconds, stats.bytes/seconds/1024/1024);
+	if(stats.barrierTimeouts > 0)
+		printf("Slaves didn't reach the barrier in time %ld times.\n", stats.barrierTimeouts);
+	dgr_slave_stats slaves[64];
+	int numSlaves = dgr_get_slave_stats(slaves, 64);
+	for(int s=0; s<numSlaves; s++)
+		printf("Slave %s: latency %.2f ms, jitter %.2f ms, max %.2f ms\n", slaves[s].address,
+		       slaves[s].latency, slaves[s].jitter, slaves[s].maxLatency);
+	exit(EXIT_SUCCESS);
+}
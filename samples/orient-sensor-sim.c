@@ -0,0 +1,493 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Simulates a BNO055 orientation sensor on a pseudo-terminal
+ * so that serial.c and orient-sensor.c can be tested without the
+ * hardware. Each record is the same as the one the Arduino sends: the
+ * magic float 123.456, a quaternion and four calibration bytes.
+ * Records are sent at a fixed rate, and some can be corrupted (a byte
+ * flipped, a byte lost or junk bytes inserted) or held back and sent
+ * all at once (a burst, like a USB hiccup).
+ *
+ * Without -B, the program prints the name of the pseudo-terminal and
+ * sends records until Ctrl+C is pressed. Set orientsensor.tty to that
+ * name to use it in place of a real sensor. The records rotate around
+ * the vertical axis, or they come from a raw capture of a real sensor
+ * (-i, for example made with "cat /dev/ttyUSB0 > capture.bin").
+ *
+ * With -B, the program benchmarks reading the records in this process.
+ * It does this two ways. The first is polling serial_read() every
+ * frame, the way orient-sensor.c used to. The second is
+ * orient_sensor_get(), which reads from a reader thread. Each record
+ * carries its sequence number in the quaternion. This lets the
+ * benchmark report:
+ * - the latency from when a record was sent until a frame saw it;
+ * - how long each frame was stalled inside the call;
+ * - the resync time: how long after a corrupted record a frame saw
+ *   a newer record;
+ * - how many frames got a corrupted record that wasn't rejected.
+ *
+ * @author Scott Kuhl
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // posix_openpt(), ptsname()
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include "libkuhl.h"
+
+/* 1 sanity check float, 4 floats for quat, 4 more bytes for calibration data */
+#define RECORD_SIZE (4+4*4+4)
+#define RECORD_MAGIC 0x42f6e979
+
+/* Sequence numbers are stored in the x component of the quaternion
+ * as seq/2^21, which a float holds exactly. */
+#define SEQ_SCALE 2097152.0f
+#define SEQ_MAX   1048576
+
+typedef struct
+{
+	float rate;          /**< Records per second */
+	float corrupt;       /**< Probability that a record is corrupted */
+	int burstMs;         /**< Once a second, hold records for this long and then send them together */
+	float degPerSec;     /**< How fast the simulated sensor rotates */
+	int benchmark;       /**< Encode sequence numbers instead of rotating */
+	FILE *capture;       /**< Raw capture to replay (or NULL) */
+} sim_options;
+
+typedef struct
+{
+	int master;          /**< Our end of the pseudo-terminal */
+	int slave;           /**< Kept open so the terminal settings stay in place */
+	char name[64];
+
+	sim_options opt;
+	long start;
+	long *sendTime;      /**< Time each record was sent (benchmark only) */
+	long maxRecords;
+	int *corrupted;      /**< 1 if the record was corrupted (benchmark only) */
+
+	long records;
+	long corruptions;
+	long overflows;      /**< Bytes the pseudo-terminal had no room for */
+	int stop;
+	pthread_t thread;
+} sim;
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+/** Creates a pseudo-terminal that behaves like a raw serial port. */
+static void sim_open(sim *s)
+{
+	s->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(s->master < 0 || grantpt(s->master) != 0 || unlockpt(s->master) != 0)
+	{
+		msg(MSG_FATAL, "Failed to create pseudo-terminal: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	snprintf(s->name, sizeof(s->name), "%s", ptsname(s->master));
+
+	/* Put the terminal in raw mode before any bytes are written so
+	 * that the records aren't changed by line processing before
+	 * serial_open() applies its settings. */
+	s->slave = open(s->name, O_RDWR | O_NOCTTY);
+	struct termios t;
+	if(s->slave < 0 || tcgetattr(s->slave, &t) != 0)
+	{
+		msg(MSG_FATAL, "Failed to open '%s': %s", s->name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	cfmakeraw(&t);
+	tcsetattr(s->slave, TCSANOW, &t);
+
+	/* A real sensor keeps sending even if nobody is reading. */
+	fcntl(s->master, F_SETFL, fcntl(s->master, F_GETFL) | O_NONBLOCK);
+}
+
+static void sim_write(sim *s, const char *buf, int len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(s->master, buf, len);
+		if(n <= 0)
+		{
+			s->overflows += len;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/** Fills in one record. Returns the number of bytes to send (which
+ * can be more or less than RECORD_SIZE if the record is corrupted). */
+static int sim_record(sim *s, long seq, char *buf)
+{
+	if(s->opt.capture)
+	{
+		int n = (int) fread(buf, 1, RECORD_SIZE, s->opt.capture);
+		if(n < RECORD_SIZE)
+		{
+			rewind(s->opt.capture);
+			n += (int) fread(buf+n, 1, RECORD_SIZE-n, s->opt.capture);
+		}
+		return n;
+	}
+
+	float quat[4];
+	if(s->opt.benchmark)
+	{
+		float x = (seq % SEQ_MAX) / SEQ_SCALE;
+		vec4f_set(quat, x, 0, 0, sqrtf(1-x*x));
+	}
+	else
+		quatf_rotateAxis_new(quat, seq / s->opt.rate * s->opt.degPerSec, 0, 1, 0);
+
+	int32_t magic = RECORD_MAGIC;
+	memcpy(buf, &magic, 4);
+	memcpy(buf+4, quat, sizeof(float)*4);
+	memset(buf+4*5, 3, 4); // fully calibrated
+	if(drand48() >= s->opt.corrupt)
+		return RECORD_SIZE;
+
+	s->corruptions++;
+	if(s->opt.benchmark && seq < s->maxRecords)
+		s->corrupted[seq] = 1;
+	switch(lrand48() % 3)
+	{
+		case 0: // flip a bit in the magic bytes
+			buf[lrand48() % 4] ^= 0x10;
+			return RECORD_SIZE;
+		case 1: // lose a byte
+		{
+			int i = lrand48() % RECORD_SIZE;
+			memmove(buf+i, buf+i+1, RECORD_SIZE-i-1);
+			return RECORD_SIZE-1;
+		}
+		default: // junk bytes before the record
+		{
+			int junk = 1 + lrand48() % (RECORD_SIZE-1);
+			memmove(buf+junk, buf, RECORD_SIZE);
+			for(int i=0; i<junk; i++)
+				buf[i] = (char) lrand48();
+			return RECORD_SIZE+junk;
+		}
+	}
+}
+
+static void* sim_thread(void *arg)
+{
+	sim *s = (sim*) arg;
+	/* Room for one second of records in case of a burst. */
+	int bufSize = (int) (s->opt.rate+1) * RECORD_SIZE*2;
+	char *buf = malloc(bufSize);
+	int len = 0;
+
+	s->start = kuhl_microseconds();
+	for(long seq=0; !__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE) && !stop; seq++)
+	{
+		long due = s->start + (long) (seq * 1000000.0 / s->opt.rate);
+		long now = kuhl_microseconds();
+		if(due > now)
+			usleep(due - now);
+
+		len += sim_record(s, seq, buf+len);
+		s->records++;
+
+		/* During the first burstMs of each second, hold the records. */
+		long msIntoSecond = ((due - s->start) / 1000) % 1000;
+		if(msIntoSecond < s->opt.burstMs && len < bufSize - RECORD_SIZE*2)
+			continue;
+
+		now = kuhl_microseconds();
+		if(s->opt.benchmark)
+		{
+			/* Records that were held were all sent now. */
+			for(long i=seq; i >= 0 && i < s->maxRecords && s->sendTime[i] == 0; i--)
+				s->sendTime[i] = now;
+		}
+		sim_write(s, buf, len);
+		len = 0;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void sim_start(sim *s, const sim_options *opt, long maxRecords)
+{
+	memset(s, 0, sizeof(sim));
+	s->opt = *opt;
+	s->maxRecords = maxRecords;
+	if(maxRecords > 0)
+	{
+		s->sendTime = calloc(maxRecords, sizeof(long));
+		s->corrupted = calloc(maxRecords, sizeof(int));
+	}
+	sim_open(s);
+	if(pthread_create(&s->thread, NULL, sim_thread, s) != 0)
+	{
+		msg(MSG_FATAL, "Failed to start simulator thread.");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sim_stop(sim *s)
+{
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(s->thread, NULL);
+	close(s->master);
+	close(s->slave);
+	free(s->sendTime);
+	free(s->corrupted);
+}
+
+
+/** Reads a record the way orient_sensor_get_bno055() did before
+ * records were read by a thread: every frame, serial_read() consumes
+ * all but the latest record. If the latest record is corrupted,
+ * serial_find() blocks until the start of the next record arrives. */
+static void legacy_get(int fd, int *isWorking, float cached[4], float quaternion[4])
+{
+	int options = *isWorking ? SERIAL_CONSUME|SERIAL_NONBLOCK : SERIAL_CONSUME;
+	if(*isWorking == 0)
+		serial_discard(fd);
+
+	char temp[RECORD_SIZE];
+	temp[0] = '\0';
+	if(serial_read(fd, temp, RECORD_SIZE, options) == 0)
+	{
+		vec4f_copy(quaternion, cached);
+		return;
+	}
+
+	int32_t v = RECORD_MAGIC;
+	while(memcmp(temp, &v, 4) != 0)
+	{
+		*isWorking = 0;
+		serial_discard(fd);
+		if(serial_find(fd, (char*) &v, 4, 1000) != 1 ||
+		   serial_read(fd, temp+4, RECORD_SIZE-4, SERIAL_NONE) != RECORD_SIZE-4)
+		{
+			vec4f_copy(quaternion, cached);
+			return;
+		}
+		memcpy(temp, &v, 4);
+	}
+	*isWorking = 1;
+	memcpy(quaternion, temp+4, sizeof(float)*4);
+	vec4f_copy(cached, quaternion);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long la = *(const long*) a, lb = *(const long*) b;
+	return la < lb ? -1 : la > lb;
+}
+
+static void print_times(const char *label, long *values, long count)
+{
+	if(count == 0)
+	{
+		printf("  %-10s (none)\n", label);
+		return;
+	}
+	qsort(values, count, sizeof(long), compare_long);
+	double mean = 0;
+	for(long i=0; i<count; i++)
+		mean += values[i];
+	mean /= count;
+	printf("  %-10s mean %8.3f ms  median %8.3f ms  99%% %8.3f ms  max %8.3f ms  (%ld)\n", label,
+	       mean/1000, values[count/2]/1000.0, values[count*99/100]/1000.0, values[count-1]/1000.0, count);
+}
+
+/** Runs one benchmark.
+
+    @param threaded 0 to poll with serial_read(), 1 to use orient_sensor_get().
+*/
+static void benchmark(const sim_options *opt, int threaded, float seconds, float fps)
+{
+	long maxRecords = (long) (opt->rate * (seconds+2)) + 1;
+	sim s;
+	sim_start(&s, opt, maxRecords);
+
+	OrientSensorState state;
+	int fd = -1, isWorking = 0;
+	float cached[4] = { 0, 0, 0, 1 };
+	if(threaded)
+		state = orient_sensor_init(s.name, ORIENT_SENSOR_BNO055);
+	else
+		fd = serial_open(s.name, 115200, 0, 1, 5);
+
+	long frames = (long) (seconds * fps);
+	long *latency = malloc(sizeof(long)*maxRecords);
+	long *stall = malloc(sizeof(long)*frames);
+	long *resync = malloc(sizeof(long)*maxRecords);
+	long latencyCount = 0, resyncCount = 0, staleFrames = 0, garbageFrames = 0;
+	long lastSeq = 0; // record 0 is the same as the quaternion we get before any records arrive
+
+	long start = kuhl_microseconds();
+	for(long f=0; f<frames && !stop; f++)
+	{
+		long due = start + (long) (f * 1000000.0 / fps);
+		long now = kuhl_microseconds();
+		if(due > now)
+			usleep(due - now);
+
+		float quat[4];
+		long before = kuhl_microseconds();
+		if(threaded)
+			orient_sensor_get(&state, quat);
+		else
+			legacy_get(fd, &isWorking, cached, quat);
+		long after = kuhl_microseconds();
+		stall[f] = after - before;
+
+		/* A corrupted record that was accepted doesn't contain a
+		 * quaternion that we sent. */
+		if(quat[1] != 0 || quat[2] != 0 || fabsf(vec4f_norm(quat)-1) > 0.001f)
+		{
+			garbageFrames++;
+			continue;
+		}
+		long seq = lroundf(quat[0] * SEQ_SCALE);
+		if(seq <= lastSeq || seq >= maxRecords || s.sendTime[seq] == 0)
+		{
+			staleFrames++;
+			continue;
+		}
+		latency[latencyCount++] = after - s.sendTime[seq];
+
+		/* If records were corrupted since the last one we saw, this is
+		 * when we recovered. */
+		for(long i=lastSeq+1; i<seq; i++)
+			if(s.corrupted[i])
+			{
+				resync[resyncCount++] = after - s.sendTime[i];
+				break;
+			}
+		lastSeq = seq;
+	}
+
+	if(threaded)
+	{
+		OrientSensorReader *r = state.reader;
+		printf("orient_sensor_get() with a reader thread: %ld records sent, %ld corrupted, %ld received, %ld resyncs, %ld bytes skipped\n",
+		       s.records, s.corruptions, (long) r->head, r->resyncs, r->skipped);
+		orient_sensor_close(&state);
+	}
+	else
+	{
+		printf("serial_read() every frame: %ld records sent, %ld corrupted\n", s.records, s.corruptions);
+		serial_close(fd);
+	}
+	if(s.overflows)
+		printf("  %ld bytes did not fit in the pseudo-terminal\n", s.overflows);
+	printf("  %ld frames, %ld without a new record, %ld with a corrupted record\n", frames, staleFrames, garbageFrames);
+	print_times("latency", latency, latencyCount);
+	print_times("stall", stall, frames);
+	print_times("resync", resync, resyncCount);
+
+	sim_stop(&s);
+	free(latency);
+	free(stall);
+	free(resync);
+}
+
+int main(int argc, char *argv[])
+{
+	sim_options opt;
+	memset(&opt, 0, sizeof(opt));
+	opt.rate = 100;
+	opt.degPerSec = 45;
+	float seconds = 0, fps = 60;
+	const char *captureFile = NULL;
+
+	int i = 1;
+	for(; i<argc-1; i++)
+	{
+		if(strcmp(argv[i], "-r") == 0 && sscanf(argv[i+1], "%f", &opt.rate) == 1 && opt.rate > 0)
+			i++;
+		else if(strcmp(argv[i], "-c") == 0 && sscanf(argv[i+1], "%f", &opt.corrupt) == 1)
+			i++;
+		else if(strcmp(argv[i], "-b") == 0 && sscanf(argv[i+1], "%d", &opt.burstMs) == 1)
+			i++;
+		else if(strcmp(argv[i], "-w") == 0 && sscanf(argv[i+1], "%f", &opt.degPerSec) == 1)
+			i++;
+		else if(strcmp(argv[i], "-f") == 0 && sscanf(argv[i+1], "%f", &fps) == 1 && fps > 0)
+			i++;
+		else if(strcmp(argv[i], "-B") == 0 && sscanf(argv[i+1], "%f", &seconds) == 1 && seconds > 0)
+			i++;
+		else if(strcmp(argv[i], "-i") == 0)
+			captureFile = argv[++i];
+		else
+			break;
+	}
+	if(i != argc || opt.burstMs >= 1000 || (captureFile && seconds > 0))
+	{
+		printf("Usage: %s [-r rate] [-c probability] [-b burstMs] [-w degPerSec] [-i capture.bin] [-B seconds [-f fps]]\n", argv[0]);
+		printf("Simulates a BNO055 orientation sensor on a pseudo-terminal.\n");
+		printf("  -r  Records per second (default 100).\n");
+		printf("  -c  Probability that a record is corrupted (default 0).\n");
+		printf("  -b  Once a second, hold records for this many milliseconds and then send them together.\n");
+		printf("  -w  Degrees per second the sensor rotates (default 45).\n");
+		printf("  -i  Replay a raw capture of a sensor's output instead.\n");
+		printf("  -B  Benchmark reading records in this process for this many seconds.\n");
+		printf("  -f  Frames per second to read records at while benchmarking (default 60).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, handle_signal);
+	srand48(kuhl_microseconds());
+
+	if(seconds > 0)
+	{
+		opt.benchmark = 1;
+		printf("Sending %.0f records/second (%.1f%% corrupted, %d ms bursts), reading at %.0f frames/second for %.0f seconds.\n",
+		       opt.rate, opt.corrupt*100, opt.burstMs, fps, seconds);
+		benchmark(&opt, 0, seconds, fps);
+		benchmark(&opt, 1, seconds, fps);
+		exit(EXIT_SUCCESS);
+	}
+
+	if(captureFile)
+	{
+		opt.capture = fopen(captureFile, "rb");
+		if(opt.capture == NULL)
+		{
+			printf("Failed to open %s\n", captureFile);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sim s;
+	sim_start(&s, &opt, 0);
+	printf("Simulated sensor is at %s (set orientsensor.tty to it). Press Ctrl+C to stop.\n", s.name);
+	long lastRecords = 0;
+	while(!stop)
+	{
+		sleep(1);
+		printf("%ld records/second, %ld records, %ld corrupted, %ld bytes did not fit\n",
+		       s.records - lastRecords, s.records, s.corruptions, s.overflows);
+		lastRecords = s.records;
+	}
+	sim_stop(&s);
+	if(opt.capture)
+		fclose(opt.capture);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Converts an image into a tiled pyramid (.ktp) file which
+ * can be displayed with the panorama program even if the image is
+ * too large to fit into a texture. See tiledtex.h for more
+ * information.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libkuhl.h"
+
+int main(int argc, char** argv)
+{
+	if(argc < 3 || argc > 5)
+	{
+		printf("Usage: %s input.jpg output.ktp [cylinder|sphere|plane] [tileSize]\n", argv[0]);
+		printf("  cylinder - Cylindrical panorama (default)\n");
+		printf("  sphere   - Equirectangular panorama\n");
+		printf("  plane    - Flat image (for example, one face of a cubemap)\n");
+		printf("  tileSize - Width and height of each tile (default 256)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tiledtex_shape shape = TILEDTEX_CYLINDER;
+	if(argc > 3)
+	{
+		if(strcmp(argv[3], "sphere") == 0)
+			shape = TILEDTEX_SPHERE;
+		else if(strcmp(argv[3], "plane") == 0)
+			shape = TILEDTEX_PLANE;
+		else if(strcmp(argv[3], "cylinder") != 0)
+		{
+			msg(MSG_FATAL, "Unknown shape: %s", argv[3]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	int tileSize = 256;
+	if(argc > 4)
+		tileSize = atoi(argv[4]);
+
+	/* Read the image with the first pixel at the bottom left corner. */
+	int width = 0, height = 0;
+	unsigned char *image = NULL;
+#ifdef KUHL_UTIL_USE_IMAGEMAGICK
+	imageio_info iioinfo;
+	iioinfo.filename   = argv[1];
+	iioinfo.type       = CharPixel;
+	iioinfo.map        = (char*) "RGB";
+	iioinfo.colorspace = sRGBColorspace;
+	image = (unsigned char*) imagein(&iioinfo);
+	width  = (int) iioinfo.width;
+	height = (int) iioinfo.height;
+#else
+	int comp = 0;
+	stbi_set_flip_vertically_on_load(1);
+	image = stbi_load(argv[1], &width, &height, &comp, STBI_rgb);
+#endif
+	if(image == NULL)
+	{
+		msg(MSG_FATAL, "Unable to read '%s'.", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	msg(MSG_INFO, "Read %s (%dx%d)\n", argv[1], width, height);
+
+	int ret = tiledtex_build(argv[2], image, width, height, 3, tileSize, shape);
+	free(image);
+	if(ret < 0)
+		exit(EXIT_FAILURE);
+
+	msg(MSG_INFO, "Wrote %s\n", argv[2]);
+	exit(EXIT_SUCCESS);
+}
@@ -6,6 +6,11 @@
 /** @file This program demonstrates how to load cylindrical and
  * cubemap panorama photos (either in mono or stereo modes).
  *
+ * Images that are too large to fit into a texture can be converted
+ * into a tiled pyramid (.ktp) file with panorama-tiler. Tiled files
+ * can be used anywhere an image file is accepted and are streamed
+ * from disk as they are needed.
+ *
  * @author Scott Kuhl
  */
 
@@ -29,6 +34,12 @@ static GLuint texIdRight = 0;
 static GLuint cubemapLeftTex[6];
 static GLuint cubemapRightTex[6];
 
+/* tiled textures (used instead of the textures above for .ktp files) */
+static tiledtex *tiledLeft  = NULL;
+static tiledtex *tiledRight = NULL;
+static tiledtex *cubemapLeftTiled[6];
+static tiledtex *cubemapRightTiled[6];
+
 
 
 /* Called by GLFW whenever a key is pressed. */
@@ -49,48 +60,52 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 			tmp = texIdLeft;
 			texIdLeft = texIdRight;
 			texIdRight = tmp;
+			tiledtex *tmpTiled = tiledLeft;
+			tiledLeft = tiledRight;
+			tiledRight = tmpTiled;
 			break;
 		}
 	}
 }
 
-void setupCubemap(GLuint texId[6], kuhl_geometry q, const float origModelView[16])
+/* Draws one face of a cubemap with either a texture or a tiled texture. */
+void drawCubemapFace(GLuint texId, tiledtex *tiled, kuhl_geometry *q, const float modelview[16], const float perspective[16], const int viewport[4])
+{
+	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
+	if(tiled != NULL)
+		tiledtex_draw(tiled, modelview, perspective, viewport);
+	else
+	{
+		kuhl_geometry_texture(q, texId, "tex", KG_WARN);
+		kuhl_geometry_draw(q);
+	}
+}
+
+void setupCubemap(GLuint texId[6], tiledtex *tiled[6], kuhl_geometry q, const float origModelView[16], const float perspective[16], const int viewport[4])
 {
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,origModelView);
-	kuhl_geometry_texture(&q, texId[0], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative Z (front)
+	drawCubemapFace(texId[0], tiled[0], &q, origModelView, perspective, viewport); // negative Z (front)
 	
 	float rotation[16];
 	float modelview[16];
 	mat4f_rotateEuler_new(rotation, 0,180,0, "XYZ");
 	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[1], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive Z (back)
+	drawCubemapFace(texId[1], tiled[1], &q, modelview, perspective, viewport); // positive Z (back)
 
 	mat4f_rotateEuler_new(rotation, 0,90,0, "XYZ");
 	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[2], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative X (left)
+	drawCubemapFace(texId[2], tiled[2], &q, modelview, perspective, viewport); // negative X (left)
 
 	mat4f_rotateEuler_new(rotation, 0,-90,0, "XYZ");
 	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[3], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive X (right)
+	drawCubemapFace(texId[3], tiled[3], &q, modelview, perspective, viewport); // positive X (right)
 
 	mat4f_rotateEuler_new(rotation, -90,0,0, "XYZ");
 	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[4], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // negative Y (down)
+	drawCubemapFace(texId[4], tiled[4], &q, modelview, perspective, viewport); // negative Y (down)
 	
 	mat4f_rotateEuler_new(rotation, 90,0,0, "XYZ");
 	mat4f_mult_mat4f_new(modelview, origModelView, rotation);
-	glUniformMatrix4fv(kuhl_get_uniform("ModelView"),1,0,modelview);
-	kuhl_geometry_texture(&q, texId[5], "tex", KG_WARN);
-	kuhl_geometry_draw(&q); // positive Y (up)
+	drawCubemapFace(texId[5], tiled[5], &q, modelview, perspective, viewport); // positive Y (up)
 }
 
 
@@ -168,21 +183,30 @@ void display()
 		                   modelview); // value
 		kuhl_errorcheck();
 
-		if(texIdLeft != 0 && texIdRight != 0) // cylinder
+		/* Each eye of a stereo cylinder may be either a tiled
+		 * pyramid or a regular image. */
+		GLuint texId = texIdLeft;
+		tiledtex *tiled = tiledLeft;
+		if(eye == VIEWMAT_EYE_RIGHT)
+		{
+			texId = texIdRight;
+			tiled = tiledRight;
+		}
+
+		if(tiled != NULL) // tiled cylinder or sphere
+			tiledtex_draw(tiled, modelview, perspective, viewport);
+		else if(texId != 0) // cylinder
 		{
 			/* Draw the cylinder with the appropriate texture */
-			if(eye == VIEWMAT_EYE_RIGHT)
-				kuhl_geometry_texture(&cylinder, texIdRight, "tex", KG_WARN);
-			else
-				kuhl_geometry_texture(&cylinder, texIdLeft, "tex", KG_WARN);
+			kuhl_geometry_texture(&cylinder, texId, "tex", KG_WARN);
 			kuhl_geometry_draw(&cylinder);
 		}
 		else // cubemap
 		{
 			if(eye == VIEWMAT_EYE_RIGHT)
-				setupCubemap(cubemapRightTex, quad, modelview);
+				setupCubemap(cubemapRightTex, cubemapRightTiled, quad, modelview, perspective, viewport);
 			else
-				setupCubemap(cubemapLeftTex, quad, modelview);
+				setupCubemap(cubemapLeftTex, cubemapLeftTiled, quad, modelview, perspective, viewport);
 		}
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
@@ -397,6 +421,26 @@ void init_geometryCylinder(kuhl_geometry *cyl, GLuint prog)
 }
 
 
+/* Loads an image file into a texture or opens a tiled pyramid
+ * file. Exits on failure. */
+void loadImage(const char *filename, GLuint *texId, tiledtex **tiled)
+{
+	*texId = 0;
+	*tiled = NULL;
+	char *path = kuhl_find_file(filename);
+	int isTiled = tiledtex_is_file(path);
+	free(path);
+	if(isTiled)
+	{
+		*tiled = tiledtex_open(filename);
+		if(*tiled == NULL)
+			exit(EXIT_FAILURE);
+	}
+	else if(kuhl_read_texture_file(filename, texId) < 0)
+		exit(EXIT_FAILURE);
+}
+
+
 int main(int argc, char** argv)
 {
 	/* Initialize GLFW and GLEW */
@@ -414,6 +458,7 @@ int main(int argc, char** argv)
 		printf("   %s Lfront.jpg Lback.jpg Lleft.jpg Lright.jpg Ldown.jpg Lup.jpg Rfront.jpg Rback.jpg Rleft.jpg Rright.jpg Rdown.jpg Rup.jpg\n", argv[0]);
 		printf("\n");
 		printf("Tip: Works best if horizon is at center of the panorama.\n");
+		printf("Tip: Use panorama-tiler to convert very large images into .ktp files.\n");
 		exit(EXIT_FAILURE);
 	}
 	/* Specify function to call when keys are pressed. */
@@ -432,18 +477,16 @@ int main(int argc, char** argv)
 	if(argc == 2)
 	{
 		msg(MSG_INFO, "Cylinder mono image: %s\n", argv[1]);
-		if(kuhl_read_texture_file(argv[1], &texIdLeft) < 0)
-			exit(EXIT_FAILURE);
+		loadImage(argv[1], &texIdLeft, &tiledLeft);
 		texIdRight = texIdLeft;
+		tiledRight = tiledLeft;
 	}
 	if(argc == 3)
 	{
 		msg(MSG_INFO, "Cylinder left  image: %s\n", argv[1]);
-		if(kuhl_read_texture_file(argv[1], &texIdLeft) < 0)
-			exit(EXIT_FAILURE);
+		loadImage(argv[1], &texIdLeft, &tiledLeft);
 		msg(MSG_INFO, "Cylinder right image: %s\n", argv[2]);
-		if(kuhl_read_texture_file(argv[2], &texIdRight) < 0)
-			exit(EXIT_FAILURE);
+		loadImage(argv[2], &texIdRight, &tiledRight);
 	}
 
 	char *cubemapNames[] = { "front", "back", "left", "right", "down", "up" };	
@@ -452,9 +495,9 @@ int main(int argc, char** argv)
 		for(int i=0; i<6; i++)
 		{
 			msg(MSG_INFO, "Cubemap image (%-5s): %s\n", cubemapNames[i], argv[i+1]);
-			if(kuhl_read_texture_file(argv[i+1], &(cubemapLeftTex[i])) < 0)
-				exit(EXIT_FAILURE);
+			loadImage(argv[i+1], &(cubemapLeftTex[i]), &(cubemapLeftTiled[i]));
 			cubemapRightTex[i]= cubemapLeftTex[i];
+			cubemapRightTiled[i] = cubemapLeftTiled[i];
 			texIdLeft =0;
 			texIdRight=0;
 		}
@@ -464,11 +507,9 @@ int main(int argc, char** argv)
 		for(int i=0; i<6; i++)
 		{
 			msg(MSG_INFO, "Cubemap image (left,  %-5s): %s\n", cubemapNames[i], argv[i+6+1]);
-			if(kuhl_read_texture_file(argv[i+1], &(cubemapLeftTex[i])) < 0)
-				exit(EXIT_FAILURE);
+			loadImage(argv[i+1], &(cubemapLeftTex[i]), &(cubemapLeftTiled[i]));
 			msg(MSG_INFO, "Cubemap image (right, %-5s)\n", cubemapNames[i], argv[i+6+1]);
-			if(kuhl_read_texture_file(argv[i+6+1], &(cubemapRightTex[i])) < 0)
-				exit(EXIT_FAILURE);
+			loadImage(argv[i+6+1], &(cubemapRightTex[i]), &(cubemapRightTiled[i]));
 			texIdLeft =0;
 			texIdRight=0;
 		}
@@ -342,5 +342,6 @@ int main(int argc, char** argv)
 		/* process events (keyboard, mouse, etc) */
 		glfwPollEvents();
 	}
+	screencap_flush(); // finish writing any frames from kuhl_video_record()
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,140 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Converts version 1 .tdl files (one object, no timestamps)
+ * into a version 2 .tdl file and prints information about version 2
+ * files. See tdl-util.c for a description of the formats.
+ *
+ * Version 1 records don't have timestamps, so they are given evenly
+ * spaced times starting at 0 (100 records per second by default, the
+ * rate that the recorder used). When several version 1 files are
+ * converted, each becomes one object in the version 2 file and
+ * records with the same index get the same time.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "libkuhl.h"
+
+static void usage(const char *program)
+{
+	printf("Usage: %s [-r recordsPerSecond] [-c] output.tdl input.tdl [input.tdl ...]\n", program);
+	printf("       %s -i file.tdl\n", program);
+	printf("The first form converts version 1 .tdl files into one version 2 file.\n");
+	printf("  -r  The rate the version 1 files were recorded at (default 100).\n");
+	printf("  -c  Compress the output (0.01 mm position resolution).\n");
+	printf("The second form prints information about a version 2 .tdl file.\n");
+	exit(EXIT_FAILURE);
+}
+
+static int info(const char *path)
+{
+	tdl2_reader *r = tdl2_open(path);
+	if(r == NULL)
+		return EXIT_FAILURE;
+	tdl2_header *h = &(r->header);
+	double seconds = (h->last - h->first) / 1000000.0;
+	printf("%s: version %d, %s, %llu records in %llu blocks, %.3f seconds, %.1f bytes/record\n",
+	       path, h->version, (h->flags & TDL2_COMPRESS) ? "compressed" : "uncompressed",
+	       (unsigned long long) h->records, (unsigned long long) h->blocks, seconds,
+	       h->records ? r->size / (double) h->records : 0.0);
+
+	/* Count the records of each object. */
+	long *counts = calloc(h->objects, sizeof(long));
+	tdl2_record rec;
+	int ret;
+	long start = kuhl_microseconds();
+	while((ret = tdl2_next(r, &rec)) != 0)
+		if(ret == 1)
+			counts[rec.object]++;
+	long elapsed = kuhl_microseconds() - start;
+	for(int i=0; i<h->objects; i++)
+		printf("  %3d %-32s %8ld records %8.1f records/second\n", i, r->names[i], counts[i],
+		       seconds > 0 ? counts[i] / seconds : 0.0);
+	if(elapsed > 0)
+		printf("Read %.0f records/second\n", h->records * 1000000.0 / elapsed);
+	free(counts);
+	tdl2_close(r);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	float rate = 100;
+	int flags = 0;
+	int i = 1;
+	for(; i<argc; i++)
+	{
+		if(strcmp(argv[i], "-i") == 0 && i == argc-2)
+			exit(info(argv[i+1]));
+		else if(strcmp(argv[i], "-r") == 0 && i+1 < argc && sscanf(argv[i+1], "%f", &rate) == 1 && rate > 0)
+			i++;
+		else if(strcmp(argv[i], "-c") == 0)
+			flags |= TDL2_COMPRESS;
+		else
+			break;
+	}
+	if(argc - i < 2)
+		usage(argv[0]);
+
+	const char *output = argv[i];
+	int inputs = argc - i - 1;
+	FILE **in = malloc(sizeof(FILE*)*inputs);
+	char **names = malloc(sizeof(char*)*inputs);
+	for(int k=0; k<inputs; k++)
+	{
+		const char *path = argv[i+1+k];
+		in[k] = fopen(path, "rb");
+		if(in[k] == NULL || tdl_prepare(in[k], &names[k]) != 1)
+		{
+			msg(MSG_FATAL, "%s is not a version 1 .tdl file.", path);
+			exit(EXIT_FAILURE);
+		}
+		printf("Object %d: '%s' from %s\n", k, names[k], path);
+	}
+
+	tdl2_writer *w = tdl2_create(output, (const char**) names, inputs, flags);
+	if(w == NULL)
+		exit(EXIT_FAILURE);
+
+	/* Interleave the records so that they are in time order. */
+	long records = 0;
+	int remaining = inputs;
+	for(long index=0; remaining > 0; index++)
+	{
+		for(int k=0; k<inputs; k++)
+		{
+			if(in[k] == NULL)
+				continue;
+			float pos[3], orient[9];
+			if(tdl_read(in[k], pos, orient) != 0)
+			{
+				fclose(in[k]);
+				in[k] = NULL;
+				remaining--;
+				continue;
+			}
+			tdl2_record rec;
+			rec.time = (int64_t) (index * 1000000.0 / rate);
+			rec.object = k;
+			vec3f_copy(rec.pos, pos);
+			quatf_from_mat3f(rec.quat, orient);
+			if(tdl2_write(w, &rec) != 0)
+				exit(EXIT_FAILURE);
+			records++;
+		}
+	}
+	if(tdl2_finish(w) != 0)
+		exit(EXIT_FAILURE);
+	printf("Wrote %ld records to %s\n", records, output);
+
+	for(int k=0; k<inputs; k++)
+		free(names[k]);
+	free(names);
+	free(in);
+	exit(EXIT_SUCCESS);
+}
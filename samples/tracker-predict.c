@@ -0,0 +1,228 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures how well pose-predict.c predicts the motion in a
+ * recorded tracker log (.tdl file, see vrpn/recorder.c). Each record
+ * is added to a pose_predictor in order. After each record, the pose
+ * is predicted several milliseconds ahead and compared with the
+ * recorded pose at that time (interpolated between records). The
+ * error is compared with the error of using the latest (filtered)
+ * pose without any prediction---which is what a program sees if it
+ * renders with the latest record.
+ *
+ * Version 2 .tdl files contain timestamps. Records in version 1 files
+ * are assumed to be evenly spaced (100 records per second by default,
+ * the rate that the recorder used).
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "libkuhl.h"
+
+/* Milliseconds to predict ahead */
+static const int horizons[] = { 10, 20, 30, 50, 80 };
+#define NUM_HORIZONS (int)(sizeof(horizons)/sizeof(horizons[0]))
+
+/* Angle between two orientations in degrees */
+static float angle_between(const float a[4], const float b[4])
+{
+	float d = fabsf(vec4f_dot(a, b));
+	if(d > 1)
+		d = 1;
+	return 2*acosf(d) * 180 / M_PI;
+}
+
+int main(int argc, char *argv[])
+{
+	float rate = 100;
+	/* Same as vrpn-help.cpp */
+	float sigma = 0.00004f, qScale = 0.01f;
+	float orientSigma = 0.0002f, orientQScale = 0.01f;
+	const char *object = NULL;
+	int i = 1;
+	for(; i<argc-1; i++)
+	{
+		if(strcmp(argv[i], "-r") == 0 && sscanf(argv[i+1], "%f", &rate) == 1 && rate > 0)
+			i++;
+		else if(strcmp(argv[i], "-s") == 0 && sscanf(argv[i+1], "%f", &sigma) == 1)
+			i++;
+		else if(strcmp(argv[i], "-q") == 0 && sscanf(argv[i+1], "%f", &qScale) == 1)
+			i++;
+		else if(strcmp(argv[i], "-S") == 0 && sscanf(argv[i+1], "%f", &orientSigma) == 1)
+			i++;
+		else if(strcmp(argv[i], "-Q") == 0 && sscanf(argv[i+1], "%f", &orientQScale) == 1)
+			i++;
+		else if(strcmp(argv[i], "-o") == 0)
+			object = argv[++i];
+		else
+			break;
+	}
+	if(i != argc-1)
+	{
+		printf("Usage: %s [-r recordsPerSecond] [-o object] [-s sigma] [-q qScale] [-S sigma] [-Q qScale] recording.tdl\n", argv[0]);
+		printf("-r is the record rate of a version 1 file; -o is the object to use from a version 2 file.\n");
+		printf("-s and -q are the position Kalman filter settings (see kalman_initialize()).\n");
+		printf("-S and -Q are the orientation Kalman filter settings (sigma is in radians).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Read all of the records. */
+	int count = 0, alloc = 1024;
+	float *pos = malloc(sizeof(float)*3*alloc);
+	float *quat = malloc(sizeof(float)*4*alloc);
+	long *times = malloc(sizeof(long)*alloc);
+	char *name = NULL;
+	FILE *f = fopen(argv[i], "rb");
+	tdl2_reader *reader = NULL;
+	int objectIndex = 0;
+	if(f != NULL && tdl_prepare(f, &name) == 1)
+	{
+		/* Version 1 */
+		float p[3], orient[9];
+		while(tdl_read(f, p, orient) == 0)
+		{
+			if(count == alloc)
+			{
+				alloc *= 2;
+				pos = realloc(pos, sizeof(float)*3*alloc);
+				quat = realloc(quat, sizeof(float)*4*alloc);
+				times = realloc(times, sizeof(long)*alloc);
+			}
+			vec3f_copy(pos+count*3, p);
+			quatf_from_mat3f(quat+count*4, orient);
+			times[count] = (long) (count * 1000000.0 / rate);
+			count++;
+		}
+	}
+	else if((reader = tdl2_open(argv[i])) != NULL)
+	{
+		if(object && (objectIndex = tdl2_object(reader, object)) < 0)
+		{
+			msg(MSG_FATAL, "%s has no object named '%s'", argv[i], object);
+			exit(EXIT_FAILURE);
+		}
+		name = strdup(reader->names[objectIndex]);
+		tdl2_record rec;
+		int ret;
+		while((ret = tdl2_next(reader, &rec)) != 0)
+		{
+			if(ret != 1 || rec.object != objectIndex)
+				continue;
+			if(count == alloc)
+			{
+				alloc *= 2;
+				pos = realloc(pos, sizeof(float)*3*alloc);
+				quat = realloc(quat, sizeof(float)*4*alloc);
+				times = realloc(times, sizeof(long)*alloc);
+			}
+			vec3f_copy(pos+count*3, rec.pos);
+			vec4f_copy(quat+count*4, rec.quat);
+			times[count] = (long) (rec.time - reader->header.first);
+			count++;
+		}
+		tdl2_close(reader);
+	}
+	else
+	{
+		msg(MSG_FATAL, "Unable to read %s", argv[i]);
+		exit(EXIT_FAILURE);
+	}
+	if(f)
+		fclose(f);
+
+	/* Keep neighboring quaternions in the same hemisphere so that
+	 * interpolating between them takes the short way. */
+	for(int r=1; r<count; r++)
+		if(vec4f_dot(quat+r*4, quat+(r-1)*4) < 0)
+			vec4f_scalarMult(quat+r*4, -1);
+
+	double seconds = count > 0 ? times[count-1] / 1000000.0 : 0;
+	printf("%s: %d records of '%s' (%.1f seconds, %.1f records/second)\n",
+	       argv[i], count, name ? name : "", seconds, seconds > 0 ? (count-1) / seconds : 0.0);
+	if(count < 2)
+		exit(EXIT_FAILURE);
+
+	double posErr[NUM_HORIZONS][2], posMax[NUM_HORIZONS][2];
+	double angErr[NUM_HORIZONS][2], angMax[NUM_HORIZONS][2];
+	long samples[NUM_HORIZONS];
+	memset(posErr, 0, sizeof(posErr));
+	memset(posMax, 0, sizeof(posMax));
+	memset(angErr, 0, sizeof(angErr));
+	memset(angMax, 0, sizeof(angMax));
+	memset(samples, 0, sizeof(samples));
+
+	pose_predictor predictor;
+	pose_predictor_init(&predictor, sigma, qScale, orientSigma, orientQScale);
+	int next[NUM_HORIZONS]; // record at or before the time we predict for
+	memset(next, 0, sizeof(next));
+	long start = kuhl_microseconds();
+	for(int r=0; r<count; r++)
+	{
+		long usec = times[r];
+		pose_predictor_add(&predictor, pos+r*3, quat+r*4, usec);
+		if(r < 10) // let the filter settle
+			continue;
+
+		for(int h=0; h<NUM_HORIZONS; h++)
+		{
+			/* The recorded pose at the time we predict for. */
+			long target = usec + horizons[h]*1000L;
+			if(next[h] < r)
+				next[h] = r;
+			while(next[h]+1 < count && times[next[h]+1] <= target)
+				next[h]++;
+			int i0 = next[h];
+			if(i0+1 >= count)
+				continue;
+			long span = times[i0+1] - times[i0];
+			float t = span > 0 ? (target - times[i0]) / (float) span : 0;
+			float truePos[3], trueQuat[4];
+			for(int k=0; k<3; k++)
+				truePos[k] = pos[i0*3+k]*(1-t) + pos[(i0+1)*3+k]*t;
+			quatf_slerp_new(trueQuat, quat+i0*4, quat+(i0+1)*4, t);
+
+			/* 0: latest filtered pose, 1: predicted pose */
+			for(int mode=0; mode<2; mode++)
+			{
+				float predPos[3], predQuat[4];
+				pose_predictor_get(&predictor, mode ? usec + horizons[h]*1000L : usec, predPos, predQuat);
+				float diff[3];
+				vec3f_sub_new(diff, predPos, truePos);
+				float e = vec3f_norm(diff);
+				float a = angle_between(predQuat, trueQuat);
+				posErr[h][mode] += e*e;
+				angErr[h][mode] += a*a;
+				if(e > posMax[h][mode])
+					posMax[h][mode] = e;
+				if(a > angMax[h][mode])
+					angMax[h][mode] = a;
+			}
+			samples[h]++;
+		}
+	}
+	long elapsed = kuhl_microseconds() - start;
+
+	printf("Predicting %.2f us/record\n", elapsed / (double) count);
+	printf("          position RMS (max) error, mm          orientation RMS (max) error, degrees\n");
+	printf("ahead     latest            predicted           latest            predicted\n");
+	for(int h=0; h<NUM_HORIZONS; h++)
+	{
+		if(samples[h] == 0)
+			continue;
+		printf("%3d ms    %6.2f (%7.2f)  %6.2f (%7.2f)    %6.3f (%7.3f)  %6.3f (%7.3f)\n", horizons[h],
+		       sqrt(posErr[h][0]/samples[h])*1000, posMax[h][0]*1000,
+		       sqrt(posErr[h][1]/samples[h])*1000, posMax[h][1]*1000,
+		       sqrt(angErr[h][0]/samples[h]), angMax[h][0],
+		       sqrt(angErr[h][1]/samples[h]), angMax[h][1]);
+	}
+	free(pos);
+	free(quat);
+	free(times);
+	free(name);
+	exit(EXIT_SUCCESS);
+}
@@ -1,122 +1,152 @@
+/* Copyright (c) 2016 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Prints statistics about tracking data (see track-stats.c):
+ * the noise of the position and orientation, the time between
+ * records, jitter, drop-outs, latency and the Allan deviation. The
+ * records can come from a VRPN server (every record is used, as it
+ * arrives) or from a .tdl file. Records are not stored, so the
+ * program can run for as long as needed.
+ *
+ * @author Scott Kuhl
+ */
+
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "libkuhl.h"
 
-#define VRPN_OBJECT "DK2"
-#define COUNT 1000
+/* Protects stats, which the VRPN tracker thread adds records to. */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static track_stats stats;
+static volatile sig_atomic_t stop = 0;
 
-void filter(float *all_data, int count, int component, float filtered_data[])
+static void handle_signal(int sig)
 {
-	for(int i=0; i<count; i++)
-		filtered_data[i] = all_data[i*7+component];
+	stop = 1;
 }
 
-float sum(float *data, int count)
+static void record_callback(void *data, long usec, const float pos[3], const float quat[4])
 {
-	float sum=0;
-	for(int i=0; i<count; i++)
-		sum += data[i];
-	return sum;
+	long received = kuhl_microseconds();
+	pthread_mutex_lock(&mutex);
+	track_stats_add(&stats, usec, received, pos, quat);
+	pthread_mutex_unlock(&mutex);
 }
 
-float mean(float *data, int count)
+static int live(const char *object, long numRecords)
 {
-	return sum(data, count)/count;
-}
+	if(!vrpn_set_callback(object, NULL, record_callback, NULL))
+	{
+		printf("This program requires VRPN to collect records from a tracker.\n");
+		return EXIT_FAILURE;
+	}
+	signal(SIGINT, handle_signal);
+	if(numRecords > 0)
+		msg(MSG_BLUE, "Collecting %ld records from tracker...please wait...\n", numRecords);
+	else
+		msg(MSG_BLUE, "Collecting records from tracker. Press Ctrl+C to stop.\n");
 
-float variance(float *data, int count)
-{
-	float avg = mean(data, count);
-	
-	float squared = 0;
-	for(int i=0; i<count; i++)
-		squared += (data[i]-avg)*(data[i]-avg);
+	while(!stop)
+	{
+		sleep(1);
+		pthread_mutex_lock(&mutex);
+		double jitter = stats.intervals > 1 ? sqrt(stats.intervalM2 / (stats.intervals-1)) / 1000 : 0.0;
+		printf("%ld records, interval %.3f ms, jitter %.3f ms, %ld drop-outs, latency %.3f ms\n",
+		       stats.count, stats.intervalMean / 1000, jitter, stats.dropouts, stats.latencyMean / 1000);
+		int done = numRecords > 0 && stats.count >= numRecords;
+		pthread_mutex_unlock(&mutex);
+		if(done)
+			break;
+	}
 
-	return squared/count;
+	vrpn_set_callback(object, NULL, NULL, NULL);
+	pthread_mutex_lock(&mutex);
+	track_stats_print(&stats, object);
+	pthread_mutex_unlock(&mutex);
+	return EXIT_SUCCESS;
 }
 
-int main(int argc, char *argv[])
+static int offline(const char *filename, float rate, long binUsec, float dropoutFactor)
 {
-#ifdef MISSING_VRPN
-	printf("This program requires VRPN.");
-	exit(EXIT_FAILURE);
-#else
-
-	if(argc != 3)
+	FILE *f = fopen(filename, "rb");
+	char *name = NULL;
+	if(f != NULL && tdl_prepare(f, &name) == 1)
 	{
-		printf("Usage: %s vrpnObjectName numRecords\n", argv[0]);
-		exit(EXIT_FAILURE);
+		/* Version 1 files have no timestamps. */
+		float pos[3], orient[9], quat[4];
+		for(long i=0; tdl_read(f, pos, orient) == 0; i++)
+		{
+			quatf_from_mat3f(quat, orient);
+			track_stats_add(&stats, (long) (i * 1000000.0 / rate), 0, pos, quat);
+		}
+		fclose(f);
+		track_stats_print(&stats, name);
+		free(name);
+		return EXIT_SUCCESS;
 	}
+	if(f)
+		fclose(f);
+
+	tdl2_reader *r = tdl2_open(filename);
+	if(r == NULL)
+		return EXIT_FAILURE;
+	int objects = r->header.objects;
+	track_stats *s = malloc(sizeof(track_stats)*objects);
+	for(int i=0; i<objects; i++)
+		track_stats_init(&s[i], binUsec, dropoutFactor);
+	tdl2_record rec;
+	int ret;
+	while((ret = tdl2_next(r, &rec)) != 0)
+		if(ret == 1)
+			track_stats_add(&s[rec.object], (long) rec.time, 0, rec.pos, rec.quat);
+	for(int i=0; i<objects; i++)
+		track_stats_print(&s[i], r->names[i]);
+	free(s);
+	tdl2_close(r);
+	return EXIT_SUCCESS;
+}
 
-	int numRecords = 0;
-	if(sscanf(argv[2], "%d", &numRecords) != 1)
+int main(int argc, char *argv[])
+{
+	long binUsec = 250;
+	float dropoutFactor = 3;
+	float rate = 100;
+	const char *filename = NULL;
+	int i = 1;
+	for(; i<argc-1; i++)
 	{
-		msg(MSG_FATAL, "Error parsing numRecords parameter.\n");
-		exit(EXIT_FAILURE);
+		if(strcmp(argv[i], "-b") == 0 && sscanf(argv[i+1], "%ld", &binUsec) == 1 && binUsec > 0)
+			i++;
+		else if(strcmp(argv[i], "-d") == 0 && sscanf(argv[i+1], "%f", &dropoutFactor) == 1 && dropoutFactor > 1)
+			i++;
+		else if(strcmp(argv[i], "-r") == 0 && sscanf(argv[i+1], "%f", &rate) == 1 && rate > 0)
+			i++;
+		else if(strcmp(argv[i], "-f") == 0)
+			filename = argv[++i];
+		else
+			break;
 	}
 
-	const char *vrpnObject = argv[1];
-
-	
-	msg(MSG_BLUE, "Collecting %d samples from tracker...please wait...\n", numRecords);
-	float *data = vrpn_get_raw(vrpnObject, NULL, numRecords);
-	if(data == NULL)
+	long numRecords = 0;
+	if((filename && i != argc) ||
+	   (!filename && (i >= argc || argc-i > 2 || (argc-i == 2 && sscanf(argv[i+1], "%ld", &numRecords) != 1))))
 	{
-		msg(MSG_FATAL, "Failed to collect data.");
+		printf("Usage: %s [-b binUsec] [-d dropoutFactor] vrpnObjectName [numRecords]\n", argv[0]);
+		printf("       %s [-b binUsec] [-d dropoutFactor] [-r recordsPerSecond] -f recording.tdl\n", argv[0]);
+		printf("The first form collects records from VRPN until numRecords have arrived or Ctrl+C is pressed.\n");
+		printf("The second form reads a .tdl file (-r is the record rate of a version 1 file).\n");
+		printf("  -b  Width of the histogram bins in microseconds (default 250).\n");
+		printf("  -d  Intervals longer than this times the mean interval are drop-outs (default 3).\n");
 		exit(EXIT_FAILURE);
 	}
 
-	printf("First record (x,y,z, quat): \n");
-	for(int i=0; i<7; i++)
-		printf("%f\n", data[i]);
-
-	float x[numRecords], y[numRecords], z[numRecords];
-
-	filter(data, numRecords, 0, x);
-	filter(data, numRecords, 1, y);
-	filter(data, numRecords, 2, z);
-	msg(MSG_BLUE, "--- XYZ ---\n");
-	
-	msg(MSG_INFO, "Means: %f %f %f\n",
-	    mean(x, numRecords),
-	    mean(y, numRecords),
-	    mean(z, numRecords));
-	msg(MSG_INFO, "Variance: %20.20f %20.20f %20.20f\n",
-	    variance(x, numRecords),
-	    variance(y, numRecords),
-	    variance(z, numRecords));
-
-	msg(MSG_INFO, "  Stddev: %20.20f %20.20f %20.20f\n",
-	    sqrt(variance(x, numRecords)),
-	    sqrt(variance(y, numRecords)),
-	    sqrt(variance(z, numRecords)));
-
-	float q1[numRecords], q2[numRecords], q3[numRecords], q4[numRecords];
-	filter(data, numRecords, 3, q1);
-	filter(data, numRecords, 4, q2);
-	filter(data, numRecords, 5, q3);
-	filter(data, numRecords, 6, q4);
-
-	msg(MSG_BLUE, "--- Quat ---\n");
-	
-	msg(MSG_INFO, "Means: %f %f %f %f\n",
-	    mean(q1, numRecords),
-	    mean(q2, numRecords),
-	    mean(q3, numRecords),
-	    mean(q4, numRecords));
-	
-	msg(MSG_INFO, "Variance: %20.20f %20.20f %20.20f %20.20f\n",
-	    variance(q1, numRecords),
-	    variance(q2, numRecords),
-	    variance(q3, numRecords),
-	    variance(q4, numRecords));
-	msg(MSG_INFO, "   Stddev: %20.20f %20.20f %20.20f %20.20f\n",
-	    sqrt(variance(q1, numRecords)),
-	    sqrt(variance(q2, numRecords)),
-	    sqrt(variance(q3, numRecords)),
-	    sqrt(variance(q4, numRecords)));
-
-	free(data);
-	
-	return 0;
-#endif
+	track_stats_init(&stats, binUsec, dropoutFactor);
+	if(filename)
+		exit(offline(filename, rate, binUsec, dropoutFactor));
+	exit(live(argv[i], numRecords));
 }
@@ -3,7 +3,15 @@
  * the file named "LICENSE" for a full copy of the license.
  */
 
-/** @file Demonstrates using a video file as a texture.
+/** @file Demonstrates using video files as textures.
+ *
+ * Usage: videoplay video1.mp4 [video2.mp4 ...]
+ *
+ * The videos are placed side by side. If the frustum.master
+ * configuration setting is set (for example, on a multiscreen wall
+ * running DGR), the videos fill the master frustum instead and each
+ * process only converts and uploads the part of each video that is
+ * visible on its screen.
  *
  * @author Scott Kuhl
  */
@@ -17,60 +25,87 @@
 #include "libkuhl.h"
 static GLuint program = 0; /**< id value for the GLSL program */
 
-static kuhl_geometry quad;
-static video_state* video = NULL;
-static char *videofilename = NULL;
+#define MAX_VIDEOS 16
+static int numVideos = 0;
+static video_player* videos[MAX_VIDEOS]; /**< NULL if video isn't visible on this screen */
+static kuhl_geometry quads[MAX_VIDEOS];
+static int wallMode = 0; /**< Fill the master frustum with the videos? */
+static long videoStart[MAX_VIDEOS]; /**< kuhl_microseconds() when a video that isn't on this screen was at time 0 */
 
 
-/* Call to update the video_state struct with the latest information */
+/* Copies the frame that should be displayed now (if any) into the
+ * textures. The videos are decoded on separate threads, so this never
+ * waits for the decoder. */
 static void update_video()
 {
-	static GLuint texId = 0;
-	static long startTime = 0;
-
-	if(video == NULL) // if it is our first time
+	int playing = 0, numOpen = 0;
+	long now = kuhl_microseconds();
+	for(int i=0; i<numVideos; i++)
 	{
-		/* Get the next frame */
-		video = video_get_next_frame(video, videofilename);
-		if(video == NULL)
+		/* Keep the slaves in sync with the master. The master shares
+		 * the time of the frame it is displaying; a slave jumps to
+		 * that time if it is too far off (but gives the decoder a
+		 * couple of seconds to catch up after each jump). Every
+		 * process shares every video, even the ones that aren't
+		 * visible on its screen, so that the master still provides
+		 * a time for videos that it doesn't decode. */
+		static long lastSeek[MAX_VIDEOS];
+		char name[32];
+		snprintf(name, 32, "video%d", i);
+		int64_t masterTime = now - videoStart[i];
+		if(videos[i] != NULL)
+			masterTime = video_player_time(videos[i]);
+		dgr_setget(name, &masterTime, sizeof(int64_t));
+		if(videos[i] == NULL)
+			continue;
+		numOpen++;
+
+		int64_t duration = video_player_duration(videos[i]);
+		if(!dgr_is_master() && duration > 0 &&
+		   now - lastSeek[i] > 2000000)
 		{
-			msg(MSG_FATAL, "Failed to load video file %s\n", videofilename);
-			exit(EXIT_FAILURE);
+			/* Times increase each time the video loops, so compare
+			 * positions within the video. */
+			int64_t drift = llabs(masterTime % duration - video_player_time(videos[i]) % duration);
+			if(drift > duration/2)
+				drift = duration - drift;
+			if(drift > 500000)
+			{
+				video_player_seek(videos[i], masterTime % duration);
+				lastSeek[i] = now;
+			}
 		}
-		
-		/* Send the new frame to OpenGL */
-		texId = kuhl_read_texture_array(video->data, 1920, 1080, 3, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
 
-		startTime = kuhl_microseconds();
-		
-		/* Tell this piece of geometry to use the texture we just loaded. */
-		kuhl_geometry_texture(&quad, texId, "tex", KG_WARN);
-
-		/* Get the frame that should be displayed next */
-		video = video_get_next_frame(video, videofilename);
+		if(video_player_update(videos[i]) >= 0)
+			playing = 1;
 	}
-	else
+	if(numOpen > 0 && !playing)
 	{
-		/* If previously loaded frame is to be displayed in the future, do nothing. */
-		if(video->usec > kuhl_microseconds()-startTime)
-			return;
-
-		/* Display the frame we previously loaded */
-		glDeleteTextures(1, &texId);
-		texId = kuhl_read_texture_array(video->data, 1920, 1080, 3, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE);
-
-		/* Tell this piece of geometry to use the texture we just
-		 * loaded. Frequently, texId won't change because we just
-		 * deleted the texture and then reloaded a texture (causing
-		 * the same id to be used again). */
-		kuhl_geometry_texture(&quad, texId, "tex", KG_WARN);
-
-		/* Get the next frame that should be displayed next */
-		video = video_get_next_frame(video, videofilename);
+		msg(MSG_INFO, "Reached end of video.");
+		glfwSetWindowShouldClose(kuhl_get_window(), GL_TRUE);
 	}
-
 }
 
+/* Jumps forward or backward in the videos by some number of microseconds. */
+static void seek_relative(int64_t usec)
+{
+	for(int i=0; i<numVideos; i++)
+	{
+		if(videos[i] == NULL)
+		{
+			/* Move the clock of a video that we aren't decoding. */
+			videoStart[i] -= (long) usec;
+			if(videoStart[i] > kuhl_microseconds())
+				videoStart[i] = kuhl_microseconds();
+			continue;
+		}
+		/* The time keeps increasing when the video loops. */
+		int64_t now = video_player_time(videos[i]);
+		if(video_player_duration(videos[i]) > 0)
+			now = now % video_player_duration(videos[i]);
+		video_player_seek(videos[i], now + usec);
+	}
+}
 
 /* Called by GLFW whenever a key is pressed. */
 void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -84,6 +119,20 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 		case GLFW_KEY_ESCAPE:
 			glfwSetWindowShouldClose(window, GL_TRUE);
 			break;
+		case GLFW_KEY_HOME: // restart the videos
+			for(int i=0; i<numVideos; i++)
+			{
+				if(videos[i] != NULL)
+					video_player_seek(videos[i], 0);
+				videoStart[i] = kuhl_microseconds();
+			}
+			break;
+		case GLFW_KEY_LEFT: // jump back 5 seconds
+			seek_relative(-5000000);
+			break;
+		case GLFW_KEY_RIGHT: // jump forward 5 seconds
+			seek_relative(5000000);
+			break;
 	}
 }
 
@@ -135,19 +184,6 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		/* Create a scale matrix.  Flip the video vertically since
-		   ffmpeg reads in the textures are "upside down" according to
-		   OpenGL. */
-		float scaleMatrix[16];
-		if(video != NULL)
-			mat4f_scale_new(scaleMatrix, 3*video->aspectRatio, -3, 3);
-		else
-			mat4f_scale_new(scaleMatrix, 3, -3, 3);
-		
-		// Modelview = (viewMatrix * scaleMatrix) * rotationMatrix
-		float modelview[16];
-		mat4f_mult_mat4f_new(modelview, viewMat, scaleMatrix);
-
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
@@ -159,15 +195,74 @@ void display()
 		                   1, // number of 4x4 float matrices
 		                   0, // transpose
 		                   perspective); // value
-		/* Send the modelview matrix to the vertex program. */
-		glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-		                   1, // number of 4x4 float matrices
-		                   0, // transpose
-		                   modelview); // value
-		kuhl_errorcheck();
-		/* Draw the geometry using the matrices that we sent to the
-		 * vertex programs immediately above */
-		kuhl_geometry_draw(&quad);
+
+		/* Total width of all of the videos placed side by side
+		 * (ignored in wall mode). */
+		float totalWidth = 0;
+		for(int i=0; i<numVideos; i++)
+			if(videos[i] != NULL)
+				totalWidth += 3*video_player_aspect_ratio(videos[i]);
+		float left = -totalWidth/2;
+
+		for(int i=0; i<numVideos; i++)
+		{
+			if(videos[i] == NULL)
+				continue;
+
+			/* The area that the entire video covers. */
+			float area[4]; // left, bottom, right, top
+			float modelview[16];
+			if(wallMode)
+			{
+				/* Each video fills a vertical slice of the master
+				 * frustum. Draw it in eye coordinates halfway between
+				 * the near and far planes. */
+				float master[6];
+				viewmat_get_master_frustum(master);
+				float depth = (master[4]+master[5])/2;
+				float s = depth / master[4];
+				float sliceWidth = (master[1]-master[0]) / numVideos;
+				area[0] = (master[0] + i*sliceWidth) * s;
+				area[2] = (master[0] + (i+1)*sliceWidth) * s;
+				area[1] = master[2] * s;
+				area[3] = master[3] * s;
+				mat4f_translate_new(modelview, 0, 0, -depth);
+			}
+			else
+			{
+				float width = 3*video_player_aspect_ratio(videos[i]);
+				area[0] = left;
+				area[2] = left + width;
+				area[1] = -1.5;
+				area[3] = 1.5;
+				left += width;
+				mat4f_copy(modelview, viewMat);
+			}
+
+			/* Our textures might only contain a region of the video;
+			 * scale the quad to the part that we have. */
+			float crop[4];
+			video_player_get_crop(videos[i], crop);
+			float x0 = area[0] + crop[0]*(area[2]-area[0]);
+			float x1 = area[0] + crop[2]*(area[2]-area[0]);
+			float y0 = area[1] + crop[1]*(area[3]-area[1]);
+			float y1 = area[1] + crop[3]*(area[3]-area[1]);
+			float transMat[16], scaleMat[16];
+			mat4f_translate_new(transMat, x0, y0, 0);
+			mat4f_scale_new(scaleMat, x1-x0, y1-y0, 1);
+			float quadMat[16];
+			mat4f_mult_mat4f_many(quadMat, modelview, transMat, scaleMat, NULL);
+
+			/* Send the modelview matrix to the vertex program. */
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
+			                   1, // number of 4x4 float matrices
+			                   0, // transpose
+			                   quadMat); // value
+			kuhl_errorcheck();
+			/* Draw the geometry using the matrices that we sent to the
+			 * vertex programs immediately above */
+			kuhl_geometry_draw(&quads[i]);
+		}
 
 		glUseProgram(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
@@ -223,14 +318,12 @@ int main(int argc, char** argv)
 	/* Initialize GLFW and GLEW */
 	kuhl_ogl_init(&argc, argv, 512, 512, 32, 4);
 
-	if(argc != 2)
+	if(argc < 2 || argc-1 > MAX_VIDEOS)
 	{
-		msg(MSG_FATAL, "Usage: %s videofile.mp4", argv[0]);
+		msg(MSG_FATAL, "Usage: %s video1.mp4 [video2.mp4 ...]", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	videofilename = argv[1];
-
 	
 	/* Specify function to call when keys are pressed. */
 	glfwSetKeyCallback(kuhl_get_window(), keyboard);
@@ -238,12 +331,10 @@ int main(int argc, char** argv)
 
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
-	program = kuhl_create_program("texture.vert", "texture.frag");
+	program = kuhl_create_program("texture.vert", "videoplay.frag");
 	glUseProgram(program);
 	kuhl_errorcheck();
 
-	init_geometryQuad(&quad, program);
-	
 	/* Good practice: Unbind objects until we really need them. */
 	glUseProgram(0);
 
@@ -253,6 +344,49 @@ int main(int argc, char** argv)
 	float initCamLook[3] = {0,0,0}; // a point the camera is facing at
 	float initCamUp[3]   = {0,1,0}; // a vector indicating which direction is up
 	viewmat_init(initCamPos, initCamLook, initCamUp);
+
+	/* Start decoding the videos (looping forever) and connect the
+	 * three textures (Y, U and V) of each video to a quad.
+	 * videoplay.frag converts the colors into RGB. */
+	wallMode = (kuhl_config_get("frustum.master") != NULL);
+	numVideos = argc-1;
+	for(int i=0; i<numVideos; i++)
+	{
+		if(wallMode)
+		{
+			/* Only decode the part of the video that is visible
+			 * on this screen. */
+			float frustum[6], master[6], crop[4];
+			viewmat_get_frustum(frustum, 0);
+			viewmat_get_master_frustum(master);
+			float sliceWidth = (master[1]-master[0]) / numVideos;
+			master[0] += i*sliceWidth;
+			master[1] = master[0] + sliceWidth;
+			if(video_player_crop_from_frustum(crop, frustum, master))
+				videos[i] = video_player_open_crop(argv[i+1], 1, crop);
+			else
+			{
+				msg(MSG_INFO, "%s is not visible on this screen.", argv[i+1]);
+				videos[i] = NULL;
+				videoStart[i] = kuhl_microseconds();
+				continue;
+			}
+		}
+		else
+			videos[i] = video_player_open(argv[i+1], 1);
+
+		if(videos[i] == NULL)
+		{
+			msg(MSG_FATAL, "Failed to load video file %s\n", argv[i+1]);
+			exit(EXIT_FAILURE);
+		}
+		init_geometryQuad(&quads[i], program);
+		GLuint tex[3];
+		video_player_textures(videos[i], tex);
+		kuhl_geometry_texture(&quads[i], tex[0], "texY", KG_WARN);
+		kuhl_geometry_texture(&quads[i], tex[1], "texU", KG_WARN);
+		kuhl_geometry_texture(&quads[i], tex[2], "texV", KG_WARN);
+	}
 	
 	while(!glfwWindowShouldClose(kuhl_get_window()))
 	{
@@ -0,0 +1,27 @@
+#version 150 // GLSL 150 = OpenGL 3.2
+
+out vec4 fragColor;
+in vec2 out_TexCoord;
+
+/* Y, U and V planes provided by video_player_textures(). Each
+ * texture has a single channel. */
+uniform sampler2D texY;
+uniform sampler2D texU;
+uniform sampler2D texV;
+
+void main()
+{
+	/* Video frames are stored with the top row first. */
+	vec2 tc = vec2(out_TexCoord.x, 1.0 - out_TexCoord.y);
+
+	/* Limited range ("TV" range) values: Y is 16-235, U and V are 16-240. */
+	float y = 1.164 * (texture(texY, tc).r - 16.0/255.0);
+	float u = texture(texU, tc).r - 128.0/255.0;
+	float v = texture(texV, tc).r - 128.0/255.0;
+
+	/* ITU-R BT.601 YUV to RGB */
+	fragColor = vec4(y + 1.596*v,
+	                 y - 0.392*u - 0.813*v,
+	                 y + 2.017*u,
+	                 1.0);
+}
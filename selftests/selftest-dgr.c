@@ -0,0 +1,623 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "vecmat.h"
+#include "kuhl-nodep.h"
+#include "kuhl-config.h"
+#include "dgr.h"
+
+/* Sends records similar to what viewer.c and multiscreen-slideshow.c
+ * send through DGR from a master process to a slave process over the
+ * loopback interface. Prints the number of bytes per frame that the
+ * old DGR format would have needed (every record, with names, in
+ * every packet) and the number of bytes per frame that DGR actually
+ * sent. The particles and mesh tests send records that are larger
+ * than a single packet, and the mesh compresses well (the compression
+ * ratio and time are printed). The particles test is repeated with
+ * several slaves receiving the packets through multicast and through
+ * one slave which shares frames with the others in shared memory.
+ * Finally, it
+ * compares slaves which use the newest frame that has arrived with
+ * slaves that are frame-locked to the master with a barrier. The
+ * slaves check that the values they receive are consistent with each
+ * other and report how long dgr_update(0,1) takes (packets are read
+ * by a separate thread, so it shouldn't wait unless a barrier is
+ * used). */
+
+#define FRAMES 600
+#define MAX_SLAVES 4
+
+/* Number of bytes that a record would use in the old DGR format. */
+static long oldSize(const char *name, int size)
+{
+	return strlen(name)+1+sizeof(int)+size;
+}
+
+/* Records that viewer.c (and viewmat.c) set every frame. The style
+ * rarely changes, the time always changes and the view matrix changes
+ * every other frame. */
+static long viewer(int frame)
+{
+	int style = 1;
+	double time = frame/60.0;
+	float pos[3] = { 0, 1.5, 0 };
+	float viewmat[16];
+	mat4f_identity(viewmat);
+	viewmat[12] = floor(frame/2);
+
+	dgr_setget("style", &style, sizeof(int));
+	dgr_setget("time", &time, sizeof(double));
+	dgr_setget("!!viewMatPos", pos, sizeof(float)*3);
+	dgr_setget("!!viewmat0", viewmat, sizeof(float)*16);
+
+	if(!dgr_is_master() && (style != 1 || viewmat[12] != floor(round(time*60)/2)))
+		return -1;
+	return oldSize("style", sizeof(int)) + oldSize("time", sizeof(double)) +
+		oldSize("!!viewMatPos", sizeof(float)*3) + oldSize("!!viewmat0", sizeof(float)*16);
+}
+
+/* Records that multiscreen-slideshow.c sets every frame. */
+static long slideshow(int frame)
+{
+	int started = 1;
+	double frameTime = frame/60.0;
+	dgr_setget("started", &started, sizeof(int));
+	dgr_setget("frameTime", &frameTime, sizeof(double));
+
+	if(!dgr_is_master() && started != 1)
+		return -1;
+	return oldSize("started", sizeof(int)) + oldSize("frameTime", sizeof(double));
+}
+
+/* Large records (such as a particle system and the bones of an
+ * animated model) which must be split across several packets. */
+#define PARTICLES 8000
+#define BONES 64
+static long particles(int frame)
+{
+	static float pos[PARTICLES];
+	static float bones[BONES*16];
+	for(int i=0; i<PARTICLES; i++)
+		pos[i] = frame+i;
+	for(int i=0; i<BONES*16; i++)
+		bones[i] = frame;
+	/* Use handles instead of names for these records. */
+	static int particlesHandle = -1, bonesHandle = -1;
+	if(particlesHandle < 0)
+	{
+		particlesHandle = dgr_register("particles", sizeof(pos));
+		bonesHandle = dgr_register("bones", sizeof(bones));
+	}
+	dgr_setget_handle(particlesHandle, pos);
+	dgr_setget_handle(bonesHandle, bones);
+
+	if(!dgr_is_master())
+	{
+		for(int i=0; i<PARTICLES; i++)
+			if(pos[i] != pos[0]+i)
+				return -1;
+		for(int i=0; i<BONES*16; i++)
+			if(bones[i] != pos[0])
+				return -1;
+	}
+	return oldSize("particles", sizeof(pos)) + oldSize("bones", sizeof(bones));
+}
+
+/* A mesh that is animated on the master: A flat grid of vertices
+ * (with normals and colors) which is raised one row at a time. Unlike
+ * the particles, it compresses well. */
+#define MESH_VERTICES 2048
+static long mesh(int frame)
+{
+	static float vertices[MESH_VERTICES*10]; // position, normal, color
+	for(int i=0; i<MESH_VERTICES; i++)
+	{
+		float *v = vertices + i*10;
+		v[0] = i % 64;
+		v[1] = i/64 <= frame % 32 ? 1 : 0;
+		v[2] = i / 64;
+		v[3] = 0; v[4] = 1; v[5] = 0;
+		v[6] = 0.5; v[7] = 0.5; v[8] = 0.5; v[9] = 1;
+	}
+	int f = frame;
+	dgr_setget("frame", &f, sizeof(int));
+	dgr_setget("mesh", vertices, sizeof(vertices));
+
+	if(!dgr_is_master())
+	{
+		for(int i=0; i<MESH_VERTICES; i++)
+			if(vertices[i*10+1] != (i/64 <= f % 32 ? 1 : 0) || vertices[i*10+4] != 1)
+				return -1;
+	}
+	return oldSize("frame", sizeof(int)) + oldSize("mesh", sizeof(vertices));
+}
+
+static int slaveFailed = 0;
+static long receiveUsec = 0, receiveCalls = 0;
+/* The slave exits inside of dgr_update() when the master exits. */
+static void slaveExit(void)
+{
+	dgr_stats stats;
+	dgr_get_stats(&stats);
+	printf("  slave:  %ld frames, %ld keyframes, %ld lost, %.1f us/frame in dgr_update(0,1)\n",
+	       stats.frames, stats.keyframes, stats.lost, receiveCalls ? receiveUsec/(double)receiveCalls : 0);
+	if(stats.compressedFrames > 0)
+		printf("  slave:  %.1f us/frame decompressing\n", stats.compressUsec/(double)stats.compressedFrames);
+	fflush(stdout);
+	if(slaveFailed || stats.frames == 0)
+	{
+		printf("  ERROR: slave received inconsistent data\n");
+		fflush(stdout);
+		_exit(EXIT_FAILURE);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+/* Master: Checks that the latency the master measured for each slave
+ * grows with the slave's delay. Slave i listens on a port that is
+ * i*100 above the first one and is slower than slave i-1. */
+static int checkLatencies(const dgr_slave_stats *slaves, int numSlaves)
+{
+	float latency[MAX_SLAVES];
+	int firstPort = -1;
+	for(int i=0; i<numSlaves; i++)
+	{
+		int port;
+		if(sscanf(slaves[i].address, "%*s %d", &port) == 1 && (firstPort < 0 || port < firstPort))
+			firstPort = port;
+	}
+	for(int i=0; i<numSlaves; i++)
+	{
+		int port = 0;
+		sscanf(slaves[i].address, "%*s %d", &port);
+		int index = (port - firstPort) / 100;
+		if(index < 0 || index >= numSlaves)
+			return 0;
+		latency[index] = slaves[i].latency;
+	}
+	for(int i=1; i<numSlaves; i++)
+		if(latency[i] <= latency[i-1])
+			return 0;
+	return latency[numSlaves-1] > 2*latency[0];
+}
+
+/* The master and slaves call dgr_update() in the same order that
+ * bufferswap() does. If slaveDelay is set, the slaves take longer to
+ * render each frame than the master. With dgr.sync = barrier, the
+ * slaves must use every frame (and the master slows down to wait for
+ * them). If delayStep is set, each slave is delayStep slower than
+ * the one before it, and the master checks that the latencies it
+ * measured show that. */
+static void run(const char *config, int isMaster, long (*func)(int), int slaveDelay, int delayStep, int barrier)
+{
+	kuhl_config_filename(config);
+	dgr_init();
+	if(isMaster)
+	{
+		usleep(200000); // let the slave start
+		long oldBytes = 0;
+		long start = kuhl_microseconds();
+		for(int i=0; i<FRAMES; i++)
+		{
+			oldBytes += func(i);
+			usleep(1000);
+			dgr_update(1,0);
+		}
+		long elapsed = kuhl_microseconds() - start;
+		dgr_stats stats;
+		dgr_get_stats(&stats);
+		printf("  master: %ld frames, %ld keyframes, %.2f ms/frame\n", stats.frames, stats.keyframes, elapsed/1000.0/FRAMES);
+		printf("  old format: %6.1f bytes/frame\n", oldBytes/(double)FRAMES);
+		printf("  new format: %6.1f bytes/frame\n", stats.bytes/(double)stats.frames);
+		if(stats.compressUsec > 0)
+			printf("  compression: %ld of %ld frames, ratio %.2f, %.1f us/frame compressing\n",
+			       stats.compressedFrames, stats.frames,
+			       stats.compressedBytes ? stats.uncompressedBytes/(double)stats.compressedBytes : 1.0,
+			       stats.compressUsec/(double)FRAMES);
+		if(barrier)
+			printf("  barrier: %.2f ms/frame waiting, %ld timeouts\n", stats.barrierUsec/1000.0/FRAMES, stats.barrierTimeouts);
+		dgr_slave_stats slaves[MAX_SLAVES];
+		int numSlaves = dgr_get_slave_stats(slaves, MAX_SLAVES);
+		for(int i=0; i<numSlaves; i++)
+			printf("  slave %s: latency %.2f ms, jitter %.2f ms, max %.2f ms\n", slaves[i].address,
+			       slaves[i].latency, slaves[i].jitter, slaves[i].maxLatency);
+		if(delayStep > 0 && (numSlaves < 2 || !checkLatencies(slaves, numSlaves)))
+		{
+			printf("  ERROR: slave latencies don't match how slow the slaves are\n");
+			fflush(stdout);
+			exit(EXIT_FAILURE);
+		}
+		fflush(stdout);
+		exit(EXIT_SUCCESS);
+	}
+	else
+	{
+		atexit(slaveExit);
+		int frame = 0;
+		long lastFrames = 0;
+		while(1)
+		{
+			long start = kuhl_microseconds();
+			dgr_update(0,1);
+			receiveUsec += kuhl_microseconds() - start;
+			receiveCalls++;
+			if(func(frame++) < 0)
+				slaveFailed = 1;
+			/* In barrier mode, we should never skip a frame once the
+			 * master knows about every slave. */
+			dgr_stats stats;
+			dgr_get_stats(&stats);
+			if(barrier && frame > 10 && stats.frames != lastFrames+1)
+			{
+				printf("  slave skipped from frame %ld to %ld\n", lastFrames, stats.frames);
+				slaveFailed = 1;
+			}
+			lastFrames = stats.frames;
+			usleep(slaveDelay);
+			dgr_update(1,0);
+		}
+	}
+}
+
+/* How packets get from the master to the slaves in a scenario. */
+#define UNICAST   0  // the master sends each packet to each slave
+#define MULTICAST 1  // the master sends each packet once to a multicast group on the loopback interface
+#define SHM       2  // the master sends each packet to the first slave, which shares frames with the others through shared memory
+
+/* Runs a master and one or more slaves. */
+static int scenario(const char *name, int port, long (*func)(int), int numSlaves, int transport,
+                    int slaveDelay, int delayStep, int barrier)
+{
+	printf("%s:\n", name);
+	fflush(stdout);
+
+	/* Without multicast, each slave needs its own port. */
+	char masterConfig[1024], slaveConfig[MAX_SLAVES][1024];
+	snprintf(masterConfig, 1024, "/tmp/selftest-dgr-master-%d.ini", getpid());
+	FILE *f = fopen(masterConfig, "w");
+	fprintf(f, "dgr.mode = master\n");
+	if(barrier)
+		fprintf(f, "dgr.sync = barrier\n");
+	if(transport == MULTICAST)
+		fprintf(f, "dgr.master.multicast = 239.255.76.67 %d\ndgr.multicast.interface = 127.0.0.1\n", port);
+	else if(transport == SHM)
+		fprintf(f, "dgr.master.dest = 127.0.0.1 %d\n", port);
+	else
+	{
+		fprintf(f, "dgr.master.dest =");
+		for(int i=0; i<numSlaves; i++)
+			fprintf(f, " 127.0.0.1 %d", port+i*100);
+		fprintf(f, "\n");
+	}
+	fclose(f);
+
+	char shm[1024];
+	snprintf(shm, 1024, "/selftest-dgr-%d", getpid());
+	pid_t slaves[MAX_SLAVES];
+	for(int i=0; i<numSlaves; i++)
+	{
+		snprintf(slaveConfig[i], 1024, "/tmp/selftest-dgr-slave%d-%d.ini", i, getpid());
+		f = fopen(slaveConfig[i], "w");
+		if(transport == SHM && i == 0)
+			fprintf(f, "dgr.mode = slave\ndgr.slave.listenport = %d\ndgr.shm = %s\n", port, shm);
+		else if(transport == SHM)
+			fprintf(f, "dgr.mode = slave\ndgr.shm = %s\n", shm);
+		else if(transport == MULTICAST)
+			fprintf(f, "dgr.mode = slave\ndgr.slave.listenport = %d\n"
+			        "dgr.slave.multicast = 239.255.76.67\ndgr.multicast.interface = 127.0.0.1\n", port);
+		else
+			fprintf(f, "dgr.mode = slave\ndgr.slave.listenport = %d\n", port+i*100);
+		fclose(f);
+
+		slaves[i] = fork();
+		if(slaves[i] == 0)
+			run(slaveConfig[i], 0, func, slaveDelay + i*delayStep, 0, barrier);
+	}
+	pid_t master = fork();
+	if(master == 0)
+		run(masterConfig, 1, func, slaveDelay, delayStep, barrier);
+
+	int status;
+	waitpid(master, &status, 0);
+	int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	for(int i=0; i<numSlaves; i++)
+	{
+		waitpid(slaves[i], &status, 0);
+		ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	unlink(masterConfig);
+	for(int i=0; i<numSlaves; i++)
+		unlink(slaveConfig[i]);
+	if(transport == SHM)
+		shm_unlink(shm);
+	return ok;
+}
+
+/* Records the viewer records without any slaves and then replays the
+ * recording as fast as possible to a slave that uses a barrier. The
+ * replay rate is the number of frames per second the slave can
+ * handle. */
+static int recordReplay(int port)
+{
+	printf("viewer (recorded, then replayed to a slave as fast as possible):\n");
+	fflush(stdout);
+	char recording[1024], masterConfig[1024], slaveConfig[1024];
+	snprintf(recording, 1024, "/tmp/selftest-dgr-%d.log", getpid());
+	snprintf(masterConfig, 1024, "/tmp/selftest-dgr-master-%d.ini", getpid());
+	snprintf(slaveConfig, 1024, "/tmp/selftest-dgr-slave-%d.ini", getpid());
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		FILE *f = fopen(masterConfig, "w");
+		fprintf(f, "dgr.mode = record\ndgr.record.file = %s\n", recording);
+		fclose(f);
+		kuhl_config_filename(masterConfig);
+		dgr_init();
+		for(int i=0; i<FRAMES; i++)
+		{
+			viewer(i);
+			usleep(1000);
+			dgr_update(1,0);
+		}
+		exit(EXIT_SUCCESS); // dgr_init() uses atexit() to finish the recording
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	FILE *f = fopen(masterConfig, "w");
+	fprintf(f, "dgr.mode = master\ndgr.sync = barrier\ndgr.master.dest = 127.0.0.1 %d\n", port);
+	fclose(f);
+	f = fopen(slaveConfig, "w");
+	fprintf(f, "dgr.mode = slave\ndgr.slave.listenport = %d\n", port);
+	fclose(f);
+
+	pid_t slave = fork();
+	if(slave == 0)
+		run(slaveConfig, 0, viewer, 0, 0, 1);
+	pid = fork();
+	if(pid == 0)
+	{
+		kuhl_config_filename(masterConfig);
+		dgr_init();
+		usleep(200000); // let the slave start
+		long start = kuhl_microseconds();
+		long frames = dgr_replay(recording, 0);
+		long elapsed = kuhl_microseconds() - start;
+		printf("  replayed %ld frames: %.0f frames/second\n", frames, frames*1000000.0/elapsed);
+		fflush(stdout);
+		exit(frames == FRAMES+1 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	waitpid(pid, &status, 0);
+	ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	waitpid(slave, &status, 0);
+	ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	unlink(recording);
+	unlink(masterConfig);
+	unlink(slaveConfig);
+	return ok;
+}
+
+/* Sends an image-sized blob to a slave under two names. The slave
+ * should only receive the data once. Later, while the slave's
+ * connection is idle, the master sends a second blob twice in a row
+ * with different contents; the first version may or may not be sent,
+ * but the master must never try to send it after it was freed. */
+#define BLOB_SIZE (8*1024*1024)
+#define LATE_SIZE (256*1024)
+static int progressCalls = 0;
+static void progress(const char *name, long done, long size, void *arg)
+{
+	progressCalls++;
+}
+static int blobs(int port)
+{
+	printf("blobs (%d MB image sent as \"image\" and \"copy\"):\n", BLOB_SIZE/1024/1024);
+	fflush(stdout);
+	char masterConfig[1024], slaveConfig[1024];
+	snprintf(masterConfig, 1024, "/tmp/selftest-dgr-master-%d.ini", getpid());
+	snprintf(slaveConfig, 1024, "/tmp/selftest-dgr-slave-%d.ini", getpid());
+	FILE *f = fopen(masterConfig, "w");
+	fprintf(f, "dgr.mode = master\ndgr.master.dest = 127.0.0.1 %d\ndgr.blob.port = %d\n", port, port+100);
+	fclose(f);
+	f = fopen(slaveConfig, "w");
+	fprintf(f, "dgr.mode = slave\ndgr.slave.listenport = %d\ndgr.blob.port = %d\n", port, port+100);
+	fclose(f);
+
+	unsigned char *image = malloc(BLOB_SIZE);
+	for(int i=0; i<BLOB_SIZE; i++)
+		image[i] = i*7 + i/4096;
+	/* The children report the bytes of the late blob that they
+	 * received or sent. */
+	int slavePipe[2], masterPipe[2];
+	if(pipe(slavePipe) != 0 || pipe(masterPipe) != 0)
+	{
+		perror("pipe");
+		return 0;
+	}
+
+	pid_t slave = fork();
+	if(slave == 0)
+	{
+		kuhl_config_filename(slaveConfig);
+		dgr_blob_progress(progress, NULL);
+		dgr_init();
+		long start = kuhl_microseconds();
+		long size1 = 0, size2 = 0;
+		const unsigned char *image1 = dgr_blob_get("image", &size1, 10000);
+		const unsigned char *image2 = dgr_blob_get("copy", &size2, 10000);
+		long elapsed = kuhl_microseconds() - start;
+		dgr_stats stats;
+		dgr_get_stats(&stats);
+		printf("  slave:  received both in %.1f ms, %.1f MB transferred, %d progress callbacks\n",
+		       elapsed/1000.0, stats.blobBytes/1024.0/1024.0, progressCalls);
+		fflush(stdout);
+		if(image1 == NULL || image2 == NULL || size1 != BLOB_SIZE || size2 != BLOB_SIZE ||
+		   memcmp(image1, image, BLOB_SIZE) != 0 || memcmp(image2, image, BLOB_SIZE) != 0 ||
+		   stats.blobBytes != BLOB_SIZE)
+		{
+			printf("  ERROR: slave received the wrong blobs\n");
+			fflush(stdout);
+			_exit(EXIT_FAILURE);
+		}
+
+		const unsigned char *late = NULL;
+		long lateSize = 0;
+		while(late == NULL || lateSize != LATE_SIZE || late[0] != 2)
+		{
+			dgr_update(0,1);
+			late = dgr_blob_get("late", &lateSize, 0);
+		}
+		dgr_get_stats(&stats);
+		long received = stats.blobBytes - BLOB_SIZE;
+		if(write(slavePipe[1], &received, sizeof(long)) != sizeof(long))
+			_exit(EXIT_FAILURE);
+		while(1) // exits when the master does
+			dgr_update(0,1);
+	}
+	pid_t master = fork();
+	if(master == 0)
+	{
+		kuhl_config_filename(masterConfig);
+		dgr_init();
+		dgr_blob_send("image", image, BLOB_SIZE);
+		dgr_blob_send("copy", image, BLOB_SIZE);
+		dgr_blob_send("image", image, BLOB_SIZE); // already sent
+		unsigned char *late = malloc(LATE_SIZE);
+		for(int i=0; i<FRAMES; i++)
+		{
+			if(i == FRAMES/2) // the slave has both blobs by now
+			{
+				memset(late, 1, LATE_SIZE);
+				dgr_blob_send("late", late, LATE_SIZE);
+				memset(late, 2, LATE_SIZE);
+				dgr_blob_send("late", late, LATE_SIZE);
+			}
+			slideshow(i);
+			usleep(1000);
+			dgr_update(1,0);
+		}
+		free(late);
+		dgr_stats stats;
+		dgr_get_stats(&stats);
+		printf("  master: sent %.1f MB of blobs\n", stats.blobBytes/1024.0/1024.0);
+		fflush(stdout);
+		long sent = stats.blobBytes - BLOB_SIZE;
+		if(write(masterPipe[1], &sent, sizeof(long)) != sizeof(long))
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	int status;
+	waitpid(master, &status, 0);
+	int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	waitpid(slave, &status, 0);
+	ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	/* The slave must receive the second version of the late blob
+	 * over the same connection, and it must receive every byte that
+	 * the master sent. */
+	close(slavePipe[1]);
+	close(masterPipe[1]);
+	long received = -1, sent = -1;
+	if(read(slavePipe[0], &received, sizeof(long)) != sizeof(long) ||
+	   read(masterPipe[0], &sent, sizeof(long)) != sizeof(long) ||
+	   sent != received || (received != LATE_SIZE && received != 2*LATE_SIZE))
+	{
+		printf("  ERROR: late blob: master sent %ld bytes, slave received %ld bytes\n", sent, received);
+		ok = 0;
+	}
+	else
+		printf("  late blob sent twice: %ld KB transferred\n", received/1024);
+	close(slavePipe[0]);
+	close(masterPipe[0]);
+	unlink(masterConfig);
+	unlink(slaveConfig);
+	free(image);
+	return ok;
+}
+
+/* Measures how long it takes the master to set many records by name
+ * and by handle. */
+#define LOOKUP_RECORDS 1000
+#define LOOKUP_ROUNDS 200
+static int lookup(void)
+{
+	printf("lookup (%d records):\n", LOOKUP_RECORDS);
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		char config[1024];
+		snprintf(config, 1024, "/tmp/selftest-dgr-lookup-%d.ini", getpid());
+		FILE *f = fopen(config, "w");
+		fprintf(f, "dgr.mode = master\ndgr.master.dest = 127.0.0.1 5690\n");
+		fclose(f);
+		kuhl_config_filename(config);
+		dgr_init();
+		unlink(config);
+
+		char names[LOOKUP_RECORDS][32];
+		int handles[LOOKUP_RECORDS];
+		for(int i=0; i<LOOKUP_RECORDS; i++)
+		{
+			snprintf(names[i], 32, "!!viewmat%d", i);
+			handles[i] = dgr_register(names[i], sizeof(float)*16);
+		}
+
+		float m[16];
+		mat4f_identity(m);
+		long start = kuhl_microseconds();
+		for(int r=0; r<LOOKUP_ROUNDS; r++)
+		{
+			m[12] = r;
+			for(int i=0; i<LOOKUP_RECORDS; i++)
+				dgr_setget(names[i], m, sizeof(m));
+		}
+		long byName = kuhl_microseconds() - start;
+		start = kuhl_microseconds();
+		for(int r=0; r<LOOKUP_ROUNDS; r++)
+		{
+			m[12] = r;
+			for(int i=0; i<LOOKUP_RECORDS; i++)
+				dgr_setget_handle(handles[i], m);
+		}
+		long byHandle = kuhl_microseconds() - start;
+		printf("  dgr_setget():        %6.1f ns/call\n", byName*1000.0/(LOOKUP_ROUNDS*LOOKUP_RECORDS));
+		printf("  dgr_setget_handle(): %6.1f ns/call\n", byHandle*1000.0/(LOOKUP_ROUNDS*LOOKUP_RECORDS));
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void)
+{
+	if(!lookup())
+		return EXIT_FAILURE;
+
+	int ok = scenario("viewer", 5680, viewer, 1, UNICAST, 500, 0, 0);
+	ok = scenario("multiscreen-slideshow", 5681, slideshow, 1, UNICAST, 500, 0, 0) && ok;
+	ok = scenario("particles", 5682, particles, 1, UNICAST, 500, 0, 0) && ok;
+	ok = scenario("mesh", 5686, mesh, 1, UNICAST, 500, 0, 0) && ok;
+	ok = scenario("particles (multicast, 3 slaves)", 5683, particles, 3, MULTICAST, 500, 0, 0) && ok;
+	ok = scenario("particles (shared memory, 3 slaves)", 5689, particles, 3, SHM, 500, 0, 0) && ok;
+	ok = scenario("viewer (2 slow slaves)", 5684, viewer, 2, UNICAST, 3000, 0, 0) && ok;
+	ok = scenario("viewer (3 slaves, each slower than the last, barrier)", 5691, viewer, 3, UNICAST, 500, 5000, 1) && ok;
+	ok = scenario("viewer (2 slow slaves, barrier)", 5685, viewer, 2, UNICAST, 3000, 0, 1) && ok;
+	ok = scenario("viewer (3 slow slaves, shared memory, barrier)", 5690, viewer, 3, SHM, 3000, 0, 1) && ok;
+	ok = recordReplay(5687) && ok;
+	ok = blobs(5688) && ok;
+	if(!ok)
+	{
+		printf("ERROR\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "vecmat.h"
+#include "kuhl-nodep.h"
+#include "kalman.h"
+#include "pose-predict.h"
+
+/* Checks that kalman_multi_estimate() filters each channel the same
+ * way that separate kalman_estimate() calls do, checks that
+ * kalman_quat_estimate() keeps the orientation normalized and
+ * estimates the angular velocity, and measures how many tracker
+ * records per second one core can filter with seven scalar filters
+ * (what vrpn-help.cpp used to do) and with a pose_predictor. */
+
+#define RECORDS 200000
+#define RATE 500  // records per second
+
+/* Noise in [-amount, amount] */
+static float noise(float amount)
+{
+	return (rand() / (float) RAND_MAX * 2 - 1) * amount;
+}
+
+/* A head moving and turning around the y axis at 90 degrees/second. */
+static void motion(int i, float pos[3], float quat[4], float noisy)
+{
+	double t = i / (double) RATE;
+	vec3f_set(pos, .3*sin(1.3*t) + noise(noisy*.0002f), 1.6 + noise(noisy*.0002f), .2*cos(.7*t) + noise(noisy*.0002f));
+	double angle = M_PI/2 * t;
+	vec4f_set(quat, noise(noisy*.0005f), sin(angle/2), noise(noisy*.0005f), cos(angle/2));
+	quatf_normalize(quat);
+}
+
+static int multi(void)
+{
+	kalman_state scalar[3];
+	kalman_multi_state batched;
+	for(int c=0; c<3; c++)
+		kalman_initialize(&scalar[c], 0.00004f, 0.01f);
+	kalman_multi_initialize(&batched, 3, 0.00004f, 0.01f);
+
+	double maxDiff = 0;
+	for(int i=0; i<10000; i++)
+	{
+		float pos[3], quat[4];
+		motion(i, pos, quat, 1);
+		long usec = i * 1000000L / RATE;
+		double measured[3] = { pos[0], pos[1], pos[2] };
+		kalman_multi_estimate(&batched, measured, usec);
+		for(int c=0; c<3; c++)
+		{
+			float s = kalman_estimate(&scalar[c], pos[c], usec);
+			double diff = fabs(s - batched.x[0][c]);
+			if(diff > maxDiff)
+				maxDiff = diff;
+		}
+	}
+	printf("kalman_multi_estimate(): largest difference from kalman_estimate() %g\n", maxDiff);
+	if(maxDiff > 1e-5)
+	{
+		printf("ERROR: kalman_multi_estimate() doesn't match kalman_estimate()\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int quat(void)
+{
+	kalman_quat_state filter;
+	kalman_quat_initialize(&filter, 0.0002f, 0.01f);
+	kalman_state components[4];
+	for(int c=0; c<4; c++)
+		kalman_initialize(&components[c], 0.0001f, 0.01f);
+
+	double maxNormError = 0, maxComponentNormError = 0;
+	for(int i=0; i<10000; i++)
+	{
+		float pos[3], q[4];
+		motion(i, pos, q, 1);
+		long usec = i * 1000000L / RATE;
+		double measured[4] = { q[0], q[1], q[2], q[3] };
+		kalman_quat_estimate(&filter, measured, usec);
+		if(fabs(vec4d_norm(filter.quat)-1) > maxNormError)
+			maxNormError = fabs(vec4d_norm(filter.quat)-1);
+
+		float c[4];
+		for(int k=0; k<4; k++)
+			c[k] = kalman_estimate(&components[k], q[k], usec);
+		if(fabs(vec4f_norm(c)-1) > maxComponentNormError)
+			maxComponentNormError = fabs(vec4f_norm(c)-1);
+	}
+	double degreesPerSecond = filter.axes.x[1][1] * 180 / M_PI;
+	printf("kalman_quat_estimate(): angular velocity %.2f degrees/second (should be 90), |q|-1 at most %g\n",
+	       degreesPerSecond, maxNormError);
+	printf("4 kalman_estimate() calls: |q|-1 at most %g\n", maxComponentNormError);
+	if(fabs(degreesPerSecond - 90) > 1 || maxNormError > 1e-6)
+	{
+		printf("ERROR: kalman_quat_estimate() failed\n");
+		return 0;
+	}
+	return 1;
+}
+
+static void benchmark(void)
+{
+	float (*pos)[3] = malloc(sizeof(float)*3*RECORDS);
+	float (*q)[4] = malloc(sizeof(float)*4*RECORDS);
+	for(int i=0; i<RECORDS; i++)
+		motion(i, pos[i], q[i], 1);
+
+	/* Seven scalar filters */
+	kalman_state scalar[7];
+	for(int c=0; c<3; c++)
+		kalman_initialize(&scalar[c], 0.00004f, 0.01f);
+	for(int c=3; c<7; c++)
+		kalman_initialize(&scalar[c], 0.0001f, 0.01f);
+	float sum = 0;
+	long start = kuhl_microseconds();
+	for(int i=0; i<RECORDS; i++)
+	{
+		long usec = i * 1000000L / RATE;
+		for(int c=0; c<3; c++)
+			sum += kalman_estimate(&scalar[c], pos[i][c], usec);
+		for(int c=0; c<4; c++)
+			sum += kalman_estimate(&scalar[3+c], q[i][c], usec);
+	}
+	long scalarUsec = kuhl_microseconds() - start;
+
+	/* pose_predictor: batched position filter and quaternion filter */
+	pose_predictor predictor;
+	pose_predictor_init(&predictor, 0.00004f, 0.01f, 0.0002f, 0.01f);
+	start = kuhl_microseconds();
+	for(int i=0; i<RECORDS; i++)
+	{
+		pose_predictor_add(&predictor, pos[i], q[i], i * 1000000L / RATE);
+		sum += predictor.position.x[0][0];
+	}
+	long batchedUsec = kuhl_microseconds() - start;
+
+	printf("7 x kalman_estimate():  %9.0f records/second\n", RECORDS * 1000000.0 / scalarUsec);
+	printf("pose_predictor_add():   %9.0f records/second (%.1fx)\n", RECORDS * 1000000.0 / batchedUsec,
+	       scalarUsec / (double) batchedUsec);
+	if(sum == 12345) // keep the compiler from skipping the work
+		printf("\n");
+	free(pos);
+	free(q);
+}
+
+int main(void)
+{
+	srand(1);
+	int ok = multi();
+	ok = quat() && ok;
+	benchmark();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
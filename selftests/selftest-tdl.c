@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "kuhl-nodep.h"
+#include "tdl-util.h"
+
+/* Writes version 2 .tdl files with several objects and irregular
+ * timestamps, reads them back, checks that tdl2_seek() finds the
+ * right records, checks that a file that was never finished can still
+ * be read, and measures how fast records can be read. */
+
+#define RECORDS 100000
+#define OBJECTS 3
+#define FILENAME "selftest-tdl.tdl"
+
+/* Record i is for object i%OBJECTS. Several records share each
+ * timestamp, and the timestamps are unevenly spaced. */
+static void make_record(int i, tdl2_record *r)
+{
+	r->time = 1000000000LL + (i/OBJECTS) * 2000LL + ((i/OBJECTS) % 7) * 100;
+	r->object = i % OBJECTS;
+	double t = r->time / 1000000.0;
+	r->pos[0] = sin(t + r->object);
+	r->pos[1] = 1.5f + .1f*cos(3*t);
+	r->pos[2] = -2 + .001f*r->object;
+	r->quat[0] = 0;
+	r->quat[1] = sin(t/2);
+	r->quat[2] = 0;
+	r->quat[3] = cos(t/2);
+}
+
+static int write_file(int flags, int finish)
+{
+	const char *names[OBJECTS] = { "Head", "Wand", "Hand" };
+	tdl2_writer *w = tdl2_create(FILENAME, names, OBJECTS, flags);
+	if(w == NULL)
+		return 0;
+	for(int i=0; i<RECORDS; i++)
+	{
+		tdl2_record r;
+		make_record(i, &r);
+		if(tdl2_write(w, &r) != 0)
+			return 0;
+	}
+	if(finish)
+		return tdl2_finish(w) == 0;
+
+	/* Pretend the program crashed: write what is buffered by the C
+	 * library, but not the last block or the index. */
+	fclose(w->f);
+	return 1;
+}
+
+static int check(const char *label, int flags, int finish)
+{
+	if(!write_file(flags, finish))
+	{
+		printf("ERROR: %s: unable to write file\n", label);
+		return 0;
+	}
+	tdl2_reader *r = tdl2_open(FILENAME);
+	if(r == NULL)
+	{
+		printf("ERROR: %s: unable to open file\n", label);
+		return 0;
+	}
+	if(tdl2_object(r, "Wand") != 1 || tdl2_object(r, "Foot") != -1)
+	{
+		printf("ERROR: %s: wrong object names\n", label);
+		return 0;
+	}
+
+	/* An unfinished file is missing its last partial block. */
+	long expected = finish ? RECORDS : RECORDS / TDL2_BLOCK_RECORDS * TDL2_BLOCK_RECORDS;
+	float tolerance = (flags & TDL2_COMPRESS) ? TDL2_POS_QUANTUM : 0;
+
+	/* Read everything. */
+	long count = 0;
+	float maxError = 0;
+	tdl2_record rec, want;
+	long start = kuhl_microseconds();
+	while(tdl2_next(r, &rec) == 1)
+	{
+		make_record(count, &want);
+		if(rec.time != want.time || rec.object != want.object)
+		{
+			printf("ERROR: %s: record %ld has the wrong time or object\n", label, count);
+			return 0;
+		}
+		for(int k=0; k<3; k++)
+			maxError = fmaxf(maxError, fabsf(rec.pos[k] - want.pos[k]));
+		count++;
+	}
+	long elapsed = kuhl_microseconds() - start;
+	if(count != expected || (long) r->header.records != expected)
+	{
+		printf("ERROR: %s: read %ld records, expected %ld\n", label, count, expected);
+		return 0;
+	}
+	if(maxError > tolerance)
+	{
+		printf("ERROR: %s: position error %g is larger than %g\n", label, maxError, tolerance);
+		return 0;
+	}
+
+	/* Seek to the time of random records and to times between
+	 * records. */
+	for(int s=0; s<10000; s++)
+	{
+		int i = rand() % expected;
+		i -= i % OBJECTS; // first record with this time
+		make_record(i, &want);
+		int64_t usec = want.time - (s%2); // s%2: just before the record
+		if(tdl2_seek(r, usec) != 1 || tdl2_next(r, &rec) != 1 ||
+		   rec.time != want.time || rec.object != 0)
+		{
+			printf("ERROR: %s: seek to %lld failed\n", label, (long long) usec);
+			return 0;
+		}
+	}
+	make_record(expected-1, &want);
+	if(tdl2_seek(r, want.time+1) != 0 || tdl2_next(r, &rec) != 0)
+	{
+		printf("ERROR: %s: seek past the end failed\n", label);
+		return 0;
+	}
+
+	printf("%s: %ld records, %.1f bytes/record, %.0f records/second\n", label, count,
+	       r->size / (double) count, count * 1000000.0 / (elapsed > 0 ? elapsed : 1));
+	tdl2_close(r);
+	return 1;
+}
+
+int main(void)
+{
+	int ok = check("uncompressed", 0, 1);
+	ok = check("compressed", TDL2_COMPRESS, 1) && ok;
+	ok = check("unfinished", TDL2_COMPRESS, 0) && ok;
+	remove(FILENAME);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
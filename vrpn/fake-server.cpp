@@ -1,18 +1,28 @@
 /* This program simulates a VRPN server to help support debugging and
    testing without access to a tracking system.
-   
+
    This file is based heavily on a VRPN server tutorial written by
    Sebastian Kuntz for VR Geeks (http://www.vrgeeks.org) in August
    2011.
-   
+
    Modified by John Thomas to support multiple Tracked objects
-   and reading from log files. (2015) 
+   and reading from log files. (2015)
+
+   Records come from sources: a generated object, a version 1 .tdl
+   file (one object, records evenly spaced at -r records/second) or a
+   version 2 .tdl file (any number of objects, timestamped records).
+   Each source has a playback time for its next record. The main loop
+   advances the playback clock (by the wall clock times the speed, or
+   by 1 ms per pass when running as fast as possible), sends every
+   record that is due and then sleeps until the next one. Each record
+   is sent with the time it was supposed to be sent at, so the message
+   times that clients see have the spacing of the recording even if
+   this program falls behind for a moment. A VRPN connection sends each
+   message to every client that is connected, so any number of clients
+   can receive the same data.
 */
 
-#define LINE_UP "\033[F"
 #define LINE_CLEAR "\033[J"
-#define DATA_TRACKER 0
-#define FILE_TRACKER 1
 
 #include <stdio.h>
 #include <fcntl.h>
@@ -24,7 +34,9 @@
 #include <iostream>
 #include <cstdlib>
 #include <string>
+#include <vector>
 #include <cerrno>
+#include <climits>
 #include <time.h>
 
 #include "vrpn_Text.h"
@@ -33,196 +45,267 @@
 #include "vrpn_Button.h"
 #include "vrpn_Connection.h"
 #include "vecmat.h"
-#include "kuhl-util.h"
+#include "kuhl-nodep.h"
 #include "tdl-util.h"
 
 using namespace std;
 
+/* Motion of generated objects */
+#define MOTION_SWAY 0  // side to side while slowly turning (the original fake server)
+#define MOTION_WALK 1  // walking in a circle while looking around
+#define MOTION_SHAKE 2 // standing still while quickly shaking the head
+
+#define SOURCE_GENERATED 0
+#define SOURCE_TDL1 1
+#define SOURCE_TDL2 2
+
 class myTracker : public vrpn_Tracker
 {
   public:
-	myTracker( const char* name, bool* flags, vrpn_Connection *c = 0, FILE* fs = NULL );
+	myTracker( const char* name, vrpn_Connection *c = 0 );
 	virtual ~myTracker() {};
 	virtual void mainloop();
-
-  protected:
-	struct timeval _timestamp;
-	kuhl_fps_state fps_state;
-	
-  private:
-  	bool verbose;
-  	bool quiet;
-  	bool noise;
-  	bool type;
-  	char* trackerName;
-  	FILE *fs;
-  	int modifier;
-  	long lastrecord;
+	void send(const float p[3], const float quat[4], long usec);
 };
 
-myTracker::myTracker( const char* name, bool* flags, vrpn_Connection *c, FILE* fs ) :
+myTracker::myTracker( const char* name, vrpn_Connection *c ) :
 	vrpn_Tracker( name, c )
 {
-	printf("Using tracker name: %s\n", name);
-	this->trackerName = (char*)name;
-	this->verbose = flags[0];
-	this->quiet = flags[1];
-	this->noise = flags[2];
-	this->type = flags[3];
-	this->fs = fs;
-	this->modifier = ((double) rand() / (RAND_MAX)) * (360);
-	this->lastrecord = kuhl_microseconds();
-	kuhl_getfps_init(&fps_state);
 }
 
 void myTracker::mainloop()
 {
-	vrpn_gettimeofday(&_timestamp, NULL);
-	vrpn_Tracker::timestamp = _timestamp;
+	server_mainloop();
+}
+
+/** Sends a record to all clients. usec is the time that goes in the
+ * message (microseconds since 1970). */
+void myTracker::send(const float p[3], const float quat[4], long usec)
+{
+	timestamp.tv_sec = usec / 1000000L;
+	timestamp.tv_usec = usec % 1000000L;
+	for(int i=0; i<3; i++)
+		pos[i] = p[i];
+	for(int i=0; i<4; i++)
+		d_quat[i] = quat[i];
+
+	char msgbuf[1000];
+	int len = vrpn_Tracker::encode_to(msgbuf);
+	if (d_connection->pack_message(len, timestamp, position_m_id, d_sender_id, msgbuf,
+	                               vrpn_CONNECTION_LOW_LATENCY))
+	{
+		fprintf(stderr,"can't write message: tossing\n");
+	}
+}
+
+typedef struct
+{
+	int type;
+	int tracker;         // index of the (first) tracker for this source
+	int64_t next;        // playback time of the next record (microseconds)
+	int64_t period;      // generated and version 1: microseconds between records; version 2: loop length if all records have the same time
+	int64_t offset;      // version 2: added to record times to get playback times
+	int loops;           // number of times we reached the end of the file
+	FILE *f;             // version 1
+	tdl2_reader *reader; // version 2
+	tdl2_record rec;     // version 2: the next record
+} source;
+
+static vector<myTracker*> trackers;
+static vector<source> sources;
+static bool noise = false;
+static int motion = MOTION_SWAY;
+
+/* Computes the pose of generated object number index at time t (seconds). */
+static void generate(int index, double t, float pos[3], float quat[4])
+{
+	double phase = index * 0.7;
+	float rotMat[9];
+	if(motion == MOTION_WALK)
+	{
+		/* 1.2 m/s around a 2 m circle, bobbing 2 cm twice a second
+		 * and looking 30 degrees left and right. */
+		double a = t * 1.2 / 2 + phase;
+		pos[0] = 2*cos(a);
+		pos[1] = 1.55f + .02f*sin(4*M_PI*t);
+		pos[2] = -2*sin(a);
+		float yaw = a*180/M_PI + 30*sin(2*M_PI*.3*t + phase);
+		mat3f_rotateEuler_new(rotMat, 0, yaw, 0, "XYZ");
+	}
+	else if(motion == MOTION_SHAKE)
+	{
+		/* Head shaking +-60 degrees 1.5 times a second. */
+		pos[0] = index % 16 * .5f;
+		pos[1] = 1.55f;
+		pos[2] = -(index / 16) * .5f;
+		mat3f_rotateEuler_new(rotMat, 0, 60*sin(2*M_PI*1.5*t + phase), 0, "XYZ");
+	}
+	else
+	{
+		pos[0] = sin( t + phase );
+		pos[1] = 1.55f; // approx normal eyeheight
+		pos[2] = 0.0f;
+		mat3f_rotateEuler_new(rotMat, 0, t*10, 0, "XYZ"); // yaw
+	}
+	quatf_from_mat3f(quat, rotMat);
+}
 
-	float filePos[3];
-	float fileOrient[9];
-	static int timeThroughData = 1;
-	if(type == FILE_TRACKER)
+/* Sends the next record of a source and finds the time of the one
+ * after it. */
+static void send_next(source *s, long usec)
+{
+	float pos[3], quat[4];
+	int tracker = s->tracker;
+	if(s->type == SOURCE_GENERATED)
+	{
+		generate(s->tracker, s->next / 1000000.0, pos, quat);
+		s->next += s->period;
+	}
+	else if(s->type == SOURCE_TDL1)
 	{
-		int readVal = tdl_read(fs, filePos, fileOrient);
-	
+		float orient[9];
+		int readVal = tdl_read(s->f, pos, orient);
 		if(readVal == 1)  // end of file
 		{
-			timeThroughData++;
+			s->loops++;
 
 			// When we reach end of file, start over again from beginning of file.
-			if(tdl_prepare(fs, NULL) == -1)
+			if(tdl_prepare(s->f, NULL) == -1 || tdl_read(s->f, pos, orient) != 0)
 			{
 				printf("Error going back to beginning of file.\n");
 				exit(EXIT_FAILURE);
 			}
-
-			// read data so that server has info to serve
-			tdl_read(fs, filePos, fileOrient);
 		}
 		else if(readVal == -1)  // error
 		{
 			exit(EXIT_FAILURE);
 		}
-	}
-	
-	if(!quiet)
-	{
-		printf(LINE_CLEAR "%s (%d time though file):\n", trackerName, timeThroughData);	
-		printf(LINE_CLEAR "Records sent per second: %.1f\n", kuhl_getfps(&fps_state));	
-	}
-	
-	double angle = kuhl_milliseconds_start() / 1000.0;
-
-	// Position
-	if(type == DATA_TRACKER)
-	{
-		pos[0] = sin( angle + this->modifier ) ;
-		pos[1] = 1.55f; // approx normal eyeheight
-		pos[2] = 0.0f;
+		quatf_from_mat3f(quat, orient);
+		s->next += s->period;
 	}
 	else
 	{
-		pos[0] = filePos[0];
-		pos[1] = filePos[1];
-		pos[2] = filePos[2];
+		tracker += s->rec.object;
+		vec3f_copy(pos, s->rec.pos);
+		vec4f_copy(quat, s->rec.quat);
+
+		int ret;
+		while((ret = tdl2_next(s->reader, &(s->rec))) == -1)
+			;
+		if(ret == 0)
+		{
+			/* Start over. The first record is played one average
+			 * record interval after the last one. */
+			const tdl2_header *h = &(s->reader->header);
+			int64_t length = h->last - h->first;
+			if(h->records > 1)
+				length += length / (h->records-1);
+			/* A file with one record (or with every record at the
+			 * same time) is repeated at the -r rate instead. */
+			s->offset += length > 0 ? length : s->period;
+			s->loops++;
+			tdl2_seek(s->reader, h->first);
+			tdl2_next(s->reader, &(s->rec));
+		}
+		s->next = s->rec.time + s->offset;
 	}
-	
-	double r[10];
+
 	if(noise)
 	{
 		// generate some random numbers to simulate imperfect tracking system
-		for(int i=0; i<10; i++)
-		{
-			r[i] = 0;
-			r[i] = kuhl_gauss(); // generate some random numbers
-		}
-	
+		double r[6];
+		for(int i=0; i<6; i++)
+			r[i] = kuhl_gauss();
+
 		// Add random noise to position
 		pos[0] += r[0] * .10;
 		pos[1] += r[1] * .01;
 		pos[2] += r[2] * .01;
+
+		// and to orientation
+		float noiseMat[9], noiseQuat[4];
+		mat3f_rotateEuler_new(noiseMat, r[3]*.05, r[4]*.05, r[5]*.05, "XYZ");
+		quatf_from_mat3f(noiseQuat, noiseMat);
+		quatf_mult_quatf_new(quat, noiseQuat, quat);
 	}
 
-	if(!quiet)printf(LINE_CLEAR "Pos = %f %f %f\n", pos[0], pos[1], pos[2]);
-	
-	// Orientation
-	float rotMat[9];
-	if(type == DATA_TRACKER)
+	trackers[tracker]->send(pos, quat, usec);
+}
+
+static void add_file(const char *filename, float rate, bool verbose, vrpn_Connection *c)
+{
+	source s;
+	memset(&s, 0, sizeof(source));
+	s.tracker = trackers.size();
+
+	FILE *fs = fopen(filename, "rb");
+	if(fs == NULL)
 	{
-		if(noise)
-		{
-			mat3f_rotateEuler_new(rotMat, r[3]*.05, angle*10 + r[4]*.05, r[5]*.05, "XYZ"); // yaw + noise
-		}
-		else
-		{
-			mat3f_rotateEuler_new(rotMat, 0, angle*10, 0, "XYZ"); // yaw
-		}
+		fprintf(stderr, "Failed to open file \"%s\": %s\n", filename, strerror(errno));
+		exit(1);
 	}
-	else
+
+	char* name;
+	if(tdl_prepare(fs, &name) == 1)
 	{
-		rotMat[0] = fileOrient[0];
-		rotMat[1] = fileOrient[1];
-		rotMat[2] = fileOrient[2];
-		rotMat[3] = fileOrient[3];
-		rotMat[4] = fileOrient[4];
-		rotMat[5] = fileOrient[5];
-		rotMat[6] = fileOrient[6];
-		rotMat[7] = fileOrient[7];
-		rotMat[8] = fileOrient[8];
+		if(verbose)printf("Creating tracker for %s from version 1 file %s\n", name, filename);
+		s.type = SOURCE_TDL1;
+		s.f = fs;
+		s.period = (int64_t) (1000000 / rate);
+		trackers.push_back(new myTracker(name, c));
+		sources.push_back(s);
+		return;
 	}
-	
-	if(!quiet)mat3f_print(rotMat);
-		
-	// Convert rotation matrix into quaternion
-	float quat[4];
-	quatf_from_mat3f(quat, rotMat);
-	for(int i=0; i<4; i++)
-		d_quat[i] = quat[i];
-
-
-	char msgbuf[1000];
-	int len = vrpn_Tracker::encode_to(msgbuf);
+	fclose(fs);
 
-	long now_microsecs = kuhl_microseconds();
-	if(!quiet)printf(LINE_CLEAR "Microseconds since last record: %ld\n", now_microsecs-lastrecord);
-	lastrecord = now_microsecs;
-	if (d_connection->pack_message(len, _timestamp, position_m_id, d_sender_id, msgbuf,
-	                               vrpn_CONNECTION_LOW_LATENCY))
+	s.type = SOURCE_TDL2;
+	s.period = (int64_t) (1000000 / rate);
+	s.reader = tdl2_open(filename);
+	if(s.reader == NULL || tdl2_next(s.reader, &(s.rec)) != 1)
 	{
-		fprintf(stderr,"can't write message: tossing\n");
+		fprintf(stderr, "Failed to read records from \"%s\"\n", filename);
+		exit(1);
 	}
-
-	server_mainloop();
+	s.offset = -s.reader->header.first;
+	s.next = s.rec.time + s.offset;
+	for(int i=0; i<s.reader->header.objects; i++)
+	{
+		if(verbose)printf("Creating tracker for %s from version 2 file %s\n", s.reader->names[i], filename);
+		trackers.push_back(new myTracker(s.reader->names[i], c));
+	}
+	sources.push_back(s);
 }
 
 /**
  * -f (files)- Takes one or more parameters, this will read from a log file instead of generating data.
+ * -g (generate)- Generate data for the specified number of objects (named Tracker0, Tracker1, ...).
  * -h (help)- Prints a helpful message
+ * -m (motion)- Motion of generated objects: sway, walk or shake.
  * -n (noise)- Adds noise to each data point.
+ * -p (port)- Port to listen on.
  * -q (quiet)- Turns off almost all debugging.
+ * -r (rate)- Records per second for each generated object and version 1 file. Also how often a version 2 file whose records all have the same time repeats.
+ * -s (speed)- Playback speed, or "max" for as fast as possible.
  * -t (tracker)- Takes one or more parameters. Uses the specified names for the tracked objects, multiple names will create multiple objects.
  * -v (verbose)- Turns on some extra debugging.
  */
 int main(int argc, char* argv[])
-{	
+{
 	srand(time(NULL));
 	//Options that will be set by the arguments
 	bool verbose = false;
 	bool quiet = false;
-	bool noise = false;
-	char** objNamesv = NULL;
-	int objNamesc = 0;
-	
-	//Start out with no file names, we will malloc later if we need it.
-	char** filesv = NULL;
-	int filesc = 0;
+	float rate = 100;
+	float speed = 1;
+	int port = 3883;
+	int generated = 0;
+	vector<char*> objNamesv;
+	vector<char*> filesv;
 
 	//Check the arguments for any options supplied
 	//See Linux man(3) getopt for more info
 	int option = 0;
-	const char* options = "f:hnqt:v";
+	const char* options = "f:g:hm:np:qr:s:t:v";
 	while((option = getopt(argc, argv, options)) != -1){
 
     	switch(option)
@@ -231,46 +314,73 @@ int main(int argc, char* argv[])
 				//decriment the option index since it get's auto-incremented twice by getopt to
 				//pass over the expected single parameter. We need to support multiple params.
        			for(optind--; optind < argc && argv[optind][0] != '-' && strlen(argv[optind]); optind++)
-				{
-					//Read all of the file names
-					filesc++;
-					filesv = (char**)realloc(filesv, filesc * sizeof(char**));
-					filesv[filesc-1] = argv[optind];
-        		}
+					filesv.push_back(argv[optind]);
+        		break;
+        	case 'g':
+				generated = atoi(optarg);
         		break;
         	case 'h':
-				//free up file names incase the user specified them.
-				if(filesv != NULL)free(filesv);
-				if(objNamesv != NULL)free(objNamesv);
 				//print the help message
 				printf("Usage: fake [OPTION]...\n");
 				printf("Runs a fake vrpn server that simulates a real tracking system.\n");
 				printf("If no data files are specified, data will be generated.\n");
-				printf("\t-f [FILE]...\tFiles: use the specified data files (one or more).\n");
+				printf("\t-f [FILE]...\tFiles: use the specified .tdl files (one or more).\n");
+				printf("\t-g COUNT\tGenerate: generate data for COUNT objects named Tracker0, Tracker1, ...\n");
 				printf("\t-h\t\tHelp: print this message.\n");
+				printf("\t-m MOTION\tMotion of generated objects: sway (default), walk or shake.\n");
 				printf("\t-n\t\tNoise: adds noise to each data point.\n");
+				printf("\t-p PORT\t\tPort: listen on PORT (default 3883).\n");
 				printf("\t-q\t\tQuiet: turn off most of the debugging.\n");
-				printf("\t-t [NAME]...\tTracker: use the specified names for tracked objects.\n\t\t\t\t NOTE: does nothing if any files are specified.\n");
+				printf("\t-r RATE\t\tRate: records per second for each generated object and\n\t\t\t\t version 1 file, and repeats per second of a version 2\n\t\t\t\t file whose records all have the same time (default 100).\n");
+				printf("\t-s SPEED\tSpeed: play files SPEED times faster than they were recorded\n\t\t\t\t (default 1) or as fast as possible (max).\n");
+				printf("\t-t [NAME]...\tTracker: generate data for objects with the specified names.\n");
 				printf("\t-v\t\tVerbose: turn on extra debugging.\n");
 				exit(0);
         		break;
+        	case 'm':
+				if(strcmp(optarg, "sway") == 0)
+					motion = MOTION_SWAY;
+				else if(strcmp(optarg, "walk") == 0)
+					motion = MOTION_WALK;
+				else if(strcmp(optarg, "shake") == 0)
+					motion = MOTION_SHAKE;
+				else
+				{
+					fprintf(stderr, "Unknown motion: %s\n", optarg);
+					exit(1);
+				}
+        		break;
         	case 'n':
 				noise = true;
         		break;
+        	case 'p':
+				port = atoi(optarg);
+        		break;
         	case 'q':
 				quiet = true;
 				verbose = false;
         		break;
+        	case 'r':
+				rate = atof(optarg);
+				if(rate <= 0)
+				{
+					fprintf(stderr, "Rate must be larger than 0.\n");
+					exit(1);
+				}
+        		break;
+        	case 's':
+				speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+				if(speed < 0 || (speed == 0 && strcmp(optarg, "max") != 0))
+				{
+					fprintf(stderr, "Speed must be larger than 0 or 'max'.\n");
+					exit(1);
+				}
+        		break;
         	case 't':
         		//decriment the option index since it get's auto-incremented twice by getopt to
 				//pass over the expected single parameter. We need to support multiple params.
        			for(optind--; optind < argc && argv[optind][0] != '-' && strlen(argv[optind]); optind++)
-				{
-					//Read all of the file names
-					objNamesc++;
-					objNamesv = (char**)realloc(objNamesv, objNamesc * sizeof(char**));
-					objNamesv[objNamesc-1] = argv[optind];
-        		}
+					objNamesv.push_back(argv[optind]);
         		break;
         	case 'v':
 				verbose = true;
@@ -282,104 +392,136 @@ int main(int argc, char* argv[])
 				{
 					fprintf(stderr,"Unknow option: %c\n", (char)option);
 				}
-				//free up files incase the user specified them.
-				if(filesv != NULL)free(filesv);
-				if(objNamesv != NULL)free(objNamesv);
 				exit(1);
 				break;
     	}
 	}
-	
+
+	/* Names for objects created with -g */
+	vector<string> generatedNames;
+	for(int i=0; i<generated; i++)
+	{
+		char name[64];
+		snprintf(name, 64, "Tracker%d", i);
+		generatedNames.push_back(name);
+	}
+	for(int i=0; i<generated; i++)
+		objNamesv.push_back((char*)generatedNames[i].c_str());
+
 	//if the user didn't specify a tracker or a file, use the default traker name.
-	if(filesc == 0 && objNamesc == 0)
+	if(filesv.size() == 0 && objNamesv.size() == 0)
 	{
-		objNamesv = (char**)malloc(sizeof(char**));
-		objNamesv[0] = (char*)("Tracker0");
-		objNamesv[1] = (char*)("Tracker1");
-		objNamesc = 2;
+		objNamesv.push_back((char*)("Tracker0"));
+		objNamesv.push_back((char*)("Tracker1"));
 	}
-	
+
 	if(verbose)
 	{
 		printf("Options specified:\n");
 		printf("  Verbose: %s\n", verbose ? "true" : "false");
 		printf("  Quiet: %s\n", quiet ? "true" : "false");
 		printf("  Noise: %s\n", noise ? "true" : "false");
-		printf("  Number of trackers: %d\n", objNamesc);
-		if(objNamesc > 0)printf("  Trackers:\n");
-		for(int i = 0; i < objNamesc; i++)
-		{
-			printf("    %s\n", objNamesv[i]);
-		}
-		printf("  Number of files: %d\n", filesc);
-		if(filesc > 0)printf("  Files:\n");
-		for(int i = 0; i < filesc; i++)
+		printf("  Rate: %g records/second\n", rate);
+		if(speed > 0)
+			printf("  Speed: %gx\n", speed);
+		else
+			printf("  Speed: max\n");
+		printf("  Number of generated trackers: %d\n", (int)objNamesv.size());
+		printf("  Number of files: %d\n", (int)filesv.size());
+		for(size_t i = 0; i < filesv.size(); i++)
 		{
 			printf("    %s\n", filesv[i]);
 		}
 		printf("-------------------\n");
 	}
 
-	
+
 	if(verbose)printf("Opening VRPN connection\n");
-	vrpn_Connection_IP* m_Connection = new vrpn_Connection_IP();
-	
-	//Set the tracker type to file if files were specified, otherwise set it to data type.
-	bool trackerst = filesc > 0 ? FILE_TRACKER : DATA_TRACKER;
-	
-	//Set the tracker count to the number of either files or data trackers depending on the type.
-	int trackersc = trackerst ? filesc : objNamesc;
-	
-	//Make an array of tracker objects that is the size of the number of trackers we need.
-	myTracker* trackersv[128];
-	if(trackersc > 128)
+	vrpn_Connection_IP* m_Connection = new vrpn_Connection_IP(port);
+
+	for(size_t i = 0; i < filesv.size(); i++)
+		add_file(filesv[i], rate, verbose, m_Connection);
+	for(size_t i = 0; i < objNamesv.size(); i++)
 	{
-		fprintf(stderr, "Too many tracker objects specified.\n");
-		exit(EXIT_FAILURE);
+		source s;
+		memset(&s, 0, sizeof(source));
+		s.type = SOURCE_GENERATED;
+		s.tracker = trackers.size();
+		s.period = (int64_t) (1000000 / rate);
+		/* Spread the records of different objects out over the
+		 * period instead of sending them all at once. */
+		s.next = s.period * i / objNamesv.size();
+		printf("Using tracker name: %s\n", objNamesv[i]);
+		trackers.push_back(new myTracker(objNamesv[i], m_Connection));
+		sources.push_back(s);
 	}
-	
-	bool flags[4] = {verbose, quiet, noise, trackerst};
-	for(int i = 0; i < trackersc; i++)
+	printf("Starting VRPN server on port %d with %d objects.\n", port, (int)trackers.size());
+
+	long start = kuhl_microseconds();
+	long lastReport = start;
+	int64_t play = 0, lastPlay = 0;
+	long sent = 0, lastSent = 0, behind = 0;
+	while(true)
 	{
-		if(trackerst == DATA_TRACKER)
-		{
-			trackersv[i] = new myTracker(objNamesv[i], flags, m_Connection);
-		}
+		long now = kuhl_microseconds();
+		if(speed > 0)
+			play = (int64_t) ((now - start) * (double) speed);
 		else
+			play += 1000;
+
+		/* Send every record that is due. */
+		int64_t nextDue = INT64_MAX;
+		for(size_t i = 0; i < sources.size(); i++)
 		{
-			FILE *fs = fopen(filesv[i], "r");
-			if(fs == NULL)
+			source *s = &sources[i];
+			while(s->next <= play)
 			{
-				fprintf(stderr, "Failed to open file \"%s\": %s\n", filesv[i], strerror(errno));
-    			exit(1);
-    		}
-    		
-    		char* name;
-			tdl_prepare(fs, &name);	
-			
-			if(verbose)printf("Creating tracker for %s from file %s\n", name, filesv[i]);
-			trackersv[i] = new myTracker(name, flags, m_Connection, fs);
-			
+				long usec = now;
+				if(speed > 0)
+				{
+					/* When the record should have been sent */
+					usec = start + (long) (s->next / speed);
+					if(now - usec > behind)
+						behind = now - usec;
+				}
+				send_next(s, usec);
+				sent++;
+			}
+			if(s->next < nextDue)
+				nextDue = s->next;
 		}
-	}
 
-	printf("Starting VRPN server.\n");
-	
-	while(true)
-	{
-		for(int i = 0; i < trackersc; i++)
+		for(size_t i = 0; i < trackers.size(); i++)
+			trackers[i]->mainloop();
+		m_Connection->mainloop();
+
+		now = kuhl_microseconds();
+		if(now - lastReport >= 1000000)
 		{
-			trackersv[i]->mainloop();
+			double seconds = (now - lastReport) / 1000000.0;
+			double perSecond = (sent - lastSent) / seconds;
+			if(!quiet)
+			{
+				printf(LINE_CLEAR "Sent %.0f records/second (%.1f per object), playing at %.2fx, up to %.1f ms behind\n",
+				       perSecond, perSecond / trackers.size(),
+				       (play - lastPlay) / 1000000.0 / seconds, behind / 1000.0);
+				fflush(stdout);
+			}
+			lastReport = now;
+			lastSent = sent;
+			lastPlay = play;
+			behind = 0;
 		}
-		for(int i = 0; i < trackersc; i++)
+
+		/* Wait for the next record, but not so long that the
+		 * connection isn't serviced. */
+		if(speed > 0 && nextDue != INT64_MAX)
 		{
-			//Clear out the last couple of lines so that the log isn't spammed
-			if(!quiet)printf(LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP LINE_UP);
+			long wait = start + (long) (nextDue / speed) - now;
+			if(wait > 1000)
+				wait = 1000;
+			if(wait > 0)
+				usleep(wait);
 		}
-
-		m_Connection->mainloop();
-		kuhl_limitfps(100);
 	}
-	if(filesv != NULL)free(filesv);
-	if(objNamesv != NULL)free(objNamesv);
 }
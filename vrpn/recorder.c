@@ -1,12 +1,27 @@
 /*
  * This is a simple program that will read from the VRPN
- * server set in the home directory and print the entries 
+ * server set in the home directory and print the entries
  * it reads to the specified file.
  *
+ * By default, every record that the VRPN server sends for the
+ * objects is written to one version 2 .tdl file with the time the
+ * tracking system recorded it (see tdl-util.c). The records are
+ * written exactly as they arrive, before vrpn-help.cpp smooths them.
+ * The tracker thread in vrpn-help.cpp hands each record to a callback
+ * which puts it in a ring buffer; the main thread takes records out
+ * of the ring buffer and writes them, so writing to the disk never
+ * delays the tracker thread. Press Ctrl+C to stop recording.
+ *
+ * With -s, the recorder works the way it used to: every 10 ms it
+ * writes the latest (smoothed) record of each object to a version 1
+ * .tdl file for that object.
+ *
  * @author John Thomas
  * @LastModified June 2015
  */
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/time.h> // gettimeofday
 #include <time.h> // localtime
@@ -15,48 +30,177 @@
 #include "kuhl-util.h"
 #include "vecmat.h"
 #include "tdl-util.h"
+#include "msg.h"
 
-int main(int argc, char* argv[])
+/* Number of records the ring buffer holds (a power of two). At 1000
+ * records per second, this is more than a minute of records. */
+#define RING_SIZE 65536
+
+/* Records from different objects can arrive slightly out of order
+ * (the tracker thread delivers all waiting records of one object
+ * before the next object). Records are held for this long so that
+ * they can be written to the file in time order. */
+#define REORDER_USEC 500000
+
+/* Written by the callback (tracker thread) */
+static tdl2_record ring[RING_SIZE];
+static unsigned int ringHead = 0;
+static long dropped = 0;
+
+/* Written by the main thread */
+static unsigned int ringTail = 0;
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig)
 {
-	//Check if we got the proper arguments.
-	if(argc < 3)
+	stop = 1;
+}
+
+/* Called by the tracker thread for every record. data is the index
+ * of the object. */
+static void record_callback(void *data, long usec, const float pos[3], const float quat[4])
+{
+	unsigned int head = ringHead;
+	if(head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE) == RING_SIZE)
 	{
-		printf("Usage\n\trecorder serverHost objName1 [ objName2 ... ]\n");
-		printf("\n");
-		printf("This program reads data from a VRPN server and saves it to a file that can be played back later.\n");
-		exit(EXIT_FAILURE);
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
+	tdl2_record *r = &ring[head % RING_SIZE];
+	r->time = usec;
+	r->object = (int) (long) data;
+	vec3f_copy(r->pos, pos);
+	vec4f_copy(r->quat, quat);
+	__atomic_store_n(&ringHead, head+1, __ATOMIC_RELEASE);
+}
 
-	/* Get the current time for a timestamp to be included in filename */
-	struct timeval tv;
-	if(gettimeofday(&tv, NULL) < 0)
+static int compare_time(const void *a, const void *b)
+{
+	const tdl2_record *ra = (const tdl2_record*) a;
+	const tdl2_record *rb = (const tdl2_record*) b;
+	if(ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	return ra->object - rb->object;
+}
+
+static void record_all(const char *host, char **objects, int objectsToRecord, const char *timestamp, int flags)
+{
+	char filename[2048];
+	snprintf(filename, 2048, "vrpn-%s.tdl", timestamp);
+	tdl2_writer *w = tdl2_create(filename, (const char**) objects, objectsToRecord, flags);
+	if(w == NULL)
 	{
-		perror("gettimeofday");
+		printf("Failed to create file: %s\n", filename);
 		exit(EXIT_FAILURE);
 	}
-	time_t nowtime = tv.tv_sec;
-	struct tm *nowtm = localtime(&nowtime);  // statically allocated
-	char timestamp[1024]; // construct a string without microseconds
-	strftime(timestamp, 1024, "%Y%m%d-%H%M%S", nowtm);
+	printf("Storing every record of %d objects in '%s'. Press Ctrl+C to stop.\n", objectsToRecord, filename);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	for(int i=0; i<objectsToRecord; i++)
+		vrpn_set_callback(objects[i], host, record_callback, (void*) (long) i);
+
+	/* Records taken out of the ring buffer but not written yet */
+	int pendingCount = 0, pendingAlloc = RING_SIZE;
+	tdl2_record *pending = malloc(sizeof(tdl2_record)*pendingAlloc);
+	int64_t newest = 0, written = 0;
+	long late = 0, total = 0, lastTotal = 0;
+	long *perObject = calloc(objectsToRecord, sizeof(long));
+	long lastReport = kuhl_microseconds();
+
+	while(1)
+	{
+		int stopping = stop;
+
+		/* Take records out of the ring buffer. */
+		unsigned int head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+		while(ringTail != head)
+		{
+			if(pendingCount == pendingAlloc)
+			{
+				pendingAlloc *= 2;
+				pending = realloc(pending, sizeof(tdl2_record)*pendingAlloc);
+			}
+			tdl2_record *r = &pending[pendingCount++];
+			*r = ring[ringTail % RING_SIZE];
+			if(r->time > newest)
+				newest = r->time;
+			perObject[r->object]++;
+			total++;
+			__atomic_store_n(&ringTail, ringTail+1, __ATOMIC_RELEASE);
+		}
+
+		/* Write the records that are old enough that no older records
+		 * should arrive (or all of them if we are stopping). */
+		qsort(pending, pendingCount, sizeof(tdl2_record), compare_time);
+		int n = 0;
+		for(; n < pendingCount && (stopping || pending[n].time <= newest - REORDER_USEC); n++)
+		{
+			if(written > 0 && pending[n].time < written)
+			{
+				late++;
+				continue;
+			}
+			if(tdl2_write(w, &pending[n]) != 0)
+				exit(EXIT_FAILURE);
+			written = pending[n].time;
+		}
+		memmove(pending, pending+n, sizeof(tdl2_record)*(pendingCount-n));
+		pendingCount -= n;
 
-	int objectsToRecord = argc - 2;
+		long now = kuhl_microseconds();
+		if(now - lastReport >= 1000000)
+		{
+			double seconds = (now - lastReport) / 1000000.0;
+			printf("\033[J%.1f records/second, %llu written", (total - lastTotal) / seconds,
+			       (unsigned long long) w->header.records);
+			for(int i=0; i<objectsToRecord; i++)
+				printf(", %s %ld", objects[i], perObject[i]);
+			long d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+			if(d || late)
+				printf(", %ld dropped, %ld out of order", d, late);
+			printf("\r");
+			fflush(stdout);
+			lastReport = now;
+			lastTotal = total;
+		}
+
+		if(stopping)
+			break;
+		usleep(10000);
+	}
+
+	for(int i=0; i<objectsToRecord; i++)
+		vrpn_set_callback(objects[i], host, NULL, NULL);
+	unsigned long long records = w->header.records;
+	if(tdl2_finish(w) == 0)
+		printf("\nWrote %llu records to %s\n", records, filename);
+	free(pending);
+	free(perObject);
+}
+
+/* Writes the latest record of each object every 10 ms into one
+ * version 1 file per object. */
+static void record_sampled(const char *host, char **objects, int objectsToRecord, const char *timestamp)
+{
 	FILE **outputFiles = malloc(sizeof(FILE*)*objectsToRecord);
-	
+
 	for(int i=0; i<objectsToRecord; i++) // for each object to record
 	{
 		char filename[2048];
-		snprintf(filename, 2048, "%s-%s.tdl", argv[i+2], timestamp);
+		snprintf(filename, 2048, "%s-%s.tdl", objects[i], timestamp);
 
 		//Create a new TDL file.
 		printf("Output file: %s\n", filename);
-		outputFiles[i] = tdl_create(filename, argv[i+2]);
+		outputFiles[i] = tdl_create(filename, objects[i]);
 		if(outputFiles[i] == NULL)
 		{
 			printf("Failed to create file: %s\n", filename);
 			exit(EXIT_FAILURE);
 		}
 		else
-			printf("Storing data from object '%s' in file '%s\n", argv[i+2], filename);
+			printf("Storing data from object '%s' in file '%s\n", objects[i], filename);
 	}
 
 
@@ -71,22 +215,68 @@ int main(int argc, char* argv[])
 		for(int i=0; i<objectsToRecord; i++)
 		{
 			//Get the next vrpn entry
-			vrpn_get(argv[i+2], argv[1], pos, rotMat4);
-			
+			vrpn_get(objects[i], host, pos, rotMat4);
+
 			//Write that entry to the file
 			mat3f_from_mat4f(rotMat3, rotMat4);
 			tdl_write(outputFiles[i], pos, rotMat3);
 		}
-		
+
 		//IMPORTANT! Since there are no time stamps, this MUST be the same value as the fake
 		//server that is going to be reading the file, otherwise artificial speed ups or delays
 		//may occur in the final reading and output of the file.
 		kuhl_limitfps(100);
 	}
-	
+
 
 	//Close the fd (Useless code until code to stop loop is added)
 	for(int i=0; i<objectsToRecord; i++)
 		fclose(outputFiles[i]);
-	         
+}
+
+int main(int argc, char* argv[])
+{
+	int sampled = 0, flags = 0;
+	int arg = 1;
+	for(; arg < argc && argv[arg][0] == '-'; arg++)
+	{
+		if(strcmp(argv[arg], "-s") == 0)
+			sampled = 1;
+		else if(strcmp(argv[arg], "-c") == 0)
+			flags |= TDL2_COMPRESS;
+		else
+			break;
+	}
+
+	//Check if we got the proper arguments.
+	if(argc - arg < 2)
+	{
+		printf("Usage\n\trecorder [-c] [-s] serverHost objName1 [ objName2 ... ]\n");
+		printf("\n");
+		printf("This program reads data from a VRPN server and saves it to a file that can be played back later.\n");
+		printf("\t-c\tCompress the file (0.01 mm position resolution).\n");
+		printf("\t-s\tSave the latest smoothed record of each object 100 times a second into version 1 files.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Get the current time for a timestamp to be included in filename */
+	struct timeval tv;
+	if(gettimeofday(&tv, NULL) < 0)
+	{
+		perror("gettimeofday");
+		exit(EXIT_FAILURE);
+	}
+	time_t nowtime = tv.tv_sec;
+	struct tm *nowtm = localtime(&nowtime);  // statically allocated
+	char timestamp[1024]; // construct a string without microseconds
+	strftime(timestamp, 1024, "%Y%m%d-%H%M%S", nowtm);
+
+	const char *host = argv[arg];
+	char **objects = argv + arg + 1;
+	int objectsToRecord = argc - arg - 1;
+	if(sampled)
+		record_sampled(host, objects, objectsToRecord, timestamp);
+	else
+		record_all(host, objects, objectsToRecord, timestamp, flags);
+	exit(EXIT_SUCCESS);
 }